@@ -0,0 +1,977 @@
+/*
+ * LIRC - IRC Client Library for C
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This library is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Message archive: segmented, block compressed, and indexed by time and channel
+ *
+ * \note An archive is a directory of segments. Each segment is a data file of compressed blocks
+ *       (NNNNNNNN.seg), and an index file with an entry per block (NNNNNNNN.idx), giving where it is,
+ *       the range of message times in it, and a Bloom filter of the channels in it.
+ *       Segments are started once the current one reaches a fixed size.
+ * \note A block is up to 64 KB of messages, each a varint time (relative to the block's first message,
+ *       zigzag encoded, since server times aren't always in order) and a varint length, then the raw line.
+ *       Blocks are compressed with a small LZ77 compressor (in the LZ4 block format),
+ *       so there's nothing outside the library to depend on.
+ * \note Blocks are written before their index entries, so a crash leaves at most a block
+ *       with no entry, which is cut off when the archive is next opened.
+ * \note Readers map the files, and use the index to decompress only the blocks that can have
+ *       messages in the requested time range and channel. Files are in the host's byte order.
+ */
+
+#define _GNU_SOURCE 1 /* timegm */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "irc_internal.h"
+
+/*! \brief Uncompressed size of a block */
+#define BLOCK_SIZE (64 * 1024)
+
+/*! \brief Default segment size */
+#define SEGMENT_SIZE_DEFAULT (64 * 1024 * 1024)
+
+/*! \brief How long (in ms) a partial block may wait for more messages before it's written anyway */
+#define FLUSH_INTERVAL 60000
+
+#define SEGMENT_MAGIC "LIRCSEG1"
+#define INDEX_MAGIC "LIRCIDX1"
+#define HEADER_SIZE 16
+
+/*! \brief The block is compressed (otherwise it's stored as is) */
+#define BLOCK_LZ (1 << 0)
+
+/*! \brief Bits in the channel Bloom filter of each block */
+#define BLOOM_BITS 256
+
+struct index_entry {
+	uint64_t offset;				/*!< Offset of the block in the segment */
+	uint32_t complen;				/*!< Size of the block in the segment */
+	uint32_t rawlen;				/*!< Size of the block uncompressed */
+	int64_t mintime;				/*!< Earliest message time in the block (ms since the epoch) */
+	int64_t maxtime;				/*!< Latest message time in the block */
+	int64_t basetime;				/*!< Time of the first message, which the others are relative to */
+	uint32_t count;					/*!< Number of messages */
+	uint32_t flags;					/*!< BLOCK_* */
+	uint64_t bloom[BLOOM_BITS / 64];	/*!< Channels in the block */
+};
+
+struct irc_archive {
+	pthread_mutex_t lock;
+	unsigned int segno;				/*!< Current segment number */
+	int segfd;
+	int idxfd;
+	uint64_t segsize;				/*!< Size of the current segment */
+	uint64_t maxsize;				/*!< Segment size at which to start a new one */
+	unsigned char *raw;				/*!< Block being filled */
+	size_t rawlen;
+	unsigned char *comp;			/*!< Compression output */
+	struct index_entry entry;		/*!< Entry for the block being filled */
+	long long started;				/*!< When the block being filled got its first message (monotonic ms) */
+	uint32_t segdocs;				/*!< Messages written to the current segment */
+	struct search_index *search;	/*!< Full-text index, NULL if not kept */
+	char dir[];
+};
+
+/* === LZ77 block compression, in the LZ4 block format === */
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5			/*!< The last bytes are always literals */
+#define LZ_MF_LIMIT 12				/*!< No match may start this close to the end */
+
+/*! \brief Largest possible compressed size */
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+static uint32_t read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned char *lz_length(unsigned char *op, size_t len)
+{
+	for (; len >= 255; len -= 255) {
+		*op++ = 255;
+	}
+	*op++ = (unsigned char) len;
+	return op;
+}
+
+/*!
+ * \brief Compress a buffer
+ * \param src
+ * \param len
+ * \param[out] dst At least LZ_BOUND(len) bytes
+ * \return Compressed size
+ */
+static size_t lz_compress(const unsigned char *src, size_t len, unsigned char *dst)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	const unsigned char *ip = src, *anchor = src, *end = src + len;
+	const unsigned char *mflimit = len > LZ_MF_LIMIT ? end - LZ_MF_LIMIT : src;
+	unsigned char *op = dst;
+
+	memset(table, 0, sizeof(table));
+	while (ip < mflimit) {
+		uint32_t seq = read32(ip), h = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+		const unsigned char *ref = src + table[h], *mp;
+		size_t litlen, matchlen;
+		unsigned char *token;
+
+		table[h] = (uint32_t) (ip - src);
+		if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != seq) {
+			ip++;
+			continue;
+		}
+		/* Extend the match backwards over literals, then forwards */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+		for (mp = ip + LZ_MIN_MATCH; mp < end - LZ_LAST_LITERALS && *mp == ref[mp - ip]; mp++);
+		matchlen = (size_t) (mp - ip);
+
+		litlen = (size_t) (ip - anchor);
+		token = op++;
+		*token = (unsigned char) ((litlen >= 15 ? 15 : litlen) << 4);
+		if (litlen >= 15) {
+			op = lz_length(op, litlen - 15);
+		}
+		memcpy(op, anchor, litlen);
+		op += litlen;
+		*op++ = (unsigned char) ((ip - ref) & 0xff);
+		*op++ = (unsigned char) ((ip - ref) >> 8);
+		matchlen -= LZ_MIN_MATCH;
+		*token |= (unsigned char) (matchlen >= 15 ? 15 : matchlen);
+		if (matchlen >= 15) {
+			op = lz_length(op, matchlen - 15);
+		}
+		ip = anchor = mp;
+	}
+
+	/* Whatever's left is literals */
+	{
+		size_t litlen = (size_t) (end - anchor);
+		*op++ = (unsigned char) ((litlen >= 15 ? 15 : litlen) << 4);
+		if (litlen >= 15) {
+			op = lz_length(op, litlen - 15);
+		}
+		memcpy(op, anchor, litlen);
+		op += litlen;
+	}
+	return (size_t) (op - dst);
+}
+
+/*!
+ * \brief Decompress a buffer, which may be corrupt
+ * \return Decompressed size, or -1 if it's corrupt or doesn't fit
+ */
+static ssize_t lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t cap)
+{
+	const unsigned char *ip = src, *end = src + len;
+	unsigned char *op = dst, *oend = dst + cap;
+
+	while (ip < end) {
+		unsigned int token = *ip++;
+		size_t litlen = token >> 4, matchlen, offset;
+
+		if (litlen == 15) {
+			unsigned int b;
+			do {
+				if (ip >= end) {
+					return -1;
+				}
+				b = *ip++;
+				litlen += b;
+			} while (b == 255);
+		}
+		if (litlen > (size_t) (end - ip) || litlen > (size_t) (oend - op)) {
+			return -1;
+		}
+		memcpy(op, ip, litlen);
+		op += litlen;
+		ip += litlen;
+		if (ip == end) {
+			break; /* The last sequence has no match */
+		}
+
+		if (end - ip < 2) {
+			return -1;
+		}
+		offset = (size_t) ip[0] | (size_t) ip[1] << 8;
+		ip += 2;
+		matchlen = token & 15;
+		if (matchlen == 15) {
+			unsigned int b;
+			do {
+				if (ip >= end) {
+					return -1;
+				}
+				b = *ip++;
+				matchlen += b;
+			} while (b == 255);
+		}
+		matchlen += LZ_MIN_MATCH;
+		if (!offset || offset > (size_t) (op - dst) || matchlen > (size_t) (oend - op)) {
+			return -1;
+		}
+		if (offset >= matchlen) {
+			memcpy(op, op - offset, matchlen);
+			op += matchlen;
+		} else {
+			/* Byte by byte, since the match overlaps what it's producing */
+			for (; matchlen; matchlen--, op++) {
+				*op = *(op - offset);
+			}
+		}
+	}
+	return op - dst;
+}
+
+/* === Messages === */
+
+unsigned char *archive_put_varint(unsigned char *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (unsigned char) (v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (unsigned char) v;
+	return p;
+}
+
+const unsigned char *archive_get_varint(const unsigned char *p, const unsigned char *end, uint64_t *v)
+{
+	unsigned int shift = 0;
+
+	*v = 0;
+	while (p < end && shift < 64) {
+		*v |= (uint64_t) (*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) {
+			return p;
+		}
+		shift += 7;
+	}
+	return NULL;
+}
+
+/*! \brief Parse an IRCv3 server-time (YYYY-MM-DDThh:mm:ss.sssZ), -1 if invalid */
+static long long parse_server_time(const char *s, size_t len)
+{
+	struct tm tm;
+	long long ms = 0;
+	size_t i;
+
+	/* Fixed positions, so just check the digits are where they should be */
+	if (len < 20 || s[4] != '-' || s[7] != '-' || s[10] != 'T' || s[13] != ':' || s[16] != ':') {
+		return -1;
+	}
+	for (i = 0; i < 19; i++) {
+		if (i != 4 && i != 7 && i != 10 && i != 13 && i != 16 && (s[i] < '0' || s[i] > '9')) {
+			return -1;
+		}
+	}
+#define DIGITS2(p) (((p)[0] - '0') * 10 + ((p)[1] - '0'))
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = DIGITS2(s) * 100 + DIGITS2(s + 2) - 1900;
+	tm.tm_mon = DIGITS2(s + 5) - 1;
+	tm.tm_mday = DIGITS2(s + 8);
+	tm.tm_hour = DIGITS2(s + 11);
+	tm.tm_min = DIGITS2(s + 14);
+	tm.tm_sec = DIGITS2(s + 17);
+#undef DIGITS2
+	if (s[19] == '.') {
+		int digits = 0;
+		for (i = 20; i < len && s[i] >= '0' && s[i] <= '9'; i++) {
+			if (digits++ < 3) {
+				ms = ms * 10 + (s[i] - '0');
+			}
+		}
+		for (; digits < 3; digits++) {
+			ms *= 10;
+		}
+	}
+	return (long long) timegm(&tm) * 1000 + ms;
+}
+
+long long archive_line_time(const char *line, size_t len, long long received)
+{
+	const char *end = line + len, *tags, *tag;
+
+	if (!len || *line != '@') {
+		return received;
+	}
+	tags = line + 1;
+	end = memchr(tags, ' ', len - 1);
+	if (!end) {
+		return received;
+	}
+	for (tag = tags; tag < end;) {
+		const char *next = memchr(tag, ';', (size_t) (end - tag));
+		if (!next) {
+			next = end;
+		}
+		if (next - tag > 5 && !memcmp(tag, "time=", 5)) {
+			long long t = parse_server_time(tag + 5, (size_t) (next - tag - 5));
+			return t < 0 ? received : t;
+		}
+		tag = next + 1;
+	}
+	return received;
+}
+
+const char *archive_line_channel(const char *line, size_t len, size_t *chanlen)
+{
+	const char *s = line, *end = line + len, *word;
+
+	/* Skip the tags and prefix */
+	if (s < end && *s == '@') {
+		s = memchr(s, ' ', (size_t) (end - s));
+		if (!s) {
+			return NULL;
+		}
+		while (s < end && *s == ' ') {
+			s++;
+		}
+	}
+	if (s < end && *s == ':') {
+		s = memchr(s, ' ', (size_t) (end - s));
+		if (!s) {
+			return NULL;
+		}
+		while (s < end && *s == ' ') {
+			s++;
+		}
+	}
+	/* Numerics are about us, not a channel (e.g. <our nick> <channel> ...) */
+	if (s >= end || (*s >= '0' && *s <= '9')) {
+		return NULL;
+	}
+	s = memchr(s, ' ', (size_t) (end - s));
+	if (!s) {
+		return NULL;
+	}
+	while (s < end && *s == ' ') {
+		s++;
+	}
+	if (s < end && *s == ':') {
+		s++; /* e.g. JOIN :#channel */
+	}
+	if (s >= end || !strchr("#&!+", *s)) {
+		return NULL;
+	}
+	for (word = s; s < end && *s != ' ' && *s != ','; s++);
+	*chanlen = (size_t) (s - word);
+	return word;
+}
+
+static void bloom_add(uint64_t *bloom, uint64_t hash)
+{
+	int i;
+
+	for (i = 0; i < 3; i++, hash >>= 16) {
+		unsigned int bit = (unsigned int) (hash % BLOOM_BITS);
+		bloom[bit / 64] |= (uint64_t) 1 << (bit % 64);
+	}
+}
+
+static int bloom_has(const uint64_t *bloom, uint64_t hash)
+{
+	int i;
+
+	for (i = 0; i < 3; i++, hash >>= 16) {
+		unsigned int bit = (unsigned int) (hash % BLOOM_BITS);
+		if (!(bloom[bit / 64] & ((uint64_t) 1 << (bit % 64)))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* === Writing === */
+
+static void segment_path(const char *dir, unsigned int segno, const char *ext, char *buf, size_t len)
+{
+	snprintf(buf, len, "%s/%08u.%s", dir, segno, ext);
+}
+
+/*! \brief Open a segment for appending, creating it if needed, and cut off anything not in the index */
+static int segment_open(struct irc_archive *archive, unsigned int segno)
+{
+	char path[4096];
+	struct stat st;
+	struct index_entry last;
+	uint64_t entries, end = HEADER_SIZE, i;
+
+	segment_path(archive->dir, segno, "seg", path, sizeof(path));
+	archive->segfd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	segment_path(archive->dir, segno, "idx", path, sizeof(path));
+	archive->idxfd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (archive->segfd < 0 || archive->idxfd < 0) {
+		irc_err("Failed to open archive segment %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(archive->idxfd, &st)) {
+		irc_err("fstat failed: %s\n", strerror(errno));
+		return -1;
+	}
+	if (st.st_size < HEADER_SIZE) {
+		char header[HEADER_SIZE] = SEGMENT_MAGIC;
+		if (pwrite(archive->segfd, header, HEADER_SIZE, 0) != HEADER_SIZE || ftruncate(archive->idxfd, 0)) {
+			irc_err("Failed to start archive segment: %s\n", strerror(errno));
+			return -1;
+		}
+		memcpy(header, INDEX_MAGIC, 8);
+		if (write(archive->idxfd, header, HEADER_SIZE) != HEADER_SIZE) {
+			irc_err("Failed to start archive segment: %s\n", strerror(errno));
+			return -1;
+		}
+		entries = 0;
+	} else {
+		entries = ((uint64_t) st.st_size - HEADER_SIZE) / sizeof(struct index_entry);
+		if (entries && pread(archive->idxfd, &last, sizeof(last), (off_t) (HEADER_SIZE + (entries - 1) * sizeof(last))) == sizeof(last)) {
+			end = last.offset + last.complen;
+		}
+		/* Drop a partial index entry, or a block that never got one */
+		if (ftruncate(archive->idxfd, (off_t) (HEADER_SIZE + entries * sizeof(last))) || ftruncate(archive->segfd, (off_t) end)) {
+			irc_err("Failed to recover archive segment: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+	/* Messages are numbered within their segment, for the full-text index */
+	archive->segdocs = 0;
+	for (i = 0; i < entries; i++) {
+		if (pread(archive->idxfd, &last, sizeof(last), (off_t) (HEADER_SIZE + i * sizeof(last))) != sizeof(last)) {
+			irc_err("Failed to read archive index: %s\n", strerror(errno));
+			return -1;
+		}
+		archive->segdocs += last.count;
+	}
+	archive->segno = segno;
+	archive->segsize = end;
+	return 0;
+}
+
+static void segment_close(struct irc_archive *archive)
+{
+	if (archive->segfd >= 0) {
+		close(archive->segfd);
+		archive->segfd = -1;
+	}
+	if (archive->idxfd >= 0) {
+		close(archive->idxfd);
+		archive->idxfd = -1;
+	}
+}
+
+int archive_segments(const char *dir, unsigned int **segnos)
+{
+	DIR *d = opendir(dir);
+	struct dirent *de;
+	unsigned int *list = NULL;
+	int count = 0, alloc = 0, i, j;
+
+	if (!d) {
+		return -1;
+	}
+	while ((de = readdir(d))) {
+		char *end;
+		unsigned long segno = strtoul(de->d_name, &end, 10);
+		if (end != de->d_name + 8 || strcmp(end, ".idx")) {
+			continue;
+		}
+		if (count == alloc) {
+			unsigned int *newlist = realloc(list, (size_t) (alloc = alloc ? alloc * 2 : 16) * sizeof(*list));
+			if (!newlist) {
+				irc_err("realloc failed\n");
+				free(list);
+				closedir(d);
+				return -1;
+			}
+			list = newlist;
+		}
+		list[count++] = (unsigned int) segno;
+	}
+	closedir(d);
+	for (i = 1; i < count; i++) {
+		unsigned int v = list[i];
+		for (j = i; j > 0 && list[j - 1] > v; j--) {
+			list[j] = list[j - 1];
+		}
+		list[j] = v;
+	}
+	*segnos = list;
+	return count;
+}
+
+struct irc_archive *irc_archive_open(const char *dir, uint64_t segment_size)
+{
+	struct irc_archive *archive;
+	unsigned int *segnos = NULL;
+	int count;
+
+	if (strlen(dir) > 4000) {
+		irc_err("Archive path too long\n");
+		return NULL;
+	}
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		irc_err("Failed to create %s: %s\n", dir, strerror(errno));
+		return NULL;
+	}
+	count = archive_segments(dir, &segnos);
+	if (count < 0) {
+		irc_err("Failed to read %s: %s\n", dir, strerror(errno));
+		return NULL;
+	}
+
+	archive = calloc(1, sizeof(*archive) + strlen(dir) + 1);
+	if (!archive) {
+		irc_err("calloc failed\n");
+		free(segnos);
+		return NULL;
+	}
+	strcpy(archive->dir, dir); /* Safe */
+	archive->segfd = archive->idxfd = -1;
+	archive->maxsize = segment_size ? segment_size : SEGMENT_SIZE_DEFAULT;
+	archive->raw = malloc(BLOCK_SIZE);
+	archive->comp = malloc(LZ_BOUND(BLOCK_SIZE));
+	pthread_mutex_init(&archive->lock, NULL);
+	if (!archive->raw || !archive->comp) {
+		irc_err("malloc failed\n");
+		free(segnos);
+		irc_archive_close(archive);
+		return NULL;
+	}
+	if (segment_open(archive, count ? segnos[count - 1] : 0)) {
+		free(segnos);
+		irc_archive_close(archive);
+		return NULL;
+	}
+	free(segnos);
+	return archive;
+}
+
+/*! \brief Compress and write out the block being filled. Must be called with the lock held. */
+static int block_write(struct irc_archive *archive)
+{
+	struct index_entry *e = &archive->entry;
+	const unsigned char *data = archive->comp;
+	size_t len;
+
+	if (!e->count) {
+		return 0;
+	}
+	len = lz_compress(archive->raw, archive->rawlen, archive->comp);
+	if (len < archive->rawlen) {
+		e->flags = BLOCK_LZ;
+	} else {
+		len = archive->rawlen; /* Incompressible */
+		data = archive->raw;
+		e->flags = 0;
+	}
+	if (archive->segsize > HEADER_SIZE && archive->segsize + len > archive->maxsize) {
+		if (archive->search) {
+			search_commit(archive->search, 1); /* Messages are numbered per segment, so its index is done */
+		}
+		segment_close(archive);
+		if (segment_open(archive, archive->segno + 1)) {
+			goto drop;
+		}
+	}
+	e->offset = archive->segsize;
+	e->complen = (uint32_t) len;
+	e->rawlen = (uint32_t) archive->rawlen;
+	if (pwrite(archive->segfd, data, len, (off_t) e->offset) != (ssize_t) len) {
+		irc_err("Failed to write archive block: %s\n", strerror(errno));
+		goto drop;
+	}
+	/* Only once the block is there, so the index never points at something that isn't */
+	if (write(archive->idxfd, e, sizeof(*e)) != sizeof(*e)) {
+		struct stat st;
+		irc_err("Failed to write archive index: %s\n", strerror(errno));
+		/* Don't leave part of an entry behind, or every entry appended after it would be misaligned */
+		if (!fstat(archive->idxfd, &st) && st.st_size > HEADER_SIZE) {
+			off_t whole = (off_t) (HEADER_SIZE + (((uint64_t) st.st_size - HEADER_SIZE) / sizeof(*e)) * sizeof(*e));
+			if (whole != st.st_size && ftruncate(archive->idxfd, whole)) {
+				irc_err("Failed to truncate archive index: %s\n", strerror(errno));
+			}
+		}
+		goto drop;
+	}
+	archive->segsize += len;
+	if (archive->search) {
+		const unsigned char *p = archive->raw, *end = archive->raw + archive->rawlen;
+		uint32_t i;
+		for (i = 0; i < e->count; i++) {
+			uint64_t delta, msglen;
+			p = archive_get_varint(p, end, &delta);
+			p = archive_get_varint(p, end, &msglen); /* We just wrote these, so they're valid */
+			search_add(archive->search, archive->segno, archive->segdocs + i, (const char *) p, (size_t) msglen);
+			p += msglen;
+		}
+		search_commit(archive->search, 0);
+	}
+	archive->segdocs += e->count;
+	memset(e, 0, sizeof(*e));
+	archive->rawlen = 0;
+	return 0;
+
+drop:
+	/* Start a new block either way, since there's no room to add to this one */
+	irc_err("Dropped %u archived messages\n", e->count);
+	memset(e, 0, sizeof(*e));
+	archive->rawlen = 0;
+	return -1;
+}
+
+static uint64_t zigzag(long long v)
+{
+	return v < 0 ? ((uint64_t) -(v + 1) << 1) | 1 : (uint64_t) v << 1;
+}
+
+static long long unzigzag(uint64_t v)
+{
+	return v & 1 ? -(long long) (v >> 1) - 1 : (long long) (v >> 1);
+}
+
+int irc_archive_append(struct irc_archive *archive, long long received, const char *line, size_t len)
+{
+	struct index_entry *e = &archive->entry;
+	const char *channel;
+	size_t chanlen;
+	long long t = archive_line_time(line, len, received);
+	unsigned char *p;
+	int res = 0;
+
+	if (len > BLOCK_SIZE - 20) {
+		irc_err("Message too long to archive\n");
+		return -1;
+	}
+	pthread_mutex_lock(&archive->lock);
+	if (archive->rawlen + len + 20 > BLOCK_SIZE) {
+		res = block_write(archive);
+	}
+	if (!e->count) {
+		e->basetime = e->mintime = e->maxtime = t;
+		archive->started = now_ms();
+	} else if (t < e->mintime) {
+		e->mintime = t;
+	} else if (t > e->maxtime) {
+		e->maxtime = t;
+	}
+	p = archive_put_varint(archive->raw + archive->rawlen, zigzag(t - e->basetime));
+	p = archive_put_varint(p, len);
+	memcpy(p, line, len);
+	archive->rawlen = (size_t) (p + len - archive->raw);
+	e->count++;
+	channel = archive_line_channel(line, len, &chanlen);
+	if (channel) {
+		bloom_add(e->bloom, irc_casemap_hash(IRC_CASEMAPPING_RFC1459, channel, chanlen));
+	}
+	pthread_mutex_unlock(&archive->lock);
+	return res;
+}
+
+int irc_archive_flush(struct irc_archive *archive)
+{
+	int res;
+
+	pthread_mutex_lock(&archive->lock);
+	res = block_write(archive);
+	if (archive->search) {
+		search_commit(archive->search, 1);
+	}
+	pthread_mutex_unlock(&archive->lock);
+	return res;
+}
+
+void archive_flush_idle(struct irc_archive *archive)
+{
+	pthread_mutex_lock(&archive->lock);
+	if (archive->entry.count && now_ms() - archive->started >= FLUSH_INTERVAL) {
+		block_write(archive);
+		if (archive->search) {
+			search_commit(archive->search, 1);
+		}
+	}
+	pthread_mutex_unlock(&archive->lock);
+}
+
+void irc_archive_close(struct irc_archive *archive)
+{
+	if (archive->segfd >= 0) {
+		block_write(archive);
+	}
+	if (archive->search) {
+		search_close(archive->search); /* Writes out the rest of the index */
+	}
+	segment_close(archive);
+	pthread_mutex_destroy(&archive->lock);
+	free(archive->raw);
+	free(archive->comp);
+	free(archive);
+}
+
+int irc_archive_index(struct irc_archive *archive)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&archive->lock);
+	if (!archive->search) {
+		archive->search = search_open(archive->dir, archive->segno);
+		res = archive->search ? 0 : -1;
+	}
+	pthread_mutex_unlock(&archive->lock);
+	return res;
+}
+
+/* === Reading === */
+
+int archive_map(const char *path, struct archive_map *m)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	m->data = NULL;
+	m->len = 0;
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+	m->len = (size_t) st.st_size;
+	if (m->len) {
+		m->data = mmap(NULL, m->len, PROT_READ, MAP_SHARED, fd, 0);
+		if (m->data == MAP_FAILED) {
+			m->data = NULL;
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+void archive_unmap(struct archive_map *m)
+{
+	if (m->data) {
+		munmap(m->data, m->len);
+	}
+}
+
+/*! \brief Get the uncompressed messages in a block, NULL if it's corrupt */
+static const unsigned char *block_data(const struct index_entry *e, const unsigned char *block, unsigned char *buf)
+{
+	if (!(e->flags & BLOCK_LZ)) {
+		return block;
+	}
+	return lz_decompress(block, e->complen, buf, BLOCK_SIZE) == (ssize_t) e->rawlen ? buf : NULL;
+}
+
+/*!
+ * \brief Pass on the messages in a block that match
+ * \retval 1 if the callback asked to stop, 0 to keep going, -1 if the block is corrupt
+ */
+static int block_query(const struct index_entry *e, const unsigned char *block, unsigned char *buf, const char *channel, long long from, long long to,
+	int (*cb)(void *data, long long time, const char *line, size_t len), void *data)
+{
+	const unsigned char *p = block_data(e, block, buf), *end;
+	size_t chanlen = channel ? strlen(channel) : 0;
+	uint32_t i;
+
+	if (!p) {
+		return -1;
+	}
+	end = p + e->rawlen;
+	for (i = 0; i < e->count; i++) {
+		uint64_t delta, len;
+		long long t;
+		p = archive_get_varint(p, end, &delta);
+		p = p ? archive_get_varint(p, end, &len) : NULL;
+		if (!p || len > (uint64_t) (end - p)) {
+			return -1;
+		}
+		t = e->basetime + unzigzag(delta);
+		if (t >= from && t <= to) {
+			const char *c;
+			size_t clen;
+			if (channel) {
+				c = archive_line_channel((const char *) p, (size_t) len, &clen);
+				if (!c || clen != chanlen || !irc_casemap_memeq(IRC_CASEMAPPING_RFC1459, c, channel, clen)) {
+					p += len;
+					continue;
+				}
+			}
+			if (cb(data, t, (const char *) p, (size_t) len)) {
+				return 1;
+			}
+		}
+		p += len;
+	}
+	return 0;
+}
+
+int irc_archive_query(const char *dir, const char *channel, long long from, long long to,
+	int (*cb)(void *data, long long time, const char *line, size_t len), void *data)
+{
+	unsigned int *segnos;
+	unsigned char *buf;
+	uint64_t hash = channel ? irc_casemap_strhash(IRC_CASEMAPPING_RFC1459, channel) : 0;
+	int count, i, res = 0;
+
+	count = archive_segments(dir, &segnos);
+	if (count < 0) {
+		irc_err("Failed to read archive %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+	buf = malloc(BLOCK_SIZE);
+	if (!buf) {
+		irc_err("malloc failed\n");
+		free(segnos);
+		return -1;
+	}
+	for (i = 0; i < count && res <= 0; i++) {
+		struct archive_map idx, seg;
+		char path[4096];
+		size_t entries, j;
+
+		/* The index first, so every block it has is in the segment when that's mapped */
+		segment_path(dir, segnos[i], "idx", path, sizeof(path));
+		if (archive_map(path, &idx) || idx.len < HEADER_SIZE || memcmp(idx.data, INDEX_MAGIC, 8)) {
+			archive_unmap(&idx);
+			continue;
+		}
+		segment_path(dir, segnos[i], "seg", path, sizeof(path));
+		if (archive_map(path, &seg)) {
+			archive_unmap(&idx);
+			continue;
+		}
+		entries = (idx.len - HEADER_SIZE) / sizeof(struct index_entry);
+		for (j = 0; j < entries; j++) {
+			struct index_entry e;
+			memcpy(&e, idx.data + HEADER_SIZE + j * sizeof(e), sizeof(e)); /* Not necessarily aligned */
+			if (e.maxtime < from || e.mintime > to || (channel && !bloom_has(e.bloom, hash))) {
+				continue; /* Nothing here */
+			} else if (e.offset + e.complen > seg.len || e.rawlen > BLOCK_SIZE) {
+				irc_warn("Archive segment %u is truncated\n", segnos[i]);
+				break;
+			}
+			res = block_query(&e, seg.data + e.offset, buf, channel, from, to, cb, data);
+			if (res < 0) {
+				irc_warn("Archive segment %u, block %zu is corrupt\n", segnos[i], j);
+				res = 0;
+			} else if (res) {
+				break;
+			}
+		}
+		archive_unmap(&seg);
+		archive_unmap(&idx);
+	}
+	free(buf);
+	free(segnos);
+	return 0;
+}
+
+int archive_segment_read(const char *dir, unsigned int segno, uint32_t from, const uint32_t *docs, size_t ndocs,
+	int (*cb)(void *data, uint32_t doc, long long time, const char *line, size_t len), void *data)
+{
+	struct archive_map idx, seg;
+	char path[4096];
+	unsigned char *buf;
+	size_t entries, j, k = 0;
+	uint32_t first = 0;
+	int res = 0;
+
+	segment_path(dir, segno, "idx", path, sizeof(path));
+	if (archive_map(path, &idx) || idx.len < HEADER_SIZE || memcmp(idx.data, INDEX_MAGIC, 8)) {
+		archive_unmap(&idx);
+		return -1;
+	}
+	segment_path(dir, segno, "seg", path, sizeof(path));
+	if (archive_map(path, &seg)) {
+		archive_unmap(&idx);
+		return -1;
+	}
+	buf = malloc(BLOCK_SIZE);
+	if (!buf) {
+		irc_err("malloc failed\n");
+		archive_unmap(&seg);
+		archive_unmap(&idx);
+		return -1;
+	}
+	entries = (idx.len - HEADER_SIZE) / sizeof(struct index_entry);
+	for (j = 0; j < entries && !res && (!docs || k < ndocs); j++) {
+		struct index_entry e;
+		const unsigned char *p, *end;
+		uint32_t i;
+
+		memcpy(&e, idx.data + HEADER_SIZE + j * sizeof(e), sizeof(e));
+		/* Skip any that weren't found in earlier blocks, e.g. corrupt ones */
+		while (docs && k < ndocs && docs[k] < first) {
+			k++;
+		}
+		if (docs && k == ndocs) {
+			break;
+		}
+		first += e.count;
+		if (docs ? docs[k] >= first : from >= first) {
+			continue; /* None wanted from this block */
+		} else if (e.offset + e.complen > seg.len || e.rawlen > BLOCK_SIZE) {
+			irc_warn("Archive segment %u is truncated\n", segno);
+			break;
+		}
+		p = block_data(&e, seg.data + e.offset, buf);
+		if (!p) {
+			irc_warn("Archive segment %u, block %zu is corrupt\n", segno, j);
+			continue;
+		}
+		end = p + e.rawlen;
+		for (i = 0; i < e.count; i++) {
+			uint32_t doc = first - e.count + i;
+			uint64_t delta, len;
+			p = archive_get_varint(p, end, &delta);
+			p = p ? archive_get_varint(p, end, &len) : NULL;
+			if (!p || len > (uint64_t) (end - p)) {
+				irc_warn("Archive segment %u, block %zu is corrupt\n", segno, j);
+				break;
+			}
+			if (docs ? k < ndocs && docs[k] == doc : doc >= from) {
+				k++;
+				if (cb(data, doc, e.basetime + unzigzag(delta), (const char *) p, (size_t) len)) {
+					res = 1;
+					break;
+				}
+			}
+			p += len;
+		}
+	}
+	free(buf);
+	archive_unmap(&seg);
+	archive_unmap(&idx);
+	return res;
+}
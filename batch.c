@@ -0,0 +1,420 @@
+/*
+ * LIRC - IRC Client Library for C
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This library is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief IRCv3 batches (BATCH)
+ *
+ * \note Everything belonging to an outermost batch, including its nested batches,
+ *       lives in bump-allocated chunks owned by that batch, which are freed all at once
+ *       after it has been delivered. A batched message is copied into a chunk
+ *       in a single memcpy, and the already parsed fields are pointed into the copy,
+ *       so nothing is parsed again or copied field by field.
+ *       Batches are only touched from the irc_loop thread, so no locking is needed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "irc_internal.h"
+
+#define CHUNK_SIZE 16384
+#define ALIGNMENT 16
+
+/*! \brief Maximum number of batches open at once */
+#define MAX_OPEN_BATCHES 64
+
+/*! \brief Maximum number of messages in an outermost batch, including its nested batches */
+#define MAX_BATCH_MESSAGES 65536
+
+struct batch_chunk {
+	struct batch_chunk *next;
+	size_t used;
+	size_t size;
+	char data[] __attribute__ ((aligned (ALIGNMENT)));
+};
+
+struct batch {
+	struct irc_batch pub;
+	struct batch *root;				/*!< Outermost batch, which owns the memory for the whole tree */
+	struct batch *next;				/*!< Next open batch */
+	struct irc_msg **msgs;
+	size_t msgalloc;
+	const struct irc_batch **children;
+	size_t childalloc;
+	unsigned int history:1;			/*!< Whether the messages are from the past (e.g. chathistory) */
+	/* Outermost batch only */
+	struct batch_chunk *chunks;		/*!< Current chunk first */
+	size_t total;					/*!< Number of messages in the whole tree */
+};
+
+struct batch_state {
+	struct batch *open;				/*!< Open batches, most recently opened first */
+	size_t nopen;
+	void (*cb)(void *data, const struct irc_batch *batch);
+	void *data;
+};
+
+int irc_client_batch_callback(struct irc_client *client, void (*cb)(void *data, const struct irc_batch *batch), void *data)
+{
+	if (!client->batch) {
+		client->batch = calloc(1, sizeof(*client->batch));
+		if (!client->batch) {
+			irc_err("calloc failed\n");
+			return -1;
+		}
+	}
+	client->batch->cb = cb;
+	client->batch->data = data;
+	return 0;
+}
+
+static void *arena_alloc(struct batch *root, size_t size)
+{
+	struct batch_chunk *chunk = root->chunks;
+	void *p;
+
+	size = (size + ALIGNMENT - 1) & ~((size_t) ALIGNMENT - 1);
+	if (chunk->used + size > chunk->size) {
+		size_t chunksize = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+		struct batch_chunk *new = malloc(sizeof(*new) + chunksize);
+		if (!new) {
+			irc_err("malloc failed\n");
+			return NULL;
+		}
+		new->used = 0;
+		new->size = chunksize;
+		if (chunksize > CHUNK_SIZE) {
+			/* Don't abandon what's left of the current chunk for an oversized allocation */
+			new->next = chunk->next;
+			chunk->next = new;
+		} else {
+			new->next = chunk;
+			root->chunks = new;
+		}
+		chunk = new;
+	}
+	p = chunk->data + chunk->used;
+	chunk->used += size;
+	return p;
+}
+
+static char *arena_strndup(struct batch *root, const char *s, size_t len)
+{
+	char *dup = arena_alloc(root, len + 1);
+
+	if (dup) {
+		memcpy(dup, s, len);
+		dup[len] = '\0';
+	}
+	return dup;
+}
+
+/*! \brief Grow an array in the arena to twice its size. The old space is simply left behind. */
+static void *arena_grow(struct batch *root, const void *array, size_t count, size_t *alloc, size_t size)
+{
+	size_t newalloc = *alloc ? *alloc * 2 : 16;
+	void *new = arena_alloc(root, newalloc * size);
+
+	if (new) {
+		if (count) {
+			memcpy(new, array, count * size);
+		}
+		*alloc = newalloc;
+	}
+	return new;
+}
+
+static void batch_free(struct batch *root)
+{
+	struct batch_chunk *chunk, *next;
+
+	/* The root itself lives in one of its chunks */
+	for (chunk = root->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+}
+
+void batch_destroy(struct irc_client *client)
+{
+	struct batch_state *bs = client->batch;
+	struct batch *b, **prev;
+
+	if (!bs) {
+		return;
+	}
+	/* Nested batches are freed with their roots, so free the roots last */
+	for (prev = &bs->open; (b = *prev);) {
+		if (b->root != b) {
+			*prev = b->next;
+		} else {
+			prev = &b->next;
+		}
+	}
+	while ((b = bs->open)) {
+		bs->open = b->next;
+		batch_free(b);
+	}
+	free(bs);
+	client->batch = NULL;
+}
+
+static struct batch *batch_find(struct batch_state *bs, const char *ref, size_t len)
+{
+	struct batch *b;
+
+	for (b = bs->open; b; b = b->next) {
+		if (!strncmp(b->pub.ref, ref, len) && !b->pub.ref[len]) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+/*! \brief The open batch a message belongs to, if any */
+static struct batch *msg_batch(struct batch_state *bs, const struct irc_msg *msg)
+{
+	size_t len;
+	const char *ref = msg_tag(msg, "batch", &len);
+
+	return ref ? batch_find(bs, ref, len) : NULL;
+}
+
+const struct irc_batch *batch_of(struct irc_client *client, const struct irc_msg *msg)
+{
+	struct batch *b = client->batch ? msg_batch(client->batch, msg) : NULL;
+
+	return b ? &b->pub : NULL;
+}
+
+static struct batch *batch_new_root(void)
+{
+	size_t size = (sizeof(struct batch) + ALIGNMENT - 1) & ~((size_t) ALIGNMENT - 1);
+	struct batch_chunk *chunk = malloc(sizeof(*chunk) + CHUNK_SIZE);
+	struct batch *b;
+
+	if (!chunk) {
+		irc_err("malloc failed\n");
+		return NULL;
+	}
+	chunk->next = NULL;
+	chunk->used = size;
+	chunk->size = CHUNK_SIZE;
+	b = (struct batch *) (void *) chunk->data;
+	memset(b, 0, sizeof(*b));
+	b->root = b;
+	b->chunks = chunk;
+	return b;
+}
+
+static void batch_open(struct batch_state *bs, struct irc_msg *msg, const char *ref, size_t reflen, const char *s)
+{
+	struct batch *b, *parent;
+	const char *type;
+	size_t typelen;
+
+	type = next_param(&s, &typelen);
+	if (!type) {
+		irc_warn("BATCH %.*s has no type\n", (int) reflen, ref);
+		return;
+	}
+	if (batch_find(bs, ref, reflen)) {
+		irc_warn("Batch %.*s is already open\n", (int) reflen, ref);
+		return;
+	}
+	if (bs->nopen >= MAX_OPEN_BATCHES) {
+		irc_warn("Too many open batches, ignoring batch %.*s\n", (int) reflen, ref);
+		return;
+	}
+
+	parent = msg_batch(bs, msg);
+	if (parent) {
+		b = arena_alloc(parent->root, sizeof(*b));
+		if (!b) {
+			return;
+		}
+		memset(b, 0, sizeof(*b));
+		b->root = parent->root;
+		b->pub.parent = &parent->pub;
+		b->history = parent->history;
+	} else {
+		b = batch_new_root();
+		if (!b) {
+			return;
+		}
+	}
+	b->pub.ref = arena_strndup(b->root, ref, reflen);
+	b->pub.type = arena_strndup(b->root, type, typelen);
+	if (s && *s) {
+		b->pub.params = arena_strndup(b->root, s, strlen(s));
+	}
+	if (!b->pub.ref || !b->pub.type || (s && *s && !b->pub.params)) {
+		if (!parent) {
+			batch_free(b);
+		}
+		return;
+	}
+	if (!strcmp(b->pub.type, "chathistory") || !strcmp(b->pub.type, "draft/chathistory")) {
+		b->history = 1;
+	}
+	b->next = bs->open;
+	bs->open = b;
+	bs->nopen++;
+}
+
+/*! \brief Whether a batch was reported by netsplit aggregation instead, and so has nothing left to deliver */
+static int batch_empty_netsplit(const struct irc_batch *batch)
+{
+	return !batch->count && !batch->nchildren && (!strcmp(batch->type, "netsplit") || !strcmp(batch->type, "netjoin"));
+}
+
+static void batch_close(struct batch_state *bs, const char *ref, size_t reflen)
+{
+	struct batch *b, *root, **prev;
+
+	for (prev = &bs->open; (b = *prev); prev = &b->next) {
+		if (!strncmp(b->pub.ref, ref, reflen) && !b->pub.ref[reflen]) {
+			break;
+		}
+	}
+	if (!b) {
+		irc_debug(1, "Batch %.*s is not open\n", (int) reflen, ref);
+		return;
+	}
+	*prev = b->next;
+	bs->nopen--;
+
+	if (b != b->root) {
+		struct batch *parent = (struct batch *) b->pub.parent;
+		if (parent->pub.nchildren == parent->childalloc) {
+			const struct irc_batch **children = arena_grow(b->root, parent->children, parent->pub.nchildren, &parent->childalloc, sizeof(*children));
+			if (!children) {
+				return;
+			}
+			parent->pub.children = parent->children = children;
+		}
+		parent->children[parent->pub.nchildren++] = &b->pub;
+		return;
+	}
+
+	/* Anything nested that was never closed goes away with the root */
+	root = b;
+	for (prev = &bs->open; (b = *prev);) {
+		if (b->root == root) {
+			*prev = b->next;
+			bs->nopen--;
+		} else {
+			prev = &b->next;
+		}
+	}
+	if (bs->cb && !batch_empty_netsplit(&root->pub)) {
+		bs->cb(bs->data, &root->pub);
+	}
+	batch_free(root);
+}
+
+/*! \brief Copy a parsed message into a batch. All the fields must point into the same line, as set by irc_parse_msg. */
+static int batch_add(struct batch *b, struct irc_msg *msg)
+{
+	const char *fields[] = { msg->tags, msg->prefix, msg->command, msg->channel, msg->body };
+	const char *lo = NULL, *hi = NULL;
+	struct irc_msg *copy;
+	char *text;
+	size_t i;
+
+	if (b->root->total >= MAX_BATCH_MESSAGES) {
+		irc_warn("Batch %s is too large\n", b->root->pub.ref);
+		return -1;
+	}
+	for (i = 0; i < ARRAY_LEN(fields); i++) {
+		if (fields[i]) {
+			const char *end = fields[i] + strlen(fields[i]) + 1;
+			if (!lo || fields[i] < lo) {
+				lo = fields[i];
+			}
+			if (!hi || end > hi) {
+				hi = end;
+			}
+		}
+	}
+	if (lo && hi - lo > IRC_MAX_TAGS_LEN + IRC_MAX_MSG_LEN) {
+		irc_warn("Message fields are not from a single line\n");
+		return -1;
+	}
+
+	copy = arena_alloc(b->root, sizeof(*copy) + (size_t) (hi - lo));
+	if (!copy) {
+		return -1;
+	}
+	*copy = *msg;
+	if (lo) {
+		text = (char *) (copy + 1);
+		memcpy(text, lo, (size_t) (hi - lo));
+#define REBASE(field) if (msg->field) { copy->field = text + (msg->field - lo); }
+		REBASE(tags);
+		REBASE(prefix);
+		REBASE(command);
+		REBASE(channel);
+		REBASE(body);
+#undef REBASE
+	}
+	if (b->pub.count == b->msgalloc) {
+		struct irc_msg **msgs = arena_grow(b->root, b->msgs, b->pub.count, &b->msgalloc, sizeof(*msgs));
+		if (!msgs) {
+			return -1;
+		}
+		b->pub.msgs = b->msgs = msgs;
+	}
+	b->msgs[b->pub.count++] = copy;
+	b->root->total++;
+	return 0;
+}
+
+int batch_process(struct irc_client *client, struct irc_msg *msg)
+{
+	struct batch_state *bs = client->batch;
+	struct batch *b;
+
+	if (msg->type == IRC_CMD_BATCH) {
+		/* BATCH +<ref> <type> [<params>...], or BATCH -<ref> */
+		const char *s = msg->body, *ref;
+		size_t reflen;
+		ref = next_param(&s, &reflen);
+		if (!ref || reflen < 2 || (*ref != '+' && *ref != '-')) {
+			irc_warn("Invalid BATCH command\n");
+			return 0;
+		}
+		if (*ref == '+') {
+			batch_open(bs, msg, ref + 1, reflen - 1, s);
+		} else {
+			batch_close(bs, ref + 1, reflen - 1);
+		}
+		return 1;
+	}
+
+	b = msg_batch(bs, msg);
+	if (!b || !b->history) {
+		return 0;
+	}
+	/* Messages from the past must not be applied to current state, and are only delivered with the batch */
+	batch_add(b, msg);
+	return 1;
+}
+
+int batch_collect(struct irc_client *client, struct irc_msg *msg)
+{
+	struct batch *b = msg_batch(client->batch, msg);
+
+	/* If it can't be added, pass it on by itself rather than lose it */
+	return b && !batch_add(b, msg);
+}
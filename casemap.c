@@ -0,0 +1,154 @@
+/*
+ * LIRC - IRC Client Library for C
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This library is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief IRC casemapping (case-insensitive folding, comparison, and hashing of nicknames and channel names)
+ *
+ * \note All of the supported casemappings only fold a contiguous range of
+ *       ASCII characters, starting at 'A', by adding 0x20:
+ *       ascii: A-Z, strict-rfc1459: A-Z[\], rfc1459: A-Z[\]^
+ *       This lets us fold 8 bytes at a time in an ordinary 64-bit register.
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "irc.h"
+
+/*! \brief Last character folded by each casemapping, indexed by enum irc_casemapping */
+static const unsigned char casemap_last[] = { '^', ']', 'Z' };
+
+#define ONES UINT64_C(0x0101010101010101)
+#define HIGH UINT64_C(0x8080808080808080)
+
+/*! \brief Fold 8 characters at once */
+static inline uint64_t fold_word(uint64_t x, unsigned char last)
+{
+	uint64_t low = x & ~HIGH; /* Clear the high bits, so the additions below can't carry into the next byte */
+	uint64_t ge_first = low + (0x80 - 'A') * ONES; /* High bit set if >= 'A' */
+	uint64_t gt_last = low + (uint64_t) (0x7F - last) * ONES; /* High bit set if > last */
+	uint64_t upper = ge_first & ~gt_last & ~x & HIGH; /* Non-ASCII bytes are never folded */
+	return x | (upper >> 2); /* 0x80 >> 2 == 0x20 */
+}
+
+static inline uint64_t load_word(const char *s)
+{
+	uint64_t x;
+	memcpy(&x, s, sizeof(x));
+	return x;
+}
+
+/*! \brief Load the last (up to 7) characters of a string, padded with NULs */
+static inline uint64_t load_tail(const char *s, size_t len)
+{
+	uint64_t x = 0;
+	memcpy(&x, s, len);
+	return x;
+}
+
+enum irc_casemapping irc_casemapping_from_string(const char *s)
+{
+	if (!s || !strcmp(s, "rfc1459")) {
+		return IRC_CASEMAPPING_RFC1459;
+	} else if (!strcmp(s, "strict-rfc1459")) {
+		return IRC_CASEMAPPING_STRICT_RFC1459;
+	}
+	/* ascii, and rfc7613, which is the same as ascii for ASCII characters */
+	return IRC_CASEMAPPING_ASCII;
+}
+
+const char *irc_casemapping_name(enum irc_casemapping casemapping)
+{
+	switch (casemapping) {
+	case IRC_CASEMAPPING_RFC1459:
+		return "rfc1459";
+	case IRC_CASEMAPPING_STRICT_RFC1459:
+		return "strict-rfc1459";
+	case IRC_CASEMAPPING_ASCII:
+		return "ascii";
+	}
+	return NULL;
+}
+
+char irc_casemap_char(enum irc_casemapping casemapping, char c)
+{
+	unsigned char u = (unsigned char) c;
+	return u >= 'A' && u <= casemap_last[casemapping] ? (char) (u | 0x20) : c;
+}
+
+void irc_casemap_fold(enum irc_casemapping casemapping, char *dst, const char *src, size_t len)
+{
+	unsigned char last = casemap_last[casemapping];
+	uint64_t x;
+
+	for (; len >= sizeof(x); len -= sizeof(x), src += sizeof(x), dst += sizeof(x)) {
+		x = fold_word(load_word(src), last);
+		memcpy(dst, &x, sizeof(x));
+	}
+	if (len) {
+		x = fold_word(load_tail(src, len), last);
+		memcpy(dst, &x, len);
+	}
+}
+
+uint64_t irc_casemap_hash(enum irc_casemapping casemapping, const char *s, size_t len)
+{
+	unsigned char last = casemap_last[casemapping];
+	uint64_t h = UINT64_C(0x9E3779B97F4A7C15) ^ len;
+
+	/* Multiply-xorshift mixing of each folded word */
+	for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t), s += sizeof(uint64_t)) {
+		h = (h ^ fold_word(load_word(s), last)) * UINT64_C(0xBF58476D1CE4E5B9);
+		h ^= h >> 31;
+	}
+	if (len) {
+		h = (h ^ fold_word(load_tail(s, len), last)) * UINT64_C(0xBF58476D1CE4E5B9);
+		h ^= h >> 31;
+	}
+	h *= UINT64_C(0x94D049BB133111EB);
+	return h ^ (h >> 29);
+}
+
+uint64_t irc_casemap_strhash(enum irc_casemapping casemapping, const char *s)
+{
+	return irc_casemap_hash(casemapping, s, strlen(s));
+}
+
+int irc_casemap_memeq(enum irc_casemapping casemapping, const char *a, const char *b, size_t len)
+{
+	unsigned char last = casemap_last[casemapping];
+
+	for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t), a += sizeof(uint64_t), b += sizeof(uint64_t)) {
+		uint64_t x = load_word(a), y = load_word(b);
+		if (x != y && fold_word(x, last) != fold_word(y, last)) {
+			return 0;
+		}
+	}
+	return !len || fold_word(load_tail(a, len), last) == fold_word(load_tail(b, len), last);
+}
+
+int irc_casemap_eq(enum irc_casemapping casemapping, const char *a, const char *b)
+{
+	size_t len = strlen(a);
+	return strlen(b) == len && irc_casemap_memeq(casemapping, a, b, len);
+}
+
+int irc_casemap_cmp(enum irc_casemapping casemapping, const char *a, const char *b)
+{
+	for (;; a++, b++) {
+		unsigned char x = (unsigned char) irc_casemap_char(casemapping, *a), y = (unsigned char) irc_casemap_char(casemapping, *b);
+		if (x != y || !x) {
+			return x - y;
+		}
+	}
+}
@@ -0,0 +1,563 @@
+/*
+ * LIRC - IRC Client Library for C
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This library is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Filling in missed channel history (IRCv3 chathistory)
+ *
+ * \note The last message seen in each channel is remembered, and when the channel
+ *       is joined again, everything after it is requested a page at a time.
+ *       Requests for several channels are kept in flight at once.
+ *       Message IDs seen recently are kept in a compact set of hashes,
+ *       so that messages received both live and from history are only passed on once.
+ *       The set has two generations; when the current one fills up, it replaces the older one,
+ *       so the most recent IDs are always remembered and memory use is fixed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "irc_internal.h"
+
+/*! \brief Page size, if the server doesn't limit it */
+#define PAGE_SIZE_DEFAULT 100
+
+/*! \brief Maximum number of requests in flight at once */
+#define MAX_IN_FLIGHT 4
+
+/*! \brief Maximum number of pages to request for a channel after joining it */
+#define MAX_PAGES 50
+
+/*! \brief How long (in ms) to wait for the server to answer a request before giving up on it */
+#define REQUEST_TIMEOUT_MS 30000
+
+/*! \brief Number of slots in each generation of the set of seen message IDs (power of 2) */
+#define SEEN_SLOTS 4096
+
+struct history_chan {
+	struct history_chan *next;
+	struct history_chan *qnext;		/*!< Next channel waiting to be requested */
+	uint64_t hash;					/*!< Casemapped hash of name */
+	size_t namelen;
+	char msgid[128];				/*!< ID of the last message seen, empty if unknown */
+	char time[40];					/*!< Server time of the last message seen, empty if unknown */
+	char ref[64];					/*!< Reference tag of the batch for the request in flight */
+	size_t received;				/*!< Number of messages received for the request in flight */
+	long long deadline;				/*!< When (monotonic ms) to give up on the request in flight */
+	int pages;						/*!< Number of pages requested since joining */
+	unsigned int queued:1;			/*!< Waiting to be requested */
+	unsigned int inflight:1;		/*!< Request sent, not yet complete */
+	char name[];
+};
+
+struct chathistory {
+	pthread_mutex_t lock;
+	enum irc_casemapping casemapping;
+	struct history_chan *chans;
+	struct history_chan *queue;		/*!< Channels waiting to be requested, in order */
+	struct history_chan **queuetail;
+	int inflight;					/*!< Number of requests in flight */
+	uint64_t *seen[2];				/*!< Current and previous generation of seen message ID hashes, 0 for an empty slot */
+	size_t seencount;				/*!< Number of hashes in the current generation */
+};
+
+static void history_free(struct chathistory *ch)
+{
+	struct history_chan *c;
+
+	while ((c = ch->chans)) {
+		ch->chans = c->next;
+		free(c);
+	}
+	free(ch->seen[0]);
+	free(ch->seen[1]);
+	pthread_mutex_destroy(&ch->lock);
+	free(ch);
+}
+
+int irc_client_chathistory_fill(struct irc_client *client, int enable)
+{
+	struct chathistory *ch;
+
+	if (!enable) {
+		if (irc_loop_running(client)) {
+			irc_err("History filling can't be disabled while irc_loop is running\n");
+			return -1;
+		}
+		pthread_mutex_lock(&client->lock);
+		ch = client->history;
+		client->history = NULL;
+		pthread_mutex_unlock(&client->lock);
+		if (ch) {
+			history_free(ch);
+		}
+		return 0;
+	} else if (client->history) {
+		return 0;
+	}
+
+	ch = calloc(1, sizeof(*ch));
+	if (ch) {
+		ch->seen[0] = calloc(SEEN_SLOTS, sizeof(uint64_t));
+		ch->seen[1] = calloc(SEEN_SLOTS, sizeof(uint64_t));
+	}
+	if (!ch || !ch->seen[0] || !ch->seen[1]) {
+		if (ch) {
+			free(ch->seen[0]);
+			free(ch->seen[1]);
+			free(ch);
+		}
+		irc_err("calloc failed\n");
+		return -1;
+	}
+	ch->casemapping = irc_client_casemapping(client);
+	ch->queuetail = &ch->queue;
+	pthread_mutex_init(&ch->lock, NULL);
+	pthread_mutex_lock(&client->lock);
+	client->history = ch;
+	pthread_mutex_unlock(&client->lock);
+	return 0;
+}
+
+void chathistory_destroy(struct irc_client *client)
+{
+	if (client->history) {
+		history_free(client->history);
+		client->history = NULL;
+	}
+}
+
+/*! \brief 64-bit FNV-1a. Message IDs are case-sensitive, so they can't use the casemapped hash. */
+static uint64_t msgid_hash(const char *s, size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char) s[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash ? hash : 1; /* 0 marks an empty slot */
+}
+
+static int seen_has(const uint64_t *set, uint64_t hash)
+{
+	size_t i;
+
+	for (i = hash & (SEEN_SLOTS - 1); set[i]; i = (i + 1) & (SEEN_SLOTS - 1)) {
+		if (set[i] == hash) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*!
+ * \brief Add a message ID to the seen set. Must be called with the lock held.
+ * \retval 1 if it was already there, 0 if newly added
+ */
+static int seen_add(struct chathistory *ch, const char *msgid, size_t len)
+{
+	uint64_t hash = msgid_hash(msgid, len);
+	size_t i;
+
+	if (seen_has(ch->seen[0], hash) || seen_has(ch->seen[1], hash)) {
+		return 1;
+	}
+	if (ch->seencount >= SEEN_SLOTS / 2) {
+		/* Keep probe sequences short: start a new generation, forgetting the oldest */
+		uint64_t *old = ch->seen[1];
+		memset(old, 0, SEEN_SLOTS * sizeof(*old));
+		ch->seen[1] = ch->seen[0];
+		ch->seen[0] = old;
+		ch->seencount = 0;
+	}
+	for (i = hash & (SEEN_SLOTS - 1); ch->seen[0][i]; i = (i + 1) & (SEEN_SLOTS - 1));
+	ch->seen[0][i] = hash;
+	ch->seencount++;
+	return 0;
+}
+
+/*! \brief Find a channel. Must be called with the lock held. */
+static struct history_chan *chan_find(struct irc_client *client, struct chathistory *ch, const char *name, size_t len)
+{
+	struct history_chan *c;
+	uint64_t hash;
+
+	if (ch->casemapping != irc_client_casemapping(client)) {
+		/* Casemapping changed since channels were added (e.g. on connecting), so rehash them */
+		ch->casemapping = irc_client_casemapping(client);
+		for (c = ch->chans; c; c = c->next) {
+			c->hash = irc_casemap_hash(ch->casemapping, c->name, c->namelen);
+		}
+	}
+	hash = irc_casemap_hash(ch->casemapping, name, len);
+	for (c = ch->chans; c; c = c->next) {
+		if (c->hash == hash && c->namelen == len && irc_casemap_memeq(ch->casemapping, c->name, name, len)) {
+			return c;
+		}
+	}
+	return NULL;
+}
+
+static struct history_chan *chan_get(struct irc_client *client, struct chathistory *ch, const char *name, size_t len)
+{
+	struct history_chan *c = chan_find(client, ch, name, len);
+
+	if (c) {
+		return c;
+	}
+	c = calloc(1, sizeof(*c) + len + 1);
+	if (!c) {
+		irc_err("calloc failed\n");
+		return NULL;
+	}
+	memcpy(c->name, name, len);
+	c->namelen = len;
+	c->hash = irc_casemap_hash(ch->casemapping, name, len);
+	c->next = ch->chans;
+	ch->chans = c;
+	return c;
+}
+
+/*! \brief Remember the last message seen in a channel */
+static void chan_mark(struct history_chan *c, const struct irc_msg *msg)
+{
+	const char *value;
+	size_t len;
+
+	value = msg_tag(msg, "msgid", &len);
+	if (value && len < sizeof(c->msgid)) {
+		memcpy(c->msgid, value, len);
+		c->msgid[len] = '\0';
+	} else {
+		c->msgid[0] = '\0';
+	}
+	value = msg_tag(msg, "time", &len);
+	if (value && len < sizeof(c->time)) {
+		memcpy(c->time, value, len);
+		c->time[len] = '\0';
+	}
+}
+
+static void chan_enqueue(struct chathistory *ch, struct history_chan *c)
+{
+	c->queued = 1;
+	c->qnext = NULL;
+	*ch->queuetail = c;
+	ch->queuetail = &c->qnext;
+}
+
+/*! \brief Page size for requests, 0 if the server doesn't support chathistory */
+static int page_size(struct irc_client *client)
+{
+	int limit = irc_client_isupport_int(client, IRC_ISUPPORT_CHATHISTORY);
+
+	if (limit < 0) {
+		return 0;
+	}
+	return limit ? limit : PAGE_SIZE_DEFAULT;
+}
+
+/*! \brief Send requests for queued channels, as long as there's room for more in flight */
+static void dispatch(struct irc_client *client, struct chathistory *ch)
+{
+	char requests[MAX_IN_FLIGHT][IRC_MAX_MSG_LEN];
+	struct history_chan *sent[MAX_IN_FLIGHT];
+	int i, n = 0, limit = page_size(client);
+	long long now = now_ms();
+	const char *msgref = irc_client_isupport(client, IRC_ISUPPORT_MSGREFTYPES);
+	int use_msgid = !msgref || strstr(msgref, "msgid") != NULL;
+
+	if (!limit) {
+		return;
+	}
+	pthread_mutex_lock(&ch->lock);
+	while (ch->queue && ch->inflight < MAX_IN_FLIGHT) {
+		struct history_chan *c = ch->queue;
+		ch->queue = c->qnext;
+		if (!ch->queue) {
+			ch->queuetail = &ch->queue;
+		}
+		c->queued = 0;
+		if (use_msgid && *c->msgid) {
+			snprintf(requests[n], sizeof(requests[n]), "CHATHISTORY AFTER %s msgid=%s %d", c->name, c->msgid, limit);
+		} else if (*c->time) {
+			snprintf(requests[n], sizeof(requests[n]), "CHATHISTORY AFTER %s timestamp=%s %d", c->name, c->time, limit);
+		} else {
+			continue; /* Nothing to go on */
+		}
+		c->inflight = 1;
+		c->received = 0;
+		c->ref[0] = '\0';
+		c->deadline = now + REQUEST_TIMEOUT_MS;
+		c->pages++;
+		ch->inflight++;
+		sent[n++] = c;
+	}
+	pthread_mutex_unlock(&ch->lock);
+
+	/* Don't hold the lock while sending */
+	for (i = 0; i < n; i++) {
+		if (irc_send(client, "%s", requests[i])) {
+			struct history_chan *c = sent[i];
+			irc_warn("Failed to request history for %s\n", c->name);
+			/* Nothing is coming back, so free up the slot */
+			pthread_mutex_lock(&ch->lock);
+			if (c->inflight && !*c->ref) {
+				c->inflight = 0;
+				c->pages--;
+				ch->inflight--;
+			}
+			pthread_mutex_unlock(&ch->lock);
+		}
+	}
+}
+
+/*! \brief The request for a channel is complete. Must be called with the lock held. */
+static void request_done(struct irc_client *client, struct chathistory *ch, struct history_chan *c)
+{
+	c->inflight = 0;
+	c->ref[0] = '\0';
+	ch->inflight--;
+	/* A full page means there's probably more */
+	if ((int) c->received >= page_size(client) && c->pages < MAX_PAGES) {
+		chan_enqueue(ch, c);
+	}
+}
+
+static struct history_chan *chan_by_ref(struct chathistory *ch, const char *ref, size_t len)
+{
+	struct history_chan *c;
+
+	for (c = ch->chans; c; c = c->next) {
+		if (c->inflight && *c->ref && !strncmp(c->ref, ref, len) && !c->ref[len]) {
+			return c;
+		}
+	}
+	return NULL;
+}
+
+/*! \brief Handle BATCH for batches of history we requested */
+static int history_batch(struct irc_client *client, struct chathistory *ch, struct irc_msg *msg)
+{
+	const char *s = msg->body, *ref, *type, *target;
+	size_t reflen, typelen, targetlen;
+	struct history_chan *c;
+
+	ref = next_param(&s, &reflen);
+	if (!ref || reflen < 2) {
+		return 0;
+	}
+	if (*ref == '-') {
+		c = chan_by_ref(ch, ref + 1, reflen - 1);
+		if (!c) {
+			return 0;
+		}
+		request_done(client, ch, c);
+		return 1;
+	}
+	/* BATCH +<ref> chathistory <target> */
+	type = next_param(&s, &typelen);
+	target = next_param(&s, &targetlen);
+	if (*ref != '+' || !type || !target || reflen - 1 >= sizeof(c->ref)) {
+		return 0;
+	}
+	if (!((typelen == 11 && !strncmp(type, "chathistory", typelen)) || (typelen == 17 && !strncmp(type, "draft/chathistory", typelen)))) {
+		return 0;
+	}
+	c = chan_find(client, ch, target, targetlen);
+	if (!c || !c->inflight || *c->ref) {
+		return 0;
+	}
+	memcpy(c->ref, ref + 1, reflen - 1);
+	c->ref[reflen - 1] = '\0';
+	c->deadline = now_ms() + REQUEST_TIMEOUT_MS; /* The server is answering, give it time to finish */
+	return 1;
+}
+
+/*! \brief Handle FAIL CHATHISTORY <code> [<context>...] :<description> */
+static void history_fail(struct irc_client *client, struct chathistory *ch, struct irc_msg *msg)
+{
+	const char *s = msg->body, *param;
+	size_t len;
+
+	param = next_param(&s, &len);
+	if (!param || len != 11 || strncmp(param, "CHATHISTORY", len)) {
+		return;
+	}
+	while ((param = next_param(&s, &len))) {
+		struct history_chan *c = chan_find(client, ch, param, len);
+		if (c && c->inflight) {
+			irc_warn("History request for %s failed\n", c->name);
+			c->pages = MAX_PAGES; /* Don't try for more */
+			request_done(client, ch, c);
+			return;
+		}
+	}
+}
+
+long long chathistory_deadline(struct irc_client *client)
+{
+	struct chathistory *ch = client->history;
+	struct history_chan *c;
+	long long next = -1;
+
+	pthread_mutex_lock(&ch->lock);
+	if (ch->inflight) {
+		for (c = ch->chans; c; c = c->next) {
+			if (c->inflight && (next == -1 || c->deadline < next)) {
+				next = c->deadline;
+			}
+		}
+	}
+	pthread_mutex_unlock(&ch->lock);
+	return next;
+}
+
+void chathistory_flush_due(struct irc_client *client, long long now)
+{
+	struct chathistory *ch = client->history;
+	struct history_chan *c;
+	int more = 0;
+
+	pthread_mutex_lock(&ch->lock);
+	if (ch->inflight) {
+		for (c = ch->chans; c; c = c->next) {
+			if (c->inflight && now >= c->deadline) {
+				/* e.g. the server answered without a batch, or not at all */
+				irc_debug(1, "History request for %s timed out\n", c->name);
+				c->pages = MAX_PAGES; /* Don't try for more */
+				request_done(client, ch, c);
+				more = 1;
+			}
+		}
+	}
+	pthread_mutex_unlock(&ch->lock);
+	if (more) {
+		dispatch(client, ch);
+	}
+}
+
+int chathistory_process(struct irc_client *client, struct irc_msg *msg)
+{
+	struct chathistory *ch = client->history;
+	struct history_chan *c;
+	const char *channel, *value;
+	size_t len;
+	int res = 0, more = 0;
+
+	pthread_mutex_lock(&ch->lock);
+	if (msg->type == IRC_CMD_BATCH) {
+		res = history_batch(client, ch, msg);
+		pthread_mutex_unlock(&ch->lock);
+		if (res) {
+			dispatch(client, ch);
+		}
+		return res;
+	}
+
+	value = msg->tags ? msg_tag(msg, "batch", &len) : NULL;
+	c = value ? chan_by_ref(ch, value, len) : NULL;
+	if (c) {
+		/* A message from history we requested: pass it on, unless it's already been seen */
+		c->received++;
+		chan_mark(c, msg);
+		value = msg_tag(msg, "msgid", &len);
+		res = value && seen_add(ch, value, len) ? CHATHISTORY_CONSUMED : CHATHISTORY_REPLAY;
+		pthread_mutex_unlock(&ch->lock);
+		return res;
+	}
+
+	switch (msg->type) {
+	case IRC_CMD_PRIVMSG:
+	case IRC_CMD_NOTICE:
+		value = msg->tags ? msg_tag(msg, "msgid", &len) : NULL;
+		if (value) {
+			seen_add(ch, value, len);
+		}
+		if (msg->channel && irc_client_is_channel(client, msg->channel)) {
+			c = chan_find(client, ch, msg->channel, strlen(msg->channel));
+			/* While history is being filled in, only history advances the last message seen */
+			if (c && !c->queued && !c->inflight) {
+				chan_mark(c, msg);
+			}
+		}
+		break;
+	case IRC_CMD_JOIN:
+		channel = msg->channel && *msg->channel == ':' ? msg->channel + 1 : msg->channel;
+		len = msg->prefix ? strcspn(msg->prefix, "!@") : 0;
+		if (channel && len && strlen(irc_client_nickname(client)) == len
+			&& irc_casemap_memeq(irc_client_casemapping(client), irc_client_nickname(client), msg->prefix, len)) {
+			c = chan_get(client, ch, channel, strlen(channel));
+			if (c && (*c->msgid || *c->time) && !c->queued && !c->inflight) {
+				c->pages = 0;
+				chan_enqueue(ch, c);
+				more = 1;
+			}
+		}
+		break;
+	default:
+		if (msg->command && !strcmp(msg->command, "FAIL")) {
+			history_fail(client, ch, msg);
+			more = 1;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&ch->lock);
+	if (more) {
+		dispatch(client, ch);
+	}
+	return 0;
+}
+
+int irc_client_chathistory_mark(struct irc_client *client, const char *channel, const char *msgid, const char *timestamp)
+{
+	struct chathistory *ch = client->history;
+	struct history_chan *c;
+
+	if (!ch) {
+		irc_err("History filling is not enabled\n");
+		return -1;
+	}
+	if ((msgid && strlen(msgid) >= sizeof(c->msgid)) || (timestamp && strlen(timestamp) >= sizeof(c->time))) {
+		irc_err("Message reference too long\n");
+		return -1;
+	}
+	pthread_mutex_lock(&ch->lock);
+	c = chan_get(client, ch, channel, strlen(channel));
+	if (c) {
+		snprintf(c->msgid, sizeof(c->msgid), "%s", msgid ? msgid : "");
+		snprintf(c->time, sizeof(c->time), "%s", timestamp ? timestamp : "");
+	}
+	pthread_mutex_unlock(&ch->lock);
+	return c ? 0 : -1;
+}
+
+int irc_client_chathistory_last(struct irc_client *client, const char *channel, char *msgid, size_t msgidlen, char *timestamp, size_t timestamplen)
+{
+	struct chathistory *ch = client->history;
+	struct history_chan *c;
+
+	if (!ch) {
+		return -1;
+	}
+	pthread_mutex_lock(&ch->lock);
+	c = chan_find(client, ch, channel, strlen(channel));
+	if (c) {
+		snprintf(msgid, msgidlen, "%s", c->msgid);
+		snprintf(timestamp, timestamplen, "%s", c->time);
+	}
+	pthread_mutex_unlock(&ch->lock);
+	return c && (*c->msgid || *c->time) ? 0 : -1;
+}
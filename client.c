@@ -31,12 +31,14 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/time.h> /* use gettimeofday */
+#include <time.h>
 #include <unistd.h>
 #include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <assert.h>
 #include <termios.h>
+#include <ctype.h>
 
 #include "irc.h"
 #include "numerics.h"
@@ -45,6 +47,7 @@
 #define CLIENT_COPYRIGHT CLIENT_VERSION ", Copyright (C) 2023 Naveen Albert"
 
 static pthread_t rx_thread_id;
+static int rx_thread_started = 0;
 static int debug_level = 0;
 static int fully_started = 0;
 static int shutting_down = 0;
@@ -52,7 +55,6 @@ static int do_not_disturb = 0;
 static char client_prompt[84] = "IRC> ";
 static char fg_chan[64] = "";
 static int iopipe[2] = { -1, -1 };
-static FILE *clientlog = NULL;
 
 static struct termios orig_term;
 
@@ -204,17 +206,36 @@ static void set_fg_chan(const char *fgchan)
 /* Forward declaration */
 static void handle_irc_msg(void *data, struct irc_msg *msg);
 
+/*! \brief Stop the receive thread, if running. Not cancelled, so irc_loop can finish and logs are written out. */
+static void stop_rx_thread(struct irc_client *client)
+{
+	if (!rx_thread_started) {
+		return;
+	}
+	irc_disconnect(client); /* irc_loop returns once the connection is closed */
+	pthread_join(rx_thread_id, NULL);
+	rx_thread_started = 0;
+}
+
 static void *rx_thread(void *varg)
 {
-	/* Thread will get killed on shutdown */
+	/* irc_loop returns once the client is disconnected on shutdown */
 	struct irc_client *client = varg;
-
-	clientlog = fopen("client.txt", "a"); /* Create or append */
-	if (!clientlog) {
-		client_log(IRC_LOG_ERR, "Failed to open file: %s\n", strerror(errno));
+	struct irc_protolog_config logconfig;
+
+	memset(&logconfig, 0, sizeof(logconfig));
+	logconfig.path = "client.txt"; /* Create or append */
+	logconfig.max_size = 64 * 1024 * 1024;
+	logconfig.max_age = 86400;
+	logconfig.timestamps = 1;
+	logconfig.archive = "client-archive";
+	logconfig.search = 1;
+	if (irc_client_protolog_open(client, &logconfig)) {
+		client_log(IRC_LOG_ERR, "Failed to start logging to client.txt\n");
 	}
 
-	irc_loop(client, clientlog, handle_irc_msg, client);
+	irc_loop(client, NULL, handle_irc_msg, client);
+	irc_client_protolog_close(client); /* Only once irc_loop has returned */
 
 	client_log(IRC_LOG_INFO, "IRC client receive thread has exited\n");
 	assert(!irc_client_connected(client));
@@ -381,8 +402,6 @@ static int get_password(char *buf, size_t len)
 	return 0;
 }
 
-static struct timeval ctcp_ping_time;
-
 static void handle_irc_msg(void *data, struct irc_msg *msg)
 {
 	char oldnick[64];
@@ -446,7 +465,8 @@ static void handle_irc_msg(void *data, struct irc_msg *msg)
 		case IRC_CMD_PRIVMSG:
 		case IRC_CMD_NOTICE:
 			/* Mentions, e.g. jsmith: you there? */
-			if (!do_not_disturb && !strncasecmp(irc_msg_body(msg), irc_client_nickname(client), strlen(irc_client_nickname(client)))) {
+			if (!do_not_disturb && strlen(irc_msg_body(msg)) >= strlen(irc_client_nickname(client))
+				&& irc_casemap_memeq(irc_client_casemapping(client), irc_msg_body(msg), irc_client_nickname(client), strlen(irc_client_nickname(client)))) {
 				irc_print("\a"); /* Ring the bell to grab the user's attention, s/he just got mentioned */
 			}
 			if (irc_msg_is_ctcp(msg) && !irc_parse_msg_ctcp(msg)) {
@@ -457,38 +477,13 @@ static void handle_irc_msg(void *data, struct irc_msg *msg)
 						case CTCP_ACTION:
 							irc_print("[ACTION] %s %s %s\n", irc_msg_prefix(msg), irc_msg_channel(msg), irc_msg_body(msg));
 							break;
-						case CTCP_PING:
-							irc_client_ctcp_reply(client, irc_msg_prefix(msg), irc_msg_ctcp_type(msg), irc_msg_body(msg)); /* Reply with the data that was sent */
-							break;
-						case CTCP_TIME:
-							{
-								char timebuf[32];
-								time_t nowtime;
-								struct tm nowdate;
-
-								nowtime = time(NULL);
-								localtime_r(&nowtime, &nowdate);
-								strftime(timebuf, sizeof(timebuf), "%a %b %e %Y %I:%M:%S %P %Z", &nowdate);
-								irc_client_ctcp_reply(client, irc_msg_prefix(msg), irc_msg_ctcp_type(msg), timebuf);
-							}
-							break;
+						/* VERSION, PING, TIME, etc. are answered by the library's CTCP responder */
 						default:
 							client_log(IRC_LOG_ERR, "Unhandled CTCP extended data type: %s\n", irc_ctcp_name(irc_msg_ctcp_type(msg)));
 					}
 				} else {
-					struct timeval tnow;
-					double secs;
-					switch (irc_msg_ctcp_type(msg)) {
-						case CTCP_PING:
-							/* XXX We don't keep track the ping reply is from the same user to whom we sent a ping request */
-							gettimeofday(&tnow, NULL);
-							secs = (1.0 * (tnow.tv_sec - ctcp_ping_time.tv_sec) * 1000000 + tnow.tv_usec - ctcp_ping_time.tv_usec) / 1000000;
-							irc_print("Ping reply from %s in %.3f seconds\n", irc_msg_prefix(msg), secs);
-							break;
-						default:
-							irc_print("CTCP %s reply %s from %s\n", irc_ctcp_name(irc_msg_ctcp_type(msg)), irc_msg_body(msg), irc_msg_prefix(msg));
-							break;
-					}
+					/* Replies to our pings are reported to handle_ping instead */
+					irc_print("CTCP %s reply %s from %s\n", irc_ctcp_name(irc_msg_ctcp_type(msg)), irc_msg_body(msg), irc_msg_prefix(msg));
 				}
 			} else {
 				/* Enclose the entire username + mask in <>, even though this is more than just the username,
@@ -518,7 +513,7 @@ static void handle_irc_msg(void *data, struct irc_msg *msg)
 			tmp = oldnick;
 			realnick = strsep(&tmp, "!");
 			if (realnick) {
-				if (!strcmp(realnick, irc_client_nickname(client))) {
+				if (irc_client_name_eq(client, realnick, irc_client_nickname(client))) {
 					/* We successfully updated our nickname */
 					irc_client_set_nick(client, irc_msg_body(msg) + 1); /* Skip leading : */
 					update_prompt(client); /* If we changed our nick, update the prompt accordingly to reflect that */
@@ -539,6 +534,133 @@ static void handle_irc_msg(void *data, struct irc_msg *msg)
 	}
 }
 
+static void handle_target_error(void *data, const char *target, int numeric, const char *reason)
+{
+	(void) data;
+	irc_print("%sFailed to send to %s (%d): %s%s\n", COLOR_RED, target, numeric, reason, COLOR_RESET);
+}
+
+static void handle_netsplit(void *data, const struct irc_netsplit *split)
+{
+	size_t i;
+
+	(void) data;
+	/* One line for the whole split, no matter how many users were affected */
+	irc_print("%s%s %s <-> %s (%zu user%s):", COLOR_RED, split->type == IRC_NETSPLIT_QUIT ? "Netsplit" : "Netjoin",
+		split->server1, split->server2, split->count, split->count == 1 ? "" : "s");
+	for (i = 0; i < split->count && i < 10; i++) {
+		irc_print(" %s", split->nicks[i]);
+	}
+	irc_print("%s%s\n", i < split->count ? " ..." : "", COLOR_RESET);
+}
+
+static void handle_batch(void *data, const struct irc_batch *batch)
+{
+	size_t i;
+	int history = !strcmp(batch->type, "chathistory");
+
+	irc_print("%sBatch %s%s%s (%zu message%s)%s\n", COLOR_CYAN, batch->type, batch->params ? " " : "", batch->params ? batch->params : "",
+		batch->count, batch->count == 1 ? "" : "s", COLOR_RESET);
+	for (i = 0; i < batch->count; i++) {
+		if (history && irc_msg_type(batch->msgs[i]) == IRC_CMD_NICK) {
+			continue; /* Don't mistake an old nick change of ours for a new one */
+		}
+		handle_irc_msg(data, batch->msgs[i]);
+	}
+	for (i = 0; i < batch->nchildren; i++) {
+		handle_batch(data, batch->children[i]);
+	}
+}
+
+static void handle_ping(void *data, const char *target, const char *nick, long long rtt)
+{
+	if (!nick) {
+		irc_print("%sNo ping reply from %s%s\n", COLOR_RED, target, COLOR_RESET);
+	} else if (irc_client_name_eq(data, target, nick)) {
+		irc_print("Ping reply from %s in %.3f seconds\n", nick, rtt / 1000000.0);
+	} else {
+		irc_print("Ping reply from %s (%s) in %.3f seconds\n", nick, target, rtt / 1000000.0);
+	}
+}
+
+static void handle_dcc(void *data, unsigned int id, enum irc_dcc_status status, uint64_t bytes, uint64_t size)
+{
+	static const char *statuses[] = { "started", "in progress", "done", "failed" };
+
+	(void) data;
+	irc_print("DCC transfer %u %s: %llu/%llu bytes\n", id, statuses[status], (unsigned long long) bytes, (unsigned long long) size);
+}
+
+static void handle_dcc_offer(void *data, const struct irc_dcc_offer *offer)
+{
+	(void) data;
+	if (offer->chat) {
+		irc_print("DCC chat offer %u from %s. Type /chat %u to accept it.\n", offer->id, offer->nick, offer->id);
+		return;
+	}
+	irc_print("DCC offer %u from %s: %s (%llu bytes). Type /get %u <FILE> to accept it.\n", offer->id, offer->nick, offer->filename, (unsigned long long) offer->size, offer->id);
+}
+
+static void handle_dcc_chat(void *data, unsigned int id, struct irc_msg *msg)
+{
+	(void) data;
+	irc_print("[chat %u] <%s> %s\n", id, irc_msg_prefix(msg), irc_msg_body(msg));
+}
+
+static void print_channel(void *data, const char *channel)
+{
+	(void) data;
+	irc_print(" %s", channel);
+}
+
+static void print_member(void *data, const char *nick, const char *prefixes)
+{
+	(void) data;
+	irc_print(" %s%s", prefixes, nick);
+}
+
+static void print_list_entry(void *data, const struct irc_list_entry *entry)
+{
+	(void) data;
+	irc_print("%-20s %5d %s\n", entry->channel, entry->users, entry->topic);
+}
+
+static void print_list_end(void *data, size_t matched, size_t total)
+{
+	(void) data;
+	irc_print("%zu of %zu channels matched\n", matched, total);
+}
+
+static void print_user_info(void *data, const char *nick, const struct irc_user_info *info)
+{
+	(void) data;
+	if (!info) {
+		irc_print("No such user: %s\n", nick);
+		return;
+	}
+	irc_print("%s is %s@%s (%s)%s%s%s%s\n", info->nick, info->user, info->host, info->realname ? info->realname : "",
+		info->account ? ", logged in as " : "", info->account ? info->account : "", info->away ? ", away" : "", info->oper ? ", IRC operator" : "");
+}
+
+static void print_channel_lookup(void *data, const char *channel, int count)
+{
+	(void) data;
+	irc_print("%d users in %s\n", count, channel);
+}
+
+static int print_search_result(void *data, long long time, const char *line, size_t len)
+{
+	char stamp[24];
+	time_t secs = (time_t) (time / 1000);
+	struct tm tm;
+
+	(void) data;
+	localtime_r(&secs, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+	irc_print("[%s] %.*s\n", stamp, (int) len, line);
+	return 0;
+}
+
 #define REQUIRED_PARAMETER(var, name) \
 	if (!(var)) { \
 		client_log(IRC_LOG_ERR, "Missing required parameter %s\n", name); \
@@ -571,15 +693,28 @@ static int handle_send_msg(struct irc_client **clientptr, char *input)
 			printf("/quit [<MSG>]             - Quit from server with optional MSG\n");
 			printf("/part <CHANS>             - Leave channel(s), comma-separated\n");
 			printf("/join <CHANS>             - Join channel(s), comma-separated\n");
-			printf("/msg <CHAN> <MSG>         - Send MSG to channel CHAN\n");
-			printf("/notice <CHAN> <MSG>      - Send MSG to channel CHAN, inhibit autoresponses\n");
+			printf("/msg <CHANS> <MSG>        - Send MSG to channel(s) CHANS, comma-separated\n");
+			printf("/notice <CHANS> <MSG>     - Send MSG to channel(s) CHANS, inhibit autoresponses\n");
 			printf("/me <ACTION>              - Send action msg to current foreground channel\n");
 			printf("/describe <USER> <ACTION> - Send action msg for specified user\n");
 			printf("/ctcp <TARGET> <CMD>      - Send CTCP command request to another user\n");
 			printf("/nick <NICK>              - Change nickname to NICK\n");
 			printf("/topic <CHAN> <TOPIC>     - Set channel CHAN's topic to TOPIC\n");
 			printf("/list [<CHANS>]           - List channels on server (with optional filter of comma-separated channels)\n");
+			printf("/find <MASK> [MIN] [N]    - Find channels matching MASK with at least MIN users, showing only the N largest\n");
 			printf("/invite <NICK> <CHAN>     - Invite user NICK to channel CHAN\n");
+			printf("/who <NICK|CHAN>          - Look up information about user NICK, or all users in channel CHAN\n");
+			printf("/names [<CHAN>]           - Show members of channel CHAN, or all channels if not specified\n");
+			printf("/latency                  - Show how long sent messages are taking to reach the server\n");
+			printf("/search <QUERY>           - Search logged messages for words, URLs, nick:NICK, and #CHAN\n");
+			printf("/dcc <NICK> <FILE>        - Offer FILE to user NICK with DCC SEND\n");
+			printf("/queue <NICK> <FILE>      - Queue FILE for user NICK, to be offered once a DCC slot is free\n");
+			printf("/get <ID> <FILE>          - Accept DCC offer ID, saving (or resuming) it to FILE\n");
+			printf("/chat <NICK|ID>           - Offer a DCC chat to user NICK, or accept DCC chat offer ID\n");
+			printf("/say <ID> <MSG>           - Send MSG in DCC chat ID\n");
+			printf("/op <CHAN> <NICKS>        - Give operator status to NICKS (space-separated). Also /deop\n");
+			printf("/voice <CHAN> <NICKS>     - Give voice to NICKS (space-separated). Also /devoice\n");
+			printf("/ban <CHAN> <MASKS>       - Ban MASKS (space-separated). Also /unban\n");
 			printf("/identify <USER> <PASS>   - Authenticate to the server if not authenticated already.\n");
 			printf("/server <HOST> <PORT>     - Connect to an IRC server, if not already connected to one.\n");
 			printf("^C                        - Exit client\n");
@@ -620,9 +755,21 @@ static int handle_send_msg(struct irc_client **clientptr, char *input)
 				if (!client) {
 					return -1;
 				}
-				/* Replace the original client with the new one */
+				/* Replace the original client with the new one, once its receive thread is done with it */
+				stop_rx_thread(*clientptr);
 				irc_client_destroy(*clientptr);
 				*clientptr = client;
+				irc_client_target_error_callback(client, handle_target_error, NULL);
+				irc_client_track_state(client, 1);
+				irc_client_netsplit_callback(client, handle_netsplit, NULL);
+				irc_client_batch_callback(client, handle_batch, client);
+				irc_client_chathistory_fill(client, 1);
+				irc_client_latency_tracking(client, 1);
+				irc_client_ping_callback(client, handle_ping, client);
+				irc_client_ctcp_responder(client, CLIENT_VERSION, NULL);
+				irc_client_dcc_callback(client, handle_dcc, client);
+				irc_client_dcc_offer_callback(client, handle_dcc_offer, client);
+				irc_client_dcc_chat_callback(client, handle_dcc_chat, client);
 				if (flags) {
 					res = irc_client_set_flags(client, flags);
 				}
@@ -635,6 +782,7 @@ static int handle_send_msg(struct irc_client **clientptr, char *input)
 				if (pthread_create(&rx_thread_id, NULL, rx_thread, (void*) client)) {
 					return -1;
 				}
+				rx_thread_started = 1;
 				update_prompt(client);
 				return res;
 			} else if (!irc_client_connected(client)) {
@@ -652,14 +800,22 @@ static int handle_send_msg(struct irc_client **clientptr, char *input)
 				res = irc_client_channel_leave(client, s); /* Explicitly leave channel(s) */
 			} else if (!strcasecmp(command, "join")) {
 				res = irc_client_channel_join(client, s); /* Explicitly join channel(s) */
-			} else if (!strcasecmp(command, "msg")) {
+			} else if (!strcasecmp(command, "msg") || !strcasecmp(command, "notice")) {
+				const char *targets[256]; /* Input is at most 512 chars, so there can't be more targets than this */
+				size_t ntargets = 0;
 				channel = strsep(&s, " ");
 				REQUIRED_PARAMETER(s, "message"); /* if channel is NULL, so is s */
-				res = irc_client_msg(client, channel, s);
-			} else if (!strcasecmp(command, "notice")) {
-				channel = strsep(&s, " ");
-				REQUIRED_PARAMETER(s, "message");
-				res = irc_client_notice(client, channel, s);
+				/* Let the library pack multiple targets into as few messages as the server allows */
+				while ((msg = strsep(&channel, ",")) && ntargets < sizeof(targets) / sizeof(targets[0])) {
+					if (*msg) {
+						targets[ntargets++] = msg;
+					}
+				}
+				if (!strcasecmp(command, "msg")) {
+					res = irc_client_msg_multi(client, targets, ntargets, s);
+				} else {
+					res = irc_client_notice_multi(client, targets, ntargets, s);
+				}
 			} else if (!strcasecmp(command, "me")) {
 				REQUIRE_FG_CHANNEL();
 				res = irc_client_action(client, fg_chan, s);
@@ -678,9 +834,6 @@ static int handle_send_msg(struct irc_client **clientptr, char *input)
 				if (ctcp < 0) {
 					return -1;
 				}
-				if (ctcp == CTCP_PING) {
-					gettimeofday(&ctcp_ping_time, NULL);
-				}
 				res = irc_client_ctcp_request(client, channel, ctcp);
 			} else if (!strcasecmp(command, "nick")) {
 				msg = strsep(&s, " "); /* Okay to use strsep, since NICKs are only one word anyways */
@@ -693,12 +846,114 @@ static int handle_send_msg(struct irc_client **clientptr, char *input)
 				res = irc_client_set_channel_topic(client, channel, s);
 			} else if (!strcasecmp(command, "list")) {
 				res = irc_client_list_channels(client, s);
+			} else if (!strcasecmp(command, "find")) {
+				struct irc_list_filter filter;
+				const char *arg;
+				memset(&filter, 0, sizeof(filter));
+				filter.pattern = strsep(&s, " ");
+				REQUIRED_PARAMETER(filter.pattern, "mask");
+				arg = strsep(&s, " ");
+				filter.min_users = arg ? atoi(arg) : 0;
+				arg = strsep(&s, " ");
+				filter.top = arg ? (size_t) atoi(arg) : 0;
+				res = irc_client_list(client, &filter, print_list_entry, print_list_end, NULL);
 			} else if (!strcasecmp(command, "invite")) {
 				const char *nickname = strsep(&s, " ");
 				REQUIRED_PARAMETER(nickname, "nickname");
 				channel = strsep(&s, " ");
 				REQUIRED_PARAMETER(channel, "channel");
 				res = irc_client_invite_user(client, nickname, channel);
+			} else if (!strcasecmp(command, "who")) {
+				msg = strsep(&s, " ");
+				REQUIRED_PARAMETER(msg, "nickname or channel");
+				if (irc_client_is_channel(client, msg)) {
+					res = irc_client_channel_lookup(client, msg, print_channel_lookup, NULL);
+				} else {
+					res = irc_client_user_lookup(client, msg, print_user_info, NULL);
+				}
+			} else if (!strcasecmp(command, "names")) {
+				/* Use the tracked state, rather than asking the server */
+				channel = strsep(&s, " ");
+				if (channel && *channel) {
+					irc_print("%s:", channel);
+					res = irc_state_channel_members(client, channel, print_member, NULL) < 0 ? -1 : 0;
+				} else {
+					irc_print("Channels:");
+					res = irc_state_channels(client, print_channel, NULL) < 0 ? -1 : 0;
+				}
+				irc_print("\n");
+			} else if (!strcasecmp(command, "latency")) {
+				static const char *segments[] = { "send", "network", "total" };
+				int i;
+				for (i = 0; i < IRC_LATENCY_SEGMENTS; i++) {
+					struct irc_latency_stats stats;
+					res = irc_client_latency_stats(client, i, &stats);
+					if (res) {
+						break;
+					}
+					irc_print("%-8s %lu msgs, min %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", segments[i], (unsigned long) stats.count,
+						stats.min / 1000.0, stats.p50 / 1000.0, stats.p99 / 1000.0, stats.max / 1000.0);
+				}
+			} else if (!strcasecmp(command, "search")) {
+				REQUIRED_PARAMETER(s, "query");
+				res = irc_archive_search("client-archive", s, 50, print_search_result, NULL);
+				if (res >= 0) {
+					irc_print("%d message%s found%s\n", res, res == 1 ? "" : "s", res == 50 ? " (showing the latest)" : "");
+					res = 0;
+				}
+			} else if (!strcasecmp(command, "dcc")) {
+				const char *nickname = strsep(&s, " ");
+				REQUIRED_PARAMETER(nickname, "nickname");
+				REQUIRED_PARAMETER(s, "file");
+				res = irc_client_dcc_send(client, nickname, s, 0);
+				if (res > 0) {
+					irc_print("Offered %s to %s (transfer %d)\n", s, nickname, res);
+					res = 0;
+				}
+			} else if (!strcasecmp(command, "queue")) {
+				const char *nickname = strsep(&s, " ");
+				REQUIRED_PARAMETER(nickname, "nickname");
+				REQUIRED_PARAMETER(s, "file");
+				res = irc_client_dcc_queue(client, nickname, s, 0);
+				if (res > 0) {
+					irc_print("Queued %s for %s (transfer %d)\n", s, nickname, res);
+					res = 0;
+				}
+			} else if (!strcasecmp(command, "get")) {
+				const char *id = strsep(&s, " ");
+				REQUIRED_PARAMETER(id, "ID");
+				REQUIRED_PARAMETER(s, "file");
+				res = irc_client_dcc_accept(client, (unsigned int) atoi(id), s, IRC_DCC_RESUME);
+			} else if (!strcasecmp(command, "chat")) {
+				REQUIRED_PARAMETER(s, "nickname or ID");
+				if (isdigit(*s)) {
+					res = irc_client_dcc_chat_accept(client, (unsigned int) atoi(s));
+				} else {
+					res = irc_client_dcc_chat(client, s, 0);
+					if (res > 0) {
+						irc_print("Offered a chat to %s (chat %d)\n", s, res);
+						res = 0;
+					}
+				}
+			} else if (!strcasecmp(command, "say")) {
+				const char *id = strsep(&s, " ");
+				REQUIRED_PARAMETER(id, "ID");
+				REQUIRED_PARAMETER(s, "message");
+				res = irc_client_dcc_chat_send(client, (unsigned int) atoi(id), s);
+			} else if (!strcasecmp(command, "op") || !strcasecmp(command, "deop") || !strcasecmp(command, "voice")
+				|| !strcasecmp(command, "devoice") || !strcasecmp(command, "ban") || !strcasecmp(command, "unban")) {
+				int add = strncasecmp(command, "de", 2) && strncasecmp(command, "un", 2);
+				char mode = tolower(command[add ? 0 : 2]);
+				channel = strsep(&s, " ");
+				REQUIRED_PARAMETER(channel, "channel");
+				REQUIRED_PARAMETER(s, "nickname");
+				/* Queue all the changes, and then send them stacked in as few MODE messages as possible */
+				while (!res && (msg = strsep(&s, " "))) {
+					if (*msg) {
+						res = irc_client_mode_queue(client, channel, add, mode, msg);
+					}
+				}
+				res |= irc_client_mode_flush(client, channel);
 			} else if (!strcasecmp(command, "identify")) {
 				const char *password, *nickname = strsep(&s, " ");
 				REQUIRED_PARAMETER(nickname, "nickname");
@@ -825,6 +1080,17 @@ int main(int argc, char *argv[])
 		}
 
 		update_prompt(client);
+		irc_client_target_error_callback(client, handle_target_error, NULL);
+		irc_client_track_state(client, 1);
+		irc_client_netsplit_callback(client, handle_netsplit, NULL);
+		irc_client_batch_callback(client, handle_batch, client);
+		irc_client_chathistory_fill(client, 1);
+		irc_client_latency_tracking(client, 1);
+		irc_client_ping_callback(client, handle_ping, client);
+		irc_client_ctcp_responder(client, CLIENT_VERSION, NULL);
+		irc_client_dcc_callback(client, handle_dcc, client);
+		irc_client_dcc_offer_callback(client, handle_dcc_offer, client);
+		irc_client_dcc_chat_callback(client, handle_dcc_chat, client);
 
 		/* Set client connection flags */
 		res = irc_client_set_flags(client, flags);
@@ -869,6 +1135,7 @@ int main(int argc, char *argv[])
 		if (pthread_create(&rx_thread_id, NULL, rx_thread, (void*) client)) {
 			return -1;
 		}
+		rx_thread_started = 1;
 	} else {
 		/* Start the client without being connected to anything. */
 		if (debug_level) {
@@ -903,13 +1170,8 @@ int main(int argc, char *argv[])
 	printf("=== Client is exiting ===\n");
 
 	/* Clean up, clean up, everybody clean up. */
-	pthread_cancel(rx_thread_id);
-	pthread_join(rx_thread_id, NULL);
+	stop_rx_thread(client);
 
-	if (clientlog) {
-		fclose(clientlog);
-		clientlog = NULL;
-	}
 	irc_client_destroy(client); /* Destroy/free client */
 
 closepipes:
@@ -0,0 +1,866 @@
+/*
+ * LIRC - IRC Client Library for C
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This library is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Columnar export of messages, for analytics
+ *
+ * \note Messages are split into row groups of a fixed number of rows, and each row group into columns
+ *       (see enum irc_column), stored one after another. The smallest and largest value of each column
+ *       in each row group are kept, so a reader only has to read the columns it needs,
+ *       of the row groups that can have what it's looking for.
+ *       Commands, nicks, hosts, and channels are stored as indexes into dictionaries, and times as
+ *       the difference from the one before, all as varints. Strings are stored as all of their lengths,
+ *       followed by all of their bytes.
+ *
+ * File layout:
+ *   Header: magic
+ *   Row groups: the data of each column
+ *   Dictionaries: for each dictionary column, a count, and then each name, NUL terminated
+ *   Row group directory: struct col_group for each row group
+ *   Trailer: struct col_trailer
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "irc_internal.h"
+
+#define COL_MAGIC "LIRCCOL1"
+
+/*! \brief Default number of rows in a row group */
+#define GROUP_ROWS_DEFAULT 65536
+
+/*! \brief Most rows a row group can have */
+#define GROUP_ROWS_MAX (1 << 24)
+
+/*! \brief Longest line exported. Longer ones are skipped. */
+#define MAX_LINE 16384
+
+/*! \brief Number of dictionary columns, which come first */
+#define DICTS (IRC_COLUMN_CHANNEL + 1)
+
+/*! \brief Whether a column is a dictionary index */
+#define IS_DICT(c) ((c) >= IRC_COLUMN_COMMAND && (c) <= IRC_COLUMN_CHANNEL)
+
+/*! \brief Whether a column is a string */
+#define IS_STRING(c) ((c) >= IRC_COLUMN_PARAMS)
+
+/*! \brief A column of a row group */
+struct col_chunk {
+	uint64_t offset;
+	uint64_t size;
+	int64_t min;					/*!< Smallest value (dictionary indexes other than 0, string lengths), 0 if none */
+	int64_t max;					/*!< Largest value, 0 if none */
+};
+
+struct col_group {
+	uint64_t rows;
+	struct col_chunk columns[IRC_COLUMNS];
+};
+
+struct col_trailer {
+	uint64_t dicts;					/*!< Offset of dictionaries */
+	uint64_t groups;				/*!< Offset of row group directory */
+	uint64_t ngroups;
+	uint64_t rows;
+	char magic[8];
+};
+
+/* === Writing === */
+
+struct col_entry {
+	struct col_entry *next;			/*!< Next in hash chain */
+	uint64_t hash;
+	uint32_t id;
+	size_t len;
+	char name[];
+};
+
+struct col_dict {
+	struct col_entry **buckets;
+	size_t nbuckets;				/*!< Power of 2 */
+	struct col_entry **entries;		/*!< By index - 1 */
+	uint32_t count;
+	size_t alloc;
+	int casemapped;					/*!< Names that are the same under rfc1459 casemapping are the same entry */
+};
+
+struct col_buf {
+	unsigned char *data;
+	size_t len;
+	size_t alloc;
+};
+
+struct irc_colwriter {
+	FILE *fp;
+	uint64_t offset;				/*!< Bytes written so far */
+	size_t group_rows;
+	size_t rows;					/*!< Rows in the current row group */
+	uint64_t total;					/*!< Rows in finished row groups */
+	long long lasttime;				/*!< Time of the previous row, which the next is relative to */
+	struct col_group group;			/*!< Stats of the current row group */
+	struct col_group *groups;
+	size_t ngroups;
+	size_t groups_alloc;
+	struct col_dict dicts[DICTS];
+	struct col_buf data[IRC_COLUMNS];	/*!< Varints, or string bytes */
+	struct col_buf lens[IRC_COLUMNS];	/*!< String lengths */
+	char line[MAX_LINE + 1];		/*!< Line being parsed */
+	char path[];
+};
+
+static int buf_reserve(struct col_buf *b, size_t len)
+{
+	if (b->len + len > b->alloc) {
+		size_t alloc = b->alloc ? b->alloc : 4096;
+		unsigned char *data;
+		while (alloc < b->len + len) {
+			alloc *= 2;
+		}
+		data = realloc(b->data, alloc);
+		if (!data) {
+			irc_err("realloc failed\n");
+			return -1;
+		}
+		b->data = data;
+		b->alloc = alloc;
+	}
+	return 0;
+}
+
+static int buf_varint(struct col_buf *b, uint64_t v)
+{
+	if (buf_reserve(b, 10)) {
+		return -1;
+	}
+	b->len = (size_t) (archive_put_varint(b->data + b->len, v) - b->data);
+	return 0;
+}
+
+static void stat_add(struct col_chunk *c, int first, int64_t v)
+{
+	if (first) {
+		c->min = c->max = v;
+	} else if (v < c->min) {
+		c->min = v;
+	} else if (v > c->max) {
+		c->max = v;
+	}
+}
+
+static int dict_grow(struct col_dict *d)
+{
+	size_t nbuckets = d->nbuckets ? d->nbuckets * 2 : 256, i;
+	struct col_entry **buckets = calloc(nbuckets, sizeof(*buckets));
+
+	if (!buckets) {
+		irc_err("calloc failed\n");
+		return -1;
+	}
+	for (i = 0; i < d->count; i++) {
+		struct col_entry *e = d->entries[i];
+		e->next = buckets[e->hash & (nbuckets - 1)];
+		buckets[e->hash & (nbuckets - 1)] = e;
+	}
+	free(d->buckets);
+	d->buckets = buckets;
+	d->nbuckets = nbuckets;
+	return 0;
+}
+
+/*! \brief Index of a name in a dictionary, adding it if it's not there, 0 on failure */
+static uint32_t dict_get(struct col_dict *d, const char *name, size_t len)
+{
+	uint64_t hash = irc_casemap_hash(IRC_CASEMAPPING_RFC1459, name, len);
+	struct col_entry *e;
+
+	if (d->nbuckets) {
+		for (e = d->buckets[hash & (d->nbuckets - 1)]; e; e = e->next) {
+			if (e->hash == hash && e->len == len
+				&& (d->casemapped ? irc_casemap_memeq(IRC_CASEMAPPING_RFC1459, e->name, name, len) : !memcmp(e->name, name, len))) {
+				return e->id;
+			}
+		}
+	}
+	if (d->count == UINT32_MAX - 1) {
+		irc_err("Dictionary is full\n");
+		return 0;
+	}
+	if (d->count >= d->nbuckets && dict_grow(d)) {
+		return 0;
+	}
+	if (d->count == d->alloc) {
+		struct col_entry **entries = realloc(d->entries, (d->alloc = d->alloc ? d->alloc * 2 : 256) * sizeof(*entries));
+		if (!entries) {
+			irc_err("realloc failed\n");
+			return 0;
+		}
+		d->entries = entries;
+	}
+	e = malloc(sizeof(*e) + len + 1);
+	if (!e) {
+		irc_err("malloc failed\n");
+		return 0;
+	}
+	e->hash = hash;
+	e->id = ++d->count;
+	e->len = len;
+	memcpy(e->name, name, len);
+	e->name[len] = '\0';
+	d->entries[e->id - 1] = e;
+	e->next = d->buckets[hash & (d->nbuckets - 1)];
+	d->buckets[hash & (d->nbuckets - 1)] = e;
+	return e->id;
+}
+
+static void dict_free(struct col_dict *d)
+{
+	uint32_t i;
+
+	for (i = 0; i < d->count; i++) {
+		free(d->entries[i]);
+	}
+	free(d->entries);
+	free(d->buckets);
+}
+
+struct irc_colwriter *irc_colwriter_open(const char *path, size_t group_rows)
+{
+	struct irc_colwriter *w;
+	char tmp[4200];
+
+	if (strlen(path) >= 4000) {
+		irc_err("Invalid path\n");
+		return NULL;
+	}
+	w = calloc(1, sizeof(*w) + strlen(path) + 1);
+	if (!w) {
+		irc_err("calloc failed\n");
+		return NULL;
+	}
+	strcpy(w->path, path); /* Safe */
+	w->group_rows = group_rows ? group_rows : GROUP_ROWS_DEFAULT;
+	if (w->group_rows > GROUP_ROWS_MAX) {
+		w->group_rows = GROUP_ROWS_MAX;
+	}
+	w->dicts[IRC_COLUMN_NICK].casemapped = 1;
+	w->dicts[IRC_COLUMN_CHANNEL].casemapped = 1;
+
+	/* Written under another name until it's complete */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	w->fp = fopen(tmp, "wb");
+	if (!w->fp) {
+		irc_err("Failed to open %s: %s\n", tmp, strerror(errno));
+		free(w);
+		return NULL;
+	}
+	fwrite(COL_MAGIC, 1, 8, w->fp);
+	w->offset = 8;
+	return w;
+}
+
+/*! \brief Write out the current row group */
+static int group_write(struct irc_colwriter *w)
+{
+	int c;
+
+	if (!w->rows) {
+		return 0;
+	}
+	if (w->ngroups == w->groups_alloc) {
+		struct col_group *groups = realloc(w->groups, (w->groups_alloc = w->groups_alloc ? w->groups_alloc * 2 : 64) * sizeof(*groups));
+		if (!groups) {
+			irc_err("realloc failed\n");
+			return -1;
+		}
+		w->groups = groups;
+	}
+	w->group.rows = w->rows;
+	for (c = 0; c < IRC_COLUMNS; c++) {
+		struct col_chunk *chunk = &w->group.columns[c];
+		chunk->offset = w->offset;
+		chunk->size = w->data[c].len;
+		if (IS_STRING(c)) {
+			/* Lengths, then bytes, so the lengths can be read without reading the bytes */
+			unsigned char prefix[10];
+			size_t plen = (size_t) (archive_put_varint(prefix, w->lens[c].len) - prefix);
+			fwrite(prefix, 1, plen, w->fp);
+			fwrite(w->lens[c].data, 1, w->lens[c].len, w->fp);
+			chunk->size += plen + w->lens[c].len;
+			w->lens[c].len = 0;
+		}
+		fwrite(w->data[c].data, 1, w->data[c].len, w->fp);
+		w->data[c].len = 0;
+		w->offset += chunk->size;
+	}
+	w->groups[w->ngroups++] = w->group;
+	w->total += w->rows;
+	w->rows = 0;
+	w->lasttime = 0;
+	memset(&w->group, 0, sizeof(w->group));
+	return ferror(w->fp) ? -1 : 0;
+}
+
+static int add_string(struct irc_colwriter *w, enum irc_column c, const char *s, size_t len)
+{
+	if (buf_varint(&w->lens[c], len) || buf_reserve(&w->data[c], len)) {
+		return -1;
+	}
+	if (len) {
+		memcpy(w->data[c].data + w->data[c].len, s, len);
+		w->data[c].len += len;
+	}
+	stat_add(&w->group.columns[c], !w->rows, (int64_t) len);
+	return 0;
+}
+
+static int add_dict(struct irc_colwriter *w, enum irc_column c, const char *name, size_t len)
+{
+	struct col_chunk *chunk = &w->group.columns[c];
+	uint32_t id = 0;
+
+	if (len) {
+		id = dict_get(&w->dicts[c], name, len);
+		if (!id) {
+			return -1;
+		}
+		/* 0 (none) isn't counted, so a row group without a channel never seems to have one */
+		stat_add(chunk, !chunk->max, id);
+	}
+	return buf_varint(&w->data[c], id);
+}
+
+int irc_colwriter_line(struct irc_colwriter *w, const char *line, size_t len, long long received)
+{
+	char *s = w->line, *tags = NULL, *prefix = NULL, *host = NULL, *command;
+	const char *params, *param, *first = NULL, *last = NULL, *prevend = NULL, *channel;
+	size_t taglen = 0, nicklen = 0, cmdlen, paramlen, lastlen = 0, chanlen;
+	long long time, lasttime = w->lasttime;
+	int64_t delta;
+	size_t datalen[IRC_COLUMNS], lenslen[IRC_COLUMNS];
+	struct col_group group;
+	int c;
+
+	if (len > MAX_LINE) {
+		irc_warn("Not exporting %lu-byte line\n", len);
+		return 1;
+	}
+	memcpy(s, line, len);
+	s[len] = '\0';
+	if (*s == '@') {
+		tags = ++s;
+		taglen = strcspn(s, " ");
+		s += taglen;
+		if (!*s) {
+			return 1;
+		}
+		*s++ = '\0';
+	}
+	while (*s == ' ') {
+		s++;
+	}
+	if (*s == ':') {
+		prefix = ++s;
+		s += strcspn(s, " ");
+		if (!*s) {
+			return 1;
+		}
+		*s++ = '\0';
+		nicklen = strcspn(prefix, "!@");
+		host = prefix + nicklen + (prefix[nicklen] == '!'); /* user@host */
+	}
+	while (*s == ' ') {
+		s++;
+	}
+	command = s;
+	cmdlen = strcspn(s, " ");
+	if (!cmdlen) {
+		return 1;
+	}
+	/* The last parameter is the body, and the ones before it, as they are, are the params */
+	params = s + cmdlen;
+	while ((param = next_param(&params, &paramlen))) {
+		if (!first) {
+			first = param;
+		}
+		if (last) {
+			prevend = last + lastlen;
+		}
+		last = param;
+		lastlen = paramlen;
+	}
+	channel = archive_line_channel(line, len, &chanlen);
+	time = archive_line_time(line, len, received < 0 ? 0 : received);
+
+	/* A row is added to every column or none, so if one fails, undo the ones before it */
+	for (c = 0; c < IRC_COLUMNS; c++) {
+		datalen[c] = w->data[c].len;
+		lenslen[c] = w->lens[c].len;
+	}
+	group = w->group;
+
+	delta = (int64_t) time - (int64_t) lasttime;
+	w->lasttime = time;
+	stat_add(&w->group.columns[IRC_COLUMN_TIME], !w->rows, time);
+	if (buf_varint(&w->data[IRC_COLUMN_TIME], ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63)) /* Zigzag */
+		|| add_dict(w, IRC_COLUMN_COMMAND, command, cmdlen)
+		|| add_dict(w, IRC_COLUMN_NICK, prefix, nicklen)
+		|| add_dict(w, IRC_COLUMN_HOST, host, host ? strlen(host) : 0)
+		|| add_dict(w, IRC_COLUMN_CHANNEL, channel, channel ? chanlen : 0)
+		|| add_string(w, IRC_COLUMN_PARAMS, first, prevend ? (size_t) (prevend - first) : 0)
+		|| add_string(w, IRC_COLUMN_BODY, last, lastlen)
+		|| add_string(w, IRC_COLUMN_TAGS, tags, taglen)) {
+		for (c = 0; c < IRC_COLUMNS; c++) {
+			w->data[c].len = datalen[c];
+			w->lens[c].len = lenslen[c];
+		}
+		w->group = group;
+		w->lasttime = lasttime;
+		return -1;
+	}
+	if (++w->rows == w->group_rows) {
+		return group_write(w);
+	}
+	return 0;
+}
+
+static int replay_line(void *data, const char *line, size_t len, long long received)
+{
+	return irc_colwriter_line(data, line, len, received) < 0 ? -1 : 0;
+}
+
+int irc_colwriter_replay(struct irc_colwriter *w, const char *path)
+{
+	return protolog_replay(path, replay_line, w);
+}
+
+int irc_colwriter_close(struct irc_colwriter *w)
+{
+	struct col_trailer t;
+	char tmp[4200];
+	int c, res = group_write(w);
+
+	memset(&t, 0, sizeof(t));
+	t.dicts = w->offset;
+	for (c = 0; c < DICTS; c++) {
+		struct col_dict *d = &w->dicts[c];
+		uint32_t i;
+		if (!IS_DICT(c)) {
+			continue;
+		}
+		fwrite(&d->count, sizeof(d->count), 1, w->fp);
+		w->offset += sizeof(d->count);
+		for (i = 0; i < d->count; i++) {
+			fwrite(d->entries[i]->name, 1, d->entries[i]->len + 1, w->fp);
+			w->offset += d->entries[i]->len + 1;
+		}
+	}
+	/* Keep the directory aligned, so it can be used where it's mapped */
+	while (w->offset % sizeof(uint64_t)) {
+		fputc(0, w->fp);
+		w->offset++;
+	}
+	t.groups = w->offset;
+	t.ngroups = w->ngroups;
+	t.rows = w->total;
+	memcpy(t.magic, COL_MAGIC, sizeof(t.magic));
+	fwrite(w->groups, sizeof(*w->groups), w->ngroups, w->fp);
+	fwrite(&t, sizeof(t), 1, w->fp);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", w->path);
+	if (ferror(w->fp) | fclose(w->fp)) {
+		irc_err("Failed to write %s: %s\n", tmp, strerror(errno));
+		res = -1;
+	} else if (!res && rename(tmp, w->path)) {
+		irc_err("Failed to rename %s to %s: %s\n", tmp, w->path, strerror(errno));
+		res = -1;
+	}
+	if (res) {
+		unlink(tmp);
+	}
+	for (c = 0; c < IRC_COLUMNS; c++) {
+		if (c < DICTS) {
+			dict_free(&w->dicts[c]);
+		}
+		free(w->data[c].data);
+		free(w->lens[c].data);
+	}
+	free(w->groups);
+	free(w);
+	return res;
+}
+
+/* === Reading === */
+
+struct irc_colfile {
+	struct archive_map map;
+	const struct col_group *groups;
+	uint64_t ngroups;
+	uint64_t rows;
+	uint64_t maxrows;				/*!< Rows in the largest row group */
+	const char **names[DICTS];		/*!< By index - 1 */
+	uint32_t counts[DICTS];
+};
+
+struct irc_colfile *irc_colfile_open(const char *path)
+{
+	struct irc_colfile *f = calloc(1, sizeof(*f));
+	struct col_trailer t;
+	const unsigned char *p, *end;
+	uint64_t i;
+	int c;
+
+	if (!f) {
+		irc_err("calloc failed\n");
+		return NULL;
+	}
+	if (archive_map(path, &f->map)) {
+		free(f);
+		return NULL;
+	}
+	if (f->map.len < 8 + sizeof(t) || memcmp(f->map.data, COL_MAGIC, 8)) {
+		goto invalid;
+	}
+	memcpy(&t, f->map.data + f->map.len - sizeof(t), sizeof(t));
+	if (memcmp(t.magic, COL_MAGIC, sizeof(t.magic)) || t.dicts < 8 || t.dicts > t.groups
+		|| t.groups > f->map.len - sizeof(t) || t.groups % sizeof(uint64_t)
+		|| t.ngroups > (f->map.len - sizeof(t) - t.groups) / sizeof(struct col_group)) {
+		goto invalid;
+	}
+	f->groups = (const struct col_group *) (f->map.data + t.groups);
+	f->ngroups = t.ngroups;
+	f->rows = t.rows;
+	for (i = 0; i < f->ngroups; i++) {
+		const struct col_group *g = &f->groups[i];
+		if (g->rows > GROUP_ROWS_MAX) {
+			goto invalid;
+		}
+		for (c = 0; c < IRC_COLUMNS; c++) {
+			if (g->columns[c].offset > t.dicts || g->columns[c].size > t.dicts - g->columns[c].offset) {
+				goto invalid;
+			}
+		}
+		if (g->rows > f->maxrows) {
+			f->maxrows = g->rows;
+		}
+	}
+
+	/* The names are NUL terminated where they're mapped, so just point to them */
+	p = f->map.data + t.dicts;
+	end = f->map.data + t.groups;
+	for (c = IRC_COLUMN_COMMAND; c < DICTS; c++) {
+		uint32_t n;
+		if (end - p < (ptrdiff_t) sizeof(n)) {
+			goto invalid;
+		}
+		memcpy(&n, p, sizeof(n));
+		p += sizeof(n);
+		if (n > (size_t) (end - p)) {
+			goto invalid;
+		}
+		f->names[c] = malloc((n ? n : 1) * sizeof(*f->names[c]));
+		if (!f->names[c]) {
+			irc_err("malloc failed\n");
+			irc_colfile_close(f);
+			return NULL;
+		}
+		for (f->counts[c] = 0; f->counts[c] < n; f->counts[c]++) {
+			const unsigned char *nul = memchr(p, '\0', (size_t) (end - p));
+			if (!nul) {
+				goto invalid;
+			}
+			f->names[c][f->counts[c]] = (const char *) p;
+			p = nul + 1;
+		}
+	}
+	return f;
+
+invalid:
+	irc_err("%s is not a valid column file\n", path);
+	irc_colfile_close(f);
+	return NULL;
+}
+
+void irc_colfile_close(struct irc_colfile *f)
+{
+	int c;
+
+	for (c = 0; c < DICTS; c++) {
+		free(f->names[c]);
+	}
+	archive_unmap(&f->map);
+	free(f);
+}
+
+uint64_t irc_colfile_rows(struct irc_colfile *f)
+{
+	return f->rows;
+}
+
+const char *irc_colfile_name(struct irc_colfile *f, enum irc_column column, uint32_t id)
+{
+	if (!IS_DICT(column) || !id || id > f->counts[column]) {
+		return NULL;
+	}
+	return f->names[column][id - 1];
+}
+
+uint32_t irc_colfile_lookup(struct irc_colfile *f, enum irc_column column, const char *name)
+{
+	uint32_t i;
+
+	if (!IS_DICT(column)) {
+		return 0;
+	}
+	for (i = 0; i < f->counts[column]; i++) {
+		const char *s = f->names[column][i];
+		if (column == IRC_COLUMN_NICK || column == IRC_COLUMN_CHANNEL ? irc_casemap_eq(IRC_CASEMAPPING_RFC1459, s, name) : !strcmp(s, name)) {
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+/*! \brief Buffers that columns are decoded into, for the largest row group */
+struct col_decoded {
+	long long *time;
+	uint32_t *ids[DICTS];
+	struct irc_colstring *strings[IRC_COLUMNS];
+};
+
+static void decoded_free(struct col_decoded *d)
+{
+	int c;
+
+	free(d->time);
+	for (c = 0; c < IRC_COLUMNS; c++) {
+		if (c < DICTS) {
+			free(d->ids[c]);
+		}
+		free(d->strings[c]);
+	}
+}
+
+static int decoded_alloc(struct irc_colfile *f, unsigned int columns, struct col_decoded *d)
+{
+	size_t n = f->maxrows ? (size_t) f->maxrows : 1;
+	int c;
+
+	memset(d, 0, sizeof(*d));
+	for (c = 0; c < IRC_COLUMNS; c++) {
+		void *p;
+		if (!(columns & (1u << c))) {
+			continue;
+		}
+		if (c == IRC_COLUMN_TIME) {
+			p = d->time = malloc(n * sizeof(*d->time));
+		} else if (IS_DICT(c)) {
+			p = d->ids[c] = malloc(n * sizeof(*d->ids[c]));
+		} else {
+			p = d->strings[c] = malloc(n * sizeof(*d->strings[c]));
+		}
+		if (!p) {
+			irc_err("malloc failed\n");
+			decoded_free(d);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*! \brief Decode a column of a row group */
+static int column_decode(struct irc_colfile *f, const struct col_group *g, int c, struct col_decoded *d)
+{
+	const unsigned char *p = f->map.data + g->columns[c].offset, *end = p + g->columns[c].size;
+	uint64_t i, v;
+
+	if (c == IRC_COLUMN_TIME) {
+		long long time = 0;
+		for (i = 0; i < g->rows; i++) {
+			p = archive_get_varint(p, end, &v);
+			if (!p) {
+				return -1;
+			}
+			time += (long long) (v >> 1) ^ -(long long) (v & 1); /* Zigzag */
+			d->time[i] = time;
+		}
+	} else if (IS_DICT(c)) {
+		for (i = 0; i < g->rows; i++) {
+			p = archive_get_varint(p, end, &v);
+			if (!p || v > f->counts[c]) {
+				return -1;
+			}
+			d->ids[c][i] = (uint32_t) v;
+		}
+	} else {
+		const unsigned char *lens, *bytes;
+		p = archive_get_varint(p, end, &v);
+		if (!p || v > (uint64_t) (end - p)) {
+			return -1;
+		}
+		lens = p;
+		bytes = p + v;
+		for (i = 0; i < g->rows; i++) {
+			lens = archive_get_varint(lens, bytes, &v);
+			if (!lens || v > (uint64_t) (end - bytes)) {
+				return -1;
+			}
+			d->strings[c][i].s = (const char *) bytes;
+			d->strings[c][i].len = (size_t) v;
+			bytes += v;
+		}
+	}
+	return 0;
+}
+
+/*! \brief Whether a row group can have rows in a time range, for a channel (0 for any) */
+static int group_may_match(const struct col_group *g, long long from, long long to, uint32_t channel)
+{
+	const struct col_chunk *t = &g->columns[IRC_COLUMN_TIME], *ch = &g->columns[IRC_COLUMN_CHANNEL];
+
+	if (t->max < from || t->min > to) {
+		return 0;
+	}
+	return !channel || ((int64_t) channel >= ch->min && (int64_t) channel <= ch->max);
+}
+
+int irc_colfile_scan(struct irc_colfile *f, unsigned int columns, long long from, long long to, const char *channel,
+	int (*cb)(void *data, const struct irc_colbatch *batch), void *data)
+{
+	struct col_decoded d;
+	uint32_t chanid = 0;
+	uint64_t i;
+	int c, res = 0;
+
+	if (channel && !(chanid = irc_colfile_lookup(f, IRC_COLUMN_CHANNEL, channel))) {
+		return 0; /* Not in any row group */
+	}
+	if (decoded_alloc(f, columns, &d)) {
+		return -1;
+	}
+	for (i = 0; i < f->ngroups && !res; i++) {
+		const struct col_group *g = &f->groups[i];
+		struct irc_colbatch batch;
+		if (!group_may_match(g, from, to, chanid)) {
+			continue;
+		}
+		memset(&batch, 0, sizeof(batch));
+		batch.rows = (size_t) g->rows;
+		for (c = 0; c < IRC_COLUMNS; c++) {
+			if (!(columns & (1u << c))) {
+				continue;
+			}
+			if (column_decode(f, g, c, &d)) {
+				irc_err("Row group %lu is corrupt\n", (unsigned long) i);
+				res = -1;
+				break;
+			}
+		}
+		if (res) {
+			break;
+		}
+		batch.time = d.time;
+		batch.command = d.ids[IRC_COLUMN_COMMAND];
+		batch.nick = d.ids[IRC_COLUMN_NICK];
+		batch.host = d.ids[IRC_COLUMN_HOST];
+		batch.channel = d.ids[IRC_COLUMN_CHANNEL];
+		batch.params = d.strings[IRC_COLUMN_PARAMS];
+		batch.body = d.strings[IRC_COLUMN_BODY];
+		batch.tags = d.strings[IRC_COLUMN_TAGS];
+		res = cb(data, &batch) ? 1 : 0;
+	}
+	decoded_free(&d);
+	return res < 0 ? -1 : 0;
+}
+
+ssize_t irc_colfile_channels(struct irc_colfile *f, long long from, long long to,
+	void (*cb)(void *data, const char *channel, const struct irc_replay_counts *counts), void *data)
+{
+	struct irc_replay_counts *counts;
+	struct col_decoded d;
+	enum irc_msg_type *types;
+	uint32_t n = f->counts[IRC_COLUMN_CHANNEL], i;
+	uint64_t g;
+	ssize_t found = 0;
+
+	counts = calloc((size_t) n + 1, sizeof(*counts));
+	types = malloc(((size_t) f->counts[IRC_COLUMN_COMMAND] + 1) * sizeof(*types));
+	if (!counts || !types || decoded_alloc(f, (1u << IRC_COLUMN_TIME) | (1u << IRC_COLUMN_COMMAND) | (1u << IRC_COLUMN_CHANNEL), &d)) {
+		free(counts);
+		free(types);
+		return -1;
+	}
+	/* Look at each command once, rather than each row */
+	types[0] = IRC_UNPARSED;
+	for (i = 0; i < f->counts[IRC_COLUMN_COMMAND]; i++) {
+		const char *command = f->names[IRC_COLUMN_COMMAND][i];
+		types[i + 1] = !strcasecmp(command, "PRIVMSG") ? IRC_CMD_PRIVMSG : !strcasecmp(command, "NOTICE") ? IRC_CMD_NOTICE
+			: !strcasecmp(command, "JOIN") ? IRC_CMD_JOIN : !strcasecmp(command, "PART") ? IRC_CMD_PART
+			: !strcasecmp(command, "KICK") ? IRC_CMD_KICK : IRC_CMD_OTHER;
+	}
+
+	for (g = 0; g < f->ngroups; g++) {
+		const struct col_group *group = &f->groups[g];
+		/* If the whole row group is in the time range, the times don't have to be read at all */
+		int within = group->columns[IRC_COLUMN_TIME].min >= from && group->columns[IRC_COLUMN_TIME].max <= to;
+		size_t r;
+		if (!group_may_match(group, from, to, 0) || !group->columns[IRC_COLUMN_CHANNEL].max) {
+			continue;
+		}
+		if ((!within && column_decode(f, group, IRC_COLUMN_TIME, &d))
+			|| column_decode(f, group, IRC_COLUMN_COMMAND, &d) || column_decode(f, group, IRC_COLUMN_CHANNEL, &d)) {
+			irc_err("Row group %lu is corrupt\n", (unsigned long) g);
+			found = -1;
+			break;
+		}
+		for (r = 0; r < group->rows; r++) {
+			struct irc_replay_counts *cnt = &counts[d.ids[IRC_COLUMN_CHANNEL][r]];
+			if (!within && (d.time[r] < from || d.time[r] > to)) {
+				continue;
+			}
+			switch (types[d.ids[IRC_COLUMN_COMMAND][r]]) {
+			case IRC_CMD_PRIVMSG:
+			case IRC_CMD_NOTICE:
+				cnt->messages++;
+				break;
+			case IRC_CMD_JOIN:
+				cnt->joins++;
+				break;
+			case IRC_CMD_PART:
+				cnt->parts++;
+				break;
+			case IRC_CMD_KICK:
+				cnt->kicks++;
+				break;
+			default:
+				break;
+			}
+		}
+	}
+	for (i = 1; found >= 0 && i <= n; i++) {
+		if (counts[i].messages || counts[i].joins || counts[i].parts || counts[i].kicks) {
+			cb(data, f->names[IRC_COLUMN_CHANNEL][i - 1], &counts[i]);
+			found++;
+		}
+	}
+	decoded_free(&d);
+	free(counts);
+	free(types);
+	return found;
+}
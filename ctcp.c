@@ -0,0 +1,714 @@
+/*
+ * LIRC - IRC Client Library for C
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This library is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief CTCP parsing, PING round trip tracking, and CTCP query responder
+ *
+ * \note Verbs are looked up in a small perfect hash table, so there's a single
+ *       string comparison per CTCP message, however many verbs there are.
+ * \note The payload of each PING is the monotonic time (in us) it was sent,
+ *       made unique by never reusing a value, so a reply identifies its request
+ *       by itself and the round trip time is just the difference.
+ *       A ping to a channel may be answered by every member, so such pings
+ *       stay outstanding until they time out, and each reply is reported.
+ * \note Replies to CTCP queries are NOTICEs, which count against the server's flood limit
+ *       like anything else we send, so the responder rate limits them per source host
+ *       (so changing nicks doesn't help) and globally (so many hosts don't help either).
+ *       Queries over budget are dropped without a reply.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "irc_internal.h"
+
+struct ctcp_verb {
+	const char *name;
+	enum irc_ctcp_type type;
+};
+
+/*! \brief Hash of a verb, case insensitive. No two standard verbs collide. */
+#define VERB_HASH(s, len) (((len) * 2 + ((s)[0] & 0xDF) + ((s)[(len) - 1] & 0xDF) * 5) & 15)
+
+/*! \brief Standard verbs, at the slot given by VERB_HASH. Adding a verb may require adjusting the hash. */
+static const struct ctcp_verb verbs[16] = {
+	[0] = { "USERINFO", CTCP_USERINFO },
+	[2] = { "CLIENTINFO", CTCP_CLIENTINFO },
+	[3] = { "ACTION", CTCP_ACTION },
+	[4] = { "ERRMSG", CTCP_ERRMSG },
+	[5] = { "TIME", CTCP_TIME },
+	[8] = { "SOURCE", CTCP_SOURCE },
+	[9] = { "DCC", CTCP_DCC },
+	[10] = { "VERSION", CTCP_VERSION },
+	[11] = { "PING", CTCP_PING },
+	[12] = { "FINGER", CTCP_FINGER },
+};
+
+static const char *verb_names[] = {
+	[CTCP_ACTION] = "ACTION",
+	[CTCP_VERSION] = "VERSION",
+	[CTCP_TIME] = "TIME",
+	[CTCP_PING] = "PING",
+	[CTCP_DCC] = "DCC",
+	[CTCP_CLIENTINFO] = "CLIENTINFO",
+	[CTCP_SOURCE] = "SOURCE",
+	[CTCP_USERINFO] = "USERINFO",
+	[CTCP_FINGER] = "FINGER",
+	[CTCP_ERRMSG] = "ERRMSG",
+};
+
+static enum irc_ctcp_type verb_lookup(const char *verb, size_t len)
+{
+	const struct ctcp_verb *v;
+
+	if (!len) {
+		return CTCP_UNKNOWN;
+	}
+	v = &verbs[VERB_HASH(verb, len)];
+	if (v->name && strlen(v->name) == len && !strncasecmp(v->name, verb, len)) {
+		return v->type;
+	}
+	return CTCP_UNKNOWN;
+}
+
+const char *irc_ctcp_name(enum irc_ctcp_type ctcp)
+{
+	if (ctcp <= CTCP_UNPARSED || ctcp >= CTCP_UNKNOWN) {
+		return NULL;
+	}
+	return verb_names[ctcp];
+}
+
+enum irc_ctcp_type irc_ctcp_from_string(const char *s)
+{
+	return verb_lookup(s, strlen(s));
+}
+
+int irc_ctcp_next(const char **s, struct irc_ctcp *ctcp)
+{
+	const char *start, *end, *space;
+
+	for (;;) {
+		start = strchr(*s, 0x01);
+		if (!start) {
+			*s += strlen(*s);
+			return 0;
+		}
+		start++;
+		end = strchr(start, 0x01);
+		if (!end) {
+			end = start + strlen(start); /* Unterminated, which some clients do at the end of the body */
+			*s = end;
+		} else {
+			*s = end + 1;
+		}
+		if (end > start) {
+			break;
+		}
+		/* Empty, keep looking */
+	}
+
+	space = memchr(start, ' ', (size_t) (end - start));
+	ctcp->verb = start;
+	ctcp->verblen = (size_t) ((space ? space : end) - start);
+	ctcp->type = verb_lookup(ctcp->verb, ctcp->verblen);
+	if (space) {
+		ctcp->args = space + 1;
+		ctcp->argslen = (size_t) (end - ctcp->args);
+	} else {
+		ctcp->args = NULL;
+		ctcp->argslen = 0;
+	}
+	return 1;
+}
+
+/*! \brief Undo low-level quoting of the character at args[*i], advancing *i past it */
+static char mdequote(const char *args, size_t len, size_t *i)
+{
+	char c = args[(*i)++];
+
+	if (c != '\020' || *i >= len) {
+		return c;
+	}
+	c = args[(*i)++];
+	switch (c) {
+	case '0':
+		return '\0';
+	case 'n':
+		return '\n';
+	case 'r':
+		return '\r';
+	default:
+		return c; /* Including M-QUOTE itself. Otherwise, the M-QUOTE is just dropped. */
+	}
+}
+
+int irc_ctcp_unquote(const char *args, size_t len, char *buf, size_t buflen)
+{
+	size_t i = 0, n = 0;
+
+	/* Unquoting never lengthens anything, and reads stay ahead of writes, so this works in place */
+	while (i < len) {
+		char c = mdequote(args, len, &i);
+		if (c == '\134' && i < len) {
+			c = mdequote(args, len, &i);
+			if (c == 'a') {
+				c = '\001';
+			} /* Otherwise, X-QUOTE is dropped */
+		}
+		if (n + 1 >= buflen) {
+			return -1;
+		}
+		buf[n++] = c;
+	}
+	if (!buflen) {
+		return -1;
+	}
+	buf[n] = '\0';
+	return (int) n;
+}
+
+/*! \brief Maximum number of outstanding pings. Beyond this, the oldest are given up on. */
+#define MAX_PINGS 64
+
+/*! \brief Number of targets whose last round trip time is remembered */
+#define MAX_RESULTS 64
+
+/*! \brief How long (in ms) to wait for ping replies */
+#define PING_TIMEOUT 30000
+
+struct ping {
+	char target[64];				/*!< Nick or channel, empty if the slot is free */
+	long long sent;					/*!< Payload: when the ping was sent (monotonic us) */
+	unsigned int replies;			/*!< Number of replies so far */
+	unsigned int channel:1;			/*!< Whether target is a channel */
+};
+
+struct ping_result {
+	char nick[64];					/*!< Empty if the slot is free */
+	long long rtt;					/*!< Last round trip time (us) */
+	long long when;					/*!< When it was measured (monotonic us) */
+};
+
+struct ctcp_pings {
+	pthread_mutex_t lock;
+	struct ping pings[MAX_PINGS];
+	struct ping_result results[MAX_RESULTS];
+	long long last;					/*!< Last payload used */
+	void (*cb)(void *data, const char *target, const char *nick, long long rtt);
+	void *data;
+};
+
+static struct ctcp_pings *pings_get(struct irc_client *client)
+{
+	struct ctcp_pings *cp;
+
+	pthread_mutex_lock(&client->lock);
+	cp = client->pings;
+	if (!cp) {
+		cp = calloc(1, sizeof(*cp));
+		if (cp) {
+			pthread_mutex_init(&cp->lock, NULL);
+			client->pings = cp;
+		} else {
+			irc_err("calloc failed\n");
+		}
+	}
+	pthread_mutex_unlock(&client->lock);
+	return cp;
+}
+
+void ctcp_destroy(struct irc_client *client)
+{
+	if (client->pings) {
+		pthread_mutex_destroy(&client->pings->lock);
+		free(client->pings);
+		client->pings = NULL;
+	}
+}
+
+int irc_client_ping_callback(struct irc_client *client, void (*cb)(void *data, const char *target, const char *nick, long long rtt), void *data)
+{
+	struct ctcp_pings *cp = pings_get(client);
+
+	if (!cp) {
+		return -1;
+	}
+	pthread_mutex_lock(&cp->lock);
+	cp->cb = cb;
+	cp->data = data;
+	pthread_mutex_unlock(&cp->lock);
+	return 0;
+}
+
+int ctcp_ping_payload(struct irc_client *client, const char *target, char *buf, size_t len)
+{
+	struct ctcp_pings *cp = pings_get(client);
+	struct ping *p = NULL;
+	long long now = now_us();
+	int i;
+
+	if (!cp) {
+		return -1;
+	}
+	if (strlen(target) >= sizeof(p->target)) {
+		irc_err("Ping target too long\n");
+		return -1;
+	}
+	pthread_mutex_lock(&cp->lock);
+	cp->last = now > cp->last ? now : cp->last + 1;
+	for (i = 0; i < MAX_PINGS; i++) {
+		if (!cp->pings[i].target[0]) {
+			p = &cp->pings[i];
+			break;
+		} else if (!p || cp->pings[i].sent < p->sent) {
+			p = &cp->pings[i]; /* Oldest, if there's no room */
+		}
+	}
+	strcpy(p->target, target); /* Safe */
+	p->sent = cp->last;
+	p->replies = 0;
+	p->channel = irc_client_is_channel(client, target) ? 1 : 0;
+	snprintf(buf, len, "%lld", p->sent);
+	pthread_mutex_unlock(&cp->lock);
+	irc_loop_wake(client); /* It needs to know about the new timeout */
+	return 0;
+}
+
+/*! \brief Remember the last round trip time for a nick. Must be called with the lock held. */
+static void result_store(struct ctcp_pings *cp, enum irc_casemapping casemapping, const char *nick, size_t nicklen, long long rtt, long long now)
+{
+	struct ping_result *r = NULL;
+	int i;
+
+	for (i = 0; i < MAX_RESULTS; i++) {
+		struct ping_result *q = &cp->results[i];
+		if (strlen(q->nick) == nicklen && irc_casemap_memeq(casemapping, q->nick, nick, nicklen)) {
+			r = q;
+			break;
+		} else if (!r || q->when < r->when) {
+			r = q; /* Least recently measured */
+		}
+	}
+	memcpy(r->nick, nick, nicklen);
+	r->nick[nicklen] = '\0';
+	r->rtt = rtt;
+	r->when = now;
+}
+
+int ctcp_process(struct irc_client *client, struct irc_msg *msg)
+{
+	struct ctcp_pings *cp = client->pings;
+	struct irc_ctcp ctcp;
+	const char *s = msg->body;
+	char target[64], nick[64];
+	long long sent, now;
+	size_t nicklen;
+	void (*cb)(void *data, const char *target, const char *nick, long long rtt) = NULL;
+	void *data = NULL;
+	int i, matched = 0;
+
+	/* NOTICE <me> :\001PING <payload>\001 */
+	if (!cp || !msg->prefix || !msg->body || !irc_ctcp_next(&s, &ctcp) || ctcp.type != CTCP_PING || !ctcp.args) {
+		return 0;
+	}
+	sent = strtoll(ctcp.args, NULL, 10);
+	nicklen = strcspn(msg->prefix, "!@");
+	if (!sent || nicklen >= sizeof(nick)) {
+		return 0;
+	}
+
+	now = now_us();
+	pthread_mutex_lock(&cp->lock);
+	for (i = 0; i < MAX_PINGS; i++) {
+		struct ping *p = &cp->pings[i];
+		if (!p->target[0] || p->sent != sent) {
+			continue;
+		}
+		/* A ping to a user must be answered by that user. Any member may answer a ping to a channel. */
+		if (!p->channel && (strlen(p->target) != nicklen || !irc_casemap_memeq(irc_client_casemapping(client), p->target, msg->prefix, nicklen))) {
+			break;
+		}
+		result_store(cp, irc_client_casemapping(client), msg->prefix, nicklen, now - sent, now);
+		p->replies++;
+		strcpy(target, p->target); /* Safe */
+		if (!p->channel) {
+			p->target[0] = '\0';
+		}
+		cb = cp->cb;
+		data = cp->data;
+		matched = 1;
+		break;
+	}
+	pthread_mutex_unlock(&cp->lock);
+
+	if (!matched) {
+		return 0;
+	}
+	if (cb) {
+		memcpy(nick, msg->prefix, nicklen);
+		nick[nicklen] = '\0';
+		cb(data, target, nick, now - sent);
+		return 1;
+	}
+	return 0;
+}
+
+long long ctcp_ping_deadline(struct irc_client *client)
+{
+	struct ctcp_pings *cp = client->pings;
+	long long next = -1;
+	int i;
+
+	if (!cp) {
+		return -1;
+	}
+	pthread_mutex_lock(&cp->lock);
+	for (i = 0; i < MAX_PINGS; i++) {
+		if (cp->pings[i].target[0] && (next == -1 || cp->pings[i].sent < next)) {
+			next = cp->pings[i].sent;
+		}
+	}
+	pthread_mutex_unlock(&cp->lock);
+	return next == -1 ? -1 : next / 1000 + PING_TIMEOUT;
+}
+
+void ctcp_ping_flush_due(struct irc_client *client, long long now)
+{
+	struct ctcp_pings *cp = client->pings;
+	char expired[MAX_PINGS][64];
+	int i, n = 0;
+	void (*cb)(void *data, const char *target, const char *nick, long long rtt);
+	void *data;
+
+	if (!cp) {
+		return;
+	}
+	pthread_mutex_lock(&cp->lock);
+	for (i = 0; i < MAX_PINGS; i++) {
+		struct ping *p = &cp->pings[i];
+		if (p->target[0] && p->sent / 1000 + PING_TIMEOUT <= now) {
+			if (!p->replies) {
+				strcpy(expired[n++], p->target); /* Safe */
+			}
+			p->target[0] = '\0';
+		}
+	}
+	cb = cp->cb;
+	data = cp->data;
+	pthread_mutex_unlock(&cp->lock);
+
+	for (i = 0; cb && i < n; i++) {
+		cb(data, expired[i], NULL, -1);
+	}
+}
+
+long long irc_client_ping_rtt(struct irc_client *client, const char *nick)
+{
+	struct ctcp_pings *cp = client->pings;
+	long long rtt = -1;
+	size_t len = strlen(nick);
+	int i;
+
+	if (!cp) {
+		return -1;
+	}
+	pthread_mutex_lock(&cp->lock);
+	for (i = 0; i < MAX_RESULTS; i++) {
+		if (strlen(cp->results[i].nick) == len && irc_casemap_memeq(irc_client_casemapping(client), cp->results[i].nick, nick, len)) {
+			rtt = cp->results[i].rtt;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cp->lock);
+	return rtt;
+}
+
+/*! \brief Number of source hosts with a token bucket. Beyond this, the least recently seen are forgotten. */
+#define MAX_SOURCES 512
+
+/*! \brief How many slots to probe for a source before reusing one */
+#define SOURCE_PROBES 8
+
+/*! \brief Buckets hold tokens in units of 1/TOKEN_SCALE, so partial refills aren't lost */
+#define TOKEN_SCALE 256
+
+/* Defaults: 3 replies per host, refilled every 10 seconds, and 6 overall, refilled every 2 seconds */
+#define DEFAULT_SOURCE_BURST 3
+#define DEFAULT_SOURCE_INTERVAL 10000
+#define DEFAULT_GLOBAL_BURST 6
+#define DEFAULT_GLOBAL_INTERVAL 2000
+
+struct bucket {
+	uint32_t key;					/*!< Hash of the source host, 0 if the slot is free */
+	uint32_t stamp;					/*!< When last refilled (monotonic ms, truncated) */
+	uint16_t tokens;				/*!< Tokens left, scaled by TOKEN_SCALE */
+};
+
+struct ctcp_responder {
+	pthread_mutex_t lock;
+	char version[256];				/*!< VERSION reply */
+	char source[256];				/*!< SOURCE reply, empty to not answer SOURCE */
+	unsigned int source_burst;
+	unsigned int source_interval;	/*!< ms per token */
+	unsigned int global_burst;
+	unsigned int global_interval;	/*!< ms per token */
+	unsigned long dropped;			/*!< Number of queries dropped */
+	struct bucket global;
+	struct bucket sources[MAX_SOURCES];
+};
+
+/*! \brief Refill a bucket and take a token from it, if there is one */
+static int bucket_take(struct bucket *b, unsigned int burst, unsigned int interval, uint32_t now)
+{
+	uint32_t elapsed = now - b->stamp; /* Unsigned, so wraparound is fine */
+	unsigned long tokens = b->tokens;
+
+	if (elapsed) {
+		tokens += (unsigned long) elapsed * TOKEN_SCALE / interval;
+		if (tokens >= burst * TOKEN_SCALE) {
+			tokens = burst * TOKEN_SCALE;
+			b->stamp = now;
+		} else {
+			/* Only advance by the time that was turned into tokens, so the remainder carries over */
+			b->stamp += (uint32_t) ((tokens - b->tokens) * interval / TOKEN_SCALE);
+		}
+	}
+	if (tokens < TOKEN_SCALE) {
+		b->tokens = (uint16_t) tokens;
+		return -1;
+	}
+	b->tokens = (uint16_t) (tokens - TOKEN_SCALE);
+	return 0;
+}
+
+/*! \brief 32-bit FNV-1a of a host name, which is case insensitive */
+static uint32_t host_hash(const char *host, size_t len)
+{
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char) tolower((unsigned char) host[i]);
+		hash *= 16777619U;
+	}
+	return hash ? hash : 1;
+}
+
+/*! \brief Find (or make) the bucket for a source. Must be called with the lock held. */
+static struct bucket *source_bucket(struct ctcp_responder *r, uint32_t key, uint32_t now)
+{
+	struct bucket *b, *victim = NULL;
+	unsigned int i;
+
+	for (i = 0; i < SOURCE_PROBES; i++) {
+		b = &r->sources[(key + i) % MAX_SOURCES];
+		if (b->key == key) {
+			return b;
+		} else if (!b->key) {
+			victim = b;
+			break;
+		} else if (!victim || now - b->stamp > now - victim->stamp) {
+			victim = b; /* Least recently refilled */
+		}
+	}
+	victim->key = key;
+	victim->stamp = now;
+	victim->tokens = (uint16_t) (r->source_burst * TOKEN_SCALE);
+	return victim;
+}
+
+int irc_client_ctcp_responder(struct irc_client *client, const char *version, const char *source)
+{
+	struct ctcp_responder *r;
+
+	if (!version) {
+		if (irc_loop_running(client)) {
+			irc_err("CTCP responder can't be stopped while irc_loop is running\n");
+			return -1;
+		}
+		pthread_mutex_lock(&client->lock);
+		r = client->responder;
+		client->responder = NULL;
+		pthread_mutex_unlock(&client->lock);
+		if (r) {
+			pthread_mutex_destroy(&r->lock);
+			free(r);
+		}
+		return 0;
+	}
+	if (strlen(version) >= sizeof(r->version) || (source && strlen(source) >= sizeof(r->source))) {
+		irc_err("CTCP reply too long\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&client->lock);
+	r = client->responder;
+	if (!r) {
+		r = calloc(1, sizeof(*r));
+		if (!r) {
+			pthread_mutex_unlock(&client->lock);
+			irc_err("calloc failed\n");
+			return -1;
+		}
+		pthread_mutex_init(&r->lock, NULL);
+		r->source_burst = DEFAULT_SOURCE_BURST;
+		r->source_interval = DEFAULT_SOURCE_INTERVAL;
+		r->global_burst = DEFAULT_GLOBAL_BURST;
+		r->global_interval = DEFAULT_GLOBAL_INTERVAL;
+		r->global.stamp = (uint32_t) now_ms();
+		r->global.tokens = DEFAULT_GLOBAL_BURST * TOKEN_SCALE;
+		client->responder = r;
+	}
+	pthread_mutex_lock(&r->lock);
+	strcpy(r->version, version); /* Safe */
+	strcpy(r->source, source ? source : ""); /* Safe */
+	pthread_mutex_unlock(&r->lock);
+	pthread_mutex_unlock(&client->lock);
+	return 0;
+}
+
+int irc_client_ctcp_limits(struct irc_client *client, unsigned int source_burst, unsigned int source_interval, unsigned int global_burst, unsigned int global_interval)
+{
+	struct ctcp_responder *r = client->responder;
+	int i;
+
+	if (!r) {
+		irc_err("CTCP responder is not enabled\n");
+		return -1;
+	}
+	if (!source_burst || !global_burst || source_burst * TOKEN_SCALE > UINT16_MAX || global_burst * TOKEN_SCALE > UINT16_MAX || !source_interval || !global_interval) {
+		irc_err("Invalid CTCP rate limits\n");
+		return -1;
+	}
+	pthread_mutex_lock(&r->lock);
+	r->source_burst = source_burst;
+	r->source_interval = source_interval;
+	r->global_burst = global_burst;
+	r->global_interval = global_interval;
+	/* Clamp what's already accumulated to the new bursts */
+	if (r->global.tokens > global_burst * TOKEN_SCALE) {
+		r->global.tokens = (uint16_t) (global_burst * TOKEN_SCALE);
+	}
+	for (i = 0; i < MAX_SOURCES; i++) {
+		if (r->sources[i].tokens > source_burst * TOKEN_SCALE) {
+			r->sources[i].tokens = (uint16_t) (source_burst * TOKEN_SCALE);
+		}
+	}
+	pthread_mutex_unlock(&r->lock);
+	return 0;
+}
+
+unsigned long irc_client_ctcp_dropped(struct irc_client *client)
+{
+	struct ctcp_responder *r = client->responder;
+	unsigned long dropped;
+
+	if (!r) {
+		return 0;
+	}
+	pthread_mutex_lock(&r->lock);
+	dropped = r->dropped;
+	pthread_mutex_unlock(&r->lock);
+	return dropped;
+}
+
+void ctcp_responder_destroy(struct irc_client *client)
+{
+	if (client->responder) {
+		pthread_mutex_destroy(&client->responder->lock);
+		free(client->responder);
+		client->responder = NULL;
+	}
+}
+
+int ctcp_respond(struct irc_client *client, struct irc_msg *msg)
+{
+	struct ctcp_responder *r = client->responder;
+	struct irc_ctcp ctcp;
+	const char *host, *s = msg->body;
+	char nick[64], reply[256];
+	size_t nicklen;
+	uint32_t now;
+	int allowed;
+
+	/* PRIVMSG <target> :\001VERB[ args]\001, not modified, since it's passed on if it's not ours to answer */
+	if (!msg->prefix || !msg->body || *msg->body != 0x01 || !irc_ctcp_next(&s, &ctcp)) {
+		return 0;
+	}
+	switch (ctcp.type) {
+	case CTCP_VERSION:
+	case CTCP_PING:
+	case CTCP_TIME:
+	case CTCP_CLIENTINFO:
+	case CTCP_SOURCE:
+		break;
+	default:
+		return 0; /* ACTION, DCC, etc. are for the application */
+	}
+
+	nicklen = strcspn(msg->prefix, "!@");
+	if (nicklen >= sizeof(nick)) {
+		return 0;
+	}
+	memcpy(nick, msg->prefix, nicklen);
+	nick[nicklen] = '\0';
+	host = strchr(msg->prefix, '@');
+	host = host ? host + 1 : msg->prefix;
+
+	now = (uint32_t) now_ms();
+	pthread_mutex_lock(&r->lock);
+	if (ctcp.type == CTCP_SOURCE && !r->source[0]) {
+		pthread_mutex_unlock(&r->lock);
+		return 0;
+	}
+	/* Check the source first, so one host flooding doesn't use up everyone else's budget */
+	allowed = !bucket_take(source_bucket(r, host_hash(host, strlen(host)), now), r->source_burst, r->source_interval, now)
+		&& !bucket_take(&r->global, r->global_burst, r->global_interval, now);
+	if (!allowed) {
+		r->dropped++;
+	} else if (ctcp.type == CTCP_VERSION) {
+		strcpy(reply, r->version); /* Safe */
+	} else if (ctcp.type == CTCP_SOURCE) {
+		strcpy(reply, r->source); /* Safe */
+	} else if (ctcp.type == CTCP_CLIENTINFO) {
+		snprintf(reply, sizeof(reply), "ACTION CLIENTINFO PING%s TIME VERSION", r->source[0] ? " SOURCE" : "");
+	}
+	pthread_mutex_unlock(&r->lock);
+
+	if (!allowed) {
+		irc_debug(3, "Dropping CTCP %s from %s\n", irc_ctcp_name(ctcp.type), msg->prefix);
+		return 1;
+	}
+	if (ctcp.type == CTCP_PING) {
+		/* Echoed back still quoted, as it was sent */
+		if (ctcp.argslen >= sizeof(reply)) {
+			return 1; /* Nobody needs a payload that big */
+		}
+		memcpy(reply, ctcp.args ? ctcp.args : "", ctcp.argslen);
+		reply[ctcp.argslen] = '\0';
+	} else if (ctcp.type == CTCP_TIME) {
+		time_t nowtime = time(NULL);
+		struct tm nowdate;
+		localtime_r(&nowtime, &nowdate);
+		strftime(reply, sizeof(reply), "%a %b %e %Y %I:%M:%S %P %Z", &nowdate);
+	}
+	if (irc_client_ctcp_reply(client, nick, ctcp.type, reply)) {
+		irc_warn("Failed to reply to CTCP %s from %s\n", irc_ctcp_name(ctcp.type), nick);
+	}
+	return 1;
+}
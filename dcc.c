@@ -0,0 +1,2455 @@
+/*
+ * LIRC - IRC Client Library for C
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This library is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief DCC file transfers (sending and receiving) and DCC CHAT
+ *
+ * \note All transfers are driven by one epoll instance, which irc_loop waits on
+ *       instead of its wakeup pipe (the pipe is in the epoll set too), so any number
+ *       of transfers run in the same thread as the client, without a thread each.
+ *       File data is sent with sendfile(), straight from the page cache to the socket.
+ * \note An active offer listens for the receiver to connect to us. A passive (reverse) offer
+ *       advertises port 0 and a token, and the receiver replies with where to connect to,
+ *       for when we can't accept connections.
+ * \note Received data is collected in a large page-aligned buffer and written out a buffer at a time
+ *       at aligned file offsets, and writeback is started right away so dirty pages don't pile up.
+ *       The file is preallocated, so it doesn't fragment, and a full disk is noticed up front.
+ *       Acknowledgements are sent once per wakeup rather than per read, and are skipped if they'd block,
+ *       since the next one includes everything anyways.
+ * \note Sends can be shaped with hierarchical token buckets: one per nick, under one per loop, under the global cap.
+ *       The global cap is split between the loops by how many sends each has. Within a loop, each wakeup starts at
+ *       a different transfer, and the loop's bucket is split evenly between the sends ready to go (at least a quantum each),
+ *       so a fast receiver can't starve the rest. A send that's out of bandwidth stops waiting for writability until
+ *       its buckets have refilled.
+ * \note Sends can also be queued, XDCC style, with a limited number of slots (in total and per nick).
+ *       Queued users are told their position, and reminded of it every so often.
+ * \note A DCC CHAT is a transfer that carries lines, in both directions, for as long as both sides like.
+ *       Lines received are passed to the application as PRIVMSGs from the other side, just like ones from the server.
+ *       Lines sent go straight to the socket, and whatever doesn't fit is queued until it's writable.
+ * \note Transfers can also be run by worker threads, each with its own epoll instance.
+ *       The lock is not held while a transfer's data is being sent or received, so workers don't hold each other up.
+ *       Only the loop a transfer belongs to does I/O on it or frees it.
+ */
+
+#define _GNU_SOURCE 1 /* accept4, pipe2 */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "irc_internal.h"
+
+/*! \brief Maximum number of epoll events handled per wakeup */
+#define MAX_EVENTS 64
+
+/*! \brief How long (in ms) an offer waits to be accepted */
+#define OFFER_TIMEOUT 120000
+
+/*! \brief How long (in ms) a transfer may go without any progress */
+#define IDLE_TIMEOUT 120000
+
+/*! \brief How long (in ms) to wait for the final acknowledgement, once everything has been sent */
+#define ACK_TIMEOUT 30000
+
+/*! \brief Minimum time (in ms) between progress reports for a transfer */
+#define PROGRESS_INTERVAL 1000
+
+/*! \brief Most to send to (or receive from) one transfer per wakeup, so that the others get a turn */
+#define CHUNK_SIZE (1024 * 1024)
+
+/*! \brief Size of the write buffer for received data */
+#define WRITE_BUFFER_SIZE (1024 * 1024)
+
+/*! \brief Longest line accepted in a DCC CHAT. Anything longer is split. */
+#define CHAT_LINE_MAX 8192
+
+/*! \brief Most output queued for a DCC CHAT, before sending fails */
+#define CHAT_QUEUE_SIZE (64 * 1024)
+
+/*! \brief Most worker threads transfers can be run by */
+#define MAX_WORKERS 16
+
+/*! \brief Most nicks with a bandwidth bucket of their own at once. Sends to any others are only limited by the global cap. */
+#define MAX_PEERS 256
+
+/*! \brief Least worth waking up to send, when bandwidth is capped */
+#define QUANTUM (16 * 1024)
+
+/*! \brief How much bandwidth (in ms worth) a capped bucket can save up */
+#define BURST_MS 100
+
+/*! \brief How often (in ms) to remind queued users of their position */
+#define ANNOUNCE_INTERVAL 300000
+
+/*! \brief Minimum time (in ms) between reminders, so a long queue doesn't get us killed for flooding */
+#define ANNOUNCE_SPACING 2000
+
+/*! \brief Most queue positions announced at once */
+#define ANNOUNCE_BATCH 8
+
+/*! \brief Quotes for a filename in a DCC message, if it needs them */
+#define QUOTE(name) (strchr(name, ' ') ? "\"" : "")
+
+enum transfer_state {
+	TRANSFER_INCOMING,			/*!< Offered to us, waiting for the application to accept it */
+	TRANSFER_RESUMING,			/*!< Waiting for the sender to accept our resume request */
+	TRANSFER_OFFERED,			/*!< Waiting for the other side to connect, or to tell us where to connect */
+	TRANSFER_CONNECTING,		/*!< Connecting to the other side */
+	TRANSFER_SENDING,
+	TRANSFER_DRAINING,			/*!< Everything sent, waiting for the final acknowledgement */
+	TRANSFER_RECEIVING,
+	TRANSFER_CHATTING,
+	TRANSFER_DEAD,				/*!< Finished, to be freed */
+};
+
+struct dcc_transfer {
+	unsigned int id;
+	enum transfer_state state;
+	int fd;						/*!< File being sent or received */
+	int sock;					/*!< Listening or connected socket, -1 if none */
+	char nick[64];				/*!< Other side */
+	char filename[256];			/*!< Filename offered to us */
+	char address[INET6_ADDRSTRLEN];	/*!< Where to connect to, for offers to us */
+	unsigned int peerport;		/*!< Port to connect to, for offers to us */
+	uint64_t size;				/*!< 0 if unknown, for offers to us */
+	uint64_t offset;			/*!< Next byte to send or receive */
+	uint32_t ack;				/*!< Last acknowledgement (bytes received, mod 2^32) */
+	unsigned char ackbuf[4];	/*!< Partially received acknowledgement */
+	unsigned int acklen;
+	unsigned char ackout[8];	/*!< Rest of a partially sent acknowledgement */
+	unsigned int ackoutlen;
+	unsigned int port;			/*!< Port we're listening on, 0 for passive offers */
+	unsigned int token;			/*!< Token for passive offers, 0 for active offers */
+	long long deadline;			/*!< When the transfer times out (monotonic ms) */
+	long long reported;			/*!< When progress was last reported (monotonic ms) */
+	/* Receiving */
+	unsigned char *buf;			/*!< Write buffer (page aligned) */
+	size_t buffered;			/*!< Bytes in buf */
+	size_t bufcap;				/*!< How much of buf to fill before writing, so writes after the first are at aligned offsets */
+	uint64_t written;			/*!< File offset of the start of buf */
+	uint32_t crc;				/*!< CRC-32 of everything received so far, including any resumed part */
+	/* Chatting (buf holds a partial line received) */
+	char *out;					/*!< Output not yet sent */
+	size_t outlen;
+	/* Scheduling */
+	struct dcc_loop *loop;		/*!< Loop that runs it. Only it does I/O on the transfer, or frees it. */
+	struct dcc_peer *peer;		/*!< Bandwidth bucket shared by sends to the same nick, NULL if none */
+	uint64_t peerkey;			/*!< Casemapped hash of nick */
+	long long resume;			/*!< When a send held back by a bandwidth cap can go again (monotonic ms), 0 if not held back */
+	unsigned int receiving:1;
+	unsigned int chat:1;		/*!< DCC CHAT, rather than a file */
+	unsigned int writing:1;		/*!< Waiting for writability to send queued chat output */
+	unsigned int ack64:1;		/*!< Send 64-bit acknowledgements */
+	unsigned int pinned:1;		/*!< Loop chosen by the application */
+	unsigned int busy:1;		/*!< Its loop is doing I/O on it, without the lock */
+	unsigned int cancelled:1;	/*!< Cancelled while busy, for its loop to end once it's done */
+	struct dcc_transfer *next;
+};
+
+struct rate {
+	uint64_t rate;				/*!< Bytes per second, 0 for unlimited */
+	uint64_t tokens;			/*!< Bytes that may be sent now */
+	long long stamp;			/*!< When tokens were last added (monotonic ms) */
+};
+
+struct dcc_peer {
+	uint64_t key;				/*!< Casemapped hash of the nick */
+	unsigned int refs;			/*!< Sends using it, 0 if the slot is free */
+	struct rate rate;
+};
+
+struct dcc_loop {
+	struct irc_client *client;
+	int epfd;
+	int wakefd[2];				/*!< Wakeup pipe, for workers. irc_loop's thread uses the client's. */
+	unsigned int index;			/*!< 0 for irc_loop's thread, otherwise the worker number */
+	unsigned int rotation;		/*!< Where in the next batch of events to start, so every transfer gets to go first */
+	struct rate rate;			/*!< Its part of the global cap */
+	pthread_t thread;
+};
+
+/*! \brief A send waiting for a slot */
+struct dcc_queued {
+	unsigned int id;
+	int worker;					/*!< Loop to pin it to, -1 for any */
+	int passive;
+	long long announced;		/*!< When its position was last announced (monotonic ms), 0 if never */
+	char nick[64];
+	struct dcc_queued *next;
+	char path[];
+};
+
+struct dcc {
+	pthread_mutex_t lock;
+	struct dcc_loop loops[MAX_WORKERS + 1];	/*!< irc_loop's, then the workers' */
+	unsigned int workers;
+	unsigned int nextworker;
+	int stopping;
+	struct dcc_transfer *transfers;
+	unsigned int last_id;
+	unsigned int last_token;
+	/* Scheduling */
+	uint64_t global_rate;
+	uint64_t peer_rate;
+	struct dcc_peer peers[MAX_PEERS];
+	struct dcc_queued *queue;
+	unsigned int slots;				/*!< Most sends at once, 0 for unlimited */
+	unsigned int nick_slots;		/*!< Most sends to one nick at once, 0 for unlimited */
+	long long announce_next;		/*!< When the next position reminder may be sent */
+	char address[INET6_ADDRSTRLEN];	/*!< Address to advertise, empty to use the one we're connected to the server from */
+	unsigned int minport;			/*!< Ports to listen on, 0 for any */
+	unsigned int maxport;
+	unsigned int nextport;
+	void (*cb)(void *data, unsigned int id, enum irc_dcc_status status, uint64_t bytes, uint64_t size);
+	void *data;
+	void (*offer_cb)(void *data, const struct irc_dcc_offer *offer);
+	void *offer_data;
+	void (*chat_cb)(void *data, unsigned int id, struct irc_msg *msg);
+	void *chat_data;
+};
+
+struct dcc_note {
+	unsigned int id;
+	enum irc_dcc_status status;
+	uint64_t bytes;
+	uint64_t size;
+};
+
+/*! \brief Callbacks to make once the lock is released */
+struct dcc_notes {
+	struct dcc_note notes[2 * MAX_EVENTS];
+	int count;
+};
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+	uint32_t i, j, c;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++) {
+			c = c & 1 ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+		}
+		crc_table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++) {
+			crc_table[j][i] = crc_table[0][crc_table[j - 1][i] & 0xFF] ^ (crc_table[j - 1][i] >> 8);
+		}
+	}
+}
+
+/*! \brief Continue a CRC-32 (IEEE, as used by zlib) over more data, 8 bytes at a time */
+static uint32_t crc32_update(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	crc = ~crc;
+	while (len >= 8) {
+		uint32_t lo = crc ^ ((uint32_t) buf[0] | (uint32_t) buf[1] << 8 | (uint32_t) buf[2] << 16 | (uint32_t) buf[3] << 24);
+		uint32_t hi = (uint32_t) buf[4] | (uint32_t) buf[5] << 8 | (uint32_t) buf[6] << 16 | (uint32_t) buf[7] << 24;
+		crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^ crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24]
+			^ crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^ crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+		buf += 8;
+		len -= 8;
+	}
+	while (len--) {
+		crc = crc_table[0][(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+static void note(struct dcc_notes *n, struct dcc_transfer *t, enum irc_dcc_status status)
+{
+	if (n->count < (int) (sizeof(n->notes) / sizeof(n->notes[0]))) {
+		n->notes[n->count].id = t->id;
+		n->notes[n->count].status = status;
+		n->notes[n->count].bytes = t->offset;
+		n->notes[n->count].size = t->size;
+		n->count++;
+	}
+}
+
+static void notes_deliver(struct dcc *d, struct dcc_notes *n)
+{
+	void (*cb)(void *data, unsigned int id, enum irc_dcc_status status, uint64_t bytes, uint64_t size);
+	void *data;
+	int i;
+
+	pthread_mutex_lock(&d->lock);
+	cb = d->cb;
+	data = d->data;
+	pthread_mutex_unlock(&d->lock);
+
+	for (i = 0; cb && i < n->count; i++) {
+		cb(data, n->notes[i].id, n->notes[i].status, n->notes[i].bytes, n->notes[i].size);
+	}
+}
+
+static uint64_t rate_burst(uint64_t rate)
+{
+	uint64_t burst = rate * BURST_MS / 1000;
+	return burst < QUANTUM ? QUANTUM : burst;
+}
+
+static void rate_set(struct rate *r, uint64_t rate, long long now)
+{
+	r->rate = rate;
+	r->tokens = rate_burst(rate);
+	r->stamp = now;
+}
+
+static void rate_refill(struct rate *r, long long now)
+{
+	uint64_t add, burst;
+
+	if (now <= r->stamp) {
+		return;
+	}
+	add = (uint64_t) (now - r->stamp) * r->rate / 1000;
+	if (!add) {
+		return; /* Leave the stamp, so slow rates still add up */
+	}
+	burst = rate_burst(r->rate);
+	r->tokens = r->tokens + add > burst ? burst : r->tokens + add;
+	r->stamp = now;
+}
+
+/*! \brief How long (in ms) until a bucket has enough tokens */
+static long long rate_wait(const struct rate *r, uint64_t want)
+{
+	return want <= r->tokens ? 0 : (long long) ((want - r->tokens) * 1000 / r->rate) + 1;
+}
+
+/*! \brief Get the bandwidth bucket for a nick. Must be called with the lock held. */
+static struct dcc_peer *peer_acquire(struct dcc *d, uint64_t key, long long now)
+{
+	struct dcc_peer *p = NULL;
+	int i;
+
+	for (i = 0; i < MAX_PEERS; i++) {
+		if (d->peers[i].refs && d->peers[i].key == key) {
+			d->peers[i].refs++;
+			return &d->peers[i];
+		} else if (!d->peers[i].refs && !p) {
+			p = &d->peers[i];
+		}
+	}
+	if (p) {
+		p->key = key;
+		p->refs = 1;
+		rate_set(&p->rate, d->peer_rate, now);
+	}
+	return p;
+}
+
+static void loop_wake(struct dcc_loop *loop)
+{
+	if (!loop->index) {
+		irc_loop_wake(loop->client);
+	} else {
+		ssize_t res = write(loop->wakefd[1], "", 1);
+		(void) res; /* If the pipe is full, it's going to wake up anyways */
+	}
+}
+
+static struct dcc *dcc_get(struct irc_client *client)
+{
+	struct dcc *d;
+	struct epoll_event ev;
+
+	pthread_mutex_lock(&client->lock);
+	d = client->dcc;
+	if (!d) {
+		d = calloc(1, sizeof(*d));
+		if (!d) {
+			irc_err("calloc failed\n");
+			goto done;
+		}
+		d->loops[0].client = client;
+		d->loops[0].epfd = epoll_create1(EPOLL_CLOEXEC);
+		d->loops[0].wakefd[0] = d->loops[0].wakefd[1] = -1;
+		if (d->loops[0].epfd < 0) {
+			irc_err("epoll_create1 failed: %s\n", strerror(errno));
+			free(d);
+			d = NULL;
+			goto done;
+		}
+		/* irc_loop waits on the epoll fd instead of the wakeup pipe, so the pipe must wake it up too */
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(d->loops[0].epfd, EPOLL_CTL_ADD, client->wakefd[0], &ev);
+		pthread_mutex_init(&d->lock, NULL);
+		client->dcc = d;
+	}
+done:
+	pthread_mutex_unlock(&client->lock);
+	if (d) {
+		irc_loop_wake(client); /* So irc_loop starts waiting on the epoll fd */
+	}
+	return d;
+}
+
+/*! \brief Write out the write buffer, and start writeback of it */
+static int transfer_flush(struct dcc_transfer *t)
+{
+	size_t done = 0;
+
+	while (done < t->buffered) {
+		ssize_t res = pwrite(t->fd, t->buf + done, t->buffered - done, (off_t) (t->written + done));
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			irc_err("DCC transfer %u: write failed: %s\n", t->id, strerror(errno));
+			t->buffered = 0; /* The transfer fails, and there's no keeping the rest of it either */
+			return -1;
+		}
+		done += (size_t) res;
+	}
+	if (done) {
+		/* Don't wait for it, just don't let dirty pages accumulate until the kernel gets around to it */
+		sync_file_range(t->fd, (off_t) t->written, (off_t) done, SYNC_FILE_RANGE_WRITE);
+	}
+	t->written += done;
+	t->buffered = 0;
+	t->bufcap = WRITE_BUFFER_SIZE;
+	return 0;
+}
+
+/*! \brief Stop a transfer. It's freed later, since there may still be events for it. Must be called with the lock held. */
+static void transfer_end(struct dcc_transfer *t)
+{
+	if (t->sock != -1) {
+		epoll_ctl(t->loop->epfd, EPOLL_CTL_DEL, t->sock, NULL);
+		close(t->sock);
+		t->sock = -1;
+	}
+	/* Anything still buffered is kept for resuming, but written out once the transfer is reaped, without the lock */
+	if (t->fd != -1 && !t->buffered) {
+		close(t->fd);
+		t->fd = -1;
+	}
+	if (t->fd == -1) {
+		free(t->buf);
+		t->buf = NULL;
+	}
+	free(t->out);
+	t->out = NULL;
+	if (t->peer) {
+		t->peer->refs--;
+		t->peer = NULL;
+	}
+	t->state = TRANSFER_DEAD;
+}
+
+/*!
+ * \brief Remove finished transfers, to be freed with transfers_free. Must be called with the lock held, and only from the loop's thread.
+ * \param loop Loop whose transfers to remove, NULL for all
+ * \return Removed transfers
+ */
+static struct dcc_transfer *transfers_reap(struct dcc *d, struct dcc_loop *loop)
+{
+	struct dcc_transfer *t, **prev = &d->transfers, *dead = NULL;
+
+	while ((t = *prev)) {
+		if (t->state == TRANSFER_DEAD && (!loop || t->loop == loop)) {
+			*prev = t->next;
+			t->next = dead;
+			dead = t;
+		} else {
+			prev = &t->next;
+		}
+	}
+	return dead;
+}
+
+/*!
+ * \brief Free transfers removed by transfers_reap, writing out anything they still had buffered. Must be called without the lock.
+ * \return Number freed
+ */
+static int transfers_free(struct dcc_transfer *dead)
+{
+	struct dcc_transfer *t;
+	int freed = 0;
+
+	while ((t = dead)) {
+		dead = t->next;
+		if (t->fd != -1) {
+			transfer_flush(t); /* Keep what was received, for resuming */
+			close(t->fd);
+		}
+		free(t->buf);
+		free(t);
+		freed++;
+	}
+	return freed;
+}
+
+void dcc_destroy(struct irc_client *client)
+{
+	struct dcc *d = client->dcc;
+	struct dcc_transfer *t;
+	struct dcc_queued *q;
+	unsigned int i, workers;
+
+	if (!d) {
+		return;
+	}
+	pthread_mutex_lock(&d->lock);
+	d->stopping = 1;
+	workers = d->workers;
+	pthread_mutex_unlock(&d->lock);
+	for (i = 1; i <= workers; i++) {
+		loop_wake(&d->loops[i]);
+		pthread_join(d->loops[i].thread, NULL);
+		close(d->loops[i].epfd);
+		close(d->loops[i].wakefd[0]);
+		close(d->loops[i].wakefd[1]);
+	}
+
+	for (t = d->transfers; t; t = t->next) {
+		transfer_end(t);
+	}
+	transfers_free(transfers_reap(d, NULL));
+	while ((q = d->queue)) {
+		d->queue = q->next;
+		free(q);
+	}
+	close(d->loops[0].epfd);
+	pthread_mutex_destroy(&d->lock);
+	free(d);
+	client->dcc = NULL;
+}
+
+int dcc_fd(struct irc_client *client)
+{
+	return client->dcc->loops[0].epfd;
+}
+
+int irc_client_dcc_config(struct irc_client *client, const char *address, unsigned int minport, unsigned int maxport)
+{
+	struct dcc *d;
+	unsigned char buf[sizeof(struct in6_addr)];
+
+	if (address && inet_pton(AF_INET, address, buf) != 1 && inet_pton(AF_INET6, address, buf) != 1) {
+		irc_err("Invalid DCC address: %s\n", address);
+		return -1;
+	}
+	if (minport > maxport || maxport > 65535 || (!minport && maxport)) {
+		irc_err("Invalid DCC port range: %u-%u\n", minport, maxport);
+		return -1;
+	}
+	d = dcc_get(client);
+	if (!d) {
+		return -1;
+	}
+	pthread_mutex_lock(&d->lock);
+	strcpy(d->address, address ? address : ""); /* Safe, since it parsed */
+	d->minport = minport;
+	d->maxport = maxport;
+	d->nextport = minport;
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+int irc_client_dcc_callback(struct irc_client *client, void (*cb)(void *data, unsigned int id, enum irc_dcc_status status, uint64_t bytes, uint64_t size), void *data)
+{
+	struct dcc *d = dcc_get(client);
+
+	if (!d) {
+		return -1;
+	}
+	pthread_mutex_lock(&d->lock);
+	d->cb = cb;
+	d->data = data;
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+/*!
+ * \brief Get the address to advertise in offers
+ * \param[out] buf IPv4 addresses as an integer (as DCC expects), IPv6 addresses as is
+ * \return Address family, -1 on failure
+ */
+static int advertised_address(struct irc_client *client, struct dcc *d, char *buf, size_t len)
+{
+	struct sockaddr_storage ss;
+	socklen_t sslen = sizeof(ss);
+	char address[INET6_ADDRSTRLEN];
+	struct in_addr in;
+
+	pthread_mutex_lock(&d->lock);
+	strcpy(address, d->address); /* Safe */
+	pthread_mutex_unlock(&d->lock);
+
+	if (!address[0]) {
+		/* Whatever address we're connected to the server from. Behind NAT, that's not the right one, so configure it. */
+		if (getsockname(client->sfd, (struct sockaddr *) &ss, &sslen)) {
+			irc_err("getsockname failed: %s\n", strerror(errno));
+			return -1;
+		}
+		if (ss.ss_family == AF_INET6) {
+			inet_ntop(AF_INET6, &((struct sockaddr_in6 *) &ss)->sin6_addr, address, sizeof(address));
+		} else {
+			inet_ntop(AF_INET, &((struct sockaddr_in *) &ss)->sin_addr, address, sizeof(address));
+		}
+	}
+	if (inet_pton(AF_INET, address, &in) == 1) {
+		snprintf(buf, len, "%u", ntohl(in.s_addr));
+		return AF_INET;
+	}
+	snprintf(buf, len, "%s", address);
+	return AF_INET6;
+}
+
+/*! \brief Listen for a receiver to connect, on a port in the configured range */
+static int transfer_listen(struct dcc *d, int family, unsigned int *port)
+{
+	struct sockaddr_storage ss;
+	socklen_t sslen;
+	unsigned int minport, maxport, range, tries, candidate;
+	int one = 1, bound = 0;
+	int sock = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if (sock < 0) {
+		irc_err("socket failed: %s\n", strerror(errno));
+		return -1;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	pthread_mutex_lock(&d->lock);
+	minport = d->minport;
+	maxport = d->maxport;
+	candidate = d->nextport;
+	pthread_mutex_unlock(&d->lock);
+
+	range = minport ? maxport - minport + 1 : 1;
+	for (tries = 0; tries < range; tries++) {
+		memset(&ss, 0, sizeof(ss));
+		if (family == AF_INET6) {
+			struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &ss;
+			sin6->sin6_family = AF_INET6;
+			sin6->sin6_addr = in6addr_any;
+			sin6->sin6_port = htons((uint16_t) candidate);
+			sslen = sizeof(*sin6);
+		} else {
+			struct sockaddr_in *sin = (struct sockaddr_in *) &ss;
+			sin->sin_family = AF_INET;
+			sin->sin_addr.s_addr = htonl(INADDR_ANY);
+			sin->sin_port = htons((uint16_t) candidate);
+			sslen = sizeof(*sin);
+		}
+		if (!bind(sock, (struct sockaddr *) &ss, sslen)) {
+			bound = 1;
+			break;
+		} else if (errno != EADDRINUSE) {
+			break;
+		}
+		candidate = candidate >= maxport ? minport : candidate + 1;
+	}
+	if (minport) {
+		pthread_mutex_lock(&d->lock);
+		d->nextport = candidate >= maxport ? minport : candidate + 1; /* Round robin, so ports aren't reused right away */
+		pthread_mutex_unlock(&d->lock);
+	}
+	if (!bound) {
+		irc_err("Failed to bind DCC socket: %s\n", strerror(errno));
+		close(sock);
+		return -1;
+	}
+	sslen = sizeof(ss);
+	if (listen(sock, 1) || getsockname(sock, (struct sockaddr *) &ss, &sslen)) {
+		irc_err("Failed to listen on DCC socket: %s\n", strerror(errno));
+		close(sock);
+		return -1;
+	}
+	*port = ntohs(family == AF_INET6 ? ((struct sockaddr_in6 *) &ss)->sin6_port : ((struct sockaddr_in *) &ss)->sin_port);
+	return sock;
+}
+
+/*! \brief Format a filename for an offer: just the name, quoted if it has spaces */
+static void offer_filename(const char *path, char *buf, size_t len)
+{
+	const char *name = strrchr(path, '/');
+	size_t i, n = 0;
+	int quote;
+
+	name = name ? name + 1 : path;
+	quote = strchr(name, ' ') ? 1 : 0;
+	if (quote && n + 1 < len) {
+		buf[n++] = '"';
+	}
+	for (i = 0; name[i] && n + 1 + (size_t) quote < len; i++) {
+		char c = name[i];
+		buf[n++] = c == '"' || c == '\001' || (unsigned char) c < 32 ? '_' : c;
+	}
+	if (quote) {
+		buf[n++] = '"';
+	}
+	buf[n] = '\0';
+}
+
+/*! \brief Pick the loop for a new transfer: the one asked for, or the next worker, if there are any. Must be called with the lock held. */
+static struct dcc_loop *loop_pick(struct dcc *d, int worker)
+{
+	if (worker >= 0 && (unsigned int) worker <= d->workers) {
+		return &d->loops[worker];
+	} else if (!d->workers) {
+		return &d->loops[0];
+	}
+	d->nextworker = d->nextworker % d->workers + 1;
+	return &d->loops[d->nextworker];
+}
+
+/*! \brief Set up the buffers for a chat */
+static int chat_alloc(struct dcc_transfer *t)
+{
+	t->chat = 1;
+	strcpy(t->filename, "chat");
+	t->buf = malloc(CHAT_LINE_MAX + 1);
+	t->out = malloc(CHAT_QUEUE_SIZE);
+	if (!t->buf || !t->out) {
+		irc_err("malloc failed\n");
+		free(t->buf);
+		free(t->out);
+		t->buf = NULL;
+		t->out = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*!
+ * \brief Offer a file, or a chat
+ * \param path File to offer, NULL to offer a chat
+ * \param id ID to use (for queued sends), 0 for a new one
+ * \param worker Loop to run it in, -1 for any
+ */
+static int transfer_offer(struct irc_client *client, const char *nick, const char *path, int passive, unsigned int id, int worker)
+{
+	struct dcc *d;
+	struct dcc_transfer *t;
+	struct dcc_loop *loop;
+	struct stat st;
+	struct epoll_event ev;
+	char filename[256], address[INET6_ADDRSTRLEN], token[16] = "";
+	unsigned int port;
+	int family, res;
+
+	if (strlen(nick) >= sizeof(t->nick)) {
+		irc_err("Nickname too long\n");
+		return -1;
+	}
+	d = dcc_get(client);
+	if (!d) {
+		return -1;
+	}
+	family = advertised_address(client, d, address, sizeof(address));
+	if (family < 0) {
+		return -1;
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (!t) {
+		irc_err("calloc failed\n");
+		return -1;
+	}
+	t->sock = t->fd = -1;
+	if (!path) {
+		if (chat_alloc(t)) {
+			goto cleanup;
+		}
+	} else {
+		t->fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (t->fd < 0) {
+			irc_err("Failed to open %s: %s\n", path, strerror(errno));
+			goto cleanup;
+		}
+		if (fstat(t->fd, &st) || !S_ISREG(st.st_mode)) {
+			irc_err("%s is not a regular file\n", path);
+			goto cleanup;
+		}
+		posix_fadvise(t->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		t->size = (uint64_t) st.st_size;
+		offer_filename(path, filename, sizeof(filename));
+	}
+	strcpy(t->nick, nick); /* Safe */
+	t->peerkey = irc_casemap_hash(irc_client_casemapping(client), nick, strlen(nick));
+
+	if (!passive) {
+		t->sock = transfer_listen(d, family, &t->port);
+		if (t->sock < 0) {
+			goto cleanup;
+		}
+	}
+
+	pthread_mutex_lock(&d->lock);
+	if (!id) {
+		id = ++d->last_id;
+	}
+	t->id = id;
+	t->loop = loop = loop_pick(d, worker);
+	port = t->port;
+	if (passive) {
+		t->token = ++d->last_token;
+		snprintf(token, sizeof(token), " %u", t->token);
+	}
+	t->state = TRANSFER_OFFERED;
+	t->deadline = now_ms() + OFFER_TIMEOUT;
+	t->reported = now_ms();
+	if (t->sock != -1) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = t;
+		epoll_ctl(loop->epfd, EPOLL_CTL_ADD, t->sock, &ev);
+	}
+	/* Add it before making the offer, since the reply could come back before the send returns */
+	t->next = d->transfers;
+	d->transfers = t;
+	pthread_mutex_unlock(&d->lock);
+
+	if (!path) {
+		res = irc_send(client, "PRIVMSG %s :" "\001" "DCC CHAT chat %s %u%s" "\001", nick, address, port, token);
+	} else {
+		res = irc_send(client, "PRIVMSG %s :" "\001" "DCC SEND %s %s %u %llu%s" "\001", nick, filename, address, port, (unsigned long long) st.st_size, token);
+	}
+	if (res) {
+		irc_client_dcc_cancel(client, id);
+		return -1;
+	}
+	loop_wake(loop); /* It needs to know about the new timeout */
+	return (int) id;
+
+cleanup:
+	if (t->fd != -1) {
+		close(t->fd);
+	}
+	free(t->buf);
+	free(t->out);
+	free(t);
+	return -1;
+}
+
+int irc_client_dcc_send(struct irc_client *client, const char *nick, const char *path, int passive)
+{
+	return transfer_offer(client, nick, path, passive, 0, -1);
+}
+
+int irc_client_dcc_queue(struct irc_client *client, const char *nick, const char *path, int passive)
+{
+	struct dcc *d;
+	struct dcc_queued *q, **tail;
+	struct stat st;
+	unsigned int id;
+
+	if (strlen(nick) >= sizeof(q->nick)) {
+		irc_err("Nickname too long\n");
+		return -1;
+	} else if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+		irc_err("%s is not a regular file\n", path);
+		return -1;
+	}
+	d = dcc_get(client);
+	if (!d) {
+		return -1;
+	}
+	q = calloc(1, sizeof(*q) + strlen(path) + 1);
+	if (!q) {
+		irc_err("calloc failed\n");
+		return -1;
+	}
+	q->worker = -1;
+	q->passive = passive;
+	strcpy(q->nick, nick); /* Safe */
+	strcpy(q->path, path); /* Safe */
+
+	pthread_mutex_lock(&d->lock);
+	id = q->id = ++d->last_id;
+	for (tail = &d->queue; *tail; tail = &(*tail)->next);
+	*tail = q;
+	pthread_mutex_unlock(&d->lock);
+
+	irc_loop_wake(client); /* irc_loop starts it, or announces its position */
+	return (int) id;
+}
+
+int irc_client_dcc_queue_position(struct irc_client *client, unsigned int id)
+{
+	struct dcc *d = client->dcc;
+	struct dcc_queued *q;
+	int position = 0;
+
+	if (!d) {
+		return 0;
+	}
+	pthread_mutex_lock(&d->lock);
+	for (q = d->queue; q; q = q->next) {
+		position++;
+		if (q->id == id) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+	return q ? position : 0;
+}
+
+int irc_client_dcc_slots(struct irc_client *client, unsigned int slots, unsigned int per_nick)
+{
+	struct dcc *d = dcc_get(client);
+
+	if (!d) {
+		return -1;
+	}
+	pthread_mutex_lock(&d->lock);
+	d->slots = slots;
+	d->nick_slots = per_nick;
+	pthread_mutex_unlock(&d->lock);
+	irc_loop_wake(client); /* More slots may have opened up */
+	return 0;
+}
+
+int irc_client_dcc_bandwidth(struct irc_client *client, uint64_t global, uint64_t per_nick)
+{
+	struct dcc *d = dcc_get(client);
+	struct dcc_transfer *t;
+	long long now = now_ms();
+	unsigned int i, workers;
+	int j;
+
+	if (!d) {
+		return -1;
+	}
+	pthread_mutex_lock(&d->lock);
+	d->global_rate = global;
+	for (i = 0; i <= MAX_WORKERS; i++) {
+		rate_set(&d->loops[i].rate, global, now); /* Until the loop splits it up */
+	}
+	d->peer_rate = per_nick;
+	for (j = 0; j < MAX_PEERS; j++) {
+		if (d->peers[j].refs) {
+			rate_set(&d->peers[j].rate, per_nick, now);
+		}
+	}
+	for (t = d->transfers; t; t = t->next) {
+		if (t->resume) {
+			t->resume = now; /* Held back under the old caps, try again */
+		}
+	}
+	workers = d->workers;
+	pthread_mutex_unlock(&d->lock);
+	for (i = 0; i <= workers; i++) {
+		loop_wake(&d->loops[i]);
+	}
+	return 0;
+}
+
+/*! \brief Find a transfer by ID. Must be called with the lock held. */
+static struct dcc_transfer *transfer_get(struct dcc *d, unsigned int id)
+{
+	struct dcc_transfer *t;
+
+	for (t = d->transfers; t; t = t->next) {
+		if (t->id == id && t->state != TRANSFER_DEAD) {
+			return t;
+		}
+	}
+	return NULL;
+}
+
+int irc_client_dcc_pin(struct irc_client *client, unsigned int id, unsigned int worker)
+{
+	struct dcc *d = client->dcc;
+	struct dcc_transfer *t;
+	struct dcc_queued *q;
+	struct dcc_loop *loop = NULL;
+	int res = -1;
+
+	if (!d) {
+		return -1;
+	}
+	pthread_mutex_lock(&d->lock);
+	if (worker > d->workers) {
+		pthread_mutex_unlock(&d->lock);
+		irc_err("No such DCC worker: %u\n", worker);
+		return -1;
+	}
+	for (q = d->queue; q; q = q->next) {
+		if (q->id == id) {
+			q->worker = (int) worker;
+			res = 0;
+			break;
+		}
+	}
+	t = q ? NULL : transfer_get(d, id);
+	if (t && t->state == TRANSFER_INCOMING) {
+		/* Nothing to move yet, it's not in any epoll set */
+		t->loop = loop = &d->loops[worker];
+		t->pinned = 1;
+		res = 0;
+	} else if (t) {
+		irc_err("DCC transfer %u has already started\n", id);
+	}
+	pthread_mutex_unlock(&d->lock);
+	if (loop) {
+		loop_wake(loop); /* It needs to know about the timeout */
+	}
+	return res;
+}
+
+int irc_client_dcc_cancel(struct irc_client *client, unsigned int id)
+{
+	struct dcc *d = client->dcc;
+	struct dcc_transfer *t;
+	struct dcc_queued *q, **prev;
+	struct dcc_loop *loop = NULL;
+	int res = -1;
+
+	if (!d) {
+		return -1;
+	}
+	pthread_mutex_lock(&d->lock);
+	t = transfer_get(d, id);
+	if (t) {
+		if (t->busy) {
+			t->cancelled = 1; /* Its loop is using the fds right now */
+		} else {
+			transfer_end(t);
+		}
+		loop = t->loop;
+		res = 0;
+	}
+	for (prev = &d->queue; !t && (q = *prev); prev = &q->next) {
+		if (q->id == id) {
+			*prev = q->next;
+			free(q);
+			res = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+	if (loop) {
+		loop_wake(loop); /* So it gets freed */
+	}
+	return res;
+}
+
+static void transfer_watch(struct dcc_transfer *t, int op, uint32_t events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = t;
+	if (epoll_ctl(t->loop->epfd, op, t->sock, &ev)) {
+		irc_err("epoll_ctl failed: %s\n", strerror(errno));
+	}
+}
+
+static void transfer_finish(struct dcc_transfer *t, enum irc_dcc_status status, struct dcc_notes *n)
+{
+	note(n, t, status);
+	transfer_end(t);
+}
+
+/*! \brief Read acknowledgements: the number of bytes received so far, mod 2^32, in network byte order */
+static void transfer_read_acks(struct dcc_transfer *t, struct dcc_notes *n)
+{
+	unsigned char buf[64];
+	ssize_t res, i;
+
+	res = read(t->sock, buf, sizeof(buf));
+	if (res == 0) {
+		/* Receivers hang up once they have everything */
+		transfer_finish(t, t->offset == t->size ? IRC_DCC_DONE : IRC_DCC_FAILED, n);
+		return;
+	} else if (res < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			irc_debug(1, "DCC transfer %u: %s\n", t->id, strerror(errno));
+			transfer_finish(t, IRC_DCC_FAILED, n);
+		}
+		return;
+	}
+	for (i = 0; i < res; i++) {
+		t->ackbuf[t->acklen++] = buf[i];
+		if (t->acklen == 4) {
+			t->ack = (uint32_t) t->ackbuf[0] << 24 | (uint32_t) t->ackbuf[1] << 16 | (uint32_t) t->ackbuf[2] << 8 | t->ackbuf[3];
+			t->acklen = 0;
+		}
+	}
+	if (t->state == TRANSFER_DRAINING && t->ack == (uint32_t) t->size) {
+		transfer_finish(t, IRC_DCC_DONE, n);
+	}
+}
+
+/*!
+ * \brief Take as much bandwidth as a send may use now, from its nick's bucket and its loop's. Must be called with the lock held.
+ * \param waiting Sends (including this one) still to go in this batch of events, which the loop's bucket is split between
+ * \return Bytes it may send. 0 if it has to wait, until t->resume.
+ */
+static uint64_t transfer_budget(struct dcc_transfer *t, unsigned int waiting, long long now)
+{
+	struct rate *r = &t->loop->rate;
+	uint64_t left = t->size - t->offset;
+	uint64_t budget = left < CHUNK_SIZE ? left : CHUNK_SIZE;
+	uint64_t quantum = budget < QUANTUM ? budget : QUANTUM;
+	long long wait = 0;
+
+	if (!budget) {
+		return 0;
+	}
+	if (r->rate) {
+		uint64_t share;
+		rate_refill(r, now);
+		/* An even share of what's left, but at least a quantum, so when there isn't enough to go around,
+		 * whoever is first this time gets it (and someone else will be first next time) */
+		share = r->tokens / (waiting ? waiting : 1);
+		share = share < quantum ? quantum : share;
+		budget = budget < share ? budget : share;
+		budget = budget < r->tokens ? budget : r->tokens;
+		if (r->tokens < quantum) {
+			/* Wait until it's full, not just for a quantum. Every send held back then goes again at the same time,
+			 * and they split it evenly, rather than whoever happens to still be waiting for writability getting it. */
+			wait = rate_wait(r, rate_burst(r->rate));
+		}
+	}
+	if (t->peer && t->peer->rate.rate) {
+		rate_refill(&t->peer->rate, now);
+		budget = budget < t->peer->rate.tokens ? budget : t->peer->rate.tokens;
+		if (t->peer->rate.tokens < quantum) {
+			long long peerwait = rate_wait(&t->peer->rate, quantum);
+			wait = peerwait > wait ? peerwait : wait;
+		}
+	}
+	if (wait) {
+		t->resume = now + wait;
+		return 0;
+	}
+	/* Taken up front, since the lock isn't held while sending */
+	if (r->rate) {
+		r->tokens -= budget;
+	}
+	if (t->peer && t->peer->rate.rate) {
+		t->peer->rate.tokens -= budget;
+	}
+	return budget;
+}
+
+/*! \brief Give back bandwidth taken but not used. Must be called with the lock held. */
+static void transfer_refund(struct dcc_transfer *t, uint64_t unused)
+{
+	if (t->loop->rate.rate) {
+		t->loop->rate.tokens += unused;
+	}
+	if (t->peer && t->peer->rate.rate) {
+		t->peer->rate.tokens += unused;
+	}
+}
+
+/*! \brief Send what the budget allows. Must be called with the lock held, which is released while sending. */
+static void transfer_send(struct dcc *d, struct dcc_transfer *t, unsigned int waiting, long long now, struct dcc_notes *n)
+{
+	uint64_t budget, sent = 0, offset = t->offset;
+	int sock = t->sock, fd = t->fd, err = 0;
+
+	budget = transfer_budget(t, waiting, now);
+	if (t->resume) {
+		transfer_watch(t, EPOLL_CTL_MOD, EPOLLIN); /* Until there's bandwidth for it */
+		return;
+	}
+
+	if (budget) {
+		t->busy = 1;
+		pthread_mutex_unlock(&d->lock);
+		/* Don't wait for acknowledgements, just keep the socket buffer full */
+		while (sent < budget) {
+			off_t off = (off_t) offset;
+			ssize_t res = sendfile(sock, fd, &off, (size_t) (budget - sent));
+			if (res < 0) {
+				if (errno != EAGAIN && errno != EINTR) {
+					err = errno;
+				}
+				break;
+			} else if (!res) {
+				err = -1;
+				break;
+			}
+			offset += (uint64_t) res;
+			sent += (uint64_t) res;
+		}
+		pthread_mutex_lock(&d->lock);
+		t->busy = 0;
+		t->offset = offset;
+		transfer_refund(t, budget - sent);
+	}
+
+	if (t->cancelled) {
+		transfer_end(t);
+		return;
+	} else if (err) {
+		if (err > 0) {
+			irc_debug(1, "DCC transfer %u: %s\n", t->id, strerror(err));
+		} else {
+			irc_warn("DCC transfer %u: file shrank while sending\n", t->id);
+		}
+		transfer_finish(t, IRC_DCC_FAILED, n);
+		return;
+	}
+	if (sent) {
+		t->deadline = now + IDLE_TIMEOUT;
+		if (now - t->reported >= PROGRESS_INTERVAL) {
+			t->reported = now;
+			note(n, t, IRC_DCC_PROGRESS);
+		}
+	}
+	if (t->offset == t->size) {
+		if (t->ack == (uint32_t) t->size) {
+			transfer_finish(t, IRC_DCC_DONE, n); /* Resumed at the end, or empty */
+			return;
+		}
+		/* Stop waiting for writability, or we'll spin */
+		t->state = TRANSFER_DRAINING;
+		t->deadline = now + ACK_TIMEOUT;
+		transfer_watch(t, EPOLL_CTL_MOD, EPOLLIN);
+	}
+}
+
+/*! \brief Acknowledge everything received so far. If the socket is full, skip it, since the next one covers this too. */
+static void transfer_ack(struct dcc_transfer *t)
+{
+	unsigned char ack[8];
+	int i, len = t->ack64 ? 8 : 4;
+	ssize_t res;
+
+	/* Acknowledgements are fixed size, so once part of one is sent, the rest has to be too */
+	if (t->ackoutlen) {
+		res = write(t->sock, t->ackout, t->ackoutlen);
+		if (res > 0) {
+			t->ackoutlen -= (unsigned int) res;
+			memmove(t->ackout, t->ackout + res, t->ackoutlen);
+		}
+		if (t->ackoutlen) {
+			return; /* Later acknowledgements include everything this one would have */
+		}
+	}
+	for (i = 0; i < len; i++) {
+		ack[i] = (unsigned char) (t->offset >> (8 * (len - 1 - i)));
+	}
+	res = write(t->sock, ack, (size_t) len);
+	if (res <= 0) {
+		irc_debug(5, "DCC transfer %u: skipped acknowledgement\n", t->id);
+	} else if (res < len) {
+		t->ackoutlen = (unsigned int) (len - res);
+		memcpy(t->ackout, ack + res, t->ackoutlen);
+	}
+}
+
+/*! \brief Receive what's available. Must be called with the lock held, which is released while receiving. */
+static void transfer_receive(struct dcc *d, struct dcc_transfer *t, long long now, struct dcc_notes *n)
+{
+	uint64_t received = 0, offset = t->offset;
+	uint32_t crc = t->crc;
+	int eof = 0, err = 0, failed = 0;
+
+	/* The write buffer is only touched by this loop, so it's safe to use without the lock */
+	t->busy = 1;
+	pthread_mutex_unlock(&d->lock);
+	while (received < CHUNK_SIZE) {
+		ssize_t res = read(t->sock, t->buf + t->buffered, t->bufcap - t->buffered);
+		if (res < 0) {
+			if (errno != EAGAIN && errno != EINTR) {
+				err = errno;
+			}
+			break;
+		} else if (!res) {
+			eof = 1;
+			break;
+		}
+		crc = crc32_update(crc, t->buf + t->buffered, (size_t) res);
+		t->buffered += (size_t) res;
+		offset += (uint64_t) res;
+		received += (uint64_t) res;
+		if (t->size && offset > t->size) {
+			irc_warn("DCC transfer %u: sender sent more than the file size\n", t->id);
+			/* Keep what was offered, for resuming, but not what's past it */
+			t->buffered -= (size_t) (offset - t->size);
+			offset = t->size;
+			failed = 1;
+			break;
+		}
+		if (t->buffered == t->bufcap && transfer_flush(t)) {
+			failed = 1;
+			break;
+		}
+	}
+	if (!failed && !err && (eof || (t->size && offset == t->size)) && transfer_flush(t)) {
+		failed = 1;
+	} else if ((failed || err) && t->buffered) {
+		transfer_flush(t); /* Now, rather than later, so it's all there by the time the application hears it failed */
+	}
+	pthread_mutex_lock(&d->lock);
+	t->busy = 0;
+	t->offset = offset;
+	t->crc = crc;
+
+	if (t->cancelled) {
+		transfer_end(t);
+		return;
+	} else if (err || failed) {
+		if (err) {
+			irc_debug(1, "DCC transfer %u: %s\n", t->id, strerror(err));
+		}
+		transfer_finish(t, IRC_DCC_FAILED, n);
+		return;
+	}
+	if (received) {
+		transfer_ack(t);
+		t->deadline = now + IDLE_TIMEOUT;
+		if (now - t->reported >= PROGRESS_INTERVAL) {
+			t->reported = now;
+			note(n, t, IRC_DCC_PROGRESS);
+		}
+	}
+	if (eof || (t->size && t->offset == t->size)) {
+		/* If the size isn't known, the sender hanging up is the only way to tell it's done */
+		transfer_finish(t, !t->size || t->offset == t->size ? IRC_DCC_DONE : IRC_DCC_FAILED, n);
+	}
+}
+
+/*!
+ * \brief Pass a line from a chat to the application, as a PRIVMSG from the other side
+ * \note The line is framed and parsed like a server message, so the application sees exactly what it would from the server
+ */
+static void chat_deliver(struct dcc_transfer *t, void (*cb)(void *data, unsigned int id, struct irc_msg *msg), void *data, const char *line)
+{
+	char framed[CHAT_LINE_MAX + 2 * sizeof(t->nick) + 16];
+	struct irc_msg msg;
+
+	snprintf(framed, sizeof(framed), ":%s PRIVMSG %s :%s", t->nick, irc_client_nickname(t->loop->client), line);
+	memset(&msg, 0, sizeof(msg));
+	if (irc_parse_msg(&msg, framed) || irc_parse_msg_type(&msg)) {
+		return;
+	}
+	cb(data, t->id, &msg);
+}
+
+/*! \brief Read from a chat, and pass on complete lines. Must be called with the lock held, which is released while reading. */
+static void transfer_chat(struct dcc *d, struct dcc_transfer *t, long long now, struct dcc_notes *n)
+{
+	void (*cb)(void *data, unsigned int id, struct irc_msg *msg) = d->chat_cb;
+	void *data = d->chat_data;
+	char *buf = (char *) t->buf;
+	uint64_t received = 0;
+	int eof = 0, err = 0;
+
+	/* The partial line is only touched by this loop, and the callback can send without deadlocking */
+	t->busy = 1;
+	pthread_mutex_unlock(&d->lock);
+	while (received < CHUNK_SIZE) {
+		char *line = buf, *eol;
+		ssize_t res = read(t->sock, buf + t->buffered, CHAT_LINE_MAX - t->buffered);
+		if (res < 0) {
+			if (errno != EAGAIN && errno != EINTR) {
+				err = errno;
+			}
+			break;
+		} else if (!res) {
+			eof = 1;
+			break;
+		}
+		received += (uint64_t) res;
+		t->buffered += (size_t) res;
+		buf[t->buffered] = '\0';
+		while ((eol = memchr(line, '\n', t->buffered - (size_t) (line - buf)))) {
+			*eol = '\0';
+			if (cb) {
+				chat_deliver(t, cb, data, line);
+			}
+			line = eol + 1;
+		}
+		if (line == buf && t->buffered == CHAT_LINE_MAX) {
+			/* No end in sight, so pass on what there is */
+			if (cb) {
+				chat_deliver(t, cb, data, line);
+			}
+			line += t->buffered;
+		}
+		t->buffered -= (size_t) (line - buf);
+		memmove(buf, line, t->buffered);
+	}
+	if (eof && t->buffered && cb) {
+		buf[t->buffered] = '\0';
+		chat_deliver(t, cb, data, buf); /* Last line, without a line ending */
+	}
+	pthread_mutex_lock(&d->lock);
+	t->busy = 0;
+	t->offset += received;
+
+	if (t->cancelled) {
+		transfer_end(t);
+	} else if (err) {
+		irc_debug(1, "DCC chat %u: %s\n", t->id, strerror(err));
+		transfer_finish(t, IRC_DCC_FAILED, n);
+	} else if (eof) {
+		transfer_finish(t, IRC_DCC_DONE, n);
+	} else if (received) {
+		t->reported = now;
+	}
+}
+
+/*! \brief Send as much queued chat output as the socket takes. Must be called with the lock held. */
+static int chat_flush(struct dcc_transfer *t)
+{
+	size_t done = 0;
+
+	while (done < t->outlen) {
+		ssize_t res = write(t->sock, t->out + done, t->outlen - done);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN) {
+				break;
+			}
+			irc_debug(1, "DCC chat %u: %s\n", t->id, strerror(errno));
+			return -1;
+		}
+		done += (size_t) res;
+	}
+	t->outlen -= done;
+	memmove(t->out, t->out + done, t->outlen);
+	/* Only wait for writability while there's something to write, or we'll spin */
+	if ((t->outlen > 0) != t->writing) {
+		t->writing = t->outlen > 0;
+		transfer_watch(t, EPOLL_CTL_MOD, t->writing ? EPOLLIN | EPOLLOUT : EPOLLIN);
+	}
+	return 0;
+}
+
+static void transfer_started(struct dcc *d, struct dcc_transfer *t, int sock, long long now, struct dcc_notes *n)
+{
+	t->sock = sock;
+	t->state = t->chat ? TRANSFER_CHATTING : t->receiving ? TRANSFER_RECEIVING : TRANSFER_SENDING;
+	t->deadline = now + IDLE_TIMEOUT;
+	t->ack = (uint32_t) t->offset; /* If resumed, what the receiver already has */
+	if (!t->receiving && !t->chat) {
+		t->peer = peer_acquire(d, t->peerkey, now);
+	}
+	note(n, t, IRC_DCC_STARTED);
+}
+
+/*!
+ * \brief Handle epoll events for a transfer. Must be called with the lock held.
+ * \param waiting Sends (including this one) still to go in this batch of events
+ */
+static void transfer_event(struct dcc *d, struct dcc_transfer *t, uint32_t events, unsigned int waiting, long long now, struct dcc_notes *n)
+{
+	int sock, err = 0;
+	socklen_t errlen = sizeof(err);
+
+	switch (t->state) {
+	case TRANSFER_OFFERED:
+		sock = accept4(t->sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock < 0) {
+			return;
+		}
+		/* Only one connection per offer */
+		epoll_ctl(t->loop->epfd, EPOLL_CTL_DEL, t->sock, NULL);
+		close(t->sock);
+		transfer_started(d, t, sock, now, n);
+		transfer_watch(t, EPOLL_CTL_ADD, t->receiving || t->chat ? EPOLLIN : EPOLLIN | EPOLLOUT);
+		if (t->chat && chat_flush(t)) {
+			transfer_finish(t, IRC_DCC_FAILED, n); /* Anything queued before it connected */
+		}
+		return;
+	case TRANSFER_CONNECTING:
+		if (getsockopt(t->sock, SOL_SOCKET, SO_ERROR, &err, &errlen) || err) {
+			irc_debug(1, "DCC transfer %u: failed to connect: %s\n", t->id, strerror(err));
+			transfer_finish(t, IRC_DCC_FAILED, n);
+			return;
+		}
+		transfer_started(d, t, t->sock, now, n);
+		if (t->receiving || t->chat) {
+			transfer_watch(t, EPOLL_CTL_MOD, EPOLLIN);
+			if (t->chat && chat_flush(t)) {
+				transfer_finish(t, IRC_DCC_FAILED, n);
+			}
+			return;
+		}
+		transfer_watch(t, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT);
+		events = EPOLLOUT;
+		/* Fall through */
+	case TRANSFER_SENDING:
+	case TRANSFER_DRAINING:
+		if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+			transfer_read_acks(t, n);
+		}
+		if (t->state == TRANSFER_SENDING && (events & EPOLLOUT)) {
+			transfer_send(d, t, waiting, now, n);
+		}
+		break;
+	case TRANSFER_RECEIVING:
+		transfer_receive(d, t, now, n);
+		break;
+	case TRANSFER_CHATTING:
+		if ((events & EPOLLOUT) && chat_flush(t)) {
+			transfer_finish(t, IRC_DCC_FAILED, n);
+			return;
+		}
+		if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+			transfer_chat(d, t, now, n);
+		}
+		break;
+	case TRANSFER_INCOMING:
+	case TRANSFER_RESUMING:
+	case TRANSFER_DEAD:
+		break;
+	}
+}
+
+/*! \brief Time out a loop's transfers, and let sends held back by bandwidth caps go again. Must be called with the lock held. */
+static void transfers_expire(struct dcc *d, struct dcc_loop *loop, long long now, struct dcc_notes *n)
+{
+	struct dcc_transfer *t;
+
+	for (t = d->transfers; t && n->count < (int) (sizeof(n->notes) / sizeof(n->notes[0])); t = t->next) {
+		if (t->loop != loop || t->state == TRANSFER_DEAD || t->state == TRANSFER_CHATTING) {
+			continue; /* Chats can be idle as long as they like */
+		} else if (t->deadline <= now) {
+			/* Not all receivers acknowledge properly, so if everything was sent, call it done */
+			irc_debug(1, "DCC transfer %u timed out\n", t->id);
+			transfer_finish(t, t->state == TRANSFER_DRAINING ? IRC_DCC_DONE : IRC_DCC_FAILED, n);
+		} else if (t->resume && t->resume <= now) {
+			t->resume = 0;
+			if (t->state == TRANSFER_SENDING) {
+				transfer_watch(t, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT);
+			}
+		}
+	}
+}
+
+/*! \brief When a loop next needs to run, -1 if nothing is pending */
+static long long loop_deadline(struct dcc *d, struct dcc_loop *loop)
+{
+	struct dcc_transfer *t;
+	long long next = -1;
+
+	pthread_mutex_lock(&d->lock);
+	for (t = d->transfers; t; t = t->next) {
+		if (t->loop != loop || t->state == TRANSFER_DEAD || t->state == TRANSFER_CHATTING) {
+			continue;
+		}
+		if (next == -1 || t->deadline < next) {
+			next = t->deadline;
+		}
+		if (t->resume && t->resume < next) {
+			next = t->resume;
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+	return next;
+}
+
+/*! \brief Work out a loop's part of the global cap, by how many of the sends it has. Must be called with the lock held. */
+static void loop_share(struct dcc *d, struct dcc_loop *loop, long long now)
+{
+	struct dcc_transfer *t;
+	uint64_t mine = 0, total = 0;
+
+	if (!d->global_rate) {
+		loop->rate.rate = 0;
+		return;
+	}
+	for (t = d->transfers; t; t = t->next) {
+		if (t->state == TRANSFER_SENDING) {
+			total++;
+			mine += t->loop == loop;
+		}
+	}
+	rate_refill(&loop->rate, now); /* At the old rate, up to now */
+	/* A send that's just starting counts as one more */
+	loop->rate.rate = d->global_rate * (mine ? mine : 1) / (mine ? total : total + 1);
+	if (!loop->rate.rate) {
+		loop->rate.rate = 1;
+	}
+}
+
+/*! \brief Handle whatever's ready in a loop */
+static void loop_run(struct dcc *d, struct dcc_loop *loop, int timeout)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct dcc_notes n;
+	long long now;
+	unsigned int writable = 0;
+	struct dcc_transfer *dead;
+	int i, count, start, reaped;
+
+	count = epoll_wait(loop->epfd, events, MAX_EVENTS, timeout);
+	if (count < 0) {
+		count = 0; /* Interrupted, just check the timers */
+	}
+	for (i = 0; i < count; i++) {
+		if (events[i].data.ptr) {
+			writable += events[i].events & EPOLLOUT ? 1 : 0;
+		} else if (loop->index) {
+			char buf[64];
+			while (read(loop->wakefd[0], buf, sizeof(buf)) > 0); /* irc_loop drains its own */
+		}
+	}
+	/* Start somewhere else each time, so the same transfer doesn't always get first pick of the bandwidth */
+	start = count ? (int) (loop->rotation++ % (unsigned int) count) : 0;
+	n.count = 0;
+	now = now_ms();
+	pthread_mutex_lock(&d->lock);
+	loop_share(d, loop, now);
+	for (i = 0; i < count; i++) {
+		struct epoll_event *ev = &events[(start + i) % count];
+		if (ev->data.ptr) {
+			transfer_event(d, ev->data.ptr, ev->events, writable, now, &n);
+			if (ev->events & EPOLLOUT) {
+				writable--;
+			}
+		}
+	}
+	transfers_expire(d, loop, now, &n);
+	pthread_mutex_unlock(&d->lock);
+
+	notes_deliver(d, &n);
+
+	/* Only now, so that irc_client_dcc_info works in the callback for finished transfers */
+	pthread_mutex_lock(&d->lock);
+	dead = transfers_reap(d, loop);
+	reaped = dead && loop->index && d->queue && !d->stopping;
+	pthread_mutex_unlock(&d->lock);
+	transfers_free(dead);
+	if (reaped) {
+		irc_loop_wake(loop->client); /* A slot may have freed up, and irc_loop's thread starts queued sends */
+	}
+}
+
+static void *worker_main(void *varg)
+{
+	struct dcc_loop *loop = varg;
+	struct dcc *d = loop->client->dcc;
+
+	for (;;) {
+		long long next, now;
+		int stopping;
+
+		pthread_mutex_lock(&d->lock);
+		stopping = d->stopping;
+		pthread_mutex_unlock(&d->lock);
+		if (stopping) {
+			break;
+		}
+		next = loop_deadline(d, loop);
+		now = now_ms();
+		loop_run(d, loop, next == -1 ? -1 : next <= now ? 0 : (int) (next - now));
+	}
+	return NULL;
+}
+
+int irc_client_dcc_workers(struct irc_client *client, unsigned int workers)
+{
+	struct dcc *d;
+	struct epoll_event ev;
+	unsigned int i;
+
+	if (workers > MAX_WORKERS) {
+		irc_err("Too many DCC workers: %u (max %d)\n", workers, MAX_WORKERS);
+		return -1;
+	}
+	d = dcc_get(client);
+	if (!d) {
+		return -1;
+	}
+	pthread_mutex_lock(&d->lock);
+	i = d->workers;
+	pthread_mutex_unlock(&d->lock);
+	if (i) {
+		irc_err("DCC workers already started\n");
+		return -1;
+	}
+
+	for (i = 1; i <= workers; i++) {
+		struct dcc_loop *loop = &d->loops[i];
+		loop->client = client;
+		loop->index = i;
+		loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (loop->epfd < 0) {
+			irc_err("epoll_create1 failed: %s\n", strerror(errno));
+			return -1;
+		} else if (pipe2(loop->wakefd, O_NONBLOCK | O_CLOEXEC)) {
+			irc_err("pipe2 failed: %s\n", strerror(errno));
+			close(loop->epfd);
+			return -1;
+		}
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd[0], &ev);
+		if (pthread_create(&loop->thread, NULL, worker_main, loop)) {
+			irc_err("Failed to create DCC worker thread\n");
+			close(loop->epfd);
+			close(loop->wakefd[0]);
+			close(loop->wakefd[1]);
+			return -1;
+		}
+		/* Only now, so new transfers can go to it */
+		pthread_mutex_lock(&d->lock);
+		d->workers = i;
+		pthread_mutex_unlock(&d->lock);
+	}
+	return 0;
+}
+
+/*! \brief Number of sends (to nick, if not NULL), including ones about to start. Must be called with the lock held. */
+static unsigned int sends_active(struct irc_client *client, struct dcc *d, const char *nick, struct dcc_queued *starting)
+{
+	struct dcc_transfer *t;
+	struct dcc_queued *q;
+	size_t len = nick ? strlen(nick) : 0;
+	unsigned int count = 0;
+
+	for (t = d->transfers; t; t = t->next) {
+		if (!t->receiving && !t->chat && t->state != TRANSFER_DEAD && (!nick || (strlen(t->nick) == len && irc_casemap_memeq(irc_client_casemapping(client), t->nick, nick, len)))) {
+			count++;
+		}
+	}
+	for (q = starting; q; q = q->next) {
+		if (!nick || (strlen(q->nick) == len && irc_casemap_memeq(irc_client_casemapping(client), q->nick, nick, len))) {
+			count++;
+		}
+	}
+	return count;
+}
+
+/*! \brief Start queued sends that have a slot, and tell the rest where they are in the queue. Only called from irc_loop's thread. */
+static void queue_advance(struct irc_client *client, struct dcc *d, long long now)
+{
+	struct dcc_queued *q, **prev, *start = NULL, **starttail = &start;
+	struct {
+		char nick[64];
+		char filename[256];
+		unsigned int position;
+	} ann[ANNOUNCE_BATCH];
+	struct dcc_notes n;
+	unsigned int active, position = 0, total = 0;
+	int i, count = 0;
+
+	pthread_mutex_lock(&d->lock);
+	if (!d->queue) {
+		pthread_mutex_unlock(&d->lock);
+		return;
+	}
+	active = sends_active(client, d, NULL, NULL);
+	for (prev = &d->queue; (q = *prev);) {
+		/* First come, first served, unless that nick is already using all its slots */
+		if ((!d->slots || active < d->slots) && (!d->nick_slots || sends_active(client, d, q->nick, start) < d->nick_slots)) {
+			*prev = q->next;
+			q->next = NULL;
+			*starttail = q;
+			starttail = &q->next;
+			active++;
+		} else {
+			total++;
+			prev = &q->next;
+		}
+	}
+	for (q = d->queue; q && count < ANNOUNCE_BATCH; q = q->next) {
+		position++;
+		if (q->announced && (now - q->announced < ANNOUNCE_INTERVAL || now < d->announce_next)) {
+			continue;
+		} else if (q->announced) {
+			d->announce_next = now + ANNOUNCE_SPACING; /* New ones are told right away, but reminders are spaced out */
+		}
+		q->announced = now;
+		strcpy(ann[count].nick, q->nick); /* Safe */
+		offer_filename(q->path, ann[count].filename, sizeof(ann[count].filename));
+		ann[count].position = position;
+		count++;
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	for (i = 0; i < count; i++) {
+		if (irc_send(client, "NOTICE %s :Queued %s, position %u of %u", ann[i].nick, ann[i].filename, ann[i].position, total)) {
+			break;
+		}
+	}
+	n.count = 0;
+	while ((q = start)) {
+		start = q->next;
+		if (transfer_offer(client, q->nick, q->path, q->passive, q->id, q->worker) < 0 && n.count < (int) (sizeof(n.notes) / sizeof(n.notes[0]))) {
+			n.notes[n.count].id = q->id;
+			n.notes[n.count].status = IRC_DCC_FAILED;
+			n.notes[n.count].bytes = n.notes[n.count].size = 0;
+			n.count++;
+		}
+		free(q);
+	}
+	notes_deliver(d, &n);
+}
+
+void dcc_run(struct irc_client *client)
+{
+	struct dcc *d = client->dcc;
+
+	loop_run(d, &d->loops[0], 0);
+	queue_advance(client, d, now_ms());
+}
+
+long long dcc_deadline(struct irc_client *client)
+{
+	struct dcc *d = client->dcc;
+	struct dcc_queued *q;
+	long long next = loop_deadline(d, &d->loops[0]);
+
+	pthread_mutex_lock(&d->lock);
+	for (q = d->queue; q; q = q->next) {
+		long long due = q->announced ? q->announced + ANNOUNCE_INTERVAL : 0;
+		if (due && due < d->announce_next) {
+			due = d->announce_next;
+		}
+		if (next == -1 || due < next) {
+			next = due;
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+	return next;
+}
+
+/*!
+ * \brief Split DCC arguments into words, allowing the filename to be quoted
+ * \return Number of words
+ */
+static int dcc_split(char *s, char **argv, int max)
+{
+	int argc = 0;
+
+	while (argc < max) {
+		while (*s == ' ') {
+			s++;
+		}
+		if (!*s) {
+			break;
+		}
+		if (*s == '"' && strchr(s + 1, '"')) {
+			argv[argc++] = ++s;
+			s = strchr(s, '"');
+		} else {
+			argv[argc++] = s;
+			s += strcspn(s, " ");
+		}
+		if (*s) {
+			*s++ = '\0';
+		}
+	}
+	return argc;
+}
+
+/*!
+ * \brief Find a transfer with a nick by port (active offers) or token (passive offers). Must be called with the lock held.
+ * \param port For our offers, the port we're listening on. For offers to us, the port the sender is listening on.
+ */
+static struct dcc_transfer *transfer_find(struct irc_client *client, struct dcc *d, enum transfer_state state, int receiving, int chat,
+	const char *nick, size_t nicklen, unsigned int port, unsigned int token)
+{
+	struct dcc_transfer *t;
+
+	for (t = d->transfers; t; t = t->next) {
+		if (t->state != state || t->receiving != receiving || t->chat != chat) {
+			continue;
+		} else if (port ? (receiving ? t->peerport : t->port) != port : !token || t->token != token) {
+			continue;
+		}
+		if (strlen(t->nick) == nicklen && irc_casemap_memeq(irc_client_casemapping(client), t->nick, nick, nicklen)) {
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*! \brief Connect to the other side of a transfer */
+static int transfer_connect(const char *address, unsigned int port)
+{
+	struct sockaddr_storage ss;
+	socklen_t sslen;
+	int sock;
+
+	memset(&ss, 0, sizeof(ss));
+	if (strchr(address, ':')) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &ss;
+		if (inet_pton(AF_INET6, address, &sin6->sin6_addr) != 1) {
+			return -1;
+		}
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons((uint16_t) port);
+		sslen = sizeof(*sin6);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *) &ss;
+		if (address[strspn(address, "0123456789")]) {
+			if (inet_pton(AF_INET, address, &sin->sin_addr) != 1) {
+				return -1;
+			}
+		} else {
+			sin->sin_addr.s_addr = htonl((uint32_t) strtoul(address, NULL, 10));
+		}
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons((uint16_t) port);
+		sslen = sizeof(*sin);
+	}
+	sock = socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr *) &ss, sslen) && errno != EINPROGRESS) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/*!
+ * \brief The other side of a passive offer of ours replied with where to connect. Must be called with the lock held.
+ * \return The transfer's loop if it failed, so it can be woken to free it, NULL otherwise
+ */
+static struct dcc_loop *passive_connect(struct dcc_transfer *t, const char *address, unsigned int port, struct dcc_notes *n)
+{
+	int sock = transfer_connect(address, port);
+
+	if (sock < 0) {
+		irc_warn("Failed to connect to %s port %u for DCC transfer %u\n", address, port, t->id);
+		transfer_finish(t, IRC_DCC_FAILED, n);
+		return t->loop;
+	}
+	t->sock = sock;
+	t->state = TRANSFER_CONNECTING;
+	t->deadline = now_ms() + IDLE_TIMEOUT;
+	transfer_watch(t, EPOLL_CTL_ADD, EPOLLOUT);
+	return NULL;
+}
+
+/*! \brief Start receiving: connect to the sender, or for passive offers, listen and tell the sender where. Must be called without the lock held. */
+static int receive_start(struct irc_client *client, struct dcc *d, unsigned int id)
+{
+	struct dcc_transfer *t;
+	char address[INET6_ADDRSTRLEN], peer[INET6_ADDRSTRLEN], filename[256], nick[64];
+	struct dcc_loop *loop;
+	unsigned int peerport, port = 0, token = 0;
+	unsigned long long size = 0;
+	int sock, family, chat;
+
+	pthread_mutex_lock(&d->lock);
+	t = transfer_get(d, id);
+	if (!t) {
+		pthread_mutex_unlock(&d->lock);
+		return -1;
+	}
+	chat = t->chat;
+	peerport = t->peerport;
+	strcpy(peer, t->address); /* Safe */
+	pthread_mutex_unlock(&d->lock);
+
+	if (peerport) {
+		sock = transfer_connect(peer, peerport);
+		if (sock < 0) {
+			irc_warn("Failed to connect to %s port %u for DCC transfer %u\n", peer, peerport, id);
+		}
+	} else {
+		family = advertised_address(client, d, address, sizeof(address));
+		sock = family < 0 ? -1 : transfer_listen(d, family, &port);
+	}
+	if (sock < 0) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&d->lock);
+	t = transfer_get(d, id);
+	if (!t || (t->state != TRANSFER_INCOMING && t->state != TRANSFER_RESUMING)) {
+		pthread_mutex_unlock(&d->lock);
+		close(sock);
+		return -1;
+	}
+	t->sock = sock;
+	if (peerport) {
+		t->state = TRANSFER_CONNECTING;
+		t->deadline = now_ms() + IDLE_TIMEOUT;
+		transfer_watch(t, EPOLL_CTL_ADD, EPOLLOUT);
+	} else {
+		t->state = TRANSFER_OFFERED;
+		t->port = port;
+		t->deadline = now_ms() + OFFER_TIMEOUT;
+		transfer_watch(t, EPOLL_CTL_ADD, EPOLLIN);
+		strcpy(nick, t->nick); /* Safe */
+		strcpy(filename, t->filename); /* Safe */
+		size = t->size;
+		token = t->token;
+	}
+	loop = t->loop;
+	pthread_mutex_unlock(&d->lock);
+
+	/* For passive offers, tell the sender where to connect */
+	if (!peerport && chat && irc_send(client, "PRIVMSG %s :" "\001" "DCC CHAT chat %s %u %u" "\001", nick, address, port, token)) {
+		irc_warn("Failed to reply to passive DCC chat offer\n");
+	} else if (!peerport && !chat && irc_send(client, "PRIVMSG %s :" "\001" "DCC SEND %s%s%s %s %u %llu %u" "\001", nick, QUOTE(filename), filename, QUOTE(filename), address, port, size, token)) {
+		irc_warn("Failed to reply to passive DCC offer\n");
+	}
+	loop_wake(loop); /* It needs to know about the new timeout */
+	return 0;
+}
+
+/*!
+ * \brief Handle a DCC SEND or DCC CHAT offer to us, if the application wants them
+ * \param chat Whether it's a chat, whose arguments are the same except there's no size
+ * \retval 1 if handled, 0 otherwise
+ */
+static int offer_incoming(struct dcc *d, const char *nick, size_t nicklen, int chat, int argc, char **argv)
+{
+	struct dcc_transfer *t;
+	struct irc_dcc_offer offer;
+	void (*cb)(void *data, const struct irc_dcc_offer *offer);
+	void *data;
+	unsigned char addrbuf[sizeof(struct in6_addr)];
+	const char *address = argv[2];
+
+	/* DCC SEND <filename> <address> <port> [<size> [<token>]], or DCC CHAT chat <address> <port> [<token>] */
+	if (nicklen >= sizeof(t->nick) || strlen(argv[1]) >= sizeof(t->filename) || strlen(address) >= sizeof(t->address)) {
+		return 0;
+	} else if (address[strspn(address, "0123456789")] && inet_pton(AF_INET, address, addrbuf) != 1 && inet_pton(AF_INET6, address, addrbuf) != 1) {
+		return 0;
+	} else if (!strtoul(argv[3], NULL, 10) && argc < (chat ? 5 : 6)) {
+		return 0; /* Passive offers need a token */
+	}
+
+	pthread_mutex_lock(&d->lock);
+	cb = d->offer_cb;
+	data = d->offer_data;
+	if (!cb) {
+		pthread_mutex_unlock(&d->lock);
+		return 0; /* The application will deal with it itself */
+	}
+	t = calloc(1, sizeof(*t));
+	if (!t) {
+		pthread_mutex_unlock(&d->lock);
+		irc_err("calloc failed\n");
+		return 0;
+	}
+	t->id = ++d->last_id;
+	t->loop = &d->loops[0]; /* Until it's accepted */
+	t->receiving = 1;
+	t->state = TRANSFER_INCOMING;
+	t->fd = t->sock = -1;
+	memcpy(t->nick, nick, nicklen);
+	t->nick[nicklen] = '\0';
+	strcpy(t->filename, argv[1]); /* Safe */
+	strcpy(t->address, address); /* Safe */
+	t->peerport = (unsigned int) strtoul(argv[3], NULL, 10);
+	if (chat) {
+		t->chat = 1;
+		t->token = argc >= 5 ? (unsigned int) strtoul(argv[4], NULL, 10) : 0;
+	} else {
+		t->size = argc >= 5 ? strtoull(argv[4], NULL, 10) : 0;
+		t->token = argc >= 6 ? (unsigned int) strtoul(argv[5], NULL, 10) : 0;
+	}
+	t->deadline = now_ms() + OFFER_TIMEOUT;
+	t->reported = now_ms();
+	t->next = d->transfers;
+	d->transfers = t;
+
+	offer.id = t->id;
+	offer.nick = t->nick;
+	offer.filename = t->filename;
+	offer.size = t->size;
+	offer.passive = !t->peerport;
+	offer.chat = t->chat;
+	pthread_mutex_unlock(&d->lock);
+
+	/* The strings stay valid during the callback, since this thread's transfers are only freed by this thread */
+	cb(data, &offer);
+	return 1;
+}
+
+int irc_client_dcc_offer_callback(struct irc_client *client, void (*cb)(void *data, const struct irc_dcc_offer *offer), void *data)
+{
+	struct dcc *d = dcc_get(client);
+
+	if (!d) {
+		return -1;
+	}
+	pthread_mutex_lock(&d->lock);
+	d->offer_cb = cb;
+	d->offer_data = data;
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+int irc_client_dcc_info(struct irc_client *client, unsigned int id, struct irc_dcc_info *info)
+{
+	struct dcc *d = client->dcc;
+	struct dcc_transfer *t;
+
+	if (!d) {
+		return -1;
+	}
+	pthread_mutex_lock(&d->lock);
+	for (t = d->transfers; t; t = t->next) {
+		if (t->id == id) { /* Including finished ones, which are still around during their callbacks */
+			strcpy(info->nick, t->nick); /* Safe */
+			strcpy(info->filename, t->filename); /* Safe */
+			info->size = t->size;
+			info->bytes = t->offset;
+			info->crc32 = t->crc;
+			info->receiving = t->receiving;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+	return t ? 0 : -1;
+}
+
+int irc_client_dcc_chat(struct irc_client *client, const char *nick, int passive)
+{
+	return transfer_offer(client, nick, NULL, passive, 0, -1);
+}
+
+int irc_client_dcc_chat_accept(struct irc_client *client, unsigned int id)
+{
+	struct dcc *d = client->dcc;
+	struct dcc_transfer *t;
+	int res = -1;
+
+	if (!d) {
+		return -1;
+	}
+	pthread_mutex_lock(&d->lock);
+	t = transfer_get(d, id);
+	if (t && t->state == TRANSFER_INCOMING && t->chat && !t->buf) {
+		res = chat_alloc(t);
+		if (!res && !t->pinned) {
+			t->loop = loop_pick(d, -1);
+		}
+	} else {
+		irc_err("No such DCC chat offer: %u\n", id);
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	if (!res && receive_start(client, d, id)) {
+		irc_client_dcc_cancel(client, id);
+		return -1;
+	}
+	return res;
+}
+
+int irc_client_dcc_chat_callback(struct irc_client *client, void (*cb)(void *data, unsigned int id, struct irc_msg *msg), void *data)
+{
+	struct dcc *d = dcc_get(client);
+
+	if (!d) {
+		return -1;
+	}
+	pthread_mutex_lock(&d->lock);
+	d->chat_cb = cb;
+	d->chat_data = data;
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+int irc_client_dcc_chat_send(struct irc_client *client, unsigned int id, const char *msg)
+{
+	struct dcc *d = client->dcc;
+	struct dcc_transfer *t;
+	size_t len = strlen(msg);
+	int res = -1;
+
+	if (strchr(msg, '\n')) {
+		irc_err("Chat messages must be a single line\n");
+		return -1;
+	} else if (!d) {
+		return -1;
+	}
+	pthread_mutex_lock(&d->lock);
+	t = transfer_get(d, id);
+	if (!t || !t->chat || !t->out || t->state == TRANSFER_DEAD) {
+		irc_err("No such DCC chat: %u\n", id);
+	} else if (t->outlen + len + 1 > CHAT_QUEUE_SIZE) {
+		irc_warn("DCC chat %u: too much queued already\n", id);
+	} else {
+		memcpy(t->out + t->outlen, msg, len);
+		t->outlen += len;
+		t->out[t->outlen++] = '\n';
+		res = 0;
+		if (t->state == TRANSFER_CHATTING && chat_flush(t)) {
+			/* The loop will find out it's broken on its own */
+			res = -1;
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+	return res;
+}
+
+/*! \brief CRC-32 of the first len bytes of a file */
+static int file_crc(int fd, uint64_t len, uint32_t *crc)
+{
+	unsigned char *buf = malloc(WRITE_BUFFER_SIZE);
+	uint64_t off = 0;
+
+	if (!buf) {
+		irc_err("malloc failed\n");
+		return -1;
+	}
+	*crc = 0;
+	while (off < len) {
+		ssize_t res = pread(fd, buf, len - off < WRITE_BUFFER_SIZE ? (size_t) (len - off) : WRITE_BUFFER_SIZE, (off_t) off);
+		if (res <= 0) {
+			irc_err("Failed to read partial file: %s\n", res ? strerror(errno) : "unexpected end of file");
+			free(buf);
+			return -1;
+		}
+		*crc = crc32_update(*crc, buf, (size_t) res);
+		off += (uint64_t) res;
+	}
+	free(buf);
+	return 0;
+}
+
+int irc_client_dcc_accept(struct irc_client *client, unsigned int id, const char *path, int flags)
+{
+	struct dcc *d = client->dcc;
+	struct dcc_transfer *t;
+	struct dcc_loop *loop;
+	struct stat st;
+	unsigned char *buf = NULL;
+	char nick[64], filename[256];
+	uint64_t size, position = 0;
+	uint32_t crc = 0;
+	unsigned int peerport, token;
+	int fd;
+
+	pthread_once(&crc_once, crc_init);
+	if (!d) {
+		return -1;
+	}
+	pthread_mutex_lock(&d->lock);
+	t = transfer_get(d, id);
+	if (!t || t->state != TRANSFER_INCOMING || t->chat) {
+		pthread_mutex_unlock(&d->lock);
+		irc_err("No such DCC offer: %u\n", id);
+		return -1;
+	}
+	size = t->size;
+	pthread_mutex_unlock(&d->lock);
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | (flags & IRC_DCC_RESUME ? 0 : O_TRUNC), 0644);
+	if (fd < 0) {
+		irc_err("Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (flags & IRC_DCC_RESUME) {
+		if (fstat(fd, &st)) {
+			irc_err("fstat failed: %s\n", strerror(errno));
+			goto cleanup;
+		}
+		if (size && (uint64_t) st.st_size >= size) {
+			/* Nothing to resume, or it's not the same file */
+			if (ftruncate(fd, 0)) {
+				irc_err("ftruncate failed: %s\n", strerror(errno));
+				goto cleanup;
+			}
+		} else if (st.st_size > 0) {
+			position = (uint64_t) st.st_size;
+			if (file_crc(fd, position, &crc)) {
+				goto cleanup;
+			}
+		}
+	}
+	/* Allocating up front avoids fragmentation, and running out of space is better found out now than halfway through.
+	 * The file size is left alone, so that if the transfer fails, it's still the amount received, for resuming. */
+	if (size > position && fallocate(fd, FALLOC_FL_KEEP_SIZE, (off_t) position, (off_t) (size - position)) && errno != EOPNOTSUPP && errno != ENOSYS) {
+		irc_err("Failed to allocate %llu bytes for %s: %s\n", (unsigned long long) (size - position), path, strerror(errno));
+		goto cleanup;
+	}
+	if (posix_memalign((void **) &buf, 4096, WRITE_BUFFER_SIZE)) {
+		irc_err("posix_memalign failed\n");
+		buf = NULL;
+		goto cleanup;
+	}
+
+	pthread_mutex_lock(&d->lock);
+	t = transfer_get(d, id);
+	if (!t || t->state != TRANSFER_INCOMING) {
+		pthread_mutex_unlock(&d->lock);
+		irc_err("DCC offer %u is gone\n", id); /* Timed out or cancelled meanwhile */
+		goto cleanup;
+	}
+	t->fd = fd;
+	t->buf = buf;
+	t->offset = t->written = position;
+	t->bufcap = WRITE_BUFFER_SIZE - position % WRITE_BUFFER_SIZE;
+	t->crc = crc;
+	t->ack64 = flags & IRC_DCC_ACK64 ? 1 : 0;
+	if (!t->pinned) {
+		t->loop = loop_pick(d, -1); /* Not in any epoll set yet, so it can still move */
+	}
+	loop = t->loop;
+	if (position) {
+		t->state = TRANSFER_RESUMING;
+		t->deadline = now_ms() + OFFER_TIMEOUT;
+	}
+	strcpy(nick, t->nick); /* Safe */
+	strcpy(filename, t->filename); /* Safe */
+	peerport = t->peerport;
+	token = t->token;
+	pthread_mutex_unlock(&d->lock);
+
+	if (position) {
+		char tokenbuf[16] = "";
+		if (!peerport) {
+			snprintf(tokenbuf, sizeof(tokenbuf), " %u", token);
+		}
+		if (irc_send(client, "PRIVMSG %s :" "\001" "DCC RESUME %s%s%s %u %llu%s" "\001", nick, QUOTE(filename), filename, QUOTE(filename),
+			peerport, (unsigned long long) position, tokenbuf)) {
+			irc_client_dcc_cancel(client, id);
+			return -1;
+		}
+		loop_wake(loop); /* It needs to know about the new timeout */
+	} else if (receive_start(client, d, id)) {
+		irc_client_dcc_cancel(client, id);
+		return -1;
+	}
+	return 0;
+
+cleanup:
+	close(fd);
+	free(buf);
+	return -1;
+}
+
+int dcc_process(struct irc_client *client, struct irc_msg *msg)
+{
+	struct dcc *d = client->dcc;
+	struct dcc_transfer *t;
+	struct irc_ctcp ctcp;
+	struct dcc_notes n;
+	struct dcc_loop *ended = NULL;
+	const char *s = msg->body;
+	char args[512], *argv[7];
+	size_t nicklen;
+	unsigned int port, token;
+	int argc, handled = 0;
+
+	if (!msg->prefix || !msg->body || !irc_ctcp_next(&s, &ctcp) || ctcp.type != CTCP_DCC || !ctcp.args) {
+		return 0;
+	}
+	if (irc_ctcp_unquote(ctcp.args, ctcp.argslen, args, sizeof(args)) < 0) {
+		return 0;
+	}
+	argc = dcc_split(args, argv, 7);
+	nicklen = strcspn(msg->prefix, "!@");
+	n.count = 0;
+
+	if (argc >= 4 && !strcasecmp(argv[0], "RESUME")) {
+		/* DCC RESUME <filename> <port> <position> [<token>] */
+		uint64_t position = strtoull(argv[3], NULL, 10);
+		port = (unsigned int) strtoul(argv[2], NULL, 10);
+		token = argc >= 5 ? (unsigned int) strtoul(argv[4], NULL, 10) : 0;
+		pthread_mutex_lock(&d->lock);
+		t = transfer_find(client, d, TRANSFER_OFFERED, 0, 0, msg->prefix, nicklen, port, token);
+		if (t && position <= t->size) {
+			t->offset = position;
+			handled = 1;
+		}
+		pthread_mutex_unlock(&d->lock);
+		if (handled) {
+			/* Echo back their filename, since that's what they'll be matching on */
+			if (irc_send(client, "PRIVMSG %.*s :" "\001" "DCC ACCEPT %s%s%s %s %s%s%s" "\001", (int) nicklen, msg->prefix,
+				QUOTE(argv[1]), argv[1], QUOTE(argv[1]), argv[2], argv[3], argc >= 5 ? " " : "", argc >= 5 ? argv[4] : "")) {
+				irc_warn("Failed to accept DCC resume\n");
+			}
+		}
+	} else if (argc >= 6 && !strcasecmp(argv[0], "SEND")) {
+		/* A reply to a passive offer: DCC SEND <filename> <address> <port> <size> <token> */
+		port = (unsigned int) strtoul(argv[3], NULL, 10);
+		token = (unsigned int) strtoul(argv[5], NULL, 10);
+		pthread_mutex_lock(&d->lock);
+		t = port ? transfer_find(client, d, TRANSFER_OFFERED, 0, 0, msg->prefix, nicklen, 0, token) : NULL;
+		if (t) {
+			handled = 1;
+			ended = passive_connect(t, argv[2], port, &n);
+		}
+		pthread_mutex_unlock(&d->lock);
+		if (!handled) {
+			handled = offer_incoming(d, msg->prefix, nicklen, 0, argc, argv);
+		}
+	} else if (argc >= 4 && !strcasecmp(argv[0], "SEND")) {
+		/* DCC SEND <filename> <address> <port>, from a client too old to include the size */
+		handled = offer_incoming(d, msg->prefix, nicklen, 0, argc, argv);
+	} else if (argc >= 4 && !strcasecmp(argv[0], "CHAT")) {
+		/* A reply to a passive chat offer: DCC CHAT chat <address> <port> <token>, or else an offer */
+		port = (unsigned int) strtoul(argv[3], NULL, 10);
+		token = argc >= 5 ? (unsigned int) strtoul(argv[4], NULL, 10) : 0;
+		pthread_mutex_lock(&d->lock);
+		t = port && token ? transfer_find(client, d, TRANSFER_OFFERED, 0, 1, msg->prefix, nicklen, 0, token) : NULL;
+		if (t) {
+			handled = 1;
+			ended = passive_connect(t, argv[2], port, &n);
+		}
+		pthread_mutex_unlock(&d->lock);
+		if (!handled) {
+			handled = offer_incoming(d, msg->prefix, nicklen, 1, argc, argv);
+		}
+	} else if (argc >= 4 && !strcasecmp(argv[0], "ACCEPT")) {
+		/* The sender accepted our resume request: DCC ACCEPT <filename> <port> <position> [<token>] */
+		uint64_t position = strtoull(argv[3], NULL, 10);
+		unsigned int id = 0;
+		port = (unsigned int) strtoul(argv[2], NULL, 10);
+		token = argc >= 5 ? (unsigned int) strtoul(argv[4], NULL, 10) : 0;
+		pthread_mutex_lock(&d->lock);
+		t = transfer_find(client, d, TRANSFER_RESUMING, 1, 0, msg->prefix, nicklen, port, token);
+		if (t) {
+			handled = 1;
+			id = t->id;
+			if (position != t->offset) {
+				irc_warn("DCC transfer %u: sender resumed at %llu, not %llu\n", t->id, (unsigned long long) position, (unsigned long long) t->offset);
+				ended = t->loop;
+				transfer_finish(t, IRC_DCC_FAILED, &n);
+				id = 0;
+			}
+		}
+		pthread_mutex_unlock(&d->lock);
+		if (id && receive_start(client, d, id)) {
+			pthread_mutex_lock(&d->lock);
+			t = transfer_get(d, id);
+			if (t) {
+				ended = t->loop;
+				transfer_finish(t, IRC_DCC_FAILED, &n);
+			}
+			pthread_mutex_unlock(&d->lock);
+		}
+	}
+
+	notes_deliver(d, &n);
+	if (ended) {
+		loop_wake(ended); /* So it gets freed */
+	}
+	return handled;
+}
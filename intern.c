@@ -0,0 +1,300 @@
+/*
+ * LIRC - IRC Client Library for C
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This library is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief String interning pool for nicknames, hostmasks, and channel names
+ *
+ * \note Strings are stored once per pool, in bump-allocated chunks.
+ *       Each string is preceded by a small header with its casemapped hash
+ *       and a reference count. When the last reference is released, the
+ *       space goes onto a free list for its size class, to be reused
+ *       by the next string of a similar size. Chunks themselves are only
+ *       freed when the pool is destroyed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "irc_internal.h"
+
+struct intern_entry {
+	struct intern_entry *next;		/*!< Next entry in hash chain, or in free list */
+	uint64_t hash;					/*!< Casemapped hash of str */
+	unsigned int refs;				/*!< Number of references */
+	unsigned int len;				/*!< Length of str */
+	unsigned short size_class;		/*!< Size class, or LARGE_CLASS if allocated separately */
+	char str[];
+};
+
+#define CHUNK_SIZE 16384
+#define CLASS_GRANULARITY 16
+#define NUM_CLASSES 32				/* Entries of up to 512 bytes come from chunks */
+#define LARGE_CLASS NUM_CLASSES
+#define INITIAL_BUCKETS 64
+
+struct intern_chunk {
+	struct intern_chunk *next;
+	size_t used;
+	char data[] __attribute__ ((aligned (16)));
+};
+
+struct irc_intern_pool {
+	pthread_mutex_t lock;
+	enum irc_casemapping casemapping;
+	unsigned int refs;				/*!< Number of owners (applications and clients) */
+	struct intern_entry **buckets;
+	size_t size;					/*!< Number of buckets (power of 2) */
+	size_t count;					/*!< Number of strings */
+	struct intern_chunk *chunks;	/*!< Current chunk first */
+	struct intern_entry *free[NUM_CLASSES];	/*!< Free list for each size class */
+};
+
+#define ENTRY(s) ((struct intern_entry *) (void *) ((char *) (s) - offsetof(struct intern_entry, str)))
+
+struct irc_intern_pool *irc_intern_pool_new(enum irc_casemapping casemapping)
+{
+	struct irc_intern_pool *pool = calloc(1, sizeof(*pool));
+
+	if (!pool) {
+		irc_err("calloc failed\n");
+		return NULL;
+	}
+	pool->buckets = calloc(INITIAL_BUCKETS, sizeof(*pool->buckets));
+	if (!pool->buckets) {
+		irc_err("calloc failed\n");
+		free(pool);
+		return NULL;
+	}
+	pool->size = INITIAL_BUCKETS;
+	pool->casemapping = casemapping;
+	pool->refs = 1;
+	pthread_mutex_init(&pool->lock, NULL);
+	return pool;
+}
+
+void irc_intern_pool_ref(struct irc_intern_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->refs++;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void irc_intern_pool_unref(struct irc_intern_pool *pool)
+{
+	struct intern_chunk *chunk;
+	size_t i;
+	unsigned int refs;
+
+	pthread_mutex_lock(&pool->lock);
+	refs = --pool->refs;
+	pthread_mutex_unlock(&pool->lock);
+	if (refs) {
+		return;
+	}
+
+	/* Chunk entries are freed with their chunks, but large entries were allocated individually */
+	for (i = 0; i < pool->size; i++) {
+		struct intern_entry *e, *next;
+		for (e = pool->buckets[i]; e; e = next) {
+			next = e->next;
+			if (e->size_class == LARGE_CLASS) {
+				free(e);
+			}
+		}
+	}
+	while ((chunk = pool->chunks)) {
+		pool->chunks = chunk->next;
+		free(chunk);
+	}
+	free(pool->buckets);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+enum irc_casemapping irc_intern_pool_casemapping(struct irc_intern_pool *pool)
+{
+	return pool->casemapping;
+}
+
+size_t irc_intern_pool_count(struct irc_intern_pool *pool)
+{
+	size_t count;
+
+	pthread_mutex_lock(&pool->lock);
+	count = pool->count;
+	pthread_mutex_unlock(&pool->lock);
+	return count;
+}
+
+/*! \brief Allocate space for an entry. Must be called with the pool locked. */
+static struct intern_entry *entry_alloc(struct irc_intern_pool *pool, size_t len)
+{
+	size_t size = sizeof(struct intern_entry) + len + 1;
+	size_t sclass = (size + CLASS_GRANULARITY - 1) / CLASS_GRANULARITY - 1;
+	struct intern_entry *e;
+	struct intern_chunk *chunk;
+
+	if (sclass >= NUM_CLASSES) {
+		e = malloc(size);
+		if (e) {
+			e->size_class = LARGE_CLASS;
+		}
+		return e;
+	}
+
+	e = pool->free[sclass];
+	if (e) {
+		pool->free[sclass] = e->next;
+		return e;
+	}
+
+	size = (sclass + 1) * CLASS_GRANULARITY;
+	chunk = pool->chunks;
+	if (!chunk || chunk->used + size > CHUNK_SIZE) {
+		chunk = malloc(sizeof(*chunk) + CHUNK_SIZE);
+		if (!chunk) {
+			return NULL;
+		}
+		chunk->used = 0;
+		chunk->next = pool->chunks;
+		pool->chunks = chunk;
+	}
+	e = (struct intern_entry *) (void *) (chunk->data + chunk->used);
+	chunk->used += size;
+	e->size_class = (unsigned short) sclass;
+	return e;
+}
+
+static void grow(struct irc_intern_pool *pool)
+{
+	size_t i, newsize = pool->size * 2;
+	struct intern_entry **buckets = calloc(newsize, sizeof(*buckets));
+
+	if (!buckets) {
+		return; /* Chains just get longer */
+	}
+	for (i = 0; i < pool->size; i++) {
+		struct intern_entry *e, *next;
+		for (e = pool->buckets[i]; e; e = next) {
+			next = e->next;
+			e->next = buckets[e->hash & (newsize - 1)];
+			buckets[e->hash & (newsize - 1)] = e;
+		}
+	}
+	free(pool->buckets);
+	pool->buckets = buckets;
+	pool->size = newsize;
+}
+
+const char *irc_intern(struct irc_intern_pool *pool, const char *s, size_t len)
+{
+	uint64_t hash = irc_casemap_hash(pool->casemapping, s, len);
+	struct intern_entry *e;
+	size_t b;
+
+	pthread_mutex_lock(&pool->lock);
+	/* Strings differing only in case hash to the same chain, but are distinct entries */
+	b = hash & (pool->size - 1);
+	for (e = pool->buckets[b]; e; e = e->next) {
+		if (e->hash == hash && e->len == len && !memcmp(e->str, s, len)) {
+			e->refs++;
+			pthread_mutex_unlock(&pool->lock);
+			return e->str;
+		}
+	}
+
+	e = entry_alloc(pool, len);
+	if (!e) {
+		pthread_mutex_unlock(&pool->lock);
+		irc_err("Failed to allocate memory\n");
+		return NULL;
+	}
+	e->hash = hash;
+	e->refs = 1;
+	e->len = (unsigned int) len;
+	memcpy(e->str, s, len);
+	e->str[len] = '\0';
+	e->next = pool->buckets[b];
+	pool->buckets[b] = e;
+	if (++pool->count > pool->size) {
+		grow(pool);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return e->str;
+}
+
+const char *irc_intern_str(struct irc_intern_pool *pool, const char *s)
+{
+	return irc_intern(pool, s, strlen(s));
+}
+
+const char *irc_intern_ref(struct irc_intern_pool *pool, const char *handle)
+{
+	pthread_mutex_lock(&pool->lock);
+	ENTRY(handle)->refs++;
+	pthread_mutex_unlock(&pool->lock);
+	return handle;
+}
+
+void irc_intern_release(struct irc_intern_pool *pool, const char *handle)
+{
+	struct intern_entry *e, **prev;
+
+	if (!handle) {
+		return;
+	}
+	e = ENTRY(handle);
+	pthread_mutex_lock(&pool->lock);
+	if (--e->refs) {
+		pthread_mutex_unlock(&pool->lock);
+		return;
+	}
+	for (prev = &pool->buckets[e->hash & (pool->size - 1)]; *prev; prev = &(*prev)->next) {
+		if (*prev == e) {
+			*prev = e->next;
+			break;
+		}
+	}
+	pool->count--;
+	if (e->size_class == LARGE_CLASS) {
+		free(e);
+	} else {
+		e->next = pool->free[e->size_class];
+		pool->free[e->size_class] = e;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+uint64_t irc_intern_hash(const char *handle)
+{
+	return ENTRY(handle)->hash;
+}
+
+size_t irc_intern_len(const char *handle)
+{
+	return ENTRY(handle)->len;
+}
+
+int irc_intern_caseeq(struct irc_intern_pool *pool, const char *a, const char *b)
+{
+	const struct intern_entry *x, *y;
+
+	if (a == b) {
+		return 1;
+	}
+	x = ENTRY(a);
+	y = ENTRY(b);
+	return x->hash == y->hash && x->len == y->len && irc_casemap_memeq(pool->casemapping, a, b, x->len);
+}
@@ -26,19 +26,21 @@
 #include <ctype.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <poll.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h> /* use sockaddr_in */
 #include <netdb.h>
 #include <arpa/inet.h>
 
-/* Compile the library with TLS support, using OpenSSL */
-#define HAVE_OPENSSL
+#include "irc_internal.h"
+#include "numerics.h"
 
 #ifdef HAVE_OPENSSL
 #include <openssl/bio.h>
-#include <openssl/ssl.h>
 #include <openssl/err.h>
 
 #ifndef ROOT_CERT_PATH
@@ -49,33 +51,6 @@
 
 #include <assert.h>
 
-#define EXPOSE_IRC_MSG
-
-#include "irc.h"
-
-/*! \brief A client for one IRC server. Use multiple clients for multiple servers or for multiple clients on the same server */
-struct irc_client {
-	int sfd;						/*!< Client socket file descriptor */
-#ifdef HAVE_OPENSSL
-	SSL*     ssl;
-	SSL_CTX* ctx;
-#endif
-	const char *hostname;			/*!< IRC server hostname */
-	unsigned int port;				/*!< IRC server port */
-	const char *username;			/*!< IRC client username */
-	const char *password;			/*!< IRC client password */
-	char *nickname;					/*!< IRC client nickname */
-	char *autojoin;					/*!< Comma-separated list of channels to autojoin */
-	/* Flags */
-	unsigned int tls:1;				/*!< Whether to use TLS */
-	unsigned int tlsverify:1;		/*!< Whether to verify the server */
-	unsigned int sasl:1;			/*!< Whether to use SASL authentication */
-	/* Internal */
-	unsigned int active:1;			/*!< Whether client is currently actively connected to a server */
-	/* Flexible Struct Member */
-	char data[];
-};
-
 static void (*log_callback)(enum irc_log_level level, int sublevel, const char *file, int line, const char *func, const char *msg) = NULL;
 
 void irc_log_callback(void (*callback)(enum irc_log_level level, int sublevel, const char *file, int line, const char *func, const char *msg))
@@ -83,12 +58,7 @@ void irc_log_callback(void (*callback)(enum irc_log_level level, int sublevel, c
 	log_callback = callback;
 }
 
-#define irc_err(fmt, ...) __irc_log(IRC_LOG_ERR, 0, __FILE__, __LINE__, __FUNCTION__, fmt, ## __VA_ARGS__)
-#define irc_warn(fmt, ...) __irc_log(IRC_LOG_WARN, 0, __FILE__, __LINE__, __FUNCTION__, fmt, ## __VA_ARGS__)
-#define irc_info(fmt, ...) __irc_log(IRC_LOG_INFO, 0, __FILE__, __LINE__, __FUNCTION__, fmt, ## __VA_ARGS__)
-#define irc_debug(level, fmt, ...) __irc_log(IRC_LOG_DEBUG, level, __FILE__, __LINE__, __FUNCTION__, fmt, ## __VA_ARGS__)
-
-static void __attribute__ ((format (printf, 6, 7))) __irc_log(enum irc_log_level level, int sublevel, const char *file, int line, const char *func, const char *fmt, ...)
+void __attribute__ ((format (printf, 6, 7))) __irc_log(enum irc_log_level level, int sublevel, const char *file, int line, const char *func, const char *fmt, ...)
 {
 	char *buf = NULL;
 	int len = 0;
@@ -110,6 +80,9 @@ static void __attribute__ ((format (printf, 6, 7))) __irc_log(enum irc_log_level
 	free(buf);
 }
 
+static void isupport_init(struct irc_client *client);
+static void isupport_destroy(struct irc_client *client);
+
 struct irc_client *irc_client_new(const char *hostname, unsigned int port, const char *username, const char *password)
 {
 	struct irc_client *client;
@@ -139,6 +112,20 @@ struct irc_client *irc_client_new(const char *hostname, unsigned int port, const
 
 	client->port = port;
 	client->sfd = -1;
+	isupport_init(client); /* Until the server tells us otherwise, assume the defaults */
+	client->mode_window = MODE_WINDOW_DEFAULT;
+	pthread_mutex_init(&client->lock, NULL);
+	pthread_mutex_init(&client->sendlock, NULL);
+
+	if (pipe(client->wakefd)) {
+		irc_err("pipe failed: %s\n", strerror(errno));
+		pthread_mutex_destroy(&client->lock);
+		pthread_mutex_destroy(&client->sendlock);
+		free(client);
+		return NULL;
+	}
+	fcntl(client->wakefd[0], F_SETFL, O_NONBLOCK);
+	fcntl(client->wakefd[1], F_SETFL, O_NONBLOCK);
 
 	client->hostname = client->data;
 	strcpy(client->data, hostname); /* Safe */
@@ -147,13 +134,37 @@ struct irc_client *irc_client_new(const char *hostname, unsigned int port, const
 	client->password = client->hostname + hostlen + userlen + 2;
 	strcpy(client->data + hostlen + 1 + userlen + 1, password); /* Safe */
 
-	client->nickname = strdup(client->username); /* Default nick to username */
+	client->pool = irc_intern_pool_new(IRC_CASEMAPPING_RFC1459);
+	if (!client->pool) {
+		close(client->wakefd[0]);
+		close(client->wakefd[1]);
+		pthread_mutex_destroy(&client->lock);
+		pthread_mutex_destroy(&client->sendlock);
+		free(client);
+		return NULL;
+	}
+	client->nickname = irc_intern_str(client->pool, client->username); /* Default nick to username */
 
 	return client;
 }
 
+static void mode_queue_free(struct mode_queue *q)
+{
+	size_t i;
+
+	for (i = 0; i < q->len; i++) {
+		free(q->changes[i].arg);
+	}
+	free(q->changes);
+	free(q->channel);
+	free(q);
+}
+
 void irc_client_destroy(struct irc_client *client)
 {
+	int i;
+	struct mode_queue *q;
+
 #ifdef HAVE_OPENSSL
 	if (client->ssl) {
 		SSL_shutdown(client->ssl);
@@ -172,9 +183,33 @@ void irc_client_destroy(struct irc_client *client)
 	if (client->autojoin) { /* If we added an autojoin but never actually authenticated, then this will still be set */
 		free(client->autojoin);
 	}
-	if (client->nickname) {
-		free(client->nickname);
-	}
+	irc_intern_release(client->pool, client->nickname);
+	for (i = 0; i < FANOUT_TARGETS; i++) {
+		free(client->fanout[i].name);
+	}
+	while ((q = client->modeq)) {
+		client->modeq = q->next;
+		mode_queue_free(q);
+	}
+	dcc_destroy(client); /* First, since its worker threads may still wake up irc_loop */
+	close(client->wakefd[0]);
+	close(client->wakefd[1]);
+	if (client->state) {
+		state_destroy(client->state);
+	}
+	list_destroy(client);
+	who_destroy(client);
+	netsplit_destroy(client);
+	batch_destroy(client);
+	chathistory_destroy(client);
+	latency_destroy(client);
+	protolog_destroy(client);
+	ctcp_destroy(client);
+	ctcp_responder_destroy(client);
+	isupport_destroy(client);
+	irc_intern_pool_unref(client->pool);
+	pthread_mutex_destroy(&client->lock);
+	pthread_mutex_destroy(&client->sendlock);
 	free(client);
 }
 
@@ -373,6 +408,7 @@ int irc_client_connect(struct irc_client *client)
 #endif
 
 	client->active = 1;
+	client->caps = 0; /* Capabilities are negotiated anew for each connection */
 	return 0;
 
 sslcleanup:
@@ -386,16 +422,114 @@ sslcleanup:
 	return -1;
 }
 
+long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void irc_loop_wake(struct irc_client *client)
+{
+	ssize_t res = write(client->wakefd[1], "", 1);
+	(void) res; /* If the pipe is full, the loop is going to wake up anyways */
+}
+
+int irc_loop_running(struct irc_client *client)
+{
+	return __atomic_load_n(&client->looping, __ATOMIC_ACQUIRE);
+}
+
+static int mode_flush_due(struct irc_client *client, long long now);
+
+/*! \brief Number of ms until irc_loop next needs to do something other than read, -1 if nothing is pending */
+static int irc_loop_timeout(struct irc_client *client)
+{
+	long long next = -1, now;
+	struct mode_queue *q;
+
+	pthread_mutex_lock(&client->lock);
+	for (q = client->modeq; q; q = q->next) {
+		if (next == -1 || q->deadline < next) {
+			next = q->deadline;
+		}
+	}
+	pthread_mutex_unlock(&client->lock);
+
+	if (client->netsplit) {
+		long long deadline = netsplit_deadline(client);
+		if (deadline != -1 && (next == -1 || deadline < next)) {
+			next = deadline;
+		}
+	}
+	if (client->history) {
+		long long deadline = chathistory_deadline(client);
+		if (deadline != -1 && (next == -1 || deadline < next)) {
+			next = deadline;
+		}
+	}
+	if (client->pings) {
+		long long deadline = ctcp_ping_deadline(client);
+		if (deadline != -1 && (next == -1 || deadline < next)) {
+			next = deadline;
+		}
+	}
+	if (client->dcc) {
+		long long deadline = dcc_deadline(client);
+		if (deadline != -1 && (next == -1 || deadline < next)) {
+			next = deadline;
+		}
+	}
+	if (next == -1) {
+		return -1;
+	}
+	now = now_ms();
+	return next <= now ? 0 : (int) (next - now);
+}
+
+/*! \brief Run anything in irc_loop that is due */
+static void irc_loop_timers(struct irc_client *client)
+{
+	char buf[32];
+
+	while (read(client->wakefd[0], buf, sizeof(buf)) > 0); /* Drain wakeups */
+	mode_flush_due(client, now_ms());
+	if (client->netsplit) {
+		netsplit_flush_due(client, now_ms());
+	}
+	if (client->history) {
+		chathistory_flush_due(client, now_ms());
+	}
+	if (client->pings) {
+		ctcp_ping_flush_due(client, now_ms());
+	}
+	if (client->dcc) {
+		dcc_run(client);
+	}
+}
+
 void irc_loop(struct irc_client *client, FILE *logfile, void (*cb)(void *data, struct irc_msg *msg), void *data)
 {
 	ssize_t res = 0;
-	char readbuf[IRC_MAX_MSG_LEN + 1];
+	char readbuf[IRC_MAX_TAGS_LEN + IRC_MAX_MSG_LEN + 1];
 	struct irc_msg msg;
+	struct protolog *log;
+	struct irc_json *json;
 	char *prevbuf, *mybuf = readbuf;
 	size_t prevlen, mylen = sizeof(readbuf) - 1;
 	char *start, *eom;
 	int rounds;
 
+	__atomic_store_n(&client->looping, 1, __ATOMIC_RELEASE);
 	start = readbuf;
 	for (;;) {
 begin:
@@ -423,9 +557,14 @@ begin:
 		if (res != sizeof(readbuf) - 1) {
 			/* XXX We don't poll if we read() into an entirely full buffer and there's still more data to read.
 			 * poll() won't return until there's even more data (but it feels like it should). */
-			res = irc_poll(client, -1, -1);
-			if (res <= 0) {
+			/* If DCC is in use, its epoll fd includes the wakeup pipe */
+			res = irc_poll(client, irc_loop_timeout(client), client->dcc ? dcc_fd(client) : client->wakefd[0]);
+			if (res < 0) {
 				break;
+			} else if (res != 1) {
+				/* Timer expired, or another thread gave us something to do */
+				irc_loop_timers(client);
+				continue;
 			}
 		}
 		prevbuf = mybuf;
@@ -437,7 +576,7 @@ begin:
 
 		mybuf[res] = '\0'; /* Safe */
 		do {
-			eom = strstr(mybuf, "\r\n");
+			eom = strstr(start, "\r\n"); /* Not mybuf, in case the CR was at the end of the previous read */
 			if (!eom) {
 				/* read returned incomplete message */
 				mybuf = prevbuf + res;
@@ -451,10 +590,20 @@ begin:
 			}
 
 			memset(&msg, 0, sizeof(msg));
+			log = __atomic_load_n(&client->protolog, __ATOMIC_ACQUIRE);
+			if (log) {
+				protolog_line(log, start, (size_t) (eom - start)); /* Written out by another thread */
+			}
+			json = __atomic_load_n(&client->json, __ATOMIC_ACQUIRE);
+			if (json) {
+				struct timespec ts;
+				clock_gettime(CLOCK_REALTIME, &ts);
+				irc_json_line(json, start, (size_t) (eom - start), (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+			}
 			if (logfile) {
 				fprintf(logfile, "%s\n", start); /* Append to log file */
 			}
-			if (!irc_parse_msg(&msg, start) && !irc_parse_msg_type(&msg)) {
+			if (!irc_parse_msg(&msg, start) && !irc_parse_msg_type(&msg) && !irc_client_process(client, &msg)) {
 				cb(data, &msg);
 			}
 
@@ -463,9 +612,22 @@ begin:
 			rounds++;
 		} while (mybuf && *mybuf);
 
+		json = __atomic_load_n(&client->json, __ATOMIC_ACQUIRE);
+		if (json && irc_json_flush(json)) {
+			irc_warn("Failed to write JSON export\n"); /* Once per read, not for every line in it */
+		}
+
+		if (!irc_loop_timeout(client)) {
+			/* If the server never goes quiet, poll never times out, so check here too */
+			irc_loop_timers(client);
+		} else if (client->dcc) {
+			dcc_run(client); /* Likewise, poll favors the server, so don't let it starve transfers */
+		}
+
 		start = mybuf = readbuf; /* Reset to beginning */
 		mylen = sizeof(readbuf) - 1;
 	}
+	__atomic_store_n(&client->looping, 0, __ATOMIC_RELEASE);
 }
 
 int irc_disconnect(struct irc_client *client)
@@ -498,6 +660,7 @@ int irc_poll(struct irc_client *client, int ms, int fd)
 			}
 			irc_err("poll returned error: %s\n", strerror(errno));
 			client->active = 0;
+			return -1;
 		}
 		if (pfds[0].revents & POLLIN) {
 			return 1;
@@ -549,6 +712,8 @@ ssize_t irc_write(struct irc_client *client, const char *buf, size_t len)
 		return -1;
 	}
 
+	/* irc_loop's thread sends too (mode flushes, CTCP replies, DCC), so hold the lock until the whole line is out */
+	pthread_mutex_lock(&client->sendlock);
 	while (len > 0) {
 		ssize_t res;
 #ifdef HAVE_OPENSSL
@@ -567,6 +732,7 @@ ssize_t irc_write(struct irc_client *client, const char *buf, size_t len)
 		len -= res;
 		written += res;
 	}
+	pthread_mutex_unlock(&client->sendlock);
 	if (written <= 0 || written != origlen) {
 		irc_debug(1, "write returned %ld\n", written);
 	}
@@ -595,8 +761,15 @@ ssize_t __attribute__ ((format (printf, 2, 3))) irc_write_fmt(struct irc_client
 	len = vsnprintf(buf, sizeof(buf), fmt, ap);
 	va_end(ap);
 
-	if (len >= (int) sizeof(buf)) {
+	if (len < 0) {
+		irc_err("Failed to format command\n");
+		return -1;
+	} else if (len >= (int) sizeof(buf)) {
 		irc_warn("Truncation occured trying to send %d-byte command\n", len);
+		/* Send what fit, still ending in CR LF, and nothing past the end of buf */
+		len = (int) sizeof(buf) - 1;
+		buf[len - 2] = '\r';
+		buf[len - 1] = '\n';
 	}
 
 	res = irc_write(client, buf, (size_t) len);
@@ -646,6 +819,52 @@ static char *base64_encode(const char *data, int input_length, int *outlen)
     return encoded_data;
 }
 
+/*! \brief Whether any optional capabilities are needed */
+#define WANT_CAPS(client) (client->batch || client->history || client->latency)
+
+/*!
+ * \brief Request the optional capabilities needed by the features in use
+ * \note Each is requested by itself, since a request is refused entirely if any capability in it isn't supported
+ */
+static int cap_request(struct irc_client *client)
+{
+	int res = 0;
+
+	if (client->batch || client->history || client->latency) {
+		res |= IRC_SEND_FIXED(client, "CAP REQ :batch") <= 0;
+	}
+	if (client->history) {
+		res |= IRC_SEND_FIXED(client, "CAP REQ :message-tags") <= 0;
+		res |= IRC_SEND_FIXED(client, "CAP REQ :server-time") <= 0;
+		res |= IRC_SEND_FIXED(client, "CAP REQ :draft/chathistory") <= 0;
+	}
+	if (client->latency) {
+		res |= IRC_SEND_FIXED(client, "CAP REQ :echo-message") <= 0;
+		res |= IRC_SEND_FIXED(client, "CAP REQ :labeled-response") <= 0;
+	}
+	return res;
+}
+
+/*! \brief Note which capabilities the server acknowledged, from the body of a CAP ACK */
+static void cap_ack(struct irc_client *client, const char *s, size_t len)
+{
+	while (len) {
+		size_t caplen;
+		while (len && *s == ' ') {
+			s++;
+			len--;
+		}
+		for (caplen = 0; caplen < len && s[caplen] != ' '; caplen++);
+		if (caplen == 12 && !strncmp(s, "echo-message", caplen)) {
+			client->caps |= CAP_ECHO_MESSAGE;
+		} else if (caplen == 16 && !strncmp(s, "labeled-response", caplen)) {
+			client->caps |= CAP_LABELED_RESPONSE;
+		}
+		s += caplen;
+		len -= caplen;
+	}
+}
+
 int irc_client_auth(struct irc_client *client, const char *username, const char *password, const char *realname)
 {
 	int res = 0;
@@ -655,6 +874,12 @@ int irc_client_auth(struct irc_client *client, const char *username, const char
 		return -1;
 	}
 
+	/* Capabilities requested here hold up registration until CAP END, so they're in effect from the start.
+	 * During SASL authentication, negotiation is already in progress and is ended once authenticated. */
+	if (WANT_CAPS(client) && !client->capneg) {
+		res |= cap_request(client);
+	}
+
 	/* PASS must be sent before both USER and JOIN, if it exists */
 	if (password && *password) {
 		res |= irc_send(client, "PASS %s", password); /* Password, if applicable (not actually used all that much) */
@@ -663,6 +888,9 @@ int irc_client_auth(struct irc_client *client, const char *username, const char
 	/* Confused about the difference between the two? See https://stackoverflow.com/questions/31666247/ */
 	res |= irc_send(client, "NICK %s", username); /* Actual IRC nickname */
 	res |= irc_send(client, "USER %s 0 * :%s", username, realname ? realname : username); /* User part of hostmask, mode, unused, real name for WHOIS */
+	if (WANT_CAPS(client) && !client->capneg) {
+		res |= IRC_SEND_FIXED(client, "CAP END") <= 0;
+	}
 
 	/* If we didn't already have a nickname set, set it now. */
 	if (!*client->nickname) {
@@ -708,6 +936,14 @@ static int wait_for_response(struct irc_client *client, char *buf, size_t len, i
 		/* NUL terminate so we can use strstr */
 		buf[bytes] = '\0'; /* Safe */
 		printf("%s", buf); /* Print out whatever we received */
+		if (WANT_CAPS(client)) {
+			/* Replies to capability requests may arrive while waiting for something else */
+			const char *ack = buf;
+			while ((ack = strstr(ack, " ACK :"))) {
+				ack += strlen(" ACK :");
+				cap_ack(client, ack, strcspn(ack, "\r\n"));
+			}
+		}
 		if (strstr(buf, s)) {
 			return 0;
 		}
@@ -726,7 +962,10 @@ static int do_sasl_auth(struct irc_client *client)
 	 * https://ircv3.net/specs/extensions/sasl-3.1.html */
 
 	IRC_SEND_FIXED(client, "CAP LS 302"); /* Begin capability negotiation */
-	if (irc_client_auth(client, client->username, NULL, NULL)) { /* Immediately send NICK and USER (but not PASS) */
+	client->capneg = 1;
+	res = irc_client_auth(client, client->username, NULL, NULL); /* Immediately send NICK and USER (but not PASS) */
+	client->capneg = 0;
+	if (res) {
 		return -1;
 	}
 	if (wait_for_response(client, readbuf, sizeof(readbuf), 10000, "CAP * LS")) { /* Wait for CAP * LS response */
@@ -744,6 +983,10 @@ static int do_sasl_auth(struct irc_client *client)
 	if (wait_for_response(client, readbuf, sizeof(readbuf), 5000, "ACK")) { /* ACK :multi-prefix sasl */
 		return -1;
 	}
+	if (WANT_CAPS(client)) {
+		/* Requested separately, so that SASL doesn't fail if the server doesn't support these */
+		cap_request(client);
+	}
 	IRC_SEND_FIXED(client, "AUTHENTICATE PLAIN"); /* This is secure if the connection is using TLS */
 
 	if (wait_for_response(client, readbuf, sizeof(readbuf), 5000, "AUTHENTICATE +")) { /* Expect: AUTHENTICATE + */
@@ -817,8 +1060,8 @@ int irc_client_login(struct irc_client *client)
 	return 0;
 }
 
-/* A valid channel name starts with a symbol, not directly with an alphanumeric character */
-#define VALID_CHANNEL_NAME(c) (!isalnum(*c))
+/* A valid channel name starts with one of the channel types advertised by the server */
+#define VALID_CHANNEL_NAME(c) (irc_client_is_channel(client, c))
 
 int irc_client_channel_join(struct irc_client *client, const char *channel)
 {
@@ -828,7 +1071,7 @@ int irc_client_channel_join(struct irc_client *client, const char *channel)
 	}
 
 	if (!VALID_CHANNEL_NAME(channel)) {
-		irc_err("Channel name '%s' is invalid, must begin with a symbol\n", channel);
+		irc_err("Channel name '%s' is invalid, must begin with one of '%s'\n", channel, client->isupport.values[IRC_ISUPPORT_CHANTYPES] ? client->isupport.values[IRC_ISUPPORT_CHANTYPES] : "#&");
 		return -1;
 	}
 
@@ -843,7 +1086,7 @@ int irc_client_channel_leave(struct irc_client *client, const char *channel)
 	}
 
 	if (!VALID_CHANNEL_NAME(channel)) {
-		irc_err("Channel name '%s' is invalid, must begin with a symbol\n", channel);
+		irc_err("Channel name '%s' is invalid, must begin with one of '%s'\n", channel, client->isupport.values[IRC_ISUPPORT_CHANTYPES] ? client->isupport.values[IRC_ISUPPORT_CHANTYPES] : "#&");
 		return -1;
 	}
 
@@ -860,60 +1103,121 @@ int irc_client_msg(struct irc_client *client, const char *channel, const char *m
 	/* When the last parameter is prefixed with a colon character,
 	 * the value of that parameter will be the remainder of the message (including space characters)
 	 * http://chi.cs.uchicago.edu/chirc/irc.html */
+	if (client->latency) {
+		return latency_send(client, "PRIVMSG", channel, msg);
+	}
 	return irc_send(client, "PRIVMSG %s :%s", channel, msg);
 }
 
 int irc_client_notice(struct irc_client *client, const char *channel, const char *msg)
 {
+	if (client->latency) {
+		return latency_send(client, "NOTICE", channel, msg);
+	}
 	return irc_send(client, "NOTICE %s :%s", channel, msg);
 }
 
-int irc_client_pong(struct irc_client *client, struct irc_msg *msg)
+void irc_client_target_error_callback(struct irc_client *client, void (*cb)(void *data, const char *target, int numeric, const char *reason), void *data)
 {
-	/* Reply with the same data that it sent us (some servers may actually require that) */
-	return irc_send(client, "PONG :%s", irc_msg_body(msg) ? irc_msg_body(msg) + 1 : ""); /* If there's a body, skip the : and bounce the rest back */
+	pthread_mutex_lock(&client->lock);
+	client->target_error_cb = cb;
+	client->target_error_data = data;
+	pthread_mutex_unlock(&client->lock);
 }
 
-const char *irc_ctcp_name(enum irc_ctcp_type ctcp)
+/*! \brief Remember a target of a multi-target send, so that errors for it can be reported */
+static void fanout_remember(struct irc_client *client, const char *target, time_t now)
 {
-	switch (ctcp) {
-	case CTCP_ACTION:
-		return "ACTION";
-	case CTCP_VERSION:
-		return "VERSION";
-	case CTCP_TIME:
-		return "TIME";
-	case CTCP_PING:
-		return "PING";
-	case CTCP_DCC:
-		return "DCC";
-	default:
-		break;
-	}
-	return NULL;
+	struct fanout_target *t;
+
+	pthread_mutex_lock(&client->lock);
+	t = &client->fanout[client->fanout_next++ % FANOUT_TARGETS];
+	free(t->name); /* Overwrite the oldest target */
+	t->name = strdup(target);
+	t->expires = now + FANOUT_TARGET_TTL;
+	pthread_mutex_unlock(&client->lock);
 }
 
-enum irc_ctcp_type irc_ctcp_from_string(const char *s)
+static int send_multi(struct irc_client *client, const char *cmd, int targmax, const char *const *targets, size_t ntargets, const char *msg)
 {
-	if (!strcasecmp(s, "ACTION")) {
-		return CTCP_ACTION;
-	} else if (!strcasecmp(s, "VERSION")) {
-		return CTCP_VERSION;
-	} else if (!strcasecmp(s, "TIME")) {
-		return CTCP_TIME;
-	} else if (!strcasecmp(s, "PING")) {
-		return CTCP_PING;
-	} else if (!strcasecmp(s, "DCC")) {
-		return CTCP_DCC;
-	} else {
-		irc_warn("Unknown CTCP code: %s\n", s);
-		return CTCP_UNKNOWN;
+	char *buf;
+	size_t i, fixedlen, len = 0, maxtlen = 0, linelen = (size_t) irc_client_isupport_int(client, IRC_ISUPPORT_LINELEN);
+	int count = 0, res = 0, track = client->target_error_cb ? 1 : 0;
+	time_t now = time(NULL);
+
+	for (i = 0; i < ntargets; i++) {
+		size_t tlen = strlen(targets[i]);
+		if (tlen > maxtlen) {
+			maxtlen = tlen;
+		}
+	}
+
+	/* Each line is CMD target[,target...] :msg CR LF */
+	fixedlen = strlen(cmd) + 1 + 2 + strlen(msg) + 2;
+	buf = malloc(fixedlen + (linelen > maxtlen ? linelen : maxtlen) + 1);
+	if (!buf) {
+		irc_err("malloc failed\n");
+		return -1;
 	}
+
+	for (i = 0; i < ntargets; i++) {
+		size_t tlen = strlen(targets[i]);
+		if (!tlen || strpbrk(targets[i], " ,")) {
+			irc_err("Target '%s' is invalid\n", targets[i]);
+			res = -1;
+			continue;
+		}
+		/* Flush the current line if this target won't fit on it */
+		if (count && ((targmax && count >= targmax) || fixedlen + len + 1 + tlen > linelen)) {
+			len += (size_t) sprintf(buf + len, " :%s\r\n", msg); /* Safe, space accounted for in fixedlen */
+			if (irc_write(client, buf, len) <= 0) {
+				res = -1;
+			}
+			count = 0;
+		}
+		if (!count) {
+			if (fixedlen + tlen > linelen) {
+				irc_warn("Message to %s exceeds maximum line length of %lu\n", targets[i], linelen);
+			}
+			len = (size_t) sprintf(buf, "%s %s", cmd, targets[i]); /* Safe */
+		} else {
+			len += (size_t) sprintf(buf + len, ",%s", targets[i]); /* Safe */
+		}
+		count++;
+		if (track) {
+			fanout_remember(client, targets[i], now);
+		}
+	}
+	if (count) {
+		len += (size_t) sprintf(buf + len, " :%s\r\n", msg); /* Safe */
+		if (irc_write(client, buf, len) <= 0) {
+			res = -1;
+		}
+	}
+	free(buf);
+	return res;
+}
+
+int irc_client_msg_multi(struct irc_client *client, const char *const *targets, size_t ntargets, const char *msg)
+{
+	return send_multi(client, "PRIVMSG", irc_client_targmax(client, "PRIVMSG"), targets, ntargets, msg);
+}
+
+int irc_client_notice_multi(struct irc_client *client, const char *const *targets, size_t ntargets, const char *msg)
+{
+	return send_multi(client, "NOTICE", irc_client_targmax(client, "NOTICE"), targets, ntargets, msg);
+}
+
+int irc_client_pong(struct irc_client *client, struct irc_msg *msg)
+{
+	/* Reply with the same data that it sent us (some servers may actually require that) */
+	return irc_send(client, "PONG :%s", irc_msg_body(msg) ? irc_msg_body(msg) + 1 : ""); /* If there's a body, skip the : and bounce the rest back */
 }
 
 int irc_client_ctcp_request(struct irc_client *client, const char *user, enum irc_ctcp_type ctcp)
 {
 	const char *msg, *ctcp_name = irc_ctcp_name(ctcp);
+	char payload[32];
 
 	if (!ctcp_name) {
 		irc_err("Unknown CTCP command\n");
@@ -925,7 +1229,11 @@ int irc_client_ctcp_request(struct irc_client *client, const char *user, enum ir
 			irc_err("Use irc_client_action instead\n");
 			return -1;
 		case CTCP_PING:
-			msg = "123456789";
+			/* A timestamp unique to this request, so the reply can be matched to it */
+			if (ctcp_ping_payload(client, user, payload, sizeof(payload))) {
+				return -1;
+			}
+			msg = payload;
 			break;
 		case CTCP_TIME:
 		case CTCP_VERSION:
@@ -964,11 +1272,39 @@ int irc_client_change_nick(struct irc_client *client, const char *nick)
 
 int irc_client_set_nick(struct irc_client *client, const char *nick)
 {
-	if (client->nickname) {
-		free(client->nickname);
+	const char *interned = irc_intern_str(client->pool, nick);
+
+	if (!interned) {
+		return -1;
+	}
+	irc_intern_release(client->pool, client->nickname);
+	client->nickname = interned;
+	return 0;
+}
+
+struct irc_intern_pool *irc_client_intern_pool(struct irc_client *client)
+{
+	return client->pool;
+}
+
+int irc_client_set_intern_pool(struct irc_client *client, struct irc_intern_pool *pool)
+{
+	const char *nickname;
+
+	if (client->state) {
+		irc_err("Intern pool must be set before enabling state tracking\n");
+		return -1;
+	}
+	nickname = irc_intern_str(pool, client->nickname);
+	if (!nickname) {
+		return -1;
 	}
-	client->nickname = strdup(nick);
-	return client->nickname ? 0 : -1;
+	irc_intern_pool_ref(pool);
+	irc_intern_release(client->pool, client->nickname);
+	irc_intern_pool_unref(client->pool);
+	client->pool = pool;
+	client->nickname = nickname;
+	return 0;
 }
 
 int irc_client_set_channel_topic(struct irc_client *client, const char *channel, const char *topic)
@@ -986,6 +1322,220 @@ int irc_client_invite_user(struct irc_client *client, const char *nickname, cons
 	return irc_send(client, "INVITE %s %s", nickname, channel);
 }
 
+void irc_client_mode_window(struct irc_client *client, int ms, int threshold)
+{
+	pthread_mutex_lock(&client->lock);
+	client->mode_window = ms;
+	client->mode_threshold = threshold;
+	pthread_mutex_unlock(&client->lock);
+}
+
+/*! \brief Send all the pending mode changes for a channel, using as few MODE messages as possible */
+static int mode_queue_send(struct irc_client *client, struct mode_queue *q)
+{
+	char modes[IRC_MAX_MSG_LEN], params[IRC_MAX_MSG_LEN], *buf;
+	size_t i, modeslen = 0, paramslen = 0, chanlen = strlen(q->channel);
+	size_t linelen = (size_t) irc_client_isupport_int(client, IRC_ISUPPORT_LINELEN) - 2; /* Leave room for CR LF */
+	int nparams = 0, res = 0, limit = irc_client_isupport_int(client, IRC_ISUPPORT_MODES);
+	char sign = 0;
+
+	if (linelen > sizeof(modes) + sizeof(params)) {
+		linelen = sizeof(modes) + sizeof(params); /* MODE lines don't need to be that long */
+	}
+	/* With a large LINELEN, lines can be longer than irc_send allows, so format them here */
+	buf = malloc(5 + chanlen + 1 + sizeof(modes) + sizeof(params) + 3);
+	if (!buf) {
+		irc_err("malloc failed\n");
+		return -1;
+	}
+
+	for (i = 0; i <= q->len; i++) {
+		struct mode_change *c = i < q->len ? &q->changes[i] : NULL;
+		size_t arglen = c && c->arg ? strlen(c->arg) : 0;
+		/* MODE <channel> <modes><params> */
+		if (modeslen && (!c || (c->arg && limit > 0 && nparams >= limit)
+			|| 5 + chanlen + 1 + modeslen + 2 + paramslen + (arglen ? arglen + 1 : 0) > linelen
+			|| modeslen + 2 >= sizeof(modes) || paramslen + arglen + 1 >= sizeof(params))) {
+			int len = sprintf(buf, "MODE %s %.*s%.*s\r\n", q->channel, (int) modeslen, modes, (int) paramslen, params); /* Safe */
+			res |= irc_write(client, buf, (size_t) len) <= 0;
+			modeslen = paramslen = 0;
+			nparams = 0;
+			sign = 0;
+		}
+		if (!c) {
+			break;
+		}
+		if (c->sign != sign) {
+			sign = modes[modeslen++] = c->sign;
+		}
+		modes[modeslen++] = c->mode;
+		if (c->arg) {
+			params[paramslen++] = ' ';
+			memcpy(params + paramslen, c->arg, arglen);
+			paramslen += arglen;
+			nparams++;
+		}
+	}
+	free(buf);
+	return res ? -1 : 0;
+}
+
+/*! \brief Remove a channel's mode queue from the client, so it can be sent without holding the lock */
+static struct mode_queue *mode_queue_detach(struct irc_client *client, struct mode_queue *q)
+{
+	struct mode_queue **prev;
+
+	for (prev = &client->modeq; *prev; prev = &(*prev)->next) {
+		if (*prev == q) {
+			*prev = q->next;
+			q->next = NULL;
+			return q;
+		}
+	}
+	return NULL;
+}
+
+/*! \brief Send all mode queues whose coalescing window has elapsed */
+static int mode_flush_due(struct irc_client *client, long long now)
+{
+	struct mode_queue *q, *next, *due = NULL;
+	int res = 0;
+
+	pthread_mutex_lock(&client->lock);
+	for (q = client->modeq; q; q = next) {
+		next = q->next;
+		if (q->deadline <= now) {
+			mode_queue_detach(client, q);
+			q->next = due;
+			due = q;
+		}
+	}
+	pthread_mutex_unlock(&client->lock);
+
+	for (q = due; q; q = next) {
+		next = q->next;
+		res |= mode_queue_send(client, q);
+		mode_queue_free(q);
+	}
+	return res;
+}
+
+int irc_client_mode_queue(struct irc_client *client, const char *channel, int add, char mode, const char *arg)
+{
+	struct mode_queue *q;
+	struct mode_change *c;
+	size_t i;
+	int threshold;
+	char sign = add ? '+' : '-';
+
+	if (!channel || !VALID_CHANNEL_NAME(channel)) {
+		irc_err("Channel name '%s' is invalid\n", channel ? channel : "");
+		return -1;
+	} else if (!isalpha((unsigned char) mode)) {
+		irc_err("Mode '%c' is invalid\n", mode);
+		return -1;
+	} else if (arg && (!*arg || strchr(arg, ' '))) {
+		irc_err("Mode argument '%s' is invalid\n", arg);
+		return -1;
+	} else if (irc_client_chanmode_type(client, mode) != IRC_CHANMODE_UNKNOWN && irc_client_chanmode_has_param(client, mode, add) != (arg ? 1 : 0)) {
+		irc_err("Mode %c%c %s an argument\n", add ? '+' : '-', mode, arg ? "does not take" : "requires");
+		return -1;
+	}
+
+	pthread_mutex_lock(&client->lock);
+	for (q = client->modeq; q; q = q->next) {
+		if (irc_client_name_eq(client, q->channel, channel)) {
+			break;
+		}
+	}
+	if (!q) {
+		q = calloc(1, sizeof(*q));
+		if (!q || !(q->channel = strdup(channel))) {
+			pthread_mutex_unlock(&client->lock);
+			free(q);
+			irc_err("Allocation failure\n");
+			return -1;
+		}
+		q->deadline = now_ms() + client->mode_window;
+		q->next = client->modeq;
+		client->modeq = q;
+		irc_loop_wake(client); /* irc_loop needs to send this when the window elapses */
+	}
+
+	/* If this mode is already pending for this argument, only the last change matters */
+	for (i = 0; i < q->len; i++) {
+		c = &q->changes[i];
+		if (c->mode == mode && (c->arg ? arg && irc_client_name_eq(client, c->arg, arg) : !arg)) {
+			free(c->arg);
+			memmove(c, c + 1, (q->len - i - 1) * sizeof(*c));
+			q->len--;
+			break;
+		}
+	}
+
+	if (q->len == q->alloc) {
+		size_t alloc = q->alloc ? q->alloc * 2 : 8;
+		c = realloc(q->changes, alloc * sizeof(*c));
+		if (!c) {
+			pthread_mutex_unlock(&client->lock);
+			irc_err("realloc failed\n");
+			return -1;
+		}
+		q->changes = c;
+		q->alloc = alloc;
+	}
+	c = &q->changes[q->len];
+	c->arg = arg ? strdup(arg) : NULL;
+	if (arg && !c->arg) {
+		pthread_mutex_unlock(&client->lock);
+		irc_err("strdup failed\n");
+		return -1;
+	}
+	c->sign = sign;
+	c->mode = mode;
+	q->len++;
+
+	/* If there are enough changes queued to fill a line, there's no point waiting any longer */
+	threshold = client->mode_threshold ? client->mode_threshold : client->isupport.ints[IRC_ISUPPORT_MODES];
+	if (threshold && q->len >= (size_t) threshold) {
+		mode_queue_detach(client, q);
+	} else {
+		q = NULL;
+	}
+	pthread_mutex_unlock(&client->lock);
+
+	if (q) {
+		int res = mode_queue_send(client, q);
+		mode_queue_free(q);
+		return res;
+	}
+	return 0;
+}
+
+int irc_client_mode_flush(struct irc_client *client, const char *channel)
+{
+	struct mode_queue *q, *next, *flush = NULL;
+	int res = 0;
+
+	pthread_mutex_lock(&client->lock);
+	for (q = client->modeq; q; q = next) {
+		next = q->next;
+		if (!channel || irc_client_name_eq(client, q->channel, channel)) {
+			mode_queue_detach(client, q);
+			q->next = flush;
+			flush = q;
+		}
+	}
+	pthread_mutex_unlock(&client->lock);
+
+	for (q = flush; q; q = next) {
+		next = q->next;
+		res |= mode_queue_send(client, q);
+		mode_queue_free(q);
+	}
+	return res;
+}
+
 #define PARSE_CHANNEL() \
 	/* Format of msg->body here is CHANNEL :BODY */ \
 	msg->channel = strsep(&msg->body, " "); \
@@ -1015,13 +1565,13 @@ int irc_parse_msg_type(struct irc_msg *msg)
 	if (!strcasecmp(c, "PRIVMSG")) { /* This is intentionally first, as it's the most common one. */
 		msg->type = IRC_CMD_PRIVMSG;
 		PARSE_CHANNEL();
-		if (*msg->body == 0x01) {
+		if (msg->body && *msg->body == 0x01) {
 			msg->ctcp = 1;
 		}
 	} else if (!strcasecmp(c, "NOTICE")) {
 		msg->type = IRC_CMD_NOTICE;
 		PARSE_CHANNEL();
-		if (*msg->body == 0x01) {
+		if (msg->body && *msg->body == 0x01) {
 			msg->ctcp = 1;
 		}
 	} else if (!strcasecmp(c, "PING")) {
@@ -1045,6 +1595,8 @@ int irc_parse_msg_type(struct irc_msg *msg)
 	} else if (!strcasecmp(c, "TOPIC")) {
 		msg->type = IRC_CMD_TOPIC;
 		PARSE_CHANNEL();
+	} else if (!strcasecmp(c, "BATCH")) {
+		msg->type = IRC_CMD_BATCH;
 	} else if (!strcasecmp(c, "ERROR")) {
 		msg->type = IRC_CMD_ERROR;
 	} else {
@@ -1056,36 +1608,31 @@ int irc_parse_msg_type(struct irc_msg *msg)
 
 int irc_parse_msg_ctcp(struct irc_msg *msg)
 {
-	char *tmp, *ctcp_name;
+	struct irc_ctcp ctcp;
+	const char *s = msg->body;
+	char *args;
 
 	if (*msg->body != 0x01) {
 		irc_err("Not a CTCP message\n");
 		return -1;
 	}
-
-	if (!*++msg->body) {
+	if (!irc_ctcp_next(&s, &ctcp)) {
 		irc_err("Empty CTCP message\n");
 		return -1;
 	}
 
-	tmp = strchr(msg->body, 0x01);
-	if (!tmp) {
-		irc_err("Unterminated CTCP message\n");
-		return -1;
+	msg->ctcp_type = ctcp.type;
+	if (ctcp.type == CTCP_UNKNOWN) {
+		return -1; /* Not worth logging, there are lots of nonstandard ones */
 	}
-
-	*tmp = '\0';
-
-	ctcp_name = strsep(&msg->body, " ");
-	if (!ctcp_name || !*ctcp_name) {
-		return -1;
-	}
-	msg->ctcp_type = irc_ctcp_from_string(ctcp_name);
-	if (msg->ctcp_type == CTCP_UNKNOWN) {
-		irc_warn("Unsupported CTCP extended data type: %s\n", ctcp_name);
-		return -1;
+	if (!ctcp.args) {
+		msg->body = NULL;
+		return 0;
 	}
-
+	/* Only the arguments remain, unquoted in place */
+	args = msg->body + (ctcp.args - msg->body);
+	irc_ctcp_unquote(args, ctcp.argslen, args, ctcp.argslen + 1);
+	msg->body = args;
 	return 0;
 }
 
@@ -1103,6 +1650,16 @@ int irc_parse_msg(struct irc_msg *msg, char *s)
 		return -1;
 	}
 
+	if (*s == '@') {
+		/* IRCv3 message tags */
+		cur = strsep(&s, " ");
+		msg->tags = cur + 1; /* Skip leading @ */
+		if (!s) {
+			irc_err("Missing command\n");
+			return -1;
+		}
+	}
+
 	if (*s == ':') {
 		/* Message begins with a prefix */
 		cur = strsep(&s, " ");
@@ -1126,17 +1683,605 @@ int irc_parse_msg(struct irc_msg *msg, char *s)
 		char *end;
 		msg->body = s;
 		end = strchr(s, '\0'); /* Presumably EOM */
-		/* Trim trailing CR LF */
-		if (end && end > s + 3) {
-		/* OR, not AND, in case the LF is NUL terminated due to multiple message read */
-			if (*(end - 1) == '\n' || *(end - 2) == '\r') {
-				*(end - 2) = '\0';
-			}
+		/* Trim trailing CR LF. The LF may already have been NUL terminated due to multiple message read. */
+		while (end > s && (*(end - 1) == '\n' || *(end - 1) == '\r')) {
+			*(--end) = '\0';
 		}
 	}
 	return 0;
 }
 
+const char *next_param(const char **s, size_t *len)
+{
+	const char *start = *s, *end;
+
+	if (!start) {
+		return NULL;
+	}
+	while (*start == ' ') {
+		start++;
+	}
+	if (!*start) {
+		*s = NULL;
+		return NULL;
+	}
+	if (*start == ':') {
+		start++;
+		*len = strlen(start);
+		*s = NULL;
+		return start;
+	}
+	end = strchr(start, ' ');
+	if (end) {
+		*len = (size_t) (end - start);
+		*s = end + 1;
+	} else {
+		*len = strlen(start);
+		*s = NULL;
+	}
+	return start;
+}
+
+/*! \brief Names of RPL_ISUPPORT tokens, in the same (alphabetical) order as enum irc_isupport_token */
+static const char *const isupport_names[IRC_ISUPPORT_TOKENS] = {
+	"ACCEPT", "AWAYLEN", "BOT", "CALLERID", "CASEMAPPING", "CHANLIMIT", "CHANMODES", "CHANNELLEN",
+	"CHANTYPES", "CHATHISTORY", "CLIENTTAGDENY", "CNOTICE", "CPRIVMSG", "DEAF", "ELIST", "EXCEPTS",
+	"EXTBAN", "HOSTLEN", "INVEX", "KEYLEN", "KICKLEN", "KNOCK", "LINELEN", "MAXBANS",
+	"MAXCHANNELS", "MAXLIST", "MAXNICKLEN", "MAXTARGETS", "MODES", "MONITOR", "MSGREFTYPES", "NAMESX",
+	"NETWORK", "NICKLEN", "PREFIX", "SAFELIST", "SILENCE", "STATUSMSG", "TARGMAX", "TOPICLEN",
+	"UHNAMES", "USERIP", "USERLEN", "UTF8ONLY", "WATCH", "WHOX",
+};
+
+static int isupport_name_cmp(const void *a, const void *b)
+{
+	return strcmp((const char *) a, *(const char *const *) b);
+}
+
+/*! \brief Get the token for an RPL_ISUPPORT token name, -1 if the library doesn't know about it */
+static int isupport_lookup(const char *name)
+{
+	const char *const *entry = bsearch(name, isupport_names, IRC_ISUPPORT_TOKENS, sizeof(isupport_names[0]), isupport_name_cmp);
+	return entry ? (int) (entry - isupport_names) : -1;
+}
+
+/*! \brief Numeric value of a token that the server has not advertised */
+static int isupport_default_int(enum irc_isupport_token token)
+{
+	switch (token) {
+	case IRC_ISUPPORT_LINELEN:
+		return IRC_MAX_MSG_LEN;
+	case IRC_ISUPPORT_MODES:
+		return 3;
+	case IRC_ISUPPORT_NICKLEN:
+		return 9;
+	default:
+		return -1;
+	}
+}
+
+/*!
+ * \brief Parse a list of limits, e.g. CHANLIMIT=#&:50,!: or MAXLIST=beI:100,q:50
+ * \param limits Limit for each character, indexed by character. An empty limit means there is no limit.
+ */
+static void isupport_parse_limits(int *limits, const char *value)
+{
+	int i;
+
+	for (i = 0; i < 128; i++) {
+		limits[i] = -1;
+	}
+	while (value && *value) {
+		const char *colon = strchr(value, ':'), *c;
+		int limit;
+		if (!colon) {
+			break;
+		}
+		limit = atoi(colon + 1); /* If empty, this is 0 (unlimited) */
+		for (c = value; c < colon; c++) {
+			if (!(*c & 0x80)) {
+				limits[(int) *c] = limit;
+			}
+		}
+		value = strchr(colon, ',');
+		if (value) {
+			value++;
+		}
+	}
+}
+
+/*! \brief Update the parsed form of a token, after its value has changed */
+static void isupport_derive(struct irc_client *client, enum irc_isupport_token token)
+{
+	struct isupport *is = &client->isupport;
+	const char *value = is->values[token], *c;
+	int i;
+
+	if (value) {
+		is->ints[token] = *value ? atoi(value) : 0;
+	} else {
+		is->ints[token] = isupport_default_int(token);
+	}
+
+	switch (token) {
+	case IRC_ISUPPORT_LINELEN:
+		if (is->ints[token] < IRC_MAX_MSG_LEN) {
+			is->ints[token] = IRC_MAX_MSG_LEN; /* Servers must accept at least this much */
+		}
+		break;
+	case IRC_ISUPPORT_CASEMAPPING:
+		is->casemapping = irc_casemapping_from_string(value);
+		break;
+	case IRC_ISUPPORT_CHANTYPES:
+		memset(is->chantypes, 0, sizeof(is->chantypes));
+		for (c = value ? value : "#&"; *c; c++) {
+			is->chantypes[(unsigned char) *c] = 1;
+		}
+		break;
+	case IRC_ISUPPORT_PREFIX:
+		/* e.g. (qaohv)~&@%+ */
+		for (i = 0; i < 128; i++) {
+			if (is->chanmodes[i] == IRC_CHANMODE_PREFIX) {
+				is->chanmodes[i] = IRC_CHANMODE_UNKNOWN;
+			}
+			is->prefix_rank[i] = -1;
+		}
+		is->prefix_modes[0] = is->prefix_symbols[0] = '\0';
+		if (!value) {
+			value = "(ov)@+";
+		}
+		c = strchr(value, ')');
+		if (*value == '(' && c) {
+			size_t len = (size_t) (c - value - 1);
+			if (len >= sizeof(is->prefix_modes) || strlen(c + 1) != len) {
+				irc_warn("Invalid PREFIX: %s\n", value);
+				break;
+			}
+			memcpy(is->prefix_modes, value + 1, len);
+			is->prefix_modes[len] = '\0';
+			strcpy(is->prefix_symbols, c + 1); /* Safe */
+			for (i = 0; i < (int) len; i++) {
+				if ((is->prefix_modes[i] | is->prefix_symbols[i]) & 0x80) {
+					continue;
+				}
+				is->chanmodes[(int) is->prefix_modes[i]] = IRC_CHANMODE_PREFIX;
+				is->prefix_rank[(int) is->prefix_modes[i]] = (signed char) i;
+				is->prefix_rank[(int) is->prefix_symbols[i]] = (signed char) i;
+			}
+		}
+		break;
+	case IRC_ISUPPORT_CHANMODES:
+		/* e.g. beI,k,l,imnst: types A, B, C, D */
+		for (i = 0; i < 128; i++) {
+			if (is->chanmodes[i] != IRC_CHANMODE_PREFIX) {
+				is->chanmodes[i] = IRC_CHANMODE_UNKNOWN;
+			}
+		}
+		i = IRC_CHANMODE_LIST;
+		/* Servers that don't send CHANMODES (or haven't yet) almost always have at least these */
+		for (c = value ? value : "beI,k,l,imnpst"; *c && i <= IRC_CHANMODE_FLAG; c++) {
+			if (*c == ',') {
+				i++;
+			} else if (!(*c & 0x80) && is->chanmodes[(int) *c] != IRC_CHANMODE_PREFIX) {
+				is->chanmodes[(int) *c] = (unsigned char) i;
+			}
+		}
+		break;
+	case IRC_ISUPPORT_CHANLIMIT:
+		isupport_parse_limits(is->chanlimit, value);
+		break;
+	case IRC_ISUPPORT_MAXLIST:
+		isupport_parse_limits(is->maxlist, value);
+		break;
+	case IRC_ISUPPORT_TARGMAX:
+		/* e.g. PRIVMSG:4,NOTICE:4,JOIN: */
+		is->ntargmax = 0;
+		for (c = value; c && *c && is->ntargmax < (int) ARRAY_LEN(is->targmax); ) {
+			const char *colon = strchr(c, ':'), *next = strchr(c, ',');
+			if (colon && (!next || colon < next) && (size_t) (colon - c) < sizeof(is->targmax[0].command)) {
+				memcpy(is->targmax[is->ntargmax].command, c, (size_t) (colon - c));
+				is->targmax[is->ntargmax].command[colon - c] = '\0';
+				is->targmax[is->ntargmax].limit = atoi(colon + 1); /* If empty, this is 0 (unlimited) */
+				is->ntargmax++;
+			}
+			c = next ? next + 1 : NULL;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/*! \brief Initialize the defaults for all RPL_ISUPPORT tokens */
+static void isupport_init(struct irc_client *client)
+{
+	int i;
+
+	for (i = 0; i < IRC_ISUPPORT_TOKENS; i++) {
+		isupport_derive(client, (enum irc_isupport_token) i);
+	}
+}
+
+static void isupport_destroy(struct irc_client *client)
+{
+	struct isupport_other *o;
+	int i;
+
+	for (i = 0; i < IRC_ISUPPORT_TOKENS; i++) {
+		free(client->isupport.values[i]);
+		client->isupport.values[i] = NULL;
+	}
+	while ((o = client->isupport.other)) {
+		client->isupport.other = o->next;
+		free(o);
+	}
+}
+
+/*! \brief Decode the \xHH escapes used in RPL_ISUPPORT values */
+static char *isupport_unescape(const char *value, size_t len)
+{
+	char *out = malloc(len + 1), *o = out;
+	size_t i;
+
+	if (!out) {
+		return NULL;
+	}
+	for (i = 0; i < len; i++) {
+		if (value[i] == '\\' && i + 3 < len && value[i + 1] == 'x' && isxdigit((unsigned char) value[i + 2]) && isxdigit((unsigned char) value[i + 3])) {
+			char hex[3] = { value[i + 2], value[i + 3], '\0' };
+			*o++ = (char) strtol(hex, NULL, 16);
+			i += 3;
+		} else {
+			*o++ = value[i];
+		}
+	}
+	*o = '\0';
+	return out;
+}
+
+/*! \brief Set (or remove, if value is NULL) an RPL_ISUPPORT token */
+static void isupport_set(struct irc_client *client, const char *name, const char *value, size_t valuelen)
+{
+	struct isupport *is = &client->isupport;
+	struct isupport_other *o, **prev;
+	char *decoded = NULL;
+	int token = isupport_lookup(name);
+
+	if (value) {
+		decoded = isupport_unescape(value, valuelen);
+		if (!decoded) {
+			irc_err("malloc failed\n");
+			return;
+		}
+	}
+
+	irc_debug(5, "ISUPPORT %s%s%s\n", value ? "" : "-", name, value ? "" : " removed");
+	pthread_mutex_lock(&client->lock);
+	if (token >= 0) {
+		free(is->values[token]);
+		is->values[token] = decoded;
+		isupport_derive(client, (enum irc_isupport_token) token);
+	} else {
+		for (prev = &is->other; (o = *prev); prev = &o->next) {
+			if (!strcmp(o->name, name)) {
+				*prev = o->next;
+				free(o);
+				break;
+			}
+		}
+		if (decoded) {
+			size_t namelen = strlen(name);
+			/* Store the name and value together in one allocation */
+			o = malloc(sizeof(*o) + namelen + 1 + strlen(decoded) + 1);
+			if (o) {
+				o->name = o->data;
+				strcpy(o->name, name); /* Safe */
+				o->value = o->name + namelen + 1;
+				strcpy(o->value, decoded); /* Safe */
+				o->next = is->other;
+				is->other = o;
+			}
+			free(decoded);
+		}
+	}
+	pthread_mutex_unlock(&client->lock);
+}
+
+/*! \brief Parse RPL_ISUPPORT: <client> <1-13 tokens> :are supported by this server */
+static void parse_isupport(struct irc_client *client, struct irc_msg *msg)
+{
+	const char *token, *s = msg->body;
+	size_t len;
+
+	next_param(&s, &len); /* Skip our nickname */
+	while ((token = next_param(&s, &len))) {
+		char name[64];
+		const char *eq;
+		size_t namelen;
+		int remove = 0;
+		if (token[-1] == ':') {
+			break; /* The trailing parameter is human-readable text, not a token */
+		}
+		eq = memchr(token, '=', len);
+		namelen = eq ? (size_t) (eq - token) : len;
+		if (*token == '-') { /* -TOKEN removes a previously advertised token */
+			remove = 1;
+			token++;
+			namelen--;
+		}
+		if (!namelen || namelen >= sizeof(name)) {
+			continue;
+		}
+		memcpy(name, token, namelen);
+		name[namelen] = '\0';
+		if (remove) {
+			isupport_set(client, name, NULL, 0);
+		} else if (eq) {
+			isupport_set(client, name, eq + 1, len - namelen - 1);
+		} else {
+			isupport_set(client, name, "", 0);
+		}
+	}
+}
+
+const char *irc_client_isupport(struct irc_client *client, enum irc_isupport_token token)
+{
+	return token < IRC_ISUPPORT_TOKENS ? client->isupport.values[token] : NULL;
+}
+
+const char *irc_client_isupport_name(struct irc_client *client, const char *name)
+{
+	struct isupport_other *o;
+	const char *value = NULL;
+	int token = isupport_lookup(name);
+
+	if (token >= 0) {
+		return client->isupport.values[token];
+	}
+	pthread_mutex_lock(&client->lock);
+	for (o = client->isupport.other; o; o = o->next) {
+		if (!strcmp(o->name, name)) {
+			value = o->value;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&client->lock);
+	return value;
+}
+
+int irc_client_isupport_int(struct irc_client *client, enum irc_isupport_token token)
+{
+	return token < IRC_ISUPPORT_TOKENS ? client->isupport.ints[token] : -1;
+}
+
+int irc_client_targmax(struct irc_client *client, const char *command)
+{
+	struct isupport *is = &client->isupport;
+	int i, limit = 1; /* Commands that aren't listed only accept one target */
+
+	pthread_mutex_lock(&client->lock);
+	if (is->values[IRC_ISUPPORT_TARGMAX]) {
+		for (i = 0; i < is->ntargmax; i++) {
+			if (!strcasecmp(is->targmax[i].command, command)) {
+				limit = is->targmax[i].limit;
+				break;
+			}
+		}
+	} else if (is->values[IRC_ISUPPORT_MAXTARGETS] && (!strcasecmp(command, "PRIVMSG") || !strcasecmp(command, "NOTICE"))) {
+		limit = is->ints[IRC_ISUPPORT_MAXTARGETS]; /* Predecessor of TARGMAX */
+	}
+	pthread_mutex_unlock(&client->lock);
+	return limit;
+}
+
+enum irc_casemapping irc_client_casemapping(struct irc_client *client)
+{
+	return client->isupport.casemapping;
+}
+
+int irc_client_name_eq(struct irc_client *client, const char *a, const char *b)
+{
+	return irc_casemap_eq(client->isupport.casemapping, a, b);
+}
+
+int irc_client_is_channel(struct irc_client *client, const char *name)
+{
+	return name && client->isupport.chantypes[(unsigned char) *name];
+}
+
+enum irc_chanmode_type irc_client_chanmode_type(struct irc_client *client, char mode)
+{
+	return mode & 0x80 ? IRC_CHANMODE_UNKNOWN : (enum irc_chanmode_type) client->isupport.chanmodes[(int) mode];
+}
+
+int irc_client_chanmode_has_param(struct irc_client *client, char mode, int add)
+{
+	switch (irc_client_chanmode_type(client, mode)) {
+	case IRC_CHANMODE_LIST:
+	case IRC_CHANMODE_PARAM:
+	case IRC_CHANMODE_PREFIX:
+		return 1;
+	case IRC_CHANMODE_PARAM_SET:
+		return add;
+	case IRC_CHANMODE_FLAG:
+	case IRC_CHANMODE_UNKNOWN:
+	default:
+		return 0;
+	}
+}
+
+int irc_client_prefix_rank(struct irc_client *client, char c)
+{
+	return c & 0x80 ? -1 : client->isupport.prefix_rank[(int) c];
+}
+
+char irc_client_prefix_mode(struct irc_client *client, char prefix)
+{
+	int rank = irc_client_prefix_rank(client, prefix);
+	/* Make sure it's actually a prefix, and not a mode */
+	return rank >= 0 && client->isupport.prefix_symbols[rank] == prefix ? client->isupport.prefix_modes[rank] : 0;
+}
+
+char irc_client_prefix_symbol(struct irc_client *client, char mode)
+{
+	int rank = irc_client_prefix_rank(client, mode);
+	return rank >= 0 && client->isupport.prefix_modes[rank] == mode ? client->isupport.prefix_symbols[rank] : 0;
+}
+
+int irc_client_chanlimit(struct irc_client *client, char chantype)
+{
+	return chantype & 0x80 ? -1 : client->isupport.chanlimit[(int) chantype];
+}
+
+int irc_client_maxlist(struct irc_client *client, char mode)
+{
+	return mode & 0x80 ? -1 : client->isupport.maxlist[(int) mode];
+}
+
+/*! \brief Report an error numeric for a target of a recent multi-target send: <client> <target> :<reason> */
+static void target_error(struct irc_client *client, struct irc_msg *msg)
+{
+	const char *targets, *reason, *s = msg->body;
+	size_t len, targetslen, reasonlen;
+	time_t now;
+	int i;
+
+	if (!client->target_error_cb) {
+		return;
+	}
+
+	next_param(&s, &len); /* Skip our nickname */
+	targets = next_param(&s, &targetslen);
+	if (!targets) {
+		return;
+	}
+	reason = next_param(&s, &reasonlen);
+
+	now = time(NULL);
+	/* Some servers echo back the whole target list (e.g. for ERR_TOOMANYTARGETS) */
+	while (targetslen) {
+		const char *comma = memchr(targets, ',', targetslen);
+		size_t tlen = comma ? (size_t) (comma - targets) : targetslen;
+		char *name = NULL;
+		pthread_mutex_lock(&client->lock);
+		for (i = 0; i < FANOUT_TARGETS; i++) {
+			struct fanout_target *t = &client->fanout[i];
+			if (t->name && t->expires >= now && strlen(t->name) == tlen && irc_casemap_memeq(client->isupport.casemapping, t->name, targets, tlen)) {
+				name = t->name; /* Only report each error once */
+				t->name = NULL;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&client->lock);
+		if (name) {
+			/* Don't hold the lock in the callback, in case it sends more messages */
+			client->target_error_cb(client->target_error_data, name, msg->numeric, reason ? reason : "");
+			free(name);
+		}
+		targetslen -= comma ? tlen + 1 : tlen;
+		targets += comma ? tlen + 1 : tlen;
+	}
+}
+
+/*!
+ * \brief Whether a message is an echo of one we sent (echo-message)
+ * \note echo-message is only requested for latency tracking, so echoes are never for the application or for us to act on
+ */
+static int msg_from_self(struct irc_client *client, struct irc_msg *msg)
+{
+	size_t len;
+
+	if (!(client->caps & CAP_ECHO_MESSAGE) || !msg->prefix) {
+		return 0;
+	}
+	len = strcspn(msg->prefix, "!@");
+	return irc_intern_len(client->nickname) == len && irc_casemap_memeq(client->isupport.casemapping, client->nickname, msg->prefix, len);
+}
+
+int irc_client_process(struct irc_client *client, struct irc_msg *msg)
+{
+	int split;
+
+	if (client->history) {
+		int res = chathistory_process(client, msg);
+		if (res) {
+			return res == CHATHISTORY_CONSUMED;
+		}
+	}
+	if (client->batch && batch_process(client, msg)) {
+		return 1;
+	}
+	if ((msg->type == IRC_CMD_PRIVMSG || msg->type == IRC_CMD_NOTICE) && msg_from_self(client, msg)) {
+		if (client->latency) {
+			latency_echo(client, msg);
+		}
+		return 1; /* Whether or not it was measured, it's what we sent, not something we received */
+	}
+	if (msg->ctcp) {
+		if (client->pings && msg->type == IRC_CMD_NOTICE && ctcp_process(client, msg)) {
+			return 1;
+		}
+		if (client->responder && msg->type == IRC_CMD_PRIVMSG && ctcp_respond(client, msg)) {
+			return 1;
+		}
+		if (client->dcc && msg->type == IRC_CMD_PRIVMSG && dcc_process(client, msg)) {
+			return 1;
+		}
+	}
+	split = client->netsplit ? netsplit_process(client, msg) : 0;
+	if (split == NETSPLIT_CONSUMED) {
+		return 1;
+	}
+	state_process(client, msg);
+	if (client->who && who_process(client, msg)) {
+		return 1;
+	}
+	if (split) {
+		return 1;
+	}
+
+	switch (msg->type) {
+	case IRC_CMD_OTHER:
+		if (msg->body && !strcasecmp(msg->command, "CAP")) {
+			/* CAP <client> ACK :<capabilities> */
+			const char *s = msg->body, *param;
+			size_t len;
+			next_param(&s, &len);
+			param = next_param(&s, &len);
+			if (param && len == 3 && !strncmp(param, "ACK", len) && (param = next_param(&s, &len))) {
+				cap_ack(client, param, len);
+			}
+		}
+		break;
+	case IRC_NUMERIC:
+		switch (msg->numeric) {
+		case RPL_ISUPPORT:
+			parse_isupport(client, msg);
+			break;
+		case RPL_LISTSTART:
+		case RPL_LIST:
+		case RPL_LISTEND:
+		case RPL_TRYAGAIN:
+			return list_process(client, msg);
+		case ERR_NOSUCHNICK:
+		case ERR_NOSUCHCHANNEL:
+		case ERR_CANNOTSENDTOCHAN:
+		case ERR_TOOMANYTARGETS:
+		case ERR_NOTOPLEVEL:
+		case ERR_WILDTOPLEVEL:
+		case ERR_CANTSENDTOUSER:
+			target_error(client, msg);
+			break;
+		default:
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+	/* Anything else in a batch is passed on with the rest of the batch, once it's complete */
+	return client->batch && msg->tags ? batch_collect(client, msg) : 0;
+}
+
 /* Accessor functions */
 
 /*! \note Not const as callers may want to mutate it */
@@ -1181,3 +2326,69 @@ char *irc_msg_body(struct irc_msg *msg)
 {
 	return msg->body;
 }
+
+const char *irc_msg_tags(struct irc_msg *msg)
+{
+	return msg->tags;
+}
+
+const char *msg_tag(const struct irc_msg *msg, const char *key, size_t *len)
+{
+	const char *s = msg->tags;
+	size_t keylen = strlen(key);
+
+	while (s && *s) {
+		size_t taglen = strcspn(s, ";");
+		/* Client-only tags (+key) and vendor prefixes (vendor/key) are part of the name */
+		if (taglen >= keylen && !strncmp(s, key, keylen) && (taglen == keylen || s[keylen] == '=')) {
+			*len = taglen == keylen ? 0 : taglen - keylen - 1;
+			return taglen == keylen ? s + taglen : s + keylen + 1;
+		}
+		s += taglen;
+		if (*s) {
+			s++;
+		}
+	}
+	return NULL;
+}
+
+int irc_msg_tag(struct irc_msg *msg, const char *key, char *buf, size_t len)
+{
+	size_t vlen, i, o = 0;
+	const char *value = msg_tag(msg, key, &vlen);
+
+	if (!value) {
+		return -1;
+	}
+	/* Unescape, per https://ircv3.net/specs/extensions/message-tags.html */
+	for (i = 0; i < vlen && o + 1 < len; i++) {
+		char c = value[i];
+		if (c == '\\') {
+			if (++i == vlen) {
+				break; /* A trailing backslash is dropped */
+			}
+			switch (value[i]) {
+			case ':':
+				c = ';';
+				break;
+			case 's':
+				c = ' ';
+				break;
+			case 'r':
+				c = '\r';
+				break;
+			case 'n':
+				c = '\n';
+				break;
+			default:
+				c = value[i]; /* Including \\ */
+				break;
+			}
+		}
+		buf[o++] = c;
+	}
+	if (len) {
+		buf[o] = '\0';
+	}
+	return 0;
+}
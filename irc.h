@@ -15,7 +15,9 @@
 
 #include <stdio.h> /* FILE */
 #include <stddef.h> /* size_t */
+#include <stdint.h> /* uint64_t */
 #include <sys/types.h> /* ssize_t */
+#include <time.h> /* time_t */
 
 #define LIRC_VERSION_MAJOR 1
 #define LIRC_VERSION_MINOR 0
@@ -24,6 +26,9 @@
 /*! \brief Maximum length of an IRC message, including trailing CR LF */
 #define IRC_MAX_MSG_LEN 512
 
+/*! \brief Maximum length of IRCv3 message tags, including the leading @ and trailing space */
+#define IRC_MAX_TAGS_LEN 8191
+
 /*! \brief Default port for insecure connections */
 #define IRC_DEFAULT_PORT 6667
 
@@ -43,6 +48,7 @@ enum irc_msg_type {
 	IRC_CMD_NICK,
 	IRC_CMD_MODE,
 	IRC_CMD_TOPIC,
+	IRC_CMD_BATCH,
 	/*! \todo Add more message types here as needed */
 	IRC_CMD_ERROR,
 	IRC_CMD_OTHER,		/*!< Some command that doesn't have an enum value */
@@ -55,10 +61,94 @@ enum irc_ctcp_type {
 	CTCP_TIME,
 	CTCP_PING,
 	CTCP_DCC,
-	/* XXX Others missing */
+	CTCP_CLIENTINFO,
+	CTCP_SOURCE,
+	CTCP_USERINFO,
+	CTCP_FINGER,
+	CTCP_ERRMSG,
 	CTCP_UNKNOWN,
 };
 
+/*! \brief A CTCP message embedded in a message body. Slices point into the body, and are not NUL terminated. */
+struct irc_ctcp {
+	enum irc_ctcp_type type;	/*!< CTCP_UNKNOWN if the verb isn't a standard one */
+	const char *verb;
+	size_t verblen;
+	const char *args;			/*!< Still quoted (see irc_ctcp_unquote). NULL if there are none. */
+	size_t argslen;
+};
+
+/*!
+ * \brief RPL_ISUPPORT tokens understood by the library
+ * \note Reference: https://modern.ircdocs.horse/#rplisupport-parameters
+ */
+enum irc_isupport_token {
+	IRC_ISUPPORT_ACCEPT,
+	IRC_ISUPPORT_AWAYLEN,
+	IRC_ISUPPORT_BOT,
+	IRC_ISUPPORT_CALLERID,
+	IRC_ISUPPORT_CASEMAPPING,
+	IRC_ISUPPORT_CHANLIMIT,
+	IRC_ISUPPORT_CHANMODES,
+	IRC_ISUPPORT_CHANNELLEN,
+	IRC_ISUPPORT_CHANTYPES,
+	IRC_ISUPPORT_CHATHISTORY,
+	IRC_ISUPPORT_CLIENTTAGDENY,
+	IRC_ISUPPORT_CNOTICE,
+	IRC_ISUPPORT_CPRIVMSG,
+	IRC_ISUPPORT_DEAF,
+	IRC_ISUPPORT_ELIST,
+	IRC_ISUPPORT_EXCEPTS,
+	IRC_ISUPPORT_EXTBAN,
+	IRC_ISUPPORT_HOSTLEN,
+	IRC_ISUPPORT_INVEX,
+	IRC_ISUPPORT_KEYLEN,
+	IRC_ISUPPORT_KICKLEN,
+	IRC_ISUPPORT_KNOCK,
+	IRC_ISUPPORT_LINELEN,
+	IRC_ISUPPORT_MAXBANS,
+	IRC_ISUPPORT_MAXCHANNELS,
+	IRC_ISUPPORT_MAXLIST,
+	IRC_ISUPPORT_MAXNICKLEN,
+	IRC_ISUPPORT_MAXTARGETS,
+	IRC_ISUPPORT_MODES,
+	IRC_ISUPPORT_MONITOR,
+	IRC_ISUPPORT_MSGREFTYPES,
+	IRC_ISUPPORT_NAMESX,
+	IRC_ISUPPORT_NETWORK,
+	IRC_ISUPPORT_NICKLEN,
+	IRC_ISUPPORT_PREFIX,
+	IRC_ISUPPORT_SAFELIST,
+	IRC_ISUPPORT_SILENCE,
+	IRC_ISUPPORT_STATUSMSG,
+	IRC_ISUPPORT_TARGMAX,
+	IRC_ISUPPORT_TOPICLEN,
+	IRC_ISUPPORT_UHNAMES,
+	IRC_ISUPPORT_USERIP,
+	IRC_ISUPPORT_USERLEN,
+	IRC_ISUPPORT_UTF8ONLY,
+	IRC_ISUPPORT_WATCH,
+	IRC_ISUPPORT_WHOX,
+	IRC_ISUPPORT_TOKENS,		/*!< Number of tokens (not a token) */
+};
+
+/*! \brief Rules for case-insensitive comparison of nicknames and channel names (CASEMAPPING ISUPPORT token) */
+enum irc_casemapping {
+	IRC_CASEMAPPING_RFC1459 = 0,		/*!< A-Z[\\]^ are equivalent to a-z{|}~ (default) */
+	IRC_CASEMAPPING_STRICT_RFC1459,		/*!< A-Z[\\] are equivalent to a-z{|} */
+	IRC_CASEMAPPING_ASCII,				/*!< A-Z are equivalent to a-z */
+};
+
+/*! \brief Channel mode types, from the CHANMODES and PREFIX ISUPPORT tokens */
+enum irc_chanmode_type {
+	IRC_CHANMODE_UNKNOWN = 0,	/*!< Mode not advertised by the server */
+	IRC_CHANMODE_LIST,			/*!< Type A: list mode, always has a parameter (e.g. +b) */
+	IRC_CHANMODE_PARAM,			/*!< Type B: always has a parameter (e.g. +k) */
+	IRC_CHANMODE_PARAM_SET,		/*!< Type C: has a parameter only when being set (e.g. +l) */
+	IRC_CHANMODE_FLAG,			/*!< Type D: never has a parameter (e.g. +m) */
+	IRC_CHANMODE_PREFIX,		/*!< Channel membership prefix mode, always has a nickname parameter (e.g. +o) */
+};
+
 /*! \brief IRC message */
 #ifdef EXPOSE_IRC_MSG
 /*! \note This is intentionally not opaque, so callers can stack allocate it if needed.
@@ -74,6 +164,7 @@ struct irc_msg {
 	enum irc_ctcp_type ctcp_type;
 	unsigned int ctcp:1;
 	char *body;
+	char *tags;
 };
 #else
 struct irc_msg;
@@ -132,6 +223,177 @@ const char *irc_client_nickname(struct irc_client *client);
 /*! \brief Whether the client is actively connected to an IRC server */
 int irc_client_connected(struct irc_client *client);
 
+/*!
+ * \brief Get the raw value of an RPL_ISUPPORT token advertised by the server
+ * \param client
+ * \param token
+ * \return Token value ("" if the token has no value)
+ * \retval NULL if the server has not advertised this token
+ * \note The returned value is only valid until the server next updates the token.
+ */
+const char *irc_client_isupport(struct irc_client *client, enum irc_isupport_token token);
+
+/*!
+ * \brief Get the raw value of any RPL_ISUPPORT token advertised by the server, by name
+ * \param client
+ * \param name Token name, e.g. "NETWORK"
+ * \return Same as irc_client_isupport
+ */
+const char *irc_client_isupport_name(struct irc_client *client, const char *name);
+
+/*!
+ * \brief Get the numeric value of an RPL_ISUPPORT token
+ * \param client
+ * \param token A token whose value is a number, e.g. IRC_ISUPPORT_NICKLEN or IRC_ISUPPORT_MODES
+ * \return Token value. 0 if the token was advertised without a value, which for limits means unlimited.
+ * \return If the server has not advertised the token, the protocol default (512 for LINELEN, 3 for MODES, 9 for NICKLEN), otherwise -1.
+ */
+int irc_client_isupport_int(struct irc_client *client, enum irc_isupport_token token);
+
+/*!
+ * \brief Get the maximum number of targets the server accepts for a command (TARGMAX / MAXTARGETS)
+ * \param client
+ * \param command e.g. "PRIVMSG"
+ * \return Maximum number of targets, 0 if unlimited
+ */
+int irc_client_targmax(struct irc_client *client, const char *command);
+
+/*! \brief Whether a name is a channel name (begins with one of the server's CHANTYPES) */
+int irc_client_is_channel(struct irc_client *client, const char *name);
+
+/*! \brief Get the type of a channel mode, according to the server's CHANMODES and PREFIX (beI,k,l,imnpst and (ov)@+ until it sends them) */
+enum irc_chanmode_type irc_client_chanmode_type(struct irc_client *client, char mode);
+
+/*!
+ * \brief Whether a channel mode change has a parameter
+ * \param client
+ * \param mode Channel mode
+ * \param add 1 if the mode is being set, 0 if it is being unset
+ * \retval 1 if it has a parameter, 0 if not
+ */
+int irc_client_chanmode_has_param(struct irc_client *client, char mode, int add);
+
+/*!
+ * \brief Get the channel membership mode for a membership prefix (e.g. 'o' for '@')
+ * \retval 0 if not a membership prefix
+ */
+char irc_client_prefix_mode(struct irc_client *client, char prefix);
+
+/*!
+ * \brief Get the channel membership prefix for a mode (e.g. '@' for 'o')
+ * \retval 0 if not a membership mode
+ */
+char irc_client_prefix_symbol(struct irc_client *client, char mode);
+
+/*!
+ * \brief Get the rank of a channel membership mode or prefix
+ * \return 0 for the highest rank (e.g. '@'), increasing for lower ranks
+ * \retval -1 if not a membership mode or prefix
+ */
+int irc_client_prefix_rank(struct irc_client *client, char c);
+
+/*!
+ * \brief Get the maximum number of channels of a given type that may be joined (CHANLIMIT)
+ * \param client
+ * \param chantype Channel type prefix, e.g. '#'
+ * \return Maximum number of channels, 0 if unlimited
+ * \retval -1 if unknown
+ */
+int irc_client_chanlimit(struct irc_client *client, char chantype);
+
+/*!
+ * \brief Get the maximum number of entries in a list mode (MAXLIST)
+ * \param client
+ * \param mode List mode, e.g. 'b'
+ * \return Maximum number of entries
+ * \retval -1 if unknown
+ */
+int irc_client_maxlist(struct irc_client *client, char mode);
+
+/*! \brief Get the casemapping used by the server (rfc1459, unless the server advertises otherwise) */
+enum irc_casemapping irc_client_casemapping(struct irc_client *client);
+
+/*! \brief Whether two nicknames or channel names are the same, according to the server's casemapping */
+int irc_client_name_eq(struct irc_client *client, const char *a, const char *b);
+
+/*!
+ * \brief Enable or disable tracking of channels, their members, topics, and modes
+ * \param client
+ * \param enable 1 to enable, 0 to disable (discarding any tracked state)
+ * \note State is built from the messages the client receives, so this should be enabled before connecting.
+ * \retval 0 on success, -1 on failure (including disabling while irc_loop is running)
+ */
+int irc_client_track_state(struct irc_client *client, int enable);
+
+/*!
+ * \brief Whether a user is in a channel
+ * \retval 1 if in channel, 0 if not, -1 if state tracking is not enabled
+ */
+int irc_state_channel_has(struct irc_client *client, const char *channel, const char *nick);
+
+/*!
+ * \brief Get the membership prefixes (e.g. @+) of a user in a channel
+ * \param client
+ * \param channel
+ * \param nick
+ * \param[out] buf
+ * \param len Size of buf
+ * \retval 0 on success, -1 if the user is not in the channel
+ */
+int irc_state_member_prefixes(struct irc_client *client, const char *channel, const char *nick, char *buf, size_t len);
+
+/*!
+ * \brief Get all channels the client is in
+ * \param client
+ * \param cb Callback to invoke for each channel. May be NULL to just get the count.
+ * \param data Custom user data for callback
+ * \note Callbacks must not call other irc_state functions for the same client.
+ * \return Number of channels
+ * \retval -1 if state tracking is not enabled
+ */
+int irc_state_channels(struct irc_client *client, void (*cb)(void *data, const char *channel), void *data);
+
+/*!
+ * \brief Get all members of a channel
+ * \param client
+ * \param channel
+ * \param cb Callback to invoke for each member, with its membership prefixes. May be NULL to just get the count.
+ * \param data Custom user data for callback
+ * \return Number of members
+ * \retval -1 if not in channel
+ */
+int irc_state_channel_members(struct irc_client *client, const char *channel, void (*cb)(void *data, const char *nick, const char *prefixes), void *data);
+
+/*!
+ * \brief Get all channels (shared with the client) a user is in
+ * \param client
+ * \param nick
+ * \param cb Callback to invoke for each channel, with the user's membership prefixes. May be NULL to just get the count.
+ * \param data Custom user data for callback
+ * \return Number of channels
+ * \retval -1 if user is not known
+ */
+int irc_state_user_channels(struct irc_client *client, const char *nick, void (*cb)(void *data, const char *channel, const char *prefixes), void *data);
+
+/*!
+ * \brief Get the user@host of a user
+ * \retval 0 on success, -1 if not known
+ */
+int irc_state_user_host(struct irc_client *client, const char *nick, char *buf, size_t len);
+
+/*!
+ * \brief Get the topic of a channel (empty if none)
+ * \retval 0 on success, -1 if not in channel
+ */
+int irc_state_channel_topic(struct irc_client *client, const char *channel, char *buf, size_t len);
+
+/*!
+ * \brief Get the modes of a channel, e.g. +ntl 50
+ * \note Membership modes and list modes (e.g. bans) are not included.
+ * \retval 0 on success, -1 if not in channel
+ */
+int irc_state_channel_modes(struct irc_client *client, const char *channel, char *buf, size_t len);
+
 /*!
  * \brief Set channels to autojoin on connect
  * \param client
@@ -211,6 +473,31 @@ int irc_client_msg(struct irc_client *client, const char *channel, const char *m
  */
 int irc_client_notice(struct irc_client *client, const char *channel, const char *msg);
 
+/*!
+ * \brief Send the same message to multiple channels and/or users
+ * \param client
+ * \param targets Names of channels or users
+ * \param ntargets Number of targets
+ * \param msg Message. Do NOT terminate with CR LF.
+ * \retval 0 on success, -1 on failure
+ * \note Targets are combined into as few PRIVMSGs as the server's TARGMAX and LINELEN allow.
+ *       If the server does not advertise TARGMAX, one PRIVMSG is sent per target.
+ *       Use irc_client_target_error_callback to find out which targets could not be messaged.
+ */
+int irc_client_msg_multi(struct irc_client *client, const char *const *targets, size_t ntargets, const char *msg);
+
+/*! \brief Same as irc_client_msg_multi, but send NOTICEs instead of PRIVMSGs */
+int irc_client_notice_multi(struct irc_client *client, const char *const *targets, size_t ntargets, const char *msg);
+
+/*!
+ * \brief Set callback function for errors caused by sends to individual targets of irc_client_msg_multi or irc_client_notice_multi
+ * \param client
+ * \param cb Callback function, which receives the target, error numeric, and error text. NULL to disable.
+ * \param data Custom data to pass to callback function
+ * \note The callback is executed by the thread that calls irc_client_process (e.g. irc_loop)
+ */
+void irc_client_target_error_callback(struct irc_client *client, void (*cb)(void *data, const char *target, int numeric, const char *reason), void *data);
+
 /*!
  * \brief Send a PONG reply to a PING message
  * \param client
@@ -219,9 +506,30 @@ int irc_client_notice(struct irc_client *client, const char *channel, const char
  */
 int irc_client_pong(struct irc_client *client, struct irc_msg *msg);
 
-/*! \brief Get a CTCP code from a string */
+/*! \brief Get a CTCP code from a string (case insensitive). CTCP_UNKNOWN if it's not a standard verb. */
 enum irc_ctcp_type irc_ctcp_from_string(const char *s);
 
+/*!
+ * \brief Find the next CTCP message in a message body, without modifying it
+ * \param[in,out] s Where to start looking. Advanced past the CTCP message found, for the next call.
+ * \param[out] ctcp
+ * \note A body may contain any number of CTCP messages, mixed with ordinary text.
+ *       A missing closing delimiter at the end of the body is tolerated.
+ * \retval 1 if one was found, 0 if there are no more
+ */
+int irc_ctcp_next(const char **s, struct irc_ctcp *ctcp);
+
+/*!
+ * \brief Undo the low-level (M-QUOTE) and CTCP-level (X-QUOTE) quoting of CTCP arguments
+ * \param args
+ * \param len Length of args
+ * \param[out] buf NUL terminated. May be the same as args. The unquoted arguments may themselves contain NULs.
+ * \param buflen Size of buf
+ * \return Length of the unquoted arguments
+ * \retval -1 if buf is too small
+ */
+int irc_ctcp_unquote(const char *args, size_t len, char *buf, size_t buflen);
+
 /*! \brief Get a string representation of a CTCP code */
 const char *irc_ctcp_name(enum irc_ctcp_type ctcp);
 
@@ -232,9 +540,258 @@ const char *irc_ctcp_name(enum irc_ctcp_type ctcp);
  * \param ctcp CTCP command to request
  * \retval 0 on success, -1 on failure
  * \note Use irc_client_action to send a CTCP action, rather than using this function directly.
+ * \note For CTCP_PING, the payload is a timestamp unique to the request, and replies are matched to it (see irc_client_ping_callback).
  */
 int irc_client_ctcp_request(struct irc_client *client, const char *user, enum irc_ctcp_type ctcp);
 
+/*!
+ * \brief Receive round trip times of CTCP pings sent with irc_client_ctcp_request
+ * \param client
+ * \param cb Callback from the irc_loop thread for each reply, with the target pinged, the nick that replied, and the round trip time in us.
+ *           For pings that get no reply within 30 seconds, it is called with a NULL nick and a time of -1.
+ *           A ping to a channel may get a reply from every member.
+ * \param data Custom user data for callback
+ * \note Once set, matched replies are not passed to the irc_loop callback.
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_ping_callback(struct irc_client *client, void (*cb)(void *data, const char *target, const char *nick, long long rtt), void *data);
+
+/*!
+ * \brief Get the last measured CTCP ping round trip time to a user
+ * \param client
+ * \param nick
+ * \return Round trip time, in us
+ * \retval -1 if not known
+ */
+long long irc_client_ping_rtt(struct irc_client *client, const char *nick);
+
+/*!
+ * \brief Answer standard CTCP queries (VERSION, PING, TIME, CLIENTINFO, SOURCE) in the library
+ * \param client
+ * \param version VERSION reply. NULL to stop answering queries, which fails while irc_loop is running.
+ * \param source SOURCE reply. NULL to leave SOURCE queries to the application.
+ * \note Replies are rate limited per source host and globally (see irc_client_ctcp_limits),
+ *       and queries over budget are dropped silently, so a CTCP flood can't make us flood the server.
+ *       Answered and dropped queries are not passed to the irc_loop callback.
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_ctcp_responder(struct irc_client *client, const char *version, const char *source);
+
+/*!
+ * \brief Set the CTCP responder's rate limits
+ * \param client
+ * \param source_burst Replies each source host may get at once (default 3)
+ * \param source_interval ms for a source host to earn another reply (default 10000)
+ * \param global_burst Replies that may be sent at once overall (default 6)
+ * \param global_interval ms to earn another reply overall (default 2000)
+ * \note Bursts may be at most 255.
+ * \retval 0 on success, -1 on failure (including if the responder is not enabled)
+ */
+int irc_client_ctcp_limits(struct irc_client *client, unsigned int source_burst, unsigned int source_interval, unsigned int global_burst, unsigned int global_interval);
+
+/*! \brief Number of CTCP queries the responder has dropped for being over budget */
+unsigned long irc_client_ctcp_dropped(struct irc_client *client);
+
+/*! \brief Status of a DCC transfer, as reported to the DCC callback */
+enum irc_dcc_status {
+	IRC_DCC_STARTED,	/*!< The receiver connected */
+	IRC_DCC_PROGRESS,	/*!< Data is flowing. Reported at most once a second per transfer. */
+	IRC_DCC_DONE,
+	IRC_DCC_FAILED,		/*!< Connection failure, timeout, or the receiver hung up early */
+};
+
+/*!
+ * \brief Configure DCC
+ * \param client
+ * \param address Address to advertise in offers. NULL to use the address we're connected to the server from (which is wrong behind NAT).
+ * \param minport Lowest port to listen on for offers. 0 for any.
+ * \param maxport Highest port to listen on for offers. 0 for any.
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_dcc_config(struct irc_client *client, const char *address, unsigned int minport, unsigned int maxport);
+
+/*!
+ * \brief Set a callback for DCC transfer status
+ * \param client
+ * \param cb Callback, called from the thread running the transfer (irc_loop's, or a DCC worker's) with the transfer ID,
+ *        bytes sent (including any resumed part), and file size.
+ * \param data
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_dcc_callback(struct irc_client *client, void (*cb)(void *data, unsigned int id, enum irc_dcc_status status, uint64_t bytes, uint64_t size), void *data);
+
+/*!
+ * \brief Offer a file to a user with DCC SEND
+ * \param client
+ * \param nick
+ * \param path
+ * \param passive If nonzero, make a passive (reverse) offer, in which the receiver listens and we connect to it.
+ *        Use this if we can't accept incoming connections.
+ * \note Transfers are run by irc_loop, and data is sent with sendfile(), without copying through userspace.
+ *       Resume requests (DCC RESUME) are accepted automatically.
+ * \return Transfer ID
+ * \retval -1 on failure
+ */
+int irc_client_dcc_send(struct irc_client *client, const char *nick, const char *path, int passive);
+
+/*!
+ * \brief Cancel (or reject) a DCC transfer or offer. The DCC callback is not called for it.
+ * \retval 0 on success, -1 if no such transfer
+ */
+int irc_client_dcc_cancel(struct irc_client *client, unsigned int id);
+
+/*!
+ * \brief Queue a file for a user, to be offered with DCC SEND once a slot is free (see irc_client_dcc_slots)
+ * \param client
+ * \param nick
+ * \param path
+ * \param passive Same as for irc_client_dcc_send
+ * \note While queued, the user is told their position by NOTICE, and reminded of it every 5 minutes.
+ *       Queued sends are started by irc_loop, first come, first served.
+ * \return Transfer ID, which it keeps once started
+ * \retval -1 on failure
+ */
+int irc_client_dcc_queue(struct irc_client *client, const char *nick, const char *path, int passive);
+
+/*!
+ * \brief Get the position of a queued send
+ * \return Position, starting from 1
+ * \retval 0 if not queued (started already, or no such transfer)
+ */
+int irc_client_dcc_queue_position(struct irc_client *client, unsigned int id);
+
+/*!
+ * \brief Limit the number of sends at once. Sends beyond this wait in the queue (sends made with irc_client_dcc_send are never held back, but do count).
+ * \param client
+ * \param slots Most sends at once. 0 for unlimited (the default).
+ * \param per_nick Most sends to the same nick at once. 0 for unlimited (the default).
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_dcc_slots(struct irc_client *client, unsigned int slots, unsigned int per_nick);
+
+/*!
+ * \brief Cap the bandwidth used by DCC sends
+ * \param client
+ * \param global Bytes per second, for all sends together. 0 for unlimited (the default).
+ * \param per_nick Bytes per second, for all sends to the same nick together. 0 for unlimited (the default).
+ * \note The global cap is shared evenly between the sends that can use it, so a fast receiver can't starve the others.
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_dcc_bandwidth(struct irc_client *client, uint64_t global, uint64_t per_nick);
+
+/*!
+ * \brief Start worker threads to run DCC transfers, instead of irc_loop's thread. New transfers are spread between them.
+ * \param client
+ * \param workers Number of threads (at most 16). This can only be done once.
+ * \note The DCC callback is then called from the worker threads.
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_dcc_workers(struct irc_client *client, unsigned int workers);
+
+/*!
+ * \brief Pin a transfer to a worker thread (or irc_loop's thread)
+ * \param client
+ * \param id A queued send, or an offer to us that hasn't been accepted yet
+ * \param worker Worker number, starting from 1. 0 for irc_loop's thread.
+ * \retval 0 on success, -1 on failure (including if the transfer has already started)
+ */
+int irc_client_dcc_pin(struct irc_client *client, unsigned int id, unsigned int worker);
+
+/*! \brief A DCC SEND or DCC CHAT offer to us */
+struct irc_dcc_offer {
+	unsigned int id;			/*!< Transfer ID, for irc_client_dcc_accept or irc_client_dcc_chat_accept */
+	const char *nick;			/*!< Sender */
+	const char *filename;		/*!< As offered. Sanitize it before using it in a path! */
+	uint64_t size;				/*!< File size, 0 if not given */
+	int passive;				/*!< Whether it's a passive offer (we listen, the sender connects) */
+	int chat;					/*!< Whether it's a chat rather than a file */
+};
+
+/*!
+ * \brief Set a callback for DCC SEND and DCC CHAT offers to us
+ * \param client
+ * \param cb Callback. Accept the offer with irc_client_dcc_accept (or irc_client_dcc_chat_accept), or reject it with irc_client_dcc_cancel,
+ *        either in the callback or later. Offers not accepted in 2 minutes are reported as failed.
+ * \param data
+ * \note If no callback is set, offers are passed to the irc_loop callback instead.
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_dcc_offer_callback(struct irc_client *client, void (*cb)(void *data, const struct irc_dcc_offer *offer), void *data);
+
+/*! \brief Resume into an existing partial file, rather than overwriting it */
+#define IRC_DCC_RESUME (1 << 0)
+/*! \brief Send 64-bit acknowledgements, for senders that expect them for files over 4 GB */
+#define IRC_DCC_ACK64 (1 << 1)
+
+/*!
+ * \brief Accept a DCC SEND offer to us
+ * \param client
+ * \param id ID from the offer callback
+ * \param path File to save to. It is preallocated to the full size before the transfer starts.
+ * \param flags IRC_DCC_RESUME and/or IRC_DCC_ACK64
+ * \note Progress and completion are reported to the DCC callback, like for sends.
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_dcc_accept(struct irc_client *client, unsigned int id, const char *path, int flags);
+
+/*! \brief Information about a DCC transfer */
+struct irc_dcc_info {
+	char nick[64];				/*!< Other side */
+	char filename[256];			/*!< For transfers to us, as offered */
+	uint64_t size;
+	uint64_t bytes;				/*!< Bytes transferred, including any resumed part */
+	uint32_t crc32;				/*!< For transfers to us, CRC-32 (as computed by zlib's crc32) of the data received so far, including any resumed part */
+	int receiving;
+};
+
+/*!
+ * \brief Get information about a DCC transfer
+ * \note This also works in the DCC callback for a transfer that just finished, e.g. to check the CRC-32 of a completed file.
+ * \retval 0 on success, -1 if no such transfer
+ */
+int irc_client_dcc_info(struct irc_client *client, unsigned int id, struct irc_dcc_info *info);
+
+/*!
+ * \brief Offer a direct chat (DCC CHAT) to a user
+ * \param client
+ * \param nick
+ * \param passive Same as for irc_client_dcc_send
+ * \note Chats are run like transfers, and use the same DCC callback: IRC_DCC_STARTED once connected,
+ *       and IRC_DCC_DONE when the other side hangs up. Chats never time out once connected.
+ *       Messages can be queued with irc_client_dcc_chat_send before then.
+ * \return Chat ID
+ * \retval -1 on failure
+ */
+int irc_client_dcc_chat(struct irc_client *client, const char *nick, int passive);
+
+/*!
+ * \brief Accept a DCC CHAT offer to us
+ * \param client
+ * \param id ID from the offer callback
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_dcc_chat_accept(struct irc_client *client, unsigned int id);
+
+/*!
+ * \brief Set a callback for lines received in DCC chats
+ * \param client
+ * \param cb Callback, called from the thread running the chat with the chat ID and the line as a PRIVMSG,
+ *        with prefix set to the other side's nick and channel to ours. CTCPs (e.g. ACTION) are left for the callback to parse.
+ * \param data
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_dcc_chat_callback(struct irc_client *client, void (*cb)(void *data, unsigned int id, struct irc_msg *msg), void *data);
+
+/*!
+ * \brief Send a line in a DCC chat
+ * \param client
+ * \param id Chat ID
+ * \param msg Line to send, without a line ending
+ * \note This does not block. Lines are queued if the other side isn't keeping up (or isn't connected yet), up to 64 KB.
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_dcc_chat_send(struct irc_client *client, unsigned int id, const char *msg);
+
 /*!
  * \brief Send a CTCP reply to another user (using NOTICE)
  * \param client
@@ -273,6 +830,18 @@ int irc_client_change_nick(struct irc_client *client, const char *nick);
  */
 int irc_client_set_nick(struct irc_client *client, const char *nick);
 
+/*! \brief Get the string pool the client uses for nicknames, hostmasks, and channel names */
+struct irc_intern_pool *irc_client_intern_pool(struct irc_client *client);
+
+/*!
+ * \brief Use a different (e.g. shared) string pool for a client
+ * \param client
+ * \param pool Pool to use. The client takes its own reference, so the caller may release its reference afterwards.
+ * \note This must be called before enabling state tracking
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_set_intern_pool(struct irc_client *client, struct irc_intern_pool *pool);
+
 /*!
  * \brief Set a channel topic
  * \param client
@@ -290,6 +859,36 @@ int irc_client_set_channel_topic(struct irc_client *client, const char *channel,
  */
 int irc_client_list_channels(struct irc_client *client, const char *channels);
 
+/*! \brief Filter for irc_client_list */
+struct irc_list_filter {
+	const char *pattern;	/*!< Channel name glob (* and ?), NULL for all */
+	const char *topic;		/*!< Case-insensitive substring the topic must contain, NULL for any */
+	int min_users;			/*!< Minimum number of users, 0 for no minimum */
+	int max_users;			/*!< Maximum number of users, 0 for no maximum */
+	size_t top;				/*!< Only report this many of the largest matching channels, 0 for all */
+};
+
+/*! \brief A channel in a listing */
+struct irc_list_entry {
+	const char *channel;
+	int users;
+	const char *topic;
+};
+
+/*!
+ * \brief List channels on the server, filtered as the replies arrive
+ * \param client
+ * \param filter Conditions channels must meet. Conditions the server supports (ELIST) are also sent to the server.
+ * \param entry_cb Callback for each matching channel. If filter->top is nonzero, this is called at the end of the listing, largest channel first.
+ * \param end_cb Callback for the end of the listing, with the number of matching channels and the total number of channels received
+ * \param data Custom user data for callbacks
+ * \note Callbacks are invoked from the irc_loop thread. Replies to the listing are not passed to the irc_loop callback.
+ *       Only one listing may be in progress at a time.
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_list(struct irc_client *client, const struct irc_list_filter *filter,
+	void (*entry_cb)(void *data, const struct irc_list_entry *entry), void (*end_cb)(void *data, size_t matched, size_t total), void *data);
+
 /*!
  * \brief Invite a user to a channel
  * \param client
@@ -299,6 +898,327 @@ int irc_client_list_channels(struct irc_client *client, const char *channels);
  */
 int irc_client_invite_user(struct irc_client *client, const char *nickname, const char *channel);
 
+/*! \brief Information about a user, from WHO, WHOX, or WHOIS */
+struct irc_user_info {
+	const char *nick;
+	const char *user;
+	const char *host;
+	const char *account;	/*!< Services account, NULL if not logged in (or unknown, if the server does not support WHOX) */
+	const char *realname;
+	int away;				/*!< Whether the user is away */
+	int oper;				/*!< Whether the user is an IRC operator */
+	time_t fetched;			/*!< When this information was received */
+};
+
+/*!
+ * \brief Enable caching of user information from WHO, WHOX, and WHOIS replies
+ * \param client
+ * \param ttl Number of seconds information remains valid. 0 for the default (5 minutes).
+ * \note Cached information is updated on NICK, QUIT, CHGHOST, ACCOUNT, and AWAY.
+ *       The cache is enabled automatically by irc_client_user_lookup and irc_client_channel_lookup.
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_who_cache(struct irc_client *client, int ttl);
+
+/*!
+ * \brief Get cached information about a user, without sending any requests
+ * \param client
+ * \param nick
+ * \param[out] info
+ * \param[out] buf Buffer for the strings in info
+ * \param len Size of buf
+ * \retval 0 on success, -1 if no valid information is cached
+ */
+int irc_client_user_cached(struct irc_client *client, const char *nick, struct irc_user_info *info, char *buf, size_t len);
+
+/*!
+ * \brief Look up information about a user
+ * \param client
+ * \param nick
+ * \param cb Callback with the information, or NULL info if the user does not exist.
+ *           Called immediately if the information is cached, otherwise from the irc_loop thread once the server replies.
+ * \param data Custom user data for callback
+ * \note Uses WHOX if the server supports it, and WHO otherwise. Concurrent lookups for the same nick share a single request.
+ *        Replies to requests made by this function are not passed to the irc_loop callback.
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_user_lookup(struct irc_client *client, const char *nick, void (*cb)(void *data, const char *nick, const struct irc_user_info *info), void *data);
+
+/*!
+ * \brief Look up information about all users in a channel, adding it to the cache
+ * \param client
+ * \param channel
+ * \param cb Callback from the irc_loop thread once the lookup is complete, with the number of users found
+ * \param data Custom user data for callback
+ * \note Concurrent lookups for the same channel share a single request.
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_channel_lookup(struct irc_client *client, const char *channel, void (*cb)(void *data, const char *channel, int count), void *data);
+
+enum irc_netsplit_type {
+	IRC_NETSPLIT_QUIT,		/*!< Users quit because their server split from the network */
+	IRC_NETSPLIT_JOIN,		/*!< Users from a previous split rejoined when their server reconnected */
+};
+
+/*! \brief A netsplit or netjoin */
+struct irc_netsplit {
+	enum irc_netsplit_type type;
+	const char *server1;	/*!< Server that remained connected to the network */
+	const char *server2;	/*!< Server that split */
+	const char *const *nicks;	/*!< Affected users */
+	size_t count;			/*!< Number of nicks */
+};
+
+/*!
+ * \brief Aggregate netsplits and netjoins
+ * \param client
+ * \param cb Callback to invoke once per netsplit or netjoin, once it is over, from the irc_loop thread
+ * \param data Custom user data for callback
+ * \note Once set, the QUITs and JOINs that are part of a netsplit or netjoin are not passed to the irc_loop callback,
+ *       and tracked state is updated in bulk. This should be set before calling irc_loop.
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_netsplit_callback(struct irc_client *client, void (*cb)(void *data, const struct irc_netsplit *split), void *data);
+
+/*! \brief An IRCv3 batch of messages */
+struct irc_batch {
+	const char *ref;				/*!< Reference tag */
+	const char *type;				/*!< Batch type, e.g. "chathistory" or "netsplit" */
+	const char *params;				/*!< Batch parameters, NULL if none */
+	struct irc_msg **msgs;			/*!< Messages in the batch, in the order received, not including those in nested batches */
+	size_t count;					/*!< Number of messages */
+	const struct irc_batch *const *children;	/*!< Nested batches, in the order they were closed */
+	size_t nchildren;				/*!< Number of nested batches */
+	const struct irc_batch *parent;	/*!< Enclosing batch, NULL for the outermost batch */
+};
+
+/*!
+ * \brief Receive IRCv3 batches as a whole, rather than message by message
+ * \param client
+ * \param cb Callback to invoke once per batch, when the outermost batch is closed, from the irc_loop thread.
+ *           The batch and its messages are only valid for the duration of the callback.
+ * \param data Custom user data for callback
+ * \note Once set, the batch capability is requested when logging in, and messages that are part of a batch
+ *       (including the BATCH commands themselves) are not passed to the irc_loop callback.
+ *       Tracked state is still updated as each message arrives. This must be set before logging in.
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_batch_callback(struct irc_client *client, void (*cb)(void *data, const struct irc_batch *batch), void *data);
+
+/*!
+ * \brief Fill in channel history missed while not in a channel, using the IRCv3 chathistory extension
+ * \param client
+ * \param enable 1 to enable, 0 to disable (forgetting the last message seen in each channel)
+ * \note Once enabled, the last message seen in each channel is remembered, and whenever the client joins a channel again,
+ *       everything since is requested from the server, a page at a time, for several channels at once.
+ *       These messages are passed to the irc_loop callback like any other, with their original time in the "time" tag,
+ *       but tracked state is not updated from them. Messages already received are not passed on again.
+ *       This must be enabled before logging in, so the necessary capabilities can be requested.
+ * \retval 0 on success, -1 on failure (including disabling while irc_loop is running)
+ */
+int irc_client_chathistory_fill(struct irc_client *client, int enable);
+
+/*!
+ * \brief Set the last message seen in a channel, e.g. as saved by a previous run of the application
+ * \param client
+ * \param channel
+ * \param msgid Message ID (msgid tag), NULL if unknown
+ * \param timestamp Server time (time tag) of the message, NULL if unknown
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_chathistory_mark(struct irc_client *client, const char *channel, const char *msgid, const char *timestamp);
+
+/*!
+ * \brief Get the last message seen in a channel, e.g. to save it for the next run of the application
+ * \param client
+ * \param channel
+ * \param[out] msgid Message ID, empty if unknown
+ * \param msgidlen Size of msgid
+ * \param[out] timestamp Server time of the message, empty if unknown
+ * \param timestamplen Size of timestamp
+ * \retval 0 on success, -1 if no message has been seen in the channel
+ */
+int irc_client_chathistory_last(struct irc_client *client, const char *channel, char *msgid, size_t msgidlen, char *timestamp, size_t timestamplen);
+
+/*! \brief Segments of the time taken for a message to reach the server */
+enum irc_latency_segment {
+	IRC_LATENCY_SEND = 0,	/*!< From the call to send the message, until it has been written to the connection */
+	IRC_LATENCY_NETWORK,	/*!< From when the message was written, until the server echoed it back */
+	IRC_LATENCY_TOTAL,		/*!< From the call to send the message, until the server echoed it back */
+	IRC_LATENCY_SEGMENTS,	/*!< Number of segments, not a segment */
+};
+
+/*! \brief Latency statistics, in microseconds */
+struct irc_latency_stats {
+	uint64_t count;			/*!< Number of messages measured */
+	uint64_t min;
+	uint64_t max;
+	uint64_t mean;
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t p999;
+};
+
+/*!
+ * \brief Measure how long messages sent with irc_client_msg and irc_client_notice take to reach the server
+ * \param client
+ * \param enable 1 to enable, 0 to disable (discarding any measurements). Must not be disabled while other threads are sending messages.
+ * \note This uses the IRCv3 echo-message capability, and labeled-response if available, so it must be enabled before logging in.
+ *       Echoes of messages sent by this client (measured or not) are not passed to the irc_loop callback.
+ *       Percentiles are accurate to within about 6%.
+ * \retval 0 on success, -1 on failure (including disabling while irc_loop is running)
+ */
+int irc_client_latency_tracking(struct irc_client *client, int enable);
+
+/*!
+ * \brief Get latency statistics
+ * \param client
+ * \param segment
+ * \param[out] stats
+ * \retval 0 on success, -1 if latency tracking is not enabled
+ */
+int irc_client_latency_stats(struct irc_client *client, enum irc_latency_segment segment, struct irc_latency_stats *stats);
+
+/*!
+ * \brief Get a latency percentile
+ * \param client
+ * \param segment
+ * \param percentile 0 to 100, e.g. 99.9
+ * \return Latency in microseconds (0 if nothing has been measured yet)
+ * \retval -1 if latency tracking is not enabled
+ */
+long long irc_client_latency_percentile(struct irc_client *client, enum irc_latency_segment segment, double percentile);
+
+/*! \brief Discard all latency measurements so far */
+void irc_client_latency_reset(struct irc_client *client);
+
+/*!
+ * \brief Queue a channel mode change, to be sent together with other pending changes for the channel
+ * \param client
+ * \param channel Channel name
+ * \param add 1 to set the mode, 0 to unset it
+ * \param mode Mode character, e.g. 'o', 'v', 'b'
+ * \param arg Mode argument (e.g. nickname or ban mask), NULL if the mode does not take one
+ * \retval 0 on success, -1 on failure
+ * \note Pending changes are combined into as few MODE messages as the server's MODES and LINELEN allow.
+ *       They are sent once the coalescing window elapses (this requires irc_loop), once enough
+ *       changes are pending to fill a MODE message, or when irc_client_mode_flush is called.
+ *       If a change is queued for a mode and argument that already has a pending change, only the latest change is kept.
+ */
+int irc_client_mode_queue(struct irc_client *client, const char *channel, int add, char mode, const char *arg);
+
+/*!
+ * \brief Immediately send pending mode changes
+ * \param client
+ * \param channel Channel whose changes to send. NULL for all channels.
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_mode_flush(struct irc_client *client, const char *channel);
+
+/*!
+ * \brief Configure when queued mode changes are sent
+ * \param client
+ * \param ms Maximum time to wait for more changes, once a change is queued for a channel (default 250)
+ * \param threshold Number of pending changes for a channel that causes them to be sent immediately.
+ *                  0 (default) to send as soon as there are enough to fill a MODE message.
+ */
+void irc_client_mode_window(struct irc_client *client, int ms, int threshold);
+
+/*! \brief Get a casemapping from its CASEMAPPING token value. Unknown casemappings are treated as ascii. */
+enum irc_casemapping irc_casemapping_from_string(const char *s);
+
+/*! \brief Get the CASEMAPPING token value for a casemapping */
+const char *irc_casemapping_name(enum irc_casemapping casemapping);
+
+/*! \brief Fold a single character to lowercase using a casemapping */
+char irc_casemap_char(enum irc_casemapping casemapping, char c);
+
+/*!
+ * \brief Fold a string to lowercase using a casemapping
+ * \param casemapping
+ * \param[out] dst Destination buffer, at least len bytes long. May be the same as src.
+ * \param src Source string
+ * \param len Number of bytes to fold
+ */
+void irc_casemap_fold(enum irc_casemapping casemapping, char *dst, const char *src, size_t len);
+
+/*!
+ * \brief Hash a string, such that strings that are equal under a casemapping have the same hash
+ * \param casemapping
+ * \param s String
+ * \param len Length of s
+ * \return 64-bit hash, suitable for hash tables
+ */
+uint64_t irc_casemap_hash(enum irc_casemapping casemapping, const char *s, size_t len);
+
+/*! \brief Same as irc_casemap_hash, for a NUL-terminated string */
+uint64_t irc_casemap_strhash(enum irc_casemapping casemapping, const char *s);
+
+/*! \brief Whether the first len bytes of two strings are equal under a casemapping */
+int irc_casemap_memeq(enum irc_casemapping casemapping, const char *a, const char *b, size_t len);
+
+/*! \brief Whether two strings are equal under a casemapping */
+int irc_casemap_eq(enum irc_casemapping casemapping, const char *a, const char *b);
+
+/*! \brief strcmp for strings under a casemapping */
+int irc_casemap_cmp(enum irc_casemapping casemapping, const char *a, const char *b);
+
+/*!
+ * \brief A pool of interned (deduplicated, reference counted) strings
+ * \note Interned strings are stable, so two interned strings are identical if and only if they are the same pointer.
+ *       Pools are thread-safe and may be shared between clients.
+ */
+struct irc_intern_pool;
+
+/*!
+ * \brief Create a string pool
+ * \param casemapping Casemapping used for the precomputed hashes, and irc_intern_caseeq
+ * \return Pool, which must be released with irc_intern_pool_unref
+ * \retval NULL on failure
+ */
+struct irc_intern_pool *irc_intern_pool_new(enum irc_casemapping casemapping);
+
+/*! \brief Add an owner to a pool */
+void irc_intern_pool_ref(struct irc_intern_pool *pool);
+
+/*! \brief Remove an owner from a pool, destroying the pool (and all its strings) if it was the last */
+void irc_intern_pool_unref(struct irc_intern_pool *pool);
+
+/*! \brief Get the casemapping of a pool */
+enum irc_casemapping irc_intern_pool_casemapping(struct irc_intern_pool *pool);
+
+/*! \brief Get the number of distinct strings in a pool */
+size_t irc_intern_pool_count(struct irc_intern_pool *pool);
+
+/*!
+ * \brief Intern a string
+ * \param pool
+ * \param s String, need not be NUL-terminated
+ * \param len Length of s
+ * \return Interned, NUL-terminated copy of s, with a new reference that must be released with irc_intern_release
+ * \retval NULL on failure
+ */
+const char *irc_intern(struct irc_intern_pool *pool, const char *s, size_t len);
+
+/*! \brief Same as irc_intern, for a NUL-terminated string */
+const char *irc_intern_str(struct irc_intern_pool *pool, const char *s);
+
+/*! \brief Add a reference to an interned string. Cheaper than interning it again. */
+const char *irc_intern_ref(struct irc_intern_pool *pool, const char *s);
+
+/*! \brief Release a reference to an interned string. NULL is allowed. */
+void irc_intern_release(struct irc_intern_pool *pool, const char *s);
+
+/*! \brief Get the casemapped hash (the same as irc_casemap_hash) of an interned string, without recomputing it */
+uint64_t irc_intern_hash(const char *s);
+
+/*! \brief Get the length of an interned string */
+size_t irc_intern_len(const char *s);
+
+/*! \brief Whether two interned strings from the same pool are equal under the pool's casemapping */
+int irc_intern_caseeq(struct irc_intern_pool *pool, const char *a, const char *b);
+
 /*!
  * \brief Parse data sent from the server
  * \param[out] msg
@@ -323,13 +1243,26 @@ int irc_parse_msg_type(struct irc_msg *msg);
  * \brief Parse a CTCP message
  * \param msg
  * \note May only be called after irc_parse_msg_type, and if irc_msg_is_ctcp() == 1
+ *       The body is replaced with the (unquoted) arguments of the first CTCP message in it,
+ *       which modifies it. Use irc_ctcp_next to look at the body without modifying it.
  *       If this function is not called, irc_msg_ctcp_type will return CTCP_UNPARSED.
  *       This means you can avoid this parsing overhead if you don't need
  *       to call irc_msg_ctcp_type later.
- * \retval 0 on success, -1 on failure
+ * \retval 0 on success, -1 on failure (including if the verb is not a standard one)
  */
 int irc_parse_msg_ctcp(struct irc_msg *msg);
 
+/*!
+ * \brief Update client state from a received message
+ * \param client
+ * \param msg
+ * \note May only be called after irc_parse_msg_type.
+ *       irc_loop does this automatically; applications that read and parse messages themselves should call this for each message.
+ * \retval 0 on success, -1 on failure
+ * \retval 1 if the message was consumed by the library (e.g. a reply to irc_client_list), and should not be processed further
+ */
+int irc_client_process(struct irc_client *client, struct irc_msg *msg);
+
 /*!
  * \brief Get the IRC message prefix.
  * \param msg
@@ -397,16 +1330,392 @@ const char *irc_msg_channel(struct irc_msg *msg);
  */
 char *irc_msg_body(struct irc_msg *msg);
 
+/*!
+ * \brief Get the raw IRCv3 message tags
+ * \param msg
+ * \note May only be called after irc_parse_msg
+ * \return Tags, without the leading @, still escaped
+ * \retval NULL, if the message has no tags
+ */
+const char *irc_msg_tags(struct irc_msg *msg);
+
+/*!
+ * \brief Get the value of an IRCv3 message tag
+ * \param msg
+ * \param key Tag name, e.g. "time" or "batch"
+ * \param[out] buf Buffer for the unescaped value. Empty for tags without a value.
+ * \param len Size of buf
+ * \retval 0 if the tag is present, -1 if not
+ */
+int irc_msg_tag(struct irc_msg *msg, const char *key, char *buf, size_t len);
+
 /*!
  * \brief Execute a loop that will receive and process IRC messages. To make the loop exit, call irc_disconnect from another thread.
  * \param client
- * \param logfile Optional log file to which to log messages (NULL if don't log)
+ * \param logfile Optional log file to which to log messages (NULL if don't log).
+ *        This is written synchronously, so a slow disk holds up processing messages. irc_client_protolog_open is better.
  * \param cb Callback function to execute for each received message
  * \param data Custom data to pass to callback function
  * \note This is a high-level convenience function that calls irc_poll and irc_read; you do not need to use this function.
  */
 void irc_loop(struct irc_client *client, FILE *logfile, void (*cb)(void *data, struct irc_msg *msg), void *data);
 
+/*! \brief Protocol log settings */
+struct irc_protolog_config {
+	const char *path;			/*!< Log file, appended to if it exists */
+	size_t buffer_size;			/*!< Bytes of lines that can be waiting to be written (rounded up to a power of 2, at least 64 KB). 0 for 1 MB. */
+	uint64_t max_size;			/*!< Rotate the file once it would exceed this many bytes. 0 for no limit. */
+	unsigned int max_age;		/*!< Rotate the file once it's this many seconds old. 0 for no limit. */
+	int block;					/*!< If the buffer is full, wait for room rather than dropping lines */
+	int timestamps;				/*!< Prefix each line with the local time it was received: [YYYY-MM-DD HH:MM:SS.mmm] */
+	const char *archive;		/*!< If not NULL, also add each line to the message archive in this directory (see irc_archive_open) */
+	int search;					/*!< Keep a full-text index of the archive (see irc_archive_index) */
+};
+
+/*! \brief Protocol log counters */
+struct irc_protolog_stats {
+	uint64_t lines;				/*!< Lines logged */
+	uint64_t dropped;			/*!< Lines dropped because the buffer was full */
+	uint64_t bytes;				/*!< Bytes written */
+	uint64_t rotations;			/*!< Number of times the file was rotated */
+};
+
+/*!
+ * \brief Log every line irc_loop receives, without holding it up
+ * \param client
+ * \param config
+ * \note Lines are handed to a writer thread, which writes them in large batches.
+ *       Rotated files are renamed to the path plus when they were started, e.g. client.txt.20230101-120000.
+ * \retval 0 on success, -1 on failure
+ */
+int irc_client_protolog_open(struct irc_client *client, const struct irc_protolog_config *config);
+
+/*!
+ * \brief Stop protocol logging, after writing out any lines still waiting
+ * \retval 0 on success, -1 if not enabled or irc_loop is running
+ */
+int irc_client_protolog_close(struct irc_client *client);
+
+/*!
+ * \brief Get protocol log counters
+ * \retval 0 on success, -1 if not enabled
+ */
+int irc_client_protolog_stats(struct irc_client *client, struct irc_protolog_stats *stats);
+
+/*! \brief A message archive being written */
+struct irc_archive;
+
+/*!
+ * \brief Open a message archive for writing, creating it if needed
+ * \param dir Directory to keep it in
+ * \param segment_size Size of each segment file. 0 for 64 MB.
+ * \note Messages are stored compressed, in blocks indexed by time and channel, so irc_archive_query
+ *       only has to read the blocks that can have the messages it's looking for.
+ *       An archive can only be written by one writer at a time, but can be read while it's being written.
+ * \return Archive, NULL on failure
+ */
+struct irc_archive *irc_archive_open(const char *dir, uint64_t segment_size);
+
+/*!
+ * \brief Add a message to an archive
+ * \param archive
+ * \param received When it was received (ms since the epoch), used if it has no server-time tag
+ * \param line Raw message, without CR LF
+ * \param len
+ * \note Messages are written a block at a time, so call irc_archive_flush to make sure the latest are readable.
+ * \retval 0 on success, -1 on failure
+ */
+int irc_archive_append(struct irc_archive *archive, long long received, const char *line, size_t len);
+
+/*! \brief Write out any messages that haven't been yet */
+int irc_archive_flush(struct irc_archive *archive);
+
+/*! \brief Write out any messages that haven't been yet, and close an archive */
+void irc_archive_close(struct irc_archive *archive);
+
+/*!
+ * \brief Keep a full-text index of an archive, so irc_archive_search can find messages in it
+ * \param archive
+ * \note Messages are indexed as they're written. Any that aren't indexed yet, e.g. from before this was called,
+ *       are indexed first (in the background, except for the segment being written).
+ *       The index is kept in the archive directory, in files that are merged in the background.
+ * \retval 0 on success, -1 on failure
+ */
+int irc_archive_index(struct irc_archive *archive);
+
+/*!
+ * \brief Find archived messages
+ * \param dir Archive directory
+ * \param channel Channel the messages are for (compared using rfc1459 casemapping), NULL for all messages
+ * \param from Earliest time (ms since the epoch, inclusive)
+ * \param to Latest time (ms since the epoch, inclusive)
+ * \param cb Callback for each message, in the order they were archived, with its time and raw line (not NUL terminated).
+ *        Return nonzero to stop.
+ * \param data
+ * \retval 0 on success, -1 on failure
+ */
+int irc_archive_query(const char *dir, const char *channel, long long from, long long to,
+	int (*cb)(void *data, long long time, const char *line, size_t len), void *data);
+
+/*!
+ * \brief Search an archive's full-text index (see irc_archive_index)
+ * \param dir Archive directory
+ * \param query Space-separated terms, all of which a message must have: words (case-insensitive), URLs,
+ *        nick:NICK for messages from NICK, and chan:CHANNEL (or just #CHANNEL) for messages to CHANNEL.
+ * \param max Find at most this many messages, the most recent ones. 0 for no limit.
+ * \param cb Callback for each message, in the order they were archived, with its time and raw line (not NUL terminated).
+ *        Return nonzero to stop.
+ * \param data
+ * \note Messages are only found once they've been written, see irc_archive_flush.
+ * \return Number of messages found, -1 on failure
+ */
+int irc_archive_search(const char *dir, const char *query, size_t max,
+	int (*cb)(void *data, long long time, const char *line, size_t len), void *data);
+
+/*! \brief Log replay settings */
+struct irc_replay_config {
+	unsigned int threads;				/*!< Number of parsing threads. 0 for one per CPU. */
+	size_t chunk_size;					/*!< Bytes of a file that a thread takes at a time. 0 for 4 MB. */
+	enum irc_casemapping casemapping;	/*!< Used to tell which channels and nicks are the same */
+};
+
+/*! \brief Counts for a channel or nick, from replaying logs */
+struct irc_replay_counts {
+	uint64_t messages;			/*!< PRIVMSGs and NOTICEs to the channel, or from the nick */
+	uint64_t joins;
+	uint64_t parts;
+	uint64_t quits;				/*!< For nicks only */
+	uint64_t kicks;				/*!< Kicks in the channel, or of the nick */
+};
+
+/*! \brief Totals from replaying logs */
+struct irc_replay_totals {
+	uint64_t lines;				/*!< Lines replayed, not counting empty ones */
+	uint64_t invalid;			/*!< Lines that couldn't be parsed */
+	uint64_t types[IRC_CMD_OTHER + 1];	/*!< Messages of each type, indexed by enum irc_msg_type */
+};
+
+/*! \brief Statistics from replaying logs */
+struct irc_replay;
+
+/*!
+ * \brief Start replaying logs
+ * \param config Settings, NULL for the defaults
+ * \return Replay, which must be freed with irc_replay_free, NULL on failure
+ */
+struct irc_replay *irc_replay_new(const struct irc_replay_config *config);
+
+void irc_replay_free(struct irc_replay *replay);
+
+/*!
+ * \brief Parse a log file and add up what's in it
+ * \param replay
+ * \param path Log of raw messages, one per line, as written by irc_loop or irc_client_protolog_open (with or without timestamps)
+ * \note The file is split into chunks that are parsed in parallel. The results are the same for any number of threads.
+ * \retval 0 on success, -1 on failure
+ */
+int irc_replay_file(struct irc_replay *replay, const char *path);
+
+/*! \brief Get the totals of the files replayed so far */
+void irc_replay_totals(struct irc_replay *replay, struct irc_replay_totals *totals);
+
+/*!
+ * \brief Get the counts for each channel in the files replayed so far
+ * \param replay
+ * \param cb Callback for each channel, in order of name (under the casemapping), spelled as it first appeared
+ * \param data
+ * \return Number of channels, -1 on failure
+ */
+ssize_t irc_replay_channels(struct irc_replay *replay, void (*cb)(void *data, const char *channel, const struct irc_replay_counts *counts), void *data);
+
+/*! \brief Same as irc_replay_channels, for nicks */
+ssize_t irc_replay_nicks(struct irc_replay *replay, void (*cb)(void *data, const char *nick, const struct irc_replay_counts *counts), void *data);
+
+/*! \brief A JSON Lines export of messages */
+struct irc_json;
+
+/*!
+ * \brief Start a JSON Lines export
+ * \param sink Called with each batch of complete lines to write out. Return 0 on success, -1 on failure.
+ * \param data
+ * \note Each message is written as one JSON object on its own line, with the fields:
+ *       received (ms since the epoch, if known), tags (an object, with unescaped values),
+ *       nick, user, and host, or server, from the prefix (whichever it has),
+ *       command, or numeric (a number), channel (if the message is for one), and params (an array of strings).
+ *       Strings that aren't valid UTF-8 are assumed to be Latin-1.
+ * \return Export, which must be freed with irc_json_free, NULL on failure
+ */
+struct irc_json *irc_json_new(int (*sink)(void *data, const char *buf, size_t len), void *data);
+
+/*! \brief Write out any lines that haven't been yet, and free an export */
+void irc_json_free(struct irc_json *json);
+
+/*!
+ * \brief Hand any lines that haven't been written yet to the sink
+ * \retval 0 on success, -1 if the sink failed (the lines are dropped)
+ */
+int irc_json_flush(struct irc_json *json);
+
+/*!
+ * \brief Export a message
+ * \param json
+ * \param line Raw message, without CR LF
+ * \param len
+ * \param received When it was received (ms since the epoch), -1 if not known
+ * \note Lines are buffered and handed to the sink in large batches, see irc_json_flush.
+ * \retval 0 on success, 1 if the line couldn't be parsed (and was skipped), -1 if the sink failed
+ */
+int irc_json_line(struct irc_json *json, const char *line, size_t len, long long received);
+
+/*!
+ * \brief Export the messages in a log file
+ * \param json
+ * \param path Log of raw messages, one per line, as written by irc_loop or irc_client_protolog_open.
+ *        If lines have timestamps, they're used as the received times.
+ * \retval 0 on success, -1 on failure
+ */
+int irc_json_replay(struct irc_json *json, const char *path);
+
+/*!
+ * \brief Export every line irc_loop receives
+ * \param client
+ * \param json Export, or NULL to stop. Must not be freed until it's been stopped.
+ * \note irc_loop flushes the export after each read, so lines are written as soon as it's caught up.
+ * \retval 0 on success, -1 if already enabled, or stopping while irc_loop is running
+ */
+int irc_client_json_export(struct irc_client *client, struct irc_json *json);
+
+/*! \brief Columns of a column file */
+enum irc_column {
+	IRC_COLUMN_TIME = 0,		/*!< Server time if the message has it, otherwise when it was received (ms since the epoch, 0 if not known) */
+	IRC_COLUMN_COMMAND,			/*!< Command, or numeric (e.g. "001") */
+	IRC_COLUMN_NICK,			/*!< Nick (or server) from the prefix. Compared using rfc1459 casemapping. */
+	IRC_COLUMN_HOST,			/*!< user@host from the prefix */
+	IRC_COLUMN_CHANNEL,			/*!< Channel the message is for. Compared using rfc1459 casemapping. */
+	IRC_COLUMN_PARAMS,			/*!< Parameters before the last, separated by spaces */
+	IRC_COLUMN_BODY,			/*!< Last parameter, e.g. the text of a PRIVMSG */
+	IRC_COLUMN_TAGS,			/*!< Raw IRCv3 tags, without the leading @ */
+};
+
+/*! \brief Number of columns */
+#define IRC_COLUMNS 8
+
+/*! \brief A string in a column file (not NUL terminated) */
+struct irc_colstring {
+	const char *s;
+	size_t len;
+};
+
+/*!
+ * \brief Rows of a row group, as arrays with an element for each row. Columns that weren't asked for are NULL.
+ * \note Commands, nicks, hosts, and channels are indexes for irc_colfile_name (0 if the message has none).
+ *       Strings point into the file, and are only valid until irc_colfile_close.
+ */
+struct irc_colbatch {
+	size_t rows;
+	const long long *time;
+	const uint32_t *command;
+	const uint32_t *nick;
+	const uint32_t *host;
+	const uint32_t *channel;
+	const struct irc_colstring *params;
+	const struct irc_colstring *body;
+	const struct irc_colstring *tags;
+};
+
+/*! \brief A column file being written */
+struct irc_colwriter;
+
+/*!
+ * \brief Start writing a column file
+ * \param path File to write. It's written under path plus .tmp, and only renamed to path once it's complete.
+ * \param group_rows Number of rows in each row group. 0 for 65536.
+ * \note A column file keeps messages split into row groups, with each column of a row group stored separately,
+ *       along with its smallest and largest values, so readers only have to read the columns they need,
+ *       of the row groups that can have what they're looking for. See enum irc_column.
+ * \return Writer, NULL on failure
+ */
+struct irc_colwriter *irc_colwriter_open(const char *path, size_t group_rows);
+
+/*!
+ * \brief Add a message to a column file
+ * \param w
+ * \param line Raw message, without CR LF
+ * \param len
+ * \param received When it was received (ms since the epoch), used if it has no server-time tag. -1 if not known.
+ * \retval 0 on success, 1 if the line couldn't be parsed (and was skipped), -1 on failure
+ */
+int irc_colwriter_line(struct irc_colwriter *w, const char *line, size_t len, long long received);
+
+/*!
+ * \brief Add the messages in a log file to a column file
+ * \param w
+ * \param path Log of raw messages, one per line, as written by irc_loop or irc_client_protolog_open.
+ *        If lines have timestamps, they're used as the received times.
+ * \retval 0 on success, -1 on failure
+ */
+int irc_colwriter_replay(struct irc_colwriter *w, const char *path);
+
+/*!
+ * \brief Finish writing a column file, and free the writer
+ * \retval 0 on success, -1 on failure (the file isn't created)
+ */
+int irc_colwriter_close(struct irc_colwriter *w);
+
+/*! \brief A column file being read */
+struct irc_colfile;
+
+/*!
+ * \brief Open a column file for reading
+ * \return File, NULL on failure
+ */
+struct irc_colfile *irc_colfile_open(const char *path);
+
+void irc_colfile_close(struct irc_colfile *f);
+
+/*! \brief Get the number of rows (messages) in a column file */
+uint64_t irc_colfile_rows(struct irc_colfile *f);
+
+/*!
+ * \brief Get the name a command, nick, host, or channel index stands for
+ * \return Name, NULL if there isn't one
+ */
+const char *irc_colfile_name(struct irc_colfile *f, enum irc_column column, uint32_t id);
+
+/*!
+ * \brief Get the index of a command, nick, host, or channel
+ * \return Index, 0 if it's not in the file
+ */
+uint32_t irc_colfile_lookup(struct irc_colfile *f, enum irc_column column, const char *name);
+
+/*!
+ * \brief Read columns of a column file
+ * \param f
+ * \param columns Columns to read, as a bitmask of (1 << enum irc_column)
+ * \param from Earliest time (ms since the epoch, inclusive)
+ * \param to Latest time (ms since the epoch, inclusive)
+ * \param channel Channel, NULL for all
+ * \param cb Callback for each row group that can have rows for channel between from and to
+ *        (it may have others, too, so check them if it matters). Return nonzero to stop.
+ * \param data
+ * \retval 0 on success, -1 on failure
+ */
+int irc_colfile_scan(struct irc_colfile *f, unsigned int columns, long long from, long long to, const char *channel,
+	int (*cb)(void *data, const struct irc_colbatch *batch), void *data);
+
+/*!
+ * \brief Count the messages, joins, parts, and kicks in each channel
+ * \param f
+ * \param from Earliest time (ms since the epoch, inclusive)
+ * \param to Latest time (ms since the epoch, inclusive)
+ * \param cb Callback for each channel with any, in the order they first appeared, spelled as they first appeared
+ * \param data
+ * \note Only the time, command, and channel columns are read (and not even the time, for row groups entirely in range).
+ * \return Number of channels, -1 on failure
+ */
+ssize_t irc_colfile_channels(struct irc_colfile *f, long long from, long long to,
+	void (*cb)(void *data, const char *channel, const struct irc_replay_counts *counts), void *data);
+
 /*!
  * \brief Disconnect an IRC client
  * \param client
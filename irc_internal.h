@@ -0,0 +1,459 @@
+/*
+ * LIRC - IRC Client Library for C
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This library is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Library internals shared between source files. Not installed, not for use by applications.
+ */
+
+#ifndef LIRC_INTERNAL_H
+#define LIRC_INTERNAL_H
+
+#include <time.h>
+#include <pthread.h>
+
+/* Compile the library with TLS support, using OpenSSL */
+#define HAVE_OPENSSL
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#endif
+
+#define EXPOSE_IRC_MSG
+
+#include "irc.h"
+
+/*! \brief Number of recent multi-target send targets remembered for error reporting */
+#define FANOUT_TARGETS 128
+
+/*! \brief How long (in seconds) to attribute errors to a multi-target send */
+#define FANOUT_TARGET_TTL 60
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof(a[0]))
+
+/*! \brief An RPL_ISUPPORT token the library doesn't know about */
+struct isupport_other {
+	char *name;
+	char *value;
+	struct isupport_other *next;
+	char data[];
+};
+
+/*! \brief Server capabilities, from RPL_ISUPPORT */
+struct isupport {
+	char *values[IRC_ISUPPORT_TOKENS];	/*!< Raw token values, NULL if not advertised */
+	int ints[IRC_ISUPPORT_TOKENS];		/*!< Numeric token values */
+	struct isupport_other *other;		/*!< Tokens not in enum irc_isupport_token */
+	enum irc_casemapping casemapping;	/*!< Casemapping for nicknames and channel names */
+	char chantypes[256];				/*!< Nonzero for each channel type prefix */
+	unsigned char chanmodes[128];		/*!< enum irc_chanmode_type of each mode */
+	signed char prefix_rank[128];		/*!< Rank of each membership mode and prefix, -1 if not one */
+	char prefix_modes[16];				/*!< Membership modes, highest rank first */
+	char prefix_symbols[16];			/*!< Membership prefixes, highest rank first */
+	int chanlimit[128];					/*!< Channel limit for each channel type, -1 if unknown */
+	int maxlist[128];					/*!< Maximum number of entries for each list mode, -1 if unknown */
+	struct {
+		char command[16];
+		int limit;
+	} targmax[16];						/*!< Maximum number of targets for each command */
+	int ntargmax;						/*!< Number of commands in targmax */
+};
+
+/*! \brief Default time (in ms) to wait for more mode changes before sending queued ones */
+#define MODE_WINDOW_DEFAULT 250
+
+/*! \brief A pending channel mode change */
+struct mode_change {
+	char sign;						/*!< + or - */
+	char mode;						/*!< Mode character */
+	char *arg;						/*!< Mode argument, if any */
+};
+
+/*! \brief Pending mode changes for a channel */
+struct mode_queue {
+	char *channel;					/*!< Channel name */
+	struct mode_change *changes;	/*!< Pending changes, in the order they were queued */
+	size_t len;						/*!< Number of pending changes */
+	size_t alloc;					/*!< Allocated size of changes */
+	long long deadline;				/*!< When (monotonic ms) to send the pending changes */
+	struct mode_queue *next;
+};
+
+/*! \brief A target of a recent multi-target send */
+struct fanout_target {
+	char *name;						/*!< Target name */
+	time_t expires;					/*!< When errors for this target should no longer be reported */
+};
+
+/*! \brief A client for one IRC server. Use multiple clients for multiple servers or for multiple clients on the same server */
+struct irc_client {
+	int sfd;						/*!< Client socket file descriptor */
+#ifdef HAVE_OPENSSL
+	SSL*     ssl;
+	SSL_CTX* ctx;
+#endif
+	const char *hostname;			/*!< IRC server hostname */
+	unsigned int port;				/*!< IRC server port */
+	const char *username;			/*!< IRC client username */
+	const char *password;			/*!< IRC client password */
+	const char *nickname;			/*!< IRC client nickname (interned) */
+	char *autojoin;					/*!< Comma-separated list of channels to autojoin */
+	pthread_mutex_t lock;			/*!< Protects state shared between the sending and receiving threads */
+	pthread_mutex_t sendlock;		/*!< Serializes writes to the server, so lines from different threads don't interleave */
+	struct irc_intern_pool *pool;	/*!< Pool for nicknames, hostmasks, and channel names */
+	struct isupport isupport;		/*!< Server capabilities */
+	int wakefd[2];					/*!< Pipe used to wake up irc_loop when there is new work for it */
+	int looping;					/*!< Whether irc_loop is running (atomic) */
+	/* Multi-target sends */
+	struct fanout_target fanout[FANOUT_TARGETS];	/*!< Ring of recent multi-target send targets */
+	unsigned int fanout_next;		/*!< Next slot to use in fanout */
+	void (*target_error_cb)(void *data, const char *target, int numeric, const char *reason);
+	void *target_error_data;
+	/* Mode stacking */
+	struct mode_queue *modeq;		/*!< Channels with pending mode changes */
+	int mode_window;				/*!< Time (in ms) to wait for more mode changes */
+	int mode_threshold;				/*!< Number of pending changes that causes an immediate send (0 = one full MODE line) */
+	/* Channel listing */
+	struct list_session *list;		/*!< Channel listing in progress */
+	/* User information */
+	struct who_cache *who;			/*!< User information cache, NULL if not enabled */
+	/* Netsplits */
+	struct netsplit *netsplit;		/*!< Netsplit aggregation, NULL if not enabled */
+	/* Batches */
+	struct batch_state *batch;		/*!< IRCv3 batches, NULL if not enabled */
+	/* Chat history */
+	struct chathistory *history;	/*!< Filling in missed history, NULL if not enabled */
+	/* Latency */
+	struct latency *latency;		/*!< Echo latency tracking, NULL if not enabled */
+	unsigned int caps;				/*!< Capabilities acknowledged by the server (CAP_*) */
+	/* CTCP */
+	struct ctcp_pings *pings;		/*!< Outstanding CTCP pings, NULL if none sent yet */
+	struct ctcp_responder *responder;	/*!< CTCP query responder, NULL if not enabled */
+	/* DCC */
+	struct dcc *dcc;				/*!< DCC transfers, NULL if DCC hasn't been used */
+	/* Protocol logging */
+	struct protolog *protolog;		/*!< Asynchronous protocol log, NULL if not enabled */
+	struct irc_json *json;			/*!< JSON Lines export, NULL if not enabled */
+	/* State tracking */
+	struct irc_state *state;		/*!< Channel and membership state, NULL if not tracked */
+	/* Flags */
+	unsigned int tls:1;				/*!< Whether to use TLS */
+	unsigned int tlsverify:1;		/*!< Whether to verify the server */
+	unsigned int sasl:1;			/*!< Whether to use SASL authentication */
+	unsigned int capneg:1;			/*!< Whether capability negotiation is in progress */
+	/* Internal */
+	unsigned int active:1;			/*!< Whether client is currently actively connected to a server */
+	/* Flexible Struct Member */
+	char data[];
+};
+
+/* Capabilities whose use depends on whether the server acknowledged them */
+#define CAP_ECHO_MESSAGE (1 << 0)
+#define CAP_LABELED_RESPONSE (1 << 1)
+
+#define IRC_INTERNAL __attribute__ ((visibility ("hidden")))
+
+#define irc_err(fmt, ...) __irc_log(IRC_LOG_ERR, 0, __FILE__, __LINE__, __FUNCTION__, fmt, ## __VA_ARGS__)
+#define irc_warn(fmt, ...) __irc_log(IRC_LOG_WARN, 0, __FILE__, __LINE__, __FUNCTION__, fmt, ## __VA_ARGS__)
+#define irc_info(fmt, ...) __irc_log(IRC_LOG_INFO, 0, __FILE__, __LINE__, __FUNCTION__, fmt, ## __VA_ARGS__)
+#define irc_debug(level, fmt, ...) __irc_log(IRC_LOG_DEBUG, level, __FILE__, __LINE__, __FUNCTION__, fmt, ## __VA_ARGS__)
+
+IRC_INTERNAL void __attribute__ ((format (printf, 6, 7))) __irc_log(enum irc_log_level level, int sublevel, const char *file, int line, const char *func, const char *fmt, ...);
+
+/*!
+ * \brief Get the next parameter of a message body, without modifying the body
+ * \param[in,out] s Current position in the body. Set to NULL once the last parameter has been returned.
+ * \param[out] len Length of the parameter
+ * \return Beginning of the parameter (for the trailing parameter, after its leading :)
+ * \retval NULL if there are no more parameters
+ */
+IRC_INTERNAL const char *next_param(const char **s, size_t *len);
+
+/*!
+ * \brief Find a message tag, without unescaping it
+ * \param msg
+ * \param key
+ * \param[out] len Length of the raw value
+ * \return Raw value (empty for tags without a value)
+ * \retval NULL if the tag is not present
+ */
+IRC_INTERNAL const char *msg_tag(const struct irc_msg *msg, const char *key, size_t *len);
+
+/*! \brief Update tracked channel state from a received message */
+IRC_INTERNAL void state_process(struct irc_client *client, struct irc_msg *msg);
+
+/*! \brief Remove several users from all tracked channels at once */
+IRC_INTERNAL void state_quit_bulk(struct irc_client *client, const char *const *nicks, size_t count);
+
+IRC_INTERNAL void state_destroy(struct irc_state *state);
+
+/*!
+ * \brief Handle a channel listing reply
+ * \retval 1 if the reply belonged to a listing started with irc_client_list, 0 otherwise
+ */
+IRC_INTERNAL int list_process(struct irc_client *client, struct irc_msg *msg);
+
+IRC_INTERNAL void list_destroy(struct irc_client *client);
+
+/*!
+ * \brief Update the user information cache from a received message
+ * \retval 1 if the message was a reply to irc_client_user_lookup or irc_client_channel_lookup, 0 otherwise
+ */
+IRC_INTERNAL int who_process(struct irc_client *client, struct irc_msg *msg);
+
+IRC_INTERNAL void who_destroy(struct irc_client *client);
+
+/*! \brief Remove several users from the user information cache at once */
+IRC_INTERNAL void who_quit_bulk(struct irc_client *client, const char *const *nicks, size_t count);
+
+/*! \brief Message is part of a netsplit, and the library will apply it later */
+#define NETSPLIT_CONSUMED 1
+/*! \brief Message is part of a netjoin, and should be applied to state now, but not passed to the application */
+#define NETSPLIT_AGGREGATED 2
+
+/*!
+ * \brief Check whether a message is part of a netsplit or netjoin
+ * \retval 0, NETSPLIT_CONSUMED, or NETSPLIT_AGGREGATED
+ */
+IRC_INTERNAL int netsplit_process(struct irc_client *client, struct irc_msg *msg);
+
+/*!
+ * \brief Add a user to a netsplit
+ * \param client
+ * \param servers "<server1> <server2>"
+ * \param serverslen
+ * \param nick
+ * \param nicklen
+ * \retval 1 if added, 0 if the QUIT should be handled normally
+ */
+IRC_INTERNAL int netsplit_quit(struct irc_client *client, const char *servers, size_t serverslen, const char *nick, size_t nicklen);
+
+/*!
+ * \brief Add a user to a netjoin, if it was in a recent netsplit
+ * \retval 1 if added, 0 if the JOIN should be handled normally
+ */
+IRC_INTERNAL int netsplit_join(struct irc_client *client, const char *nick, size_t nicklen);
+
+/*! \brief When the next netsplit or netjoin should be reported (monotonic ms), -1 if none pending */
+IRC_INTERNAL long long netsplit_deadline(struct irc_client *client);
+
+/*! \brief Report any netsplits and netjoins that are due */
+IRC_INTERNAL void netsplit_flush_due(struct irc_client *client, long long now);
+
+IRC_INTERNAL void netsplit_destroy(struct irc_client *client);
+
+/*!
+ * \brief Open and close batches, and collect messages that must not be processed as they arrive
+ * \retval 1 if the message was a BATCH command or part of a chathistory batch, 0 otherwise
+ */
+IRC_INTERNAL int batch_process(struct irc_client *client, struct irc_msg *msg);
+
+/*!
+ * \brief Add a processed message to the open batch it belongs to
+ * \retval 1 if the message will be delivered with its batch, 0 otherwise
+ */
+IRC_INTERNAL int batch_collect(struct irc_client *client, struct irc_msg *msg);
+
+/*! \brief The open batch a message belongs to, NULL if none */
+IRC_INTERNAL const struct irc_batch *batch_of(struct irc_client *client, const struct irc_msg *msg);
+
+IRC_INTERNAL void batch_destroy(struct irc_client *client);
+
+/*! \brief Message was handled by history filling, and should not be processed further */
+#define CHATHISTORY_CONSUMED 1
+/*! \brief Message is from history, and should be passed to the application, but not applied to current state */
+#define CHATHISTORY_REPLAY 2
+
+/*!
+ * \brief Track the last message seen in each channel, and handle history requested after joining
+ * \retval 0, CHATHISTORY_CONSUMED, or CHATHISTORY_REPLAY
+ */
+IRC_INTERNAL int chathistory_process(struct irc_client *client, struct irc_msg *msg);
+
+/*! \brief When the next history request times out (monotonic ms), -1 if none in flight */
+IRC_INTERNAL long long chathistory_deadline(struct irc_client *client);
+
+/*! \brief Give up on any history requests that have timed out, and send queued ones in their place */
+IRC_INTERNAL void chathistory_flush_due(struct irc_client *client, long long now);
+
+IRC_INTERNAL void chathistory_destroy(struct irc_client *client);
+
+/*!
+ * \brief Send a PRIVMSG or NOTICE, measuring how long it takes to be echoed
+ * \retval 0 on success, 1 on failure (same as irc_send)
+ */
+IRC_INTERNAL int latency_send(struct irc_client *client, const char *command, const char *target, const char *text);
+
+/*!
+ * \brief Check whether a message is the echo of a message sent with latency_send
+ * \retval 1 if so, 0 otherwise
+ */
+IRC_INTERNAL int latency_echo(struct irc_client *client, struct irc_msg *msg);
+
+IRC_INTERNAL void latency_destroy(struct irc_client *client);
+
+/*!
+ * \brief Start tracking a CTCP ping
+ * \param client
+ * \param target Nick or channel
+ * \param[out] buf Payload to send
+ * \param len Size of buf
+ * \retval 0 on success, -1 on failure
+ */
+IRC_INTERNAL int ctcp_ping_payload(struct irc_client *client, const char *target, char *buf, size_t len);
+
+/*!
+ * \brief Match a CTCP reply to its request
+ * \retval 1 if it was a reply to a tracked ping that has been reported to the application, 0 otherwise
+ */
+IRC_INTERNAL int ctcp_process(struct irc_client *client, struct irc_msg *msg);
+
+/*! \brief When the next CTCP ping times out (monotonic ms), -1 if none outstanding */
+IRC_INTERNAL long long ctcp_ping_deadline(struct irc_client *client);
+
+/*! \brief Report any CTCP pings that have timed out */
+IRC_INTERNAL void ctcp_ping_flush_due(struct irc_client *client, long long now);
+
+IRC_INTERNAL void ctcp_destroy(struct irc_client *client);
+
+/*!
+ * \brief Answer a CTCP query, if it's one the responder handles
+ * \retval 1 if it was answered or dropped, 0 if it's for the application
+ */
+IRC_INTERNAL int ctcp_respond(struct irc_client *client, struct irc_msg *msg);
+
+IRC_INTERNAL void ctcp_responder_destroy(struct irc_client *client);
+
+/*! \brief The epoll fd that DCC transfers (and irc_loop's wakeup pipe) are in, for irc_loop to wait on */
+IRC_INTERNAL int dcc_fd(struct irc_client *client);
+
+/*! \brief Run DCC transfers that are ready, and time out any that are due */
+IRC_INTERNAL void dcc_run(struct irc_client *client);
+
+/*! \brief When the next DCC transfer times out (monotonic ms), -1 if none */
+IRC_INTERNAL long long dcc_deadline(struct irc_client *client);
+
+/*!
+ * \brief Handle DCC messages about our offers (resume requests, and replies to passive offers)
+ * \retval 1 if handled, 0 otherwise
+ */
+IRC_INTERNAL int dcc_process(struct irc_client *client, struct irc_msg *msg);
+
+IRC_INTERNAL void dcc_destroy(struct irc_client *client);
+
+/*! \brief Log a received line (without its CR LF). Must only be called from irc_loop's thread. */
+IRC_INTERNAL void protolog_line(struct protolog *log, const char *line, size_t len);
+
+IRC_INTERNAL void protolog_destroy(struct irc_client *client);
+
+/*!
+ * \brief Read a log file, as written by irc_loop or irc_client_protolog_open
+ * \param path
+ * \param cb Callback for each non-empty line, without its timestamp or CR LF, and when it was received
+ *        (ms since the epoch, from its timestamp, -1 if it doesn't have one). Return nonzero to stop.
+ * \param data
+ * \retval 0 on success, -1 on failure, or what cb returned if it stopped
+ */
+IRC_INTERNAL int protolog_replay(const char *path, int (*cb)(void *data, const char *line, size_t len, long long received), void *data);
+
+/*! \brief Time of a message (ms since the epoch): its server-time tag if it has one, otherwise when it was received */
+IRC_INTERNAL long long archive_line_time(const char *line, size_t len, long long received);
+
+/*!
+ * \brief Find the channel a raw message is for, without parsing it
+ * \param line
+ * \param len
+ * \param[out] chanlen
+ * \return Channel name (not NUL terminated), NULL if it's not for a channel
+ */
+IRC_INTERNAL const char *archive_line_channel(const char *line, size_t len, size_t *chanlen);
+
+/*! \brief Write out the block being filled, if it's been waiting for a while */
+IRC_INTERNAL void archive_flush_idle(struct irc_archive *archive);
+
+IRC_INTERNAL unsigned char *archive_put_varint(unsigned char *p, uint64_t v);
+
+/*! \brief Decode a varint, NULL if it runs past end */
+IRC_INTERNAL const unsigned char *archive_get_varint(const unsigned char *p, const unsigned char *end, uint64_t *v);
+
+/*! \brief A mapped file */
+struct archive_map {
+	unsigned char *data;
+	size_t len;
+};
+
+/*! \brief Map a file read only. Empty files aren't mapped (data is NULL). */
+IRC_INTERNAL int archive_map(const char *path, struct archive_map *m);
+
+IRC_INTERNAL void archive_unmap(struct archive_map *m);
+
+/*!
+ * \brief List the segments in an archive
+ * \param dir
+ * \param[out] segnos Segment numbers, in order. Must be freed.
+ * \return Number of segments, -1 on failure
+ */
+IRC_INTERNAL int archive_segments(const char *dir, unsigned int **segnos);
+
+/*!
+ * \brief Read messages from a segment, by their number within it
+ * \param dir
+ * \param segno
+ * \param from If docs is NULL, read every message from this one on
+ * \param docs Messages to read, in increasing order, or NULL
+ * \param ndocs
+ * \param cb Callback for each message. Return nonzero to stop.
+ * \param data
+ * \retval 0 on success, 1 if stopped by the callback, -1 if the segment couldn't be read
+ */
+IRC_INTERNAL int archive_segment_read(const char *dir, unsigned int segno, uint32_t from, const uint32_t *docs, size_t ndocs,
+	int (*cb)(void *data, uint32_t doc, long long time, const char *line, size_t len), void *data);
+
+struct search_index;
+
+/*!
+ * \brief Start keeping the full-text index of an archive, first indexing any messages that aren't yet
+ * \param dir Archive directory
+ * \param segno Segment being written
+ * \note Earlier segments are caught up in the background. Must be called with the archive locked.
+ */
+IRC_INTERNAL struct search_index *search_open(const char *dir, unsigned int segno);
+
+/*! \brief Index a message that's been written to an archive. Must be called with the archive locked. */
+IRC_INTERNAL void search_add(struct search_index *search, unsigned int segno, uint32_t doc, const char *line, size_t len);
+
+/*!
+ * \brief Write out the messages indexed since the last time, if there are enough of them to be worth it
+ * \param search
+ * \param force Write them out regardless
+ */
+IRC_INTERNAL void search_commit(struct search_index *search, int force);
+
+/*! \brief Write out the rest of the index, and stop merging it */
+IRC_INTERNAL void search_close(struct search_index *search);
+
+/*!
+ * \brief Whether irc_loop is running, and so may be using anything hanging off the client without locking
+ * \note Features that irc_loop uses can't be disabled (freed) while this is the case
+ */
+IRC_INTERNAL int irc_loop_running(struct irc_client *client);
+
+/*! \brief Wake up irc_loop, so that it recalculates when it next needs to do something */
+IRC_INTERNAL void irc_loop_wake(struct irc_client *client);
+
+/*! \brief Current monotonic time, in ms */
+IRC_INTERNAL long long now_ms(void);
+
+/*! \brief Current monotonic time, in us */
+IRC_INTERNAL long long now_us(void);
+
+#endif /* LIRC_INTERNAL_H */
@@ -0,0 +1,396 @@
+/*
+ * LIRC - IRC Client Library for C
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This library is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief JSON Lines export of messages
+ *
+ * \note Each message is formatted straight into one output buffer, which is only handed to the sink
+ *       once it's full (or flushed), so nothing is allocated per message. Before a message is formatted,
+ *       we make sure there's room for the longest it could possibly be, so formatting never has to check.
+ *       Most of the work is escaping strings, which is done 8 bytes at a time in an ordinary 64-bit register,
+ *       copying words that don't have anything that needs escaping (or checking) as they are.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "irc_internal.h"
+
+/*! \brief Size of the output buffer */
+#define BUFFER_SIZE (256 * 1024)
+
+/*! \brief Longest line exported. Longer ones are skipped. */
+#define MAX_LINE 16384
+
+/*! \brief Most a line can grow when formatted. Each byte is at most 6 once escaped (\u00XX), or at most 6 counting
+ *         the quotes, commas, and colon around the parameter or tag it separates. The channel is written twice
+ *         (as itself, and as a parameter). 256 is plenty for the field names. */
+#define FORMATTED_MAX(len, chanlen) (6 * ((len) + (chanlen)) + 256)
+
+#define ONES UINT64_C(0x0101010101010101)
+#define HIGH UINT64_C(0x8080808080808080)
+
+struct irc_json {
+	int (*sink)(void *data, const char *buf, size_t len);
+	void *data;
+	size_t len;						/*!< Bytes waiting in out */
+	char line[MAX_LINE + 1];		/*!< Line being parsed, which irc_parse_msg modifies */
+	char out[BUFFER_SIZE];
+};
+
+struct irc_json *irc_json_new(int (*sink)(void *data, const char *buf, size_t len), void *data)
+{
+	struct irc_json *json = malloc(sizeof(*json));
+
+	if (!json) {
+		irc_err("malloc failed\n");
+		return NULL;
+	}
+	json->sink = sink;
+	json->data = data;
+	json->len = 0;
+	return json;
+}
+
+int irc_json_flush(struct irc_json *json)
+{
+	size_t len = json->len;
+
+	if (!len) {
+		return 0;
+	}
+	json->len = 0; /* Even if the sink fails, so one failure doesn't fail every line after it */
+	return json->sink(json->data, json->out, len) ? -1 : 0;
+}
+
+void irc_json_free(struct irc_json *json)
+{
+	irc_json_flush(json);
+	free(json);
+}
+
+/* === Formatting (no bounds checks, see FORMATTED_MAX) === */
+
+static inline void put(struct irc_json *json, const char *s, size_t len)
+{
+	memcpy(json->out + json->len, s, len);
+	json->len += len;
+}
+
+#define put_literal(json, s) put(json, s, sizeof(s) - 1)
+
+static inline void put_char(struct irc_json *json, char c)
+{
+	json->out[json->len++] = c;
+}
+
+static void put_int(struct irc_json *json, long long n)
+{
+	char digits[20];
+	int i = sizeof(digits);
+	unsigned long long u = n < 0 ? 0 - (unsigned long long) n : (unsigned long long) n;
+
+	do {
+		digits[--i] = (char) ('0' + u % 10);
+		u /= 10;
+	} while (u);
+	if (n < 0) {
+		put_char(json, '-');
+	}
+	put(json, digits + i, sizeof(digits) - (size_t) i);
+}
+
+/*! \brief High bit set in a byte (or, since borrows only carry upwards, a later one) if it's a control character,
+ *         a quote, a backslash, or not ASCII */
+static inline uint64_t special_bytes(uint64_t x)
+{
+	uint64_t quote = x ^ ('"' * ONES), backslash = x ^ ('\\' * ONES);
+
+	return ((x - 0x20 * ONES) | ((quote - ONES) & ~quote) | ((backslash - ONES) & ~backslash) | x) & HIGH;
+}
+
+static inline uint64_t load_word(const char *s)
+{
+	uint64_t x;
+	memcpy(&x, s, sizeof(x));
+	return x;
+}
+
+/*! \brief Length of the valid UTF-8 sequence s starts with, 0 if it doesn't start with one */
+static size_t utf8_len(const unsigned char *s, size_t len)
+{
+	unsigned char lo = 0x80, hi = 0xBF;
+	size_t n, i;
+
+	if (*s >= 0xC2 && *s <= 0xDF) {
+		n = 2;
+	} else if (*s >= 0xE0 && *s <= 0xEF) {
+		n = 3;
+		if (*s == 0xE0) {
+			lo = 0xA0; /* Overlong */
+		} else if (*s == 0xED) {
+			hi = 0x9F; /* Surrogates */
+		}
+	} else if (*s >= 0xF0 && *s <= 0xF4) {
+		n = 4;
+		if (*s == 0xF0) {
+			lo = 0x90; /* Overlong */
+		} else if (*s == 0xF4) {
+			hi = 0x8F; /* Past U+10FFFF */
+		}
+	} else {
+		return 0;
+	}
+	if (len < n || s[1] < lo || s[1] > hi) {
+		return 0;
+	}
+	for (i = 2; i < n; i++) {
+		if (s[i] < 0x80 || s[i] > 0xBF) {
+			return 0;
+		}
+	}
+	return n;
+}
+
+/*! \brief Escape one character, returning how many bytes of s it was */
+static size_t put_escaped(struct irc_json *json, const char *s, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c = (unsigned char) *s;
+	size_t n;
+
+	if (c >= 0x80) {
+		n = utf8_len((const unsigned char *) s, len);
+		if (n) {
+			put(json, s, n);
+			return n;
+		}
+		/* Not UTF-8, which isn't unusual on IRC. Assume it's Latin-1, whose code points are the same as its bytes. */
+	} else if (c == '"' || c == '\\') {
+		put_char(json, '\\');
+		put_char(json, (char) c);
+		return 1;
+	} else if (c >= 0x20) {
+		put_char(json, (char) c);
+		return 1;
+	} else if (c == '\n' || c == '\r' || c == '\t') {
+		put_char(json, '\\');
+		put_char(json, c == '\n' ? 'n' : c == '\r' ? 'r' : 't');
+		return 1;
+	}
+	put_literal(json, "\\u00");
+	put_char(json, hex[c >> 4]);
+	put_char(json, hex[c & 0xF]);
+	return 1;
+}
+
+/*! \brief Add a quoted, escaped string */
+static void put_string(struct irc_json *json, const char *s, size_t len)
+{
+	size_t i = 0;
+
+	put_char(json, '"');
+	while (i < len) {
+		size_t start = i;
+		while (i + 8 <= len && !special_bytes(load_word(s + i))) {
+			i += 8;
+		}
+		while (i < len && (unsigned char) s[i] >= 0x20 && (unsigned char) s[i] < 0x80 && s[i] != '"' && s[i] != '\\') {
+			i++; /* Up to the character that needs escaping, or the end */
+		}
+		put(json, s + start, i - start);
+		if (i < len) {
+			i += put_escaped(json, s + i, len - i);
+		}
+	}
+	put_char(json, '"');
+}
+
+static void put_field(struct irc_json *json, const char *name, size_t namelen, const char *s, size_t len)
+{
+	put_char(json, ',');
+	put_char(json, '"');
+	put(json, name, namelen);
+	put_literal(json, "\":");
+	put_string(json, s, len);
+}
+
+#define put_field_literal(json, name, s, len) put_field(json, name, sizeof(name) - 1, s, len)
+
+/*! \brief Unescape a tag value in place, per https://ircv3.net/specs/extensions/message-tags.html */
+static size_t tag_unescape(char *s, size_t len)
+{
+	size_t i, o = 0;
+
+	for (i = 0; i < len; i++) {
+		char c = s[i];
+		if (c == '\\') {
+			if (++i == len) {
+				break; /* A trailing backslash is dropped */
+			}
+			switch (s[i]) {
+			case ':':
+				c = ';';
+				break;
+			case 's':
+				c = ' ';
+				break;
+			case 'r':
+				c = '\r';
+				break;
+			case 'n':
+				c = '\n';
+				break;
+			default:
+				c = s[i]; /* Including \\ */
+				break;
+			}
+		}
+		s[o++] = c;
+	}
+	return o;
+}
+
+static void put_tags(struct irc_json *json, char *tags)
+{
+	int first = 1;
+
+	put_literal(json, ",\"tags\":{");
+	while (*tags) {
+		size_t taglen = strcspn(tags, ";");
+		size_t keylen = strcspn(tags, "=;");
+		if (keylen) {
+			if (!first) {
+				put_char(json, ',');
+			}
+			first = 0;
+			put_string(json, tags, keylen);
+			put_char(json, ':');
+			/* Tags without a value have an empty one */
+			put_string(json, tags + keylen + 1, keylen < taglen ? tag_unescape(tags + keylen + 1, taglen - keylen - 1) : 0);
+		}
+		tags += taglen;
+		if (*tags) {
+			tags++;
+		}
+	}
+	put_char(json, '}');
+}
+
+static void put_prefix(struct irc_json *json, const char *prefix)
+{
+	size_t nicklen = strcspn(prefix, "!@");
+
+	if (!prefix[nicklen] && memchr(prefix, '.', nicklen)) {
+		put_field_literal(json, "server", prefix, nicklen); /* Nicks can't have dots in them */
+		return;
+	}
+	put_field_literal(json, "nick", prefix, nicklen);
+	prefix += nicklen;
+	if (*prefix == '!') {
+		size_t userlen = strcspn(++prefix, "@");
+		put_field_literal(json, "user", prefix, userlen);
+		prefix += userlen;
+	}
+	if (*prefix == '@') {
+		prefix++;
+		put_field_literal(json, "host", prefix, strlen(prefix));
+	}
+}
+
+int irc_json_line(struct irc_json *json, const char *line, size_t len, long long received)
+{
+	struct irc_msg msg;
+	const char *channel, *params, *param;
+	size_t chanlen, paramlen, start;
+	int first = 1;
+
+	if (len > MAX_LINE) {
+		irc_warn("Not exporting %lu-byte line\n", len);
+		return 1;
+	}
+	channel = archive_line_channel(line, len, &chanlen);
+	if (json->len + FORMATTED_MAX(len, channel ? chanlen : 0) > BUFFER_SIZE && irc_json_flush(json)) {
+		return -1;
+	}
+	memcpy(json->line, line, len);
+	json->line[len] = '\0';
+	memset(&msg, 0, sizeof(msg));
+	if (!len || irc_parse_msg(&msg, json->line)) {
+		return 1;
+	}
+
+	/* Every field starts with a comma, and the first one is replaced with the opening brace.
+	 * Everything written after this can't fail, so the line is always written whole. */
+	start = json->len;
+	if (received >= 0) {
+		put_literal(json, ",\"received\":");
+		put_int(json, received);
+	}
+	if (msg.tags) {
+		put_tags(json, msg.tags);
+	}
+	if (msg.prefix) {
+		put_prefix(json, msg.prefix);
+	}
+	if (msg.command) {
+		put_field_literal(json, "command", msg.command, strlen(msg.command));
+	} else {
+		put_literal(json, ",\"numeric\":");
+		put_int(json, msg.numeric);
+	}
+	if (channel) {
+		put_field_literal(json, "channel", channel, chanlen);
+	}
+	put_literal(json, ",\"params\":[");
+	params = msg.body;
+	while ((param = next_param(&params, &paramlen))) {
+		if (!first) {
+			put_char(json, ',');
+		}
+		first = 0;
+		put_string(json, param, paramlen);
+	}
+	put_literal(json, "]}\n");
+	json->out[start] = '{';
+	return 0;
+}
+
+int irc_client_json_export(struct irc_client *client, struct irc_json *json)
+{
+	if (json && client->json) {
+		irc_err("JSON export is already enabled\n");
+		return -1;
+	} else if (!json && irc_loop_running(client)) {
+		irc_err("JSON export can't be stopped while irc_loop is running\n");
+		return -1;
+	}
+	__atomic_store_n(&client->json, json, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static int replay_line(void *data, const char *line, size_t len, long long received)
+{
+	return irc_json_line(data, line, len, received) < 0 ? -1 : 0;
+}
+
+int irc_json_replay(struct irc_json *json, const char *path)
+{
+	int res = protolog_replay(path, replay_line, json);
+
+	if (irc_json_flush(json)) {
+		res = -1;
+	}
+	return res;
+}
@@ -0,0 +1,343 @@
+/*
+ * LIRC - IRC Client Library for C
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This library is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Send to echo latency tracking (IRCv3 echo-message and labeled-response)
+ *
+ * \note Each tracked message is timed from the call to send it, to when the write completes,
+ *       to when the server echoes it back. Echoes are matched by label if the server supports
+ *       labeled-response, and otherwise by a hash of the target and text, oldest first.
+ *       Latencies go into log-linear histograms (like HdrHistogram): 32 linear buckets,
+ *       then 16 buckets per power of two, so any value is recorded to within about 6%
+ *       in a fixed amount of memory.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "irc_internal.h"
+
+/*! \brief Maximum number of messages awaiting their echo. Beyond this, the oldest are given up on. */
+#define MAX_PENDING 256
+
+/*! \brief How long (in us) to wait for an echo */
+#define ECHO_TIMEOUT 60000000
+
+#define LINEAR_BUCKETS 32
+#define SUB_BUCKETS 16
+#define MAX_EXPONENT 41				/* About 50 days, in us */
+#define NUM_BUCKETS (LINEAR_BUCKETS + (MAX_EXPONENT - 4) * SUB_BUCKETS)
+
+struct histogram {
+	uint64_t counts[NUM_BUCKETS];
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+	uint64_t sum;
+};
+
+struct pending_echo {
+	uint64_t hash;					/*!< Hash of target and text, 0 if the slot is free */
+	unsigned int label;				/*!< Label sent with the message, 0 if none */
+	long long start;				/*!< When the send was requested (monotonic us) */
+	long long written;				/*!< When the write completed (monotonic us), 0 if not yet */
+};
+
+struct latency {
+	pthread_mutex_t lock;
+	struct pending_echo pending[MAX_PENDING];	/*!< Ring, in the order sent */
+	unsigned int next;				/*!< Next slot in pending to use */
+	unsigned int label;				/*!< Last label used */
+	struct histogram hist[IRC_LATENCY_SEGMENTS];
+};
+
+static unsigned int bucket_index(uint64_t v)
+{
+	unsigned int e;
+
+	if (v < LINEAR_BUCKETS) {
+		return (unsigned int) v;
+	}
+	e = 63 - (unsigned int) __builtin_clzll(v); /* v is in [2^e, 2^(e+1)) */
+	if (e > MAX_EXPONENT) {
+		return NUM_BUCKETS - 1;
+	}
+	return LINEAR_BUCKETS + (e - 5) * SUB_BUCKETS + (unsigned int) ((v >> (e - 4)) - SUB_BUCKETS);
+}
+
+/*! \brief Highest value that goes into a bucket */
+static uint64_t bucket_value(unsigned int i)
+{
+	unsigned int e;
+
+	if (i < LINEAR_BUCKETS) {
+		return i;
+	}
+	i -= LINEAR_BUCKETS;
+	e = 5 + i / SUB_BUCKETS;
+	return ((uint64_t) (SUB_BUCKETS + i % SUB_BUCKETS + 1) << (e - 4)) - 1;
+}
+
+static void histogram_record(struct histogram *h, long long us)
+{
+	uint64_t v = us > 0 ? (uint64_t) us : 0;
+
+	h->counts[bucket_index(v)]++;
+	if (!h->total || v < h->min) {
+		h->min = v;
+	}
+	if (v > h->max) {
+		h->max = v;
+	}
+	h->total++;
+	h->sum += v;
+}
+
+static uint64_t histogram_percentile(const struct histogram *h, double pct)
+{
+	uint64_t rank, seen = 0;
+	unsigned int i;
+
+	if (!h->total) {
+		return 0;
+	}
+	rank = (uint64_t) ((pct / 100.0) * (double) h->total + 0.5);
+	if (rank < 1) {
+		rank = 1;
+	} else if (rank > h->total) {
+		rank = h->total;
+	}
+	for (i = 0; i < NUM_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= rank) {
+			uint64_t v = bucket_value(i);
+			return v < h->max ? v : h->max;
+		}
+	}
+	return h->max;
+}
+
+int irc_client_latency_tracking(struct irc_client *client, int enable)
+{
+	struct latency *lt;
+
+	if (!enable) {
+		if (irc_loop_running(client)) {
+			irc_err("Latency tracking can't be disabled while irc_loop is running\n");
+			return -1;
+		}
+		pthread_mutex_lock(&client->lock);
+		lt = client->latency;
+		client->latency = NULL;
+		pthread_mutex_unlock(&client->lock);
+		if (lt) {
+			pthread_mutex_destroy(&lt->lock);
+			free(lt);
+		}
+		return 0;
+	} else if (client->latency) {
+		return 0;
+	}
+
+	lt = calloc(1, sizeof(*lt));
+	if (!lt) {
+		irc_err("calloc failed\n");
+		return -1;
+	}
+	pthread_mutex_init(&lt->lock, NULL);
+	pthread_mutex_lock(&client->lock);
+	client->latency = lt;
+	pthread_mutex_unlock(&client->lock);
+	return 0;
+}
+
+void latency_destroy(struct irc_client *client)
+{
+	if (client->latency) {
+		pthread_mutex_destroy(&client->latency->lock);
+		free(client->latency);
+		client->latency = NULL;
+	}
+}
+
+/*! \brief 64-bit FNV-1a of target and text. Targets are compared exactly, since the server echoes them as sent. */
+static uint64_t echo_hash(const char *target, size_t targetlen, const char *text)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < targetlen; i++) {
+		hash ^= (unsigned char) target[i];
+		hash *= 1099511628211ULL;
+	}
+	hash ^= ' ';
+	hash *= 1099511628211ULL;
+	for (; *text; text++) {
+		hash ^= (unsigned char) *text;
+		hash *= 1099511628211ULL;
+	}
+	return hash ? hash : 1;
+}
+
+int latency_send(struct irc_client *client, const char *command, const char *target, const char *text)
+{
+	struct latency *lt = client->latency;
+	struct pending_echo *p;
+	unsigned int slot, label = 0;
+	long long start = now_us(), written;
+	int res;
+
+	pthread_mutex_lock(&lt->lock);
+	slot = lt->next;
+	lt->next = (lt->next + 1) % MAX_PENDING;
+	p = &lt->pending[slot];
+	p->hash = echo_hash(target, strlen(target), text);
+	p->start = start;
+	p->written = 0;
+	if (client->caps & CAP_LABELED_RESPONSE) {
+		if (!++lt->label) {
+			lt->label++; /* 0 means no label */
+		}
+		label = lt->label;
+	}
+	p->label = label;
+	pthread_mutex_unlock(&lt->lock);
+
+	if (label) {
+		/* The tag has its own budget, so it can't go through irc_send, which only has room for the message */
+		char buf[IRC_MAX_TAGS_LEN + IRC_MAX_MSG_LEN];
+		int len = snprintf(buf, sizeof(buf), "@label=%u %s %s :%s\r\n", label, command, target, text);
+		if (len < 0 || len >= (int) sizeof(buf)) {
+			irc_err("Message to %s is too long\n", target);
+			res = 1;
+		} else {
+			res = irc_write(client, buf, (size_t) len) <= 0;
+		}
+	} else {
+		res = irc_send(client, "%s %s :%s", command, target, text);
+	}
+	written = now_us();
+
+	pthread_mutex_lock(&lt->lock);
+	if (res) {
+		p->hash = 0;
+	} else {
+		histogram_record(&lt->hist[IRC_LATENCY_SEND], written - start);
+		if (p->start == start && p->hash) {
+			p->written = written; /* Unless the echo already came back */
+		}
+	}
+	pthread_mutex_unlock(&lt->lock);
+	return res;
+}
+
+int latency_echo(struct irc_client *client, struct irc_msg *msg)
+{
+	struct latency *lt = client->latency;
+	struct pending_echo *p = NULL;
+	const char *value;
+	long long now;
+	unsigned int i, label = 0;
+	size_t len;
+
+	if (!msg->prefix || !msg->channel || !msg->body) {
+		return 0;
+	}
+	len = strcspn(msg->prefix, "!@");
+	if (strlen(irc_client_nickname(client)) != len || !irc_casemap_memeq(irc_client_casemapping(client), irc_client_nickname(client), msg->prefix, len)) {
+		return 0; /* Not an echo */
+	}
+	value = msg->tags ? msg_tag(msg, "label", &len) : NULL;
+	if (value) {
+		label = (unsigned int) strtoul(value, NULL, 10);
+	}
+
+	now = now_us();
+	pthread_mutex_lock(&lt->lock);
+	if (label) {
+		for (i = 0; i < MAX_PENDING; i++) {
+			if (lt->pending[i].hash && lt->pending[i].label == label) {
+				p = &lt->pending[i];
+				break;
+			}
+		}
+	} else {
+		/* The oldest match, since the server echoes messages in the order they were sent */
+		uint64_t hash = echo_hash(msg->channel, strlen(msg->channel), msg->body);
+		for (i = 0; i < MAX_PENDING; i++) {
+			struct pending_echo *q = &lt->pending[(lt->next + i) % MAX_PENDING];
+			if (q->hash && q->start + ECHO_TIMEOUT < now) {
+				q->hash = 0; /* Never coming back */
+			} else if (q->hash == hash) {
+				p = q;
+				break;
+			}
+		}
+	}
+	if (p) {
+		long long written = p->written ? p->written : p->start;
+		histogram_record(&lt->hist[IRC_LATENCY_NETWORK], now - written);
+		histogram_record(&lt->hist[IRC_LATENCY_TOTAL], now - p->start);
+		p->hash = 0;
+	}
+	pthread_mutex_unlock(&lt->lock);
+	return p != NULL;
+}
+
+int irc_client_latency_stats(struct irc_client *client, enum irc_latency_segment segment, struct irc_latency_stats *stats)
+{
+	struct latency *lt = client->latency;
+	const struct histogram *h;
+
+	if (!lt || segment < 0 || segment >= IRC_LATENCY_SEGMENTS) {
+		return -1;
+	}
+	h = &lt->hist[segment];
+	pthread_mutex_lock(&lt->lock);
+	stats->count = h->total;
+	stats->min = h->min;
+	stats->max = h->max;
+	stats->mean = h->total ? h->sum / h->total : 0;
+	stats->p50 = histogram_percentile(h, 50);
+	stats->p90 = histogram_percentile(h, 90);
+	stats->p99 = histogram_percentile(h, 99);
+	stats->p999 = histogram_percentile(h, 99.9);
+	pthread_mutex_unlock(&lt->lock);
+	return 0;
+}
+
+long long irc_client_latency_percentile(struct irc_client *client, enum irc_latency_segment segment, double percentile)
+{
+	struct latency *lt = client->latency;
+	uint64_t v;
+
+	if (!lt || segment < 0 || segment >= IRC_LATENCY_SEGMENTS || percentile < 0 || percentile > 100) {
+		return -1;
+	}
+	pthread_mutex_lock(&lt->lock);
+	v = histogram_percentile(&lt->hist[segment], percentile);
+	pthread_mutex_unlock(&lt->lock);
+	return (long long) v;
+}
+
+void irc_client_latency_reset(struct irc_client *client)
+{
+	struct latency *lt = client->latency;
+
+	if (lt) {
+		pthread_mutex_lock(&lt->lock);
+		memset(lt->hist, 0, sizeof(lt->hist));
+		pthread_mutex_unlock(&lt->lock);
+	}
+}
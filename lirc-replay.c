@@ -0,0 +1,303 @@
+/*
+ * LIRC - IRC Client Library for C
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the Mozilla Public License Version 2.
+ */
+
+/*! \file
+ *
+ * \brief Protocol log replay program
+ *
+ * \note Parses logs written by irc_loop or the client's protocol log on all CPUs,
+ *       and prints message counts by type, and for the busiest channels and nicks.
+ *       Alternately, exports the messages as JSON Lines.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "irc.h"
+
+struct ranked {
+	char *name;
+	size_t order;				/*!< Position in order of name */
+	struct irc_replay_counts counts;
+};
+
+struct ranking {
+	struct ranked *entries;
+	size_t count;
+	size_t alloc;
+};
+
+static void collect(void *data, const char *name, const struct irc_replay_counts *counts)
+{
+	struct ranking *r = data;
+
+	if (r->count == r->alloc) {
+		struct ranked *entries = realloc(r->entries, (r->alloc = r->alloc ? r->alloc * 2 : 256) * sizeof(*entries));
+		if (!entries) {
+			return;
+		}
+		r->entries = entries;
+	}
+	r->entries[r->count].name = strdup(name);
+	if (r->entries[r->count].name) {
+		r->entries[r->count].order = r->count;
+		r->entries[r->count++].counts = *counts;
+	}
+}
+
+static int ranked_cmp(const void *a, const void *b)
+{
+	const struct ranked *x = a, *y = b;
+
+	if (x->counts.messages != y->counts.messages) {
+		return x->counts.messages < y->counts.messages ? 1 : -1;
+	}
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static void print_top(const char *what, struct ranking *r, size_t top)
+{
+	size_t i;
+
+	/* Ties are in order of name, so they come out the same every time */
+	qsort(r->entries, r->count, sizeof(*r->entries), ranked_cmp);
+	printf("\n%-32s %12s %10s %10s %10s %10s\n", what, "Messages", "Joins", "Parts", "Quits", "Kicks");
+	for (i = 0; i < r->count && i < top; i++) {
+		const struct irc_replay_counts *c = &r->entries[i].counts;
+		printf("%-32s %12llu %10llu %10llu %10llu %10llu\n", r->entries[i].name, (unsigned long long) c->messages,
+			(unsigned long long) c->joins, (unsigned long long) c->parts, (unsigned long long) c->quits, (unsigned long long) c->kicks);
+	}
+	for (i = 0; i < r->count; i++) {
+		free(r->entries[i].name);
+	}
+	free(r->entries);
+}
+
+static int write_json(void *data, const char *buf, size_t len)
+{
+	return fwrite(buf, 1, len, data) == len ? 0 : -1;
+}
+
+/*! \brief Export logs as JSON Lines, instead of counting what's in them */
+static int export_json(const char *path, char *files[], int count)
+{
+	struct irc_json *json;
+	FILE *fp = strcmp(path, "-") ? fopen(path, "w") : stdout;
+	int i, res = 0;
+
+	if (!fp) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return -1;
+	}
+	json = irc_json_new(write_json, fp);
+	if (!json) {
+		res = -1;
+	}
+	for (i = 0; json && i < count; i++) {
+		if (irc_json_replay(json, files[i])) {
+			res = -1;
+		}
+	}
+	if (json) {
+		irc_json_free(json);
+	}
+	if (fp == stdout ? fflush(fp) : fclose(fp)) {
+		fprintf(stderr, "Failed to write %s\n", path);
+		res = -1;
+	}
+	return res;
+}
+
+/*! \brief Convert logs to a column file, instead of counting what's in them */
+static int export_columns(const char *path, char *files[], int count)
+{
+	struct irc_colwriter *w = irc_colwriter_open(path, 0);
+	int i, res = 0;
+
+	if (!w) {
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (irc_colwriter_replay(w, files[i])) {
+			res = -1;
+		}
+	}
+	return irc_colwriter_close(w) ? -1 : res;
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+	const struct ranked *x = a, *y = b;
+	int res = irc_casemap_cmp(IRC_CASEMAPPING_RFC1459, x->name, y->name);
+
+	if (res) {
+		return res;
+	}
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/*! \brief Add up the counts for the same channel from different files, and put them in order of name like irc_replay_channels */
+static void merge_names(struct ranking *r)
+{
+	size_t i, n = 0;
+
+	qsort(r->entries, r->count, sizeof(*r->entries), name_cmp);
+	for (i = 0; i < r->count; i++) {
+		struct ranked *e = &r->entries[i];
+		if (n && !irc_casemap_cmp(IRC_CASEMAPPING_RFC1459, r->entries[n - 1].name, e->name)) {
+			struct irc_replay_counts *c = &r->entries[n - 1].counts;
+			c->messages += e->counts.messages;
+			c->joins += e->counts.joins;
+			c->parts += e->counts.parts;
+			c->kicks += e->counts.kicks;
+			free(e->name);
+			continue;
+		}
+		r->entries[n] = *e;
+		r->entries[n].order = n;
+		n++;
+	}
+	r->count = n;
+}
+
+/*! \brief Show the busiest channels in column files */
+static int query_columns(char *files[], int count, size_t top)
+{
+	struct ranking channels;
+	int i, res = 0;
+
+	memset(&channels, 0, sizeof(channels));
+	for (i = 0; i < count; i++) {
+		struct irc_colfile *f = irc_colfile_open(files[i]);
+		if (!f) {
+			res = -1;
+			continue;
+		}
+		if (irc_colfile_channels(f, 0, LLONG_MAX, collect, &channels) < 0) {
+			res = -1;
+		}
+		irc_colfile_close(f);
+	}
+	merge_names(&channels);
+	print_top("Channel", &channels, top);
+	return res;
+}
+
+static void replay_log(enum irc_log_level level, int sublevel, const char *file, int line, const char *func, const char *msg)
+{
+	(void) sublevel;
+	if (level <= IRC_LOG_WARN) {
+		fprintf(stderr, "%s:%d %s(): %s", file, line, func, msg);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *types[] = { "unparsed", "numeric", "PRIVMSG", "NOTICE", "PING", "JOIN", "PART", "QUIT", "KICK",
+		"NICK", "MODE", "TOPIC", "BATCH", "ERROR", "other" };
+	struct irc_replay_config config;
+	struct irc_replay_totals totals;
+	struct irc_replay *replay;
+	struct ranking channels, nicks;
+	struct timespec start, end;
+	size_t top = 20;
+	const char *jsonpath = NULL, *colpath = NULL;
+	int query = 0;
+	double secs;
+	uint64_t bytes = 0;
+	int c, i, res = 0;
+
+	memset(&config, 0, sizeof(config));
+	while ((c = getopt(argc, argv, "?C:c:j:n:Qt:")) != -1) {
+		switch (c) {
+		case 'C':
+			colpath = optarg;
+			break;
+		case 'c':
+			config.casemapping = irc_casemapping_from_string(optarg);
+			break;
+		case 'j':
+			jsonpath = optarg;
+			break;
+		case 'n':
+			top = (size_t) atoi(optarg);
+			break;
+		case 'Q':
+			query = 1;
+			break;
+		case 't':
+			config.threads = (unsigned int) atoi(optarg);
+			break;
+		case '?':
+		default:
+			fprintf(stderr, "Usage: %s [-C <file>] [-c <casemapping>] [-j <file>] [-n <top>] [-Q] [-t <threads>] <log file>...\n", argv[0]);
+			fprintf(stderr, "-C<file>        Convert the messages to a column file, instead of counting them\n");
+			fprintf(stderr, "-c<casemapping> Casemapping used to tell which channels and nicks are the same (default rfc1459)\n");
+			fprintf(stderr, "-j<file>        Export the messages as JSON Lines to file (- for stdout), instead of counting them\n");
+			fprintf(stderr, "-n<top>         Number of channels and nicks to show (default 20)\n");
+			fprintf(stderr, "-Q              Show the busiest channels in column files, instead of replaying logs\n");
+			fprintf(stderr, "-t<threads>     Number of parsing threads (default one per CPU)\n");
+			return -1;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "No log files specified\n");
+		return -1;
+	}
+
+	irc_log_callback(replay_log);
+	if (jsonpath) {
+		return export_json(jsonpath, argv + optind, argc - optind);
+	} else if (colpath) {
+		return export_columns(colpath, argv + optind, argc - optind);
+	} else if (query) {
+		return query_columns(argv + optind, argc - optind, top);
+	}
+	replay = irc_replay_new(&config);
+	if (!replay) {
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = optind; i < argc; i++) {
+		struct stat st;
+		if (irc_replay_file(replay, argv[i])) {
+			res = -1;
+		} else if (!stat(argv[i], &st)) {
+			bytes += (uint64_t) st.st_size;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	irc_replay_totals(replay, &totals);
+	fprintf(stderr, "Replayed %d file%s (%.1f MB) in %.3f s, %.1f MB/s\n", argc - optind, argc - optind == 1 ? "" : "s",
+		(double) bytes / 1e6, secs, secs > 0 ? (double) bytes / 1e6 / secs : 0);
+	printf("%-32s %12llu\n", "Lines", (unsigned long long) totals.lines);
+	printf("%-32s %12llu\n", "Invalid", (unsigned long long) totals.invalid);
+	for (i = IRC_NUMERIC; i <= IRC_CMD_OTHER; i++) {
+		printf("%-32s %12llu\n", types[i], (unsigned long long) totals.types[i]);
+	}
+
+	memset(&channels, 0, sizeof(channels));
+	memset(&nicks, 0, sizeof(nicks));
+	irc_replay_channels(replay, collect, &channels);
+	irc_replay_nicks(replay, collect, &nicks);
+	print_top("Channel", &channels, top);
+	print_top("Nick", &nicks, top);
+	irc_replay_free(replay);
+	return res;
+}
@@ -0,0 +1,371 @@
+/*
+ * LIRC - IRC Client Library for C
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This library is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Filtered channel listing (LIST)
+ *
+ * \note RPL_LIST replies are filtered as they arrive, so nothing needs to be
+ *       retained for channels that don't match. If only the largest channels
+ *       are wanted, a min-heap of bounded size keeps track of them.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "irc_internal.h"
+#include "numerics.h"
+
+/*! \brief A retained channel, for top-K listings */
+struct list_kept {
+	int users;
+	char *channel;
+	char *topic;
+};
+
+struct list_session {
+	enum irc_casemapping casemapping;
+	char *pattern;					/*!< Casemapped name glob, NULL for any */
+	char *topic;					/*!< Casemapped topic substring, NULL for any */
+	size_t topiclen;
+	int min_users;
+	int max_users;
+	size_t top;						/*!< Number of largest channels to keep, 0 to stream all */
+	struct list_kept *heap;			/*!< Min-heap (by users) of the largest channels so far */
+	size_t heaplen;
+	size_t matched;					/*!< Number of channels that matched the filter */
+	size_t total;					/*!< Number of channels received */
+	void (*entry_cb)(void *data, const struct irc_list_entry *entry);
+	void (*end_cb)(void *data, size_t matched, size_t total);
+	void *data;
+};
+
+/*! \brief Match a casemapped glob (* and ?) against a string, folding the string as we go */
+static int glob_match(enum irc_casemapping casemapping, const char *pattern, const char *s, size_t len)
+{
+	const char *star = NULL, *end = s + len, *retry = NULL;
+
+	while (s < end) {
+		if (*pattern == '*') {
+			star = ++pattern;
+			retry = s;
+		} else if (*pattern && (*pattern == '?' || *pattern == irc_casemap_char(casemapping, *s))) {
+			pattern++;
+			s++;
+		} else if (star) {
+			/* Backtrack: let the last * absorb one more character */
+			pattern = star;
+			s = ++retry;
+		} else {
+			return 0;
+		}
+	}
+	while (*pattern == '*') {
+		pattern++;
+	}
+	return !*pattern;
+}
+
+/*! \brief Whether the casemapped needle occurs in s */
+static int topic_match(struct list_session *ls, const char *s, size_t len)
+{
+	char folded[512];
+
+	if (len > sizeof(folded)) {
+		len = sizeof(folded);
+	}
+	irc_casemap_fold(ls->casemapping, folded, s, len);
+	return memmem(folded, len, ls->topic, ls->topiclen) != NULL;
+}
+
+static void kept_free(struct list_kept *k)
+{
+	free(k->channel);
+	free(k->topic);
+}
+
+static void heap_sift_down(struct list_kept *heap, size_t len, size_t i)
+{
+	for (;;) {
+		size_t smallest = i, l = 2 * i + 1, r = l + 1;
+		struct list_kept tmp;
+		if (l < len && heap[l].users < heap[smallest].users) {
+			smallest = l;
+		}
+		if (r < len && heap[r].users < heap[smallest].users) {
+			smallest = r;
+		}
+		if (smallest == i) {
+			return;
+		}
+		tmp = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = tmp;
+		i = smallest;
+	}
+}
+
+static void heap_sift_up(struct list_kept *heap, size_t i)
+{
+	while (i) {
+		size_t parent = (i - 1) / 2;
+		struct list_kept tmp;
+		if (heap[parent].users <= heap[i].users) {
+			return;
+		}
+		tmp = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = tmp;
+		i = parent;
+	}
+}
+
+/*! \brief Offer a channel to the top-K heap */
+static void heap_offer(struct list_session *ls, const char *channel, size_t chanlen, int users, const char *topic, size_t topiclen)
+{
+	struct list_kept k;
+
+	if (ls->heaplen == ls->top && users <= ls->heap[0].users) {
+		return; /* Not large enough, the common case once the heap is full */
+	}
+	k.users = users;
+	k.channel = strndup(channel, chanlen);
+	k.topic = strndup(topic, topiclen);
+	if (!k.channel || !k.topic) {
+		kept_free(&k);
+		return;
+	}
+	if (ls->heaplen == ls->top) {
+		kept_free(&ls->heap[0]);
+		ls->heap[0] = k;
+		heap_sift_down(ls->heap, ls->heaplen, 0);
+	} else {
+		ls->heap[ls->heaplen] = k;
+		heap_sift_up(ls->heap, ls->heaplen++);
+	}
+}
+
+static void list_session_free(struct list_session *ls)
+{
+	size_t i;
+
+	for (i = 0; i < ls->heaplen; i++) {
+		kept_free(&ls->heap[i]);
+	}
+	free(ls->heap);
+	free(ls->pattern);
+	free(ls->topic);
+	free(ls);
+}
+
+/*! \brief Build the server-side conditions for a LIST, as far as the server supports them (ELIST) */
+static void list_conditions(struct irc_client *client, const struct irc_list_filter *filter, char *buf, size_t len)
+{
+	const char *elist = irc_client_isupport(client, IRC_ISUPPORT_ELIST);
+	size_t o = 0;
+
+	buf[0] = '\0';
+	if (filter->pattern && (!strpbrk(filter->pattern, "*?") || (elist && strpbrk(elist, "Mm")))) {
+		/* An exact channel name is always allowed. Wildcards need ELIST=M. */
+		o += (size_t) snprintf(buf + o, len - o, "%s", filter->pattern);
+	}
+	if (elist && strpbrk(elist, "Uu")) {
+		if (filter->min_users > 0 && o < len) {
+			o += (size_t) snprintf(buf + o, len - o, "%s>%d", o ? "," : "", filter->min_users - 1);
+		}
+		if (filter->max_users > 0 && o < len) {
+			snprintf(buf + o, len - o, "%s<%d", o ? "," : "", filter->max_users + 1);
+		}
+	}
+}
+
+int irc_client_list(struct irc_client *client, const struct irc_list_filter *filter,
+	void (*entry_cb)(void *data, const struct irc_list_entry *entry), void (*end_cb)(void *data, size_t matched, size_t total), void *data)
+{
+	struct list_session *ls;
+	char conditions[256];
+	int res;
+
+	ls = calloc(1, sizeof(*ls));
+	if (!ls) {
+		irc_err("calloc failed\n");
+		return -1;
+	}
+	ls->casemapping = irc_client_casemapping(client);
+	ls->min_users = filter->min_users;
+	ls->max_users = filter->max_users;
+	ls->top = filter->top;
+	ls->entry_cb = entry_cb;
+	ls->end_cb = end_cb;
+	ls->data = data;
+	/* Fold the filter once, rather than for every channel */
+	if (filter->pattern && strcmp(filter->pattern, "*")) {
+		ls->pattern = strdup(filter->pattern);
+		if (ls->pattern) {
+			irc_casemap_fold(ls->casemapping, ls->pattern, ls->pattern, strlen(ls->pattern));
+		}
+	}
+	if (filter->topic && *filter->topic) {
+		ls->topic = strdup(filter->topic);
+		if (ls->topic) {
+			ls->topiclen = strlen(ls->topic);
+			irc_casemap_fold(ls->casemapping, ls->topic, ls->topic, ls->topiclen);
+		}
+	}
+	if (ls->top) {
+		ls->heap = malloc(ls->top * sizeof(*ls->heap));
+	}
+	if ((filter->pattern && strcmp(filter->pattern, "*") && !ls->pattern) || (filter->topic && *filter->topic && !ls->topic) || (ls->top && !ls->heap)) {
+		irc_err("Failed to allocate memory\n");
+		list_session_free(ls);
+		return -1;
+	}
+
+	pthread_mutex_lock(&client->lock);
+	if (client->list) {
+		pthread_mutex_unlock(&client->lock);
+		irc_err("A channel listing is already in progress\n");
+		list_session_free(ls);
+		return -1;
+	}
+	client->list = ls;
+	pthread_mutex_unlock(&client->lock);
+
+	list_conditions(client, filter, conditions, sizeof(conditions));
+	res = irc_send(client, "LIST%s%s", *conditions ? " " : "", conditions);
+	if (res) {
+		pthread_mutex_lock(&client->lock);
+		client->list = NULL;
+		pthread_mutex_unlock(&client->lock);
+		list_session_free(ls);
+	}
+	return res;
+}
+
+static void list_entry(struct list_session *ls, const char *s)
+{
+	const char *channel, *count, *topic;
+	size_t chanlen, len, topiclen = 0;
+	int users;
+
+	/* <client> <channel> <client count> :<topic> */
+	next_param(&s, &len);
+	channel = next_param(&s, &chanlen);
+	count = next_param(&s, &len);
+	if (!channel || !count) {
+		return;
+	}
+	ls->total++;
+	users = atoi(count);
+	topic = next_param(&s, &topiclen);
+	if (!topic) {
+		topic = "";
+	}
+
+	if ((ls->min_users > 0 && users < ls->min_users) || (ls->max_users > 0 && users > ls->max_users)) {
+		return;
+	}
+	if (ls->pattern && !glob_match(ls->casemapping, ls->pattern, channel, chanlen)) {
+		return;
+	}
+	if (ls->topic && !topic_match(ls, topic, topiclen)) {
+		return;
+	}
+	ls->matched++;
+
+	if (ls->top) {
+		heap_offer(ls, channel, chanlen, users, topic, topiclen);
+	} else if (ls->entry_cb) {
+		char name[256];
+		struct irc_list_entry entry;
+		snprintf(name, sizeof(name), "%.*s", (int) chanlen, channel);
+		entry.channel = name;
+		entry.users = users;
+		entry.topic = topic;
+		ls->entry_cb(ls->data, &entry);
+	}
+}
+
+static void list_end(struct list_session *ls)
+{
+	size_t i, n = ls->heaplen;
+
+	/* Heapsort in place. Since it's a min-heap, this leaves the largest channels first. */
+	while (ls->heaplen > 1) {
+		struct list_kept tmp = ls->heap[0];
+		ls->heap[0] = ls->heap[--ls->heaplen];
+		ls->heap[ls->heaplen] = tmp;
+		heap_sift_down(ls->heap, ls->heaplen, 0);
+	}
+	ls->heaplen = n;
+	for (i = 0; i < n && ls->entry_cb; i++) {
+		struct irc_list_entry entry;
+		entry.channel = ls->heap[i].channel;
+		entry.users = ls->heap[i].users;
+		entry.topic = ls->heap[i].topic;
+		ls->entry_cb(ls->data, &entry);
+	}
+	if (ls->end_cb) {
+		ls->end_cb(ls->data, ls->matched, ls->total);
+	}
+}
+
+int list_process(struct irc_client *client, struct irc_msg *msg)
+{
+	struct list_session *ls;
+
+	if (msg->numeric == RPL_TRYAGAIN) {
+		/* <client> <command> :<info> */
+		const char *s = msg->body, *command;
+		size_t len;
+		next_param(&s, &len);
+		command = next_param(&s, &len);
+		if (!command || len != 4 || strncasecmp(command, "LIST", 4)) {
+			return 0;
+		}
+	}
+
+	pthread_mutex_lock(&client->lock);
+	ls = client->list;
+	if (ls && (msg->numeric == RPL_LISTEND || msg->numeric == RPL_TRYAGAIN)) {
+		client->list = NULL; /* Another listing may be started as soon as we're done */
+	}
+	pthread_mutex_unlock(&client->lock);
+
+	if (!ls) {
+		return 0;
+	}
+	switch (msg->numeric) {
+	case RPL_LIST:
+		list_entry(ls, msg->body);
+		break;
+	case RPL_LISTEND:
+	case RPL_TRYAGAIN:
+		list_end(ls);
+		list_session_free(ls);
+		break;
+	default:
+		break;
+	}
+	return 1;
+}
+
+void list_destroy(struct irc_client *client)
+{
+	if (client->list) {
+		list_session_free(client->list);
+		client->list = NULL;
+	}
+}
@@ -0,0 +1,423 @@
+/*
+ * LIRC - IRC Client Library for C
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This library is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Netsplit and netjoin aggregation
+ *
+ * \note When servers split, every user behind the split server QUITs
+ *       with the reason "<server1> <server2>", all at once. Rather than
+ *       handling each of these individually, they are grouped by split,
+ *       removed from the tracked state in bulk, and reported as a single
+ *       event once the storm has subsided. The users in a split are
+ *       remembered for a while, so that their JOINs when the split
+ *       heals can be grouped in the same way.
+ *
+ *       All of this runs on the irc_loop thread, so no locking is needed.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "irc_internal.h"
+
+/*! \brief How long (ms) after the last QUIT or JOIN of a split to report it */
+#define NETSPLIT_QUIET_MS 1000
+
+/*! \brief Longest (ms) a split may be aggregated for, even if it's still going */
+#define NETSPLIT_MAX_MS 10000
+
+/*! \brief How long (seconds) to remember users in a split, to recognize them rejoining */
+#define NETJOIN_WINDOW 1800
+
+/*! \brief A split or join in progress */
+struct split_group {
+	enum irc_netsplit_type type;
+	char *servers;					/*!< "<server1> <server2>" */
+	const char **nicks;				/*!< Interned nicks */
+	size_t count;
+	size_t alloc;
+	long long first;				/*!< When the first user was added (monotonic ms) */
+	long long last;					/*!< When the last user was added (monotonic ms) */
+	struct split_group *next;
+};
+
+/*! \brief A user who was in a split, and may rejoin */
+struct split_user {
+	struct split_user *next;		/*!< Next in hash chain */
+	uint64_t hash;
+	const char *nick;				/*!< Interned */
+	const char *servers;			/*!< Interned */
+	time_t expires;
+	unsigned int rejoined:1;		/*!< Already added to a netjoin group */
+};
+
+struct netsplit {
+	void (*cb)(void *data, const struct irc_netsplit *split);
+	void *data;
+	struct split_group *groups;		/*!< Splits and joins being aggregated */
+	struct split_user **users;		/*!< Hash table of users that may rejoin */
+	size_t size;					/*!< Number of buckets in users (power of 2) */
+	size_t count;					/*!< Number of users */
+};
+
+#define INITIAL_BUCKETS 64
+
+/*!
+ * \brief Whether a QUIT reason is a netsplit reason
+ * \note Servers prefix ordinary quit messages (e.g. "Quit: "), so users can't spoof these
+ */
+static int is_split_reason(const char *reason)
+{
+	const char *space = strchr(reason, ' ');
+	const char *dot1 = strchr(reason, '.'), *dot2 = space ? strchr(space + 1, '.') : NULL;
+
+	if (!space || space == reason || !space[1] || strchr(space + 1, ' ')) {
+		return 0; /* Must be exactly two words */
+	}
+	if (!dot1 || dot1 > space || !dot2) {
+		return 0; /* Both must look like server names */
+	}
+	return !strpbrk(reason, ":/*!@");
+}
+
+static int netsplit_init(struct irc_client *client)
+{
+	struct netsplit *ns = calloc(1, sizeof(*ns));
+
+	if (ns) {
+		ns->users = calloc(INITIAL_BUCKETS, sizeof(*ns->users));
+	}
+	if (!ns || !ns->users) {
+		free(ns);
+		irc_err("calloc failed\n");
+		return -1;
+	}
+	ns->size = INITIAL_BUCKETS;
+	client->netsplit = ns;
+	return 0;
+}
+
+int irc_client_netsplit_callback(struct irc_client *client, void (*cb)(void *data, const struct irc_netsplit *split), void *data)
+{
+	if (!client->netsplit && netsplit_init(client)) {
+		return -1;
+	}
+	client->netsplit->cb = cb;
+	client->netsplit->data = data;
+	return 0;
+}
+
+static void group_free(struct irc_client *client, struct split_group *g)
+{
+	size_t i;
+
+	for (i = 0; i < g->count; i++) {
+		irc_intern_release(client->pool, g->nicks[i]);
+	}
+	free(g->nicks);
+	free(g->servers);
+	free(g);
+}
+
+static void split_user_free(struct irc_client *client, struct split_user *u)
+{
+	irc_intern_release(client->pool, u->nick);
+	irc_intern_release(client->pool, u->servers);
+	free(u);
+}
+
+void netsplit_destroy(struct irc_client *client)
+{
+	struct netsplit *ns = client->netsplit;
+	size_t i;
+
+	if (!ns) {
+		return;
+	}
+	while (ns->groups) {
+		struct split_group *g = ns->groups;
+		ns->groups = g->next;
+		group_free(client, g);
+	}
+	for (i = 0; i < ns->size; i++) {
+		while (ns->users[i]) {
+			struct split_user *u = ns->users[i];
+			ns->users[i] = u->next;
+			split_user_free(client, u);
+		}
+	}
+	free(ns->users);
+	free(ns);
+	client->netsplit = NULL;
+}
+
+static struct split_group *group_get(struct netsplit *ns, enum irc_netsplit_type type, const char *servers, size_t len)
+{
+	struct split_group *g;
+
+	for (g = ns->groups; g; g = g->next) {
+		if (g->type == type && !strncmp(g->servers, servers, len) && !g->servers[len]) {
+			return g;
+		}
+	}
+	g = calloc(1, sizeof(*g));
+	if (!g) {
+		return NULL;
+	}
+	g->servers = strndup(servers, len);
+	if (!g->servers) {
+		free(g);
+		return NULL;
+	}
+	g->type = type;
+	g->first = now_ms();
+	g->next = ns->groups;
+	ns->groups = g;
+	return g;
+}
+
+static int group_add(struct irc_client *client, struct split_group *g, const char *nick, size_t len)
+{
+	if (g->count == g->alloc) {
+		size_t alloc = g->alloc ? g->alloc * 2 : 32;
+		const char **nicks = realloc(g->nicks, alloc * sizeof(*nicks));
+		if (!nicks) {
+			return -1;
+		}
+		g->nicks = nicks;
+		g->alloc = alloc;
+	}
+	g->nicks[g->count] = irc_intern(client->pool, nick, len);
+	if (!g->nicks[g->count]) {
+		return -1;
+	}
+	g->count++;
+	g->last = now_ms();
+	return 0;
+}
+
+static struct split_user *split_user_find(struct netsplit *ns, enum irc_casemapping casemapping, const char *nick, size_t len)
+{
+	uint64_t hash = irc_casemap_hash(casemapping, nick, len);
+	struct split_user *u;
+
+	for (u = ns->users[hash & (ns->size - 1)]; u; u = u->next) {
+		if (u->hash == hash && irc_intern_len(u->nick) == len && irc_casemap_memeq(casemapping, u->nick, nick, len)) {
+			return u;
+		}
+	}
+	return NULL;
+}
+
+/*! \brief Remove users who were in a split too long ago to still be expected back, or that already rejoined */
+static void split_users_sweep(struct irc_client *client, int rejoined)
+{
+	struct netsplit *ns = client->netsplit;
+	time_t now = time(NULL);
+	size_t i;
+
+	for (i = 0; i < ns->size; i++) {
+		struct split_user **u = &ns->users[i];
+		while (*u) {
+			if ((*u)->expires <= now || (rejoined && (*u)->rejoined)) {
+				struct split_user *old = *u;
+				*u = old->next;
+				ns->count--;
+				split_user_free(client, old);
+			} else {
+				u = &(*u)->next;
+			}
+		}
+	}
+}
+
+/*! \brief Remember the users in a split, so we can recognize them rejoining */
+static void split_users_remember(struct irc_client *client, struct split_group *g)
+{
+	struct netsplit *ns = client->netsplit;
+	enum irc_casemapping casemapping = irc_client_casemapping(client);
+	time_t expires = time(NULL) + NETJOIN_WINDOW;
+	const char *servers = irc_intern_str(client->pool, g->servers);
+	size_t i;
+
+	if (!servers) {
+		return;
+	}
+	split_users_sweep(client, 0);
+	while (ns->count + g->count > ns->size) {
+		size_t newsize = ns->size * 2;
+		struct split_user **users = calloc(newsize, sizeof(*users));
+		if (!users) {
+			break;
+		}
+		for (i = 0; i < ns->size; i++) {
+			struct split_user *u, *next;
+			for (u = ns->users[i]; u; u = next) {
+				next = u->next;
+				u->next = users[u->hash & (newsize - 1)];
+				users[u->hash & (newsize - 1)] = u;
+			}
+		}
+		free(ns->users);
+		ns->users = users;
+		ns->size = newsize;
+	}
+	for (i = 0; i < g->count; i++) {
+		struct split_user *u = split_user_find(ns, casemapping, g->nicks[i], irc_intern_len(g->nicks[i]));
+		if (!u) {
+			u = calloc(1, sizeof(*u));
+			if (!u) {
+				break;
+			}
+			u->hash = irc_casemap_hash(casemapping, g->nicks[i], irc_intern_len(g->nicks[i]));
+			u->nick = irc_intern_ref(client->pool, g->nicks[i]);
+			u->next = ns->users[u->hash & (ns->size - 1)];
+			ns->users[u->hash & (ns->size - 1)] = u;
+			ns->count++;
+		} else {
+			irc_intern_release(client->pool, u->servers);
+		}
+		u->servers = irc_intern_ref(client->pool, servers);
+		u->expires = expires;
+		u->rejoined = 0;
+	}
+	irc_intern_release(client->pool, servers);
+}
+
+/*! \brief Report a split or join, and apply it to tracked state */
+static void group_flush(struct irc_client *client, struct split_group *g)
+{
+	struct netsplit *ns = client->netsplit;
+	struct irc_netsplit split;
+	size_t space = strcspn(g->servers, " ");
+	char server1[256];
+
+	if (g->type == IRC_NETSPLIT_QUIT) {
+		/* All the QUITs at once */
+		state_quit_bulk(client, (const char *const *) g->nicks, g->count);
+		who_quit_bulk(client, (const char *const *) g->nicks, g->count);
+		split_users_remember(client, g);
+	} else {
+		split_users_sweep(client, 1);
+	}
+
+	snprintf(server1, sizeof(server1), "%.*s", (int) space, g->servers);
+	split.type = g->type;
+	split.server1 = server1;
+	split.server2 = g->servers[space] ? g->servers + space + 1 : "";
+	split.nicks = (const char *const *) g->nicks;
+	split.count = g->count;
+	if (ns->cb) {
+		ns->cb(ns->data, &split);
+	}
+}
+
+long long netsplit_deadline(struct irc_client *client)
+{
+	struct split_group *g;
+	long long next = -1;
+
+	for (g = client->netsplit->groups; g; g = g->next) {
+		long long deadline = g->last + NETSPLIT_QUIET_MS;
+		if (deadline > g->first + NETSPLIT_MAX_MS) {
+			deadline = g->first + NETSPLIT_MAX_MS;
+		}
+		if (next == -1 || deadline < next) {
+			next = deadline;
+		}
+	}
+	return next;
+}
+
+void netsplit_flush_due(struct irc_client *client, long long now)
+{
+	struct split_group **gp = &client->netsplit->groups;
+
+	while (*gp) {
+		struct split_group *g = *gp;
+		if (now >= g->last + NETSPLIT_QUIET_MS || now >= g->first + NETSPLIT_MAX_MS) {
+			*gp = g->next;
+			group_flush(client, g);
+			group_free(client, g);
+		} else {
+			gp = &g->next;
+		}
+	}
+}
+
+int netsplit_quit(struct irc_client *client, const char *servers, size_t serverslen, const char *nick, size_t nicklen)
+{
+	struct split_group *g = group_get(client->netsplit, IRC_NETSPLIT_QUIT, servers, serverslen);
+
+	if (!g || group_add(client, g, nick, nicklen)) {
+		return 0; /* Let it be handled as an ordinary QUIT */
+	}
+	return 1;
+}
+
+int netsplit_join(struct irc_client *client, const char *nick, size_t nicklen)
+{
+	struct netsplit *ns = client->netsplit;
+	struct split_user *u = split_user_find(ns, irc_client_casemapping(client), nick, nicklen);
+	struct split_group *g;
+
+	if (!u || u->expires <= time(NULL)) {
+		return 0;
+	}
+	if (u->rejoined) {
+		return 1; /* Already in the netjoin, this is just another channel */
+	}
+	g = group_get(ns, IRC_NETSPLIT_JOIN, u->servers, irc_intern_len(u->servers));
+	if (!g || group_add(client, g, nick, nicklen)) {
+		return 0;
+	}
+	u->rejoined = 1;
+	return 1;
+}
+
+int netsplit_process(struct irc_client *client, struct irc_msg *msg)
+{
+	const struct irc_batch *batch;
+	size_t nicklen;
+
+	if (!msg->prefix || !client->netsplit->cb) {
+		return 0;
+	}
+	nicklen = strcspn(msg->prefix, "!@");
+	switch (msg->type) {
+	case IRC_CMD_QUIT:
+		batch = batch_of(client, msg);
+		if (batch && !strcmp(batch->type, "netsplit") && batch->params) {
+			/* BATCH +<ref> netsplit <server1> <server2> */
+			if (netsplit_quit(client, batch->params, strlen(batch->params), msg->prefix, nicklen)) {
+				return NETSPLIT_CONSUMED;
+			}
+		} else if (msg->body) {
+			const char *reason = *msg->body == ':' ? msg->body + 1 : msg->body;
+			if (is_split_reason(reason) && netsplit_quit(client, reason, strlen(reason), msg->prefix, nicklen)) {
+				return NETSPLIT_CONSUMED;
+			}
+		}
+		break;
+	case IRC_CMD_JOIN:
+		if (client->netsplit->count && netsplit_join(client, msg->prefix, nicklen)) {
+			return NETSPLIT_AGGREGATED;
+		}
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
@@ -0,0 +1,533 @@
+/*
+ * LIRC - IRC Client Library for C
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This library is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Asynchronous protocol logging
+ *
+ * \note irc_loop copies each received line, with the time it was received, into a
+ *       single-producer single-consumer ring, which a writer thread drains into large writes.
+ *       Neither side takes a lock unless the ring is empty (the writer waits for more)
+ *       or full (irc_loop waits for room, or drops the line, as configured),
+ *       so a slow disk never holds up processing messages from the server.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "irc_internal.h"
+
+/*! \brief Default ring size */
+#define RING_SIZE_DEFAULT (1024 * 1024)
+
+/*! \brief Smallest ring size, which must fit the longest possible line */
+#define RING_SIZE_MIN (64 * 1024)
+
+/*! \brief Size of the writer's output buffer, i.e. of the largest write */
+#define WRITE_SIZE (256 * 1024)
+
+/*! \brief Length of the timestamp written before each line: "[YYYY-MM-DD HH:MM:SS.mmm] " */
+#define STAMP_LEN 26
+
+/*! \brief Minimum time (in seconds) between warnings about dropped lines */
+#define DROP_WARN_INTERVAL 10
+
+/*! \brief Records are aligned to this, which is also the size of a record header */
+#define RECORD_ALIGN 16
+
+/*! \brief Header length marking the rest of the ring as unused, since the next record didn't fit before the end */
+#define RECORD_WRAP UINT32_MAX
+
+#define CACHE_LINE 64
+
+struct record {
+	uint32_t len;					/*!< Length of the line that follows, or RECORD_WRAP */
+	uint32_t unused;
+	long long received;				/*!< When it was received (realtime ms) */
+};
+
+struct protolog {
+	/* Written by irc_loop's thread */
+	uint64_t head __attribute__ ((aligned (CACHE_LINE)));	/*!< Total bytes ever put in the ring */
+	uint64_t dropped;				/*!< Lines dropped because the ring was full */
+	uint64_t lines;					/*!< Lines put in the ring */
+	int producer_waiting;			/*!< Waiting for room */
+	/* Written by the writer thread */
+	uint64_t tail __attribute__ ((aligned (CACHE_LINE)));	/*!< Total bytes ever taken out of the ring */
+	uint64_t written;				/*!< Bytes written to files */
+	uint64_t rotations;
+	int writer_waiting;				/*!< Waiting for more */
+	int stopping;
+	/* Set up before the writer starts, and then only used by it */
+	unsigned char *ring __attribute__ ((aligned (CACHE_LINE)));
+	size_t size;					/*!< Power of 2 */
+	char *out;						/*!< Output buffer */
+	size_t outlen;
+	int fd;
+	uint64_t filesize;				/*!< Size of the current file */
+	time_t opened;					/*!< When the current file was started */
+	uint64_t max_size;
+	unsigned int max_age;
+	unsigned int block:1;
+	unsigned int timestamps:1;
+	time_t stamp_secs;				/*!< Second that stamp is for */
+	char stamp[24];					/*!< Formatted timestamp, to the second */
+	struct irc_archive *archive;	/*!< Message archive, NULL if none */
+	pthread_mutex_t lock;			/*!< Only for waiting */
+	pthread_cond_t cond;
+	pthread_t thread;
+	char path[];
+};
+
+static int log_open(struct protolog *log)
+{
+	struct stat st;
+
+	log->fd = open(log->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (log->fd < 0) {
+		irc_err("Failed to open %s: %s\n", log->path, strerror(errno));
+		return -1;
+	}
+	log->filesize = fstat(log->fd, &st) ? 0 : (uint64_t) st.st_size;
+	log->opened = time(NULL);
+	return 0;
+}
+
+/*! \brief Move the current file aside, named for when it was started, and start a new one */
+static void log_rotate(struct protolog *log)
+{
+	char newpath[4096], stamp[32];
+	struct tm tm;
+	int i;
+
+	localtime_r(&log->opened, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+	snprintf(newpath, sizeof(newpath), "%s.%s", log->path, stamp);
+	for (i = 1; !access(newpath, F_OK) && i < 1000; i++) {
+		snprintf(newpath, sizeof(newpath), "%s.%s.%d", log->path, stamp, i); /* Rotated more than once a second */
+	}
+	if (rename(log->path, newpath)) {
+		irc_err("Failed to rename %s to %s: %s\n", log->path, newpath, strerror(errno));
+		log->opened = time(NULL); /* Don't try again right away */
+		return;
+	}
+	close(log->fd);
+	if (log_open(log)) {
+		return; /* Lines are discarded until the next rotation succeeds */
+	}
+	__atomic_add_fetch(&log->rotations, 1, __ATOMIC_RELAXED);
+}
+
+static int rotation_due(struct protolog *log, size_t pending)
+{
+	if (log->fd < 0) {
+		return 1;
+	} else if (log->max_size && log->filesize && log->filesize + pending > log->max_size) {
+		return 1;
+	}
+	return log->max_age && time(NULL) - log->opened >= (time_t) log->max_age;
+}
+
+static void log_flush(struct protolog *log)
+{
+	size_t done = 0;
+
+	if (rotation_due(log, log->outlen)) {
+		if (log->fd < 0) {
+			log_open(log);
+		} else {
+			log_rotate(log);
+		}
+	}
+	while (log->fd >= 0 && done < log->outlen) {
+		ssize_t res = write(log->fd, log->out + done, log->outlen - done);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			irc_err("Failed to write to %s: %s\n", log->path, strerror(errno));
+			break;
+		}
+		done += (size_t) res;
+	}
+	log->filesize += done;
+	__atomic_add_fetch(&log->written, done, __ATOMIC_RELAXED);
+	log->outlen = 0;
+}
+
+/*! \brief Format a record into the output buffer */
+static void log_record(struct protolog *log, const struct record *rec, const char *line)
+{
+	size_t need = rec->len + 1 + (log->timestamps ? STAMP_LEN : 0);
+
+	if (log->outlen + need > WRITE_SIZE) {
+		log_flush(log);
+	}
+	if (log->timestamps) {
+		time_t secs = (time_t) (rec->received / 1000);
+		if (secs != log->stamp_secs) {
+			/* Many lines arrive in the same second, so don't convert the time for each one */
+			struct tm tm;
+			localtime_r(&secs, &tm);
+			strftime(log->stamp, sizeof(log->stamp), "%Y-%m-%d %H:%M:%S", &tm);
+			log->stamp_secs = secs;
+		}
+		snprintf(log->out + log->outlen, WRITE_SIZE - log->outlen, "[%s.%03d] ", log->stamp, (int) (rec->received % 1000));
+		log->outlen += STAMP_LEN;
+	}
+	memcpy(log->out + log->outlen, line, rec->len);
+	log->outlen += rec->len;
+	log->out[log->outlen++] = '\n';
+	if (log->archive) {
+		irc_archive_append(log->archive, rec->received, line, rec->len);
+	}
+}
+
+/*! \brief Wake up the other side, if it's waiting. The flag must be checked after publishing what it's waiting for. */
+static void log_signal(struct protolog *log, int *waiting)
+{
+	if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&log->lock);
+		pthread_cond_broadcast(&log->cond);
+		pthread_mutex_unlock(&log->lock);
+	}
+}
+
+static void *log_writer(void *varg)
+{
+	struct protolog *log = varg;
+	uint64_t tail = log->tail, reported = 0;
+	time_t warned = 0;
+
+	for (;;) {
+		uint64_t head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE), dropped;
+		int stopping;
+
+		if (head != tail) {
+			/* Take everything there is, freeing up space as we go */
+			while (tail != head) {
+				struct record *rec = (struct record *) (log->ring + (tail & (log->size - 1)));
+				if (rec->len == RECORD_WRAP) {
+					tail += log->size - (tail & (log->size - 1));
+				} else {
+					log_record(log, rec, (const char *) (rec + 1));
+					tail += (sizeof(*rec) + rec->len + RECORD_ALIGN - 1) & ~((uint64_t) RECORD_ALIGN - 1);
+				}
+				__atomic_store_n(&log->tail, tail, __ATOMIC_SEQ_CST);
+				log_signal(log, &log->producer_waiting);
+			}
+			if (log->outlen >= WRITE_SIZE / 2) {
+				log_flush(log);
+			}
+			continue; /* Check for more before writing out the rest, so writes stay large while busy */
+		}
+
+		if (log->archive) {
+			archive_flush_idle(log->archive);
+		}
+		if (log->outlen) {
+			log_flush(log);
+		} else if (rotation_due(log, 0) && log->fd >= 0 && log->filesize) {
+			log_rotate(log); /* Rotate on time even when quiet, so files cover predictable periods */
+		}
+		dropped = __atomic_load_n(&log->dropped, __ATOMIC_RELAXED);
+		if (dropped != reported && time(NULL) - warned >= DROP_WARN_INTERVAL) {
+			irc_warn("Protocol log fell behind, %llu line%s dropped\n", (unsigned long long) (dropped - reported), dropped - reported == 1 ? "" : "s");
+			reported = dropped;
+			warned = time(NULL);
+		}
+
+		/* Nothing to do, wait for more. Recheck under the lock, so a wakeup can't be missed. */
+		pthread_mutex_lock(&log->lock);
+		__atomic_store_n(&log->writer_waiting, 1, __ATOMIC_SEQ_CST);
+		stopping = __atomic_load_n(&log->stopping, __ATOMIC_SEQ_CST);
+		if (!stopping && __atomic_load_n(&log->head, __ATOMIC_SEQ_CST) == tail) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += 1; /* Wake up now and then to rotate */
+			pthread_cond_timedwait(&log->cond, &log->lock, &ts);
+		}
+		__atomic_store_n(&log->writer_waiting, 0, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&log->lock);
+		if (stopping && __atomic_load_n(&log->head, __ATOMIC_ACQUIRE) == tail) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*! \brief Free space in the ring, as seen by the producer */
+static uint64_t ring_free(struct protolog *log)
+{
+	return log->size - (log->head - __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE));
+}
+
+void protolog_line(struct protolog *log, const char *line, size_t len)
+{
+	struct timespec ts;
+	struct record *rec;
+	uint64_t need, pos, wrap = 0;
+
+	if (len > RING_SIZE_MIN / 2) {
+		len = RING_SIZE_MIN / 2; /* Can't happen for lines from irc_loop */
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	need = (sizeof(*rec) + len + RECORD_ALIGN - 1) & ~((uint64_t) RECORD_ALIGN - 1);
+	pos = log->head & (log->size - 1);
+	if (log->size - pos < need) {
+		wrap = log->size - pos; /* Doesn't fit before the end, so skip to the start */
+	}
+
+	if (ring_free(log) < need + wrap) {
+		if (!log->block) {
+			__atomic_add_fetch(&log->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		pthread_mutex_lock(&log->lock);
+		__atomic_store_n(&log->producer_waiting, 1, __ATOMIC_SEQ_CST);
+		while (ring_free(log) < need + wrap) {
+			pthread_cond_broadcast(&log->cond); /* In case the writer is waiting too, which it shouldn't be for long */
+			pthread_cond_wait(&log->cond, &log->lock);
+		}
+		__atomic_store_n(&log->producer_waiting, 0, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&log->lock);
+	}
+
+	if (wrap) {
+		rec = (struct record *) (log->ring + pos);
+		rec->len = RECORD_WRAP;
+		pos = 0;
+	}
+	rec = (struct record *) (log->ring + pos);
+	rec->len = (uint32_t) len;
+	rec->received = (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	memcpy(rec + 1, line, len);
+	__atomic_store_n(&log->lines, log->lines + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&log->head, log->head + wrap + need, __ATOMIC_SEQ_CST);
+	log_signal(log, &log->writer_waiting);
+}
+
+static void log_free(struct protolog *log)
+{
+	if (log->fd >= 0) {
+		close(log->fd);
+	}
+	if (log->archive) {
+		irc_archive_close(log->archive);
+	}
+	pthread_cond_destroy(&log->cond);
+	pthread_mutex_destroy(&log->lock);
+	free(log->ring);
+	free(log->out);
+	free(log);
+}
+
+int irc_client_protolog_open(struct irc_client *client, const struct irc_protolog_config *config)
+{
+	struct protolog *log;
+	size_t size = RING_SIZE_MIN;
+
+	if (client->protolog) {
+		irc_err("Protocol logging is already enabled\n");
+		return -1;
+	} else if (!config->path || strlen(config->path) >= 4000) {
+		irc_err("Invalid log file path\n");
+		return -1;
+	}
+	while (size < config->buffer_size || (!config->buffer_size && size < RING_SIZE_DEFAULT)) {
+		size *= 2;
+	}
+
+	log = calloc(1, sizeof(*log) + strlen(config->path) + 1);
+	if (!log) {
+		irc_err("calloc failed\n");
+		return -1;
+	}
+	strcpy(log->path, config->path); /* Safe */
+	log->size = size;
+	log->max_size = config->max_size;
+	log->max_age = config->max_age;
+	log->block = config->block ? 1 : 0;
+	log->timestamps = config->timestamps ? 1 : 0;
+	pthread_mutex_init(&log->lock, NULL);
+	pthread_cond_init(&log->cond, NULL);
+	log->ring = malloc(size);
+	log->out = malloc(WRITE_SIZE);
+	if (!log->ring || !log->out) {
+		irc_err("malloc failed\n");
+		log->fd = -1;
+		log_free(log);
+		return -1;
+	}
+	if (log_open(log)) {
+		log_free(log);
+		return -1;
+	}
+	if (config->archive) {
+		log->archive = irc_archive_open(config->archive, 0);
+		if (!log->archive || (config->search && irc_archive_index(log->archive))) {
+			log_free(log);
+			return -1;
+		}
+	}
+	if (pthread_create(&log->thread, NULL, log_writer, log)) {
+		irc_err("Failed to create log writer thread\n");
+		log_free(log);
+		return -1;
+	}
+	__atomic_store_n(&client->protolog, log, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*! \brief Stop the writer thread, once it's written out everything still in the ring, and free the log */
+static void log_stop(struct irc_client *client, struct protolog *log)
+{
+	__atomic_store_n(&client->protolog, NULL, __ATOMIC_RELEASE);
+	__atomic_store_n(&log->stopping, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&log->lock);
+	pthread_cond_broadcast(&log->cond);
+	pthread_mutex_unlock(&log->lock);
+	pthread_join(log->thread, NULL); /* Everything in the ring is written out first */
+	log_free(log);
+}
+
+int irc_client_protolog_close(struct irc_client *client)
+{
+	struct protolog *log = client->protolog;
+
+	if (!log) {
+		return -1;
+	} else if (irc_loop_running(client)) {
+		irc_err("Protocol logging can't be stopped while irc_loop is running\n");
+		return -1;
+	}
+	log_stop(client, log);
+	return 0;
+}
+
+int irc_client_protolog_stats(struct irc_client *client, struct irc_protolog_stats *stats)
+{
+	struct protolog *log = __atomic_load_n(&client->protolog, __ATOMIC_ACQUIRE);
+
+	if (!log) {
+		return -1;
+	}
+	stats->lines = __atomic_load_n(&log->lines, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&log->dropped, __ATOMIC_RELAXED);
+	stats->bytes = __atomic_load_n(&log->written, __ATOMIC_RELAXED);
+	stats->rotations = __atomic_load_n(&log->rotations, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void protolog_destroy(struct irc_client *client)
+{
+	/* Not irc_client_protolog_close: irc_loop is gone by now, even if it was cancelled without getting to say so */
+	if (client->protolog) {
+		log_stop(client, client->protolog);
+	}
+}
+
+/* === Replay === */
+
+static int is_digits(const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (s[i] < '0' || s[i] > '9') {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*! \brief Whether a line starts with a timestamp */
+static int has_stamp(const char *s, size_t len)
+{
+	return len > STAMP_LEN && s[0] == '[' && s[STAMP_LEN - 2] == ']' && s[STAMP_LEN - 1] == ' '
+		&& is_digits(s + 1, 4) && is_digits(s + 6, 2) && is_digits(s + 9, 2)
+		&& is_digits(s + 12, 2) && is_digits(s + 15, 2) && is_digits(s + 18, 2) && is_digits(s + 21, 3);
+}
+
+#define DIGITS2(p) (((p)[0] - '0') * 10 + ((p)[1] - '0'))
+
+int protolog_replay(const char *path, int (*cb)(void *data, const char *line, size_t len, long long received), void *data)
+{
+	struct stat st;
+	const char *map, *line, *end;
+	char stamp[19] = ""; /* Last timestamp converted, "YYYY-MM-DD HH:MM:SS" */
+	long long stamp_ms = 0;
+	int fd, res = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		irc_err("Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	} else if (fstat(fd, &st)) {
+		irc_err("fstat failed: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	} else if (!st.st_size) {
+		close(fd);
+		return 0;
+	}
+	map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		irc_err("mmap failed: %s\n", strerror(errno));
+		return -1;
+	}
+	madvise((void *) map, (size_t) st.st_size, MADV_SEQUENTIAL);
+
+	end = map + st.st_size;
+	for (line = map; line < end && !res; ) {
+		const char *eol = memchr(line, '\n', (size_t) (end - line));
+		size_t len = (size_t) ((eol ? eol : end) - line);
+		long long received = -1;
+		if (has_stamp(line, len)) {
+			if (memcmp(stamp, line + 1, sizeof(stamp))) {
+				/* Many lines are logged in the same second, so don't convert the time for each one */
+				struct tm tm;
+				memset(&tm, 0, sizeof(tm));
+				tm.tm_year = DIGITS2(line + 1) * 100 + DIGITS2(line + 3) - 1900;
+				tm.tm_mon = DIGITS2(line + 6) - 1;
+				tm.tm_mday = DIGITS2(line + 9);
+				tm.tm_hour = DIGITS2(line + 12);
+				tm.tm_min = DIGITS2(line + 15);
+				tm.tm_sec = DIGITS2(line + 18);
+				tm.tm_isdst = -1; /* Logged in local time */
+				stamp_ms = (long long) mktime(&tm) * 1000;
+				memcpy(stamp, line + 1, sizeof(stamp));
+			}
+			received = stamp_ms + DIGITS2(line + 21) * 10 + (line[23] - '0');
+			line += STAMP_LEN;
+			len -= STAMP_LEN;
+		}
+		if (len && line[len - 1] == '\r') {
+			len--;
+		}
+		if (len) {
+			res = cb(data, line, len, received);
+		}
+		line = eol ? eol + 1 : end;
+	}
+	munmap((void *) map, (size_t) st.st_size);
+	return res;
+}
@@ -0,0 +1,558 @@
+/*
+ * LIRC - IRC Client Library for C
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This library is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Parallel replay of protocol logs
+ *
+ * \note A log file is mapped and divided into chunks, each starting at the first line that begins in it.
+ *       Threads take chunks in turn and parse their lines with irc_parse_msg, counting into their own tables,
+ *       so they share nothing but the counter of which chunk is next. Once they're done,
+ *       their tables are added together. Sums don't depend on which thread counted what, and names are
+ *       shown as they were first spelled in the log, so the results are the same for any number of threads.
+ */
+
+#define _GNU_SOURCE 1 /* qsort_r */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "irc_internal.h"
+
+/*! \brief Default chunk size */
+#define CHUNK_SIZE_DEFAULT (4 * 1024 * 1024)
+
+/*! \brief Longest line parsed. Longer ones are counted as invalid. */
+#define MAX_LINE 65536
+
+/*! \brief Length of the timestamp irc_client_protolog_open can prefix lines with: "[YYYY-MM-DD HH:MM:SS.mmm] " */
+#define STAMP_LEN 26
+
+struct replay_entry {
+	struct replay_entry *next;		/*!< Next in hash chain */
+	uint64_t hash;					/*!< Casemapped hash of name */
+	uint64_t first;					/*!< Where it first appeared, to pick which spelling of its name to show */
+	struct irc_replay_counts counts;
+	size_t len;
+	char name[];
+};
+
+struct replay_table {
+	struct replay_entry **buckets;
+	size_t nbuckets;				/*!< Power of 2 */
+	size_t count;
+};
+
+struct irc_replay {
+	enum irc_casemapping casemapping;
+	unsigned int threads;
+	size_t chunk_size;
+	uint64_t replayed;				/*!< Bytes replayed so far, so positions in later files come after earlier ones */
+	struct irc_replay_totals totals;
+	struct replay_table channels;
+	struct replay_table nicks;
+};
+
+/*! \brief A file being replayed */
+struct replay_file {
+	struct irc_replay *replay;
+	const char *data;
+	size_t len;
+	size_t chunks;
+	size_t next;					/*!< Next chunk to take */
+};
+
+/*! \brief What a thread counted */
+struct replay_worker {
+	struct replay_file *file;
+	pthread_t thread;
+	int failed;
+	struct irc_replay_totals totals;
+	struct replay_table channels;
+	struct replay_table nicks;
+	char buf[MAX_LINE + 1];			/*!< Line being parsed, which irc_parse_msg modifies */
+};
+
+/* === Tables === */
+
+static int table_init(struct replay_table *t)
+{
+	t->count = 0;
+	t->nbuckets = 256;
+	t->buckets = calloc(t->nbuckets, sizeof(*t->buckets));
+	if (!t->buckets) {
+		irc_err("calloc failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void table_free(struct replay_table *t)
+{
+	size_t i;
+
+	if (!t->buckets) {
+		return;
+	}
+	for (i = 0; i < t->nbuckets; i++) {
+		while (t->buckets[i]) {
+			struct replay_entry *e = t->buckets[i];
+			t->buckets[i] = e->next;
+			free(e);
+		}
+	}
+	free(t->buckets);
+	t->buckets = NULL;
+}
+
+static int table_grow(struct replay_table *t)
+{
+	size_t nbuckets = t->nbuckets * 2, i;
+	struct replay_entry **buckets = calloc(nbuckets, sizeof(*buckets));
+
+	if (!buckets) {
+		irc_err("calloc failed\n");
+		return -1;
+	}
+	for (i = 0; i < t->nbuckets; i++) {
+		while (t->buckets[i]) {
+			struct replay_entry *e = t->buckets[i];
+			t->buckets[i] = e->next;
+			e->next = buckets[e->hash & (nbuckets - 1)];
+			buckets[e->hash & (nbuckets - 1)] = e;
+		}
+	}
+	free(t->buckets);
+	t->buckets = buckets;
+	t->nbuckets = nbuckets;
+	return 0;
+}
+
+/*! \brief Find a name, adding it if it's not there */
+static struct replay_entry *table_get(struct replay_table *t, enum irc_casemapping casemapping, const char *name, size_t len, uint64_t hash, uint64_t pos)
+{
+	struct replay_entry *e;
+
+	for (e = t->buckets[hash & (t->nbuckets - 1)]; e; e = e->next) {
+		if (e->hash == hash && e->len == len && irc_casemap_memeq(casemapping, e->name, name, len)) {
+			if (pos < e->first) {
+				memcpy(e->name, name, len); /* Same length, since they're equal under the casemapping */
+				e->first = pos;
+			}
+			return e;
+		}
+	}
+	if (t->count >= t->nbuckets && table_grow(t)) {
+		return NULL;
+	}
+	e = calloc(1, sizeof(*e) + len + 1);
+	if (!e) {
+		irc_err("calloc failed\n");
+		return NULL;
+	}
+	e->hash = hash;
+	e->first = pos;
+	e->len = len;
+	memcpy(e->name, name, len);
+	e->next = t->buckets[hash & (t->nbuckets - 1)];
+	t->buckets[hash & (t->nbuckets - 1)] = e;
+	t->count++;
+	return e;
+}
+
+static struct replay_entry *table_count(struct replay_table *t, enum irc_casemapping casemapping, const char *name, size_t len, uint64_t pos)
+{
+	return table_get(t, casemapping, name, len, irc_casemap_hash(casemapping, name, len), pos);
+}
+
+/*! \brief Add the counts in one table to another */
+static int table_merge(struct replay_table *dst, const struct replay_table *src, enum irc_casemapping casemapping)
+{
+	size_t i;
+
+	for (i = 0; i < src->nbuckets; i++) {
+		const struct replay_entry *s;
+		for (s = src->buckets[i]; s; s = s->next) {
+			struct replay_entry *d = table_get(dst, casemapping, s->name, s->len, s->hash, s->first);
+			if (!d) {
+				return -1;
+			}
+			d->counts.messages += s->counts.messages;
+			d->counts.joins += s->counts.joins;
+			d->counts.parts += s->counts.parts;
+			d->counts.quits += s->counts.quits;
+			d->counts.kicks += s->counts.kicks;
+		}
+	}
+	return 0;
+}
+
+/* === Parsing === */
+
+static int is_digits(const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (s[i] < '0' || s[i] > '9') {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int is_channel(const char *s)
+{
+	return s && *s && strchr("#&!+", *s);
+}
+
+/*! \brief Count a parsed message */
+static int replay_msg(struct replay_worker *w, struct irc_msg *msg, uint64_t pos)
+{
+	enum irc_casemapping casemapping = w->file->replay->casemapping;
+	struct replay_entry *nick = NULL, *channel = NULL;
+	const char *chan = msg->channel;
+
+	w->totals.types[msg->type]++;
+	switch (msg->type) {
+	case IRC_CMD_PRIVMSG:
+	case IRC_CMD_NOTICE:
+	case IRC_CMD_JOIN:
+	case IRC_CMD_PART:
+	case IRC_CMD_QUIT:
+	case IRC_CMD_KICK:
+		break;
+	default:
+		return 0;
+	}
+
+	/* From a user, not a server */
+	if (msg->prefix) {
+		size_t len = strcspn(msg->prefix, "!");
+		if (msg->prefix[len] || !strchr(msg->prefix, '.')) {
+			nick = table_count(&w->nicks, casemapping, msg->prefix, len, pos);
+			if (!nick) {
+				return -1;
+			}
+		}
+	}
+	if (chan && *chan == ':') {
+		chan++; /* JOIN :#channel */
+	}
+	if (is_channel(chan)) {
+		channel = table_count(&w->channels, casemapping, chan, strlen(chan), pos);
+		if (!channel) {
+			return -1;
+		}
+	}
+
+	switch (msg->type) {
+	case IRC_CMD_PRIVMSG:
+	case IRC_CMD_NOTICE:
+		if (nick) {
+			nick->counts.messages++;
+		}
+		if (channel) {
+			channel->counts.messages++;
+		}
+		break;
+	case IRC_CMD_JOIN:
+		if (nick) {
+			nick->counts.joins++;
+		}
+		if (channel) {
+			channel->counts.joins++;
+		}
+		break;
+	case IRC_CMD_PART:
+		if (nick) {
+			nick->counts.parts++;
+		}
+		if (channel) {
+			channel->counts.parts++;
+		}
+		break;
+	case IRC_CMD_QUIT:
+		if (nick) {
+			nick->counts.quits++;
+		}
+		break;
+	case IRC_CMD_KICK:
+		if (channel) {
+			channel->counts.kicks++;
+		}
+		if (msg->body) {
+			/* The one kicked, not the one kicking */
+			size_t len = strcspn(msg->body, " ");
+			if (len) {
+				nick = table_count(&w->nicks, casemapping, msg->body, len, pos);
+				if (!nick) {
+					return -1;
+				}
+				nick->counts.kicks++;
+			}
+		}
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+static int replay_line(struct replay_worker *w, const char *line, size_t len, uint64_t pos)
+{
+	struct irc_msg msg;
+
+	/* Written by irc_client_protolog_open with timestamps */
+	if (len > STAMP_LEN && *line == '[' && line[STAMP_LEN - 2] == ']' && line[STAMP_LEN - 1] == ' ' && is_digits(line + 1, 4)) {
+		line += STAMP_LEN;
+		len -= STAMP_LEN;
+	}
+	if (len && line[len - 1] == '\r') {
+		len--;
+	}
+	if (!len) {
+		return 0;
+	}
+	w->totals.lines++;
+	if (len > MAX_LINE) {
+		w->totals.invalid++;
+		return 0;
+	}
+	memcpy(w->buf, line, len);
+	w->buf[len] = '\0';
+	memset(&msg, 0, sizeof(msg));
+	if (irc_parse_msg(&msg, w->buf) || irc_parse_msg_type(&msg)) {
+		w->totals.invalid++;
+		return 0;
+	}
+	return replay_msg(w, &msg, pos);
+}
+
+/*! \brief Where a chunk starts: the first line that starts in it */
+static size_t chunk_start(const struct replay_file *f, size_t chunk)
+{
+	size_t offset = chunk * f->replay->chunk_size;
+	const char *nl;
+
+	if (!chunk) {
+		return 0;
+	} else if (offset >= f->len) {
+		return f->len;
+	}
+	nl = memchr(f->data + offset - 1, '\n', f->len - offset + 1);
+	return nl ? (size_t) (nl - f->data) + 1 : f->len;
+}
+
+static void *replay_thread(void *varg)
+{
+	struct replay_worker *w = varg;
+	struct replay_file *f = w->file;
+
+	for (;;) {
+		size_t chunk = __atomic_fetch_add(&f->next, 1, __ATOMIC_RELAXED), start, end;
+		if (chunk >= f->chunks) {
+			break;
+		}
+		start = chunk_start(f, chunk);
+		end = chunk_start(f, chunk + 1);
+		while (start < end) {
+			const char *line = f->data + start, *nl = memchr(line, '\n', end - start);
+			size_t len = nl ? (size_t) (nl - line) : end - start;
+			if (replay_line(w, line, len, f->replay->replayed + start)) {
+				w->failed = 1;
+				return NULL;
+			}
+			start += len + 1;
+		}
+	}
+	return NULL;
+}
+
+/* === API === */
+
+struct irc_replay *irc_replay_new(const struct irc_replay_config *config)
+{
+	struct irc_replay *replay = calloc(1, sizeof(*replay));
+
+	if (!replay) {
+		irc_err("calloc failed\n");
+		return NULL;
+	}
+	if (config) {
+		replay->casemapping = config->casemapping;
+		replay->threads = config->threads;
+		replay->chunk_size = config->chunk_size;
+	}
+	if (!replay->threads) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		replay->threads = cpus > 0 ? (unsigned int) cpus : 1;
+	}
+	if (!replay->chunk_size) {
+		replay->chunk_size = CHUNK_SIZE_DEFAULT;
+	}
+	if (table_init(&replay->channels) || table_init(&replay->nicks)) {
+		irc_replay_free(replay);
+		return NULL;
+	}
+	return replay;
+}
+
+void irc_replay_free(struct irc_replay *replay)
+{
+	table_free(&replay->channels);
+	table_free(&replay->nicks);
+	free(replay);
+}
+
+int irc_replay_file(struct irc_replay *replay, const char *path)
+{
+	struct replay_file f;
+	struct replay_worker **workers;
+	struct stat st;
+	unsigned int i, started = 0;
+	int fd, res = 0;
+	void *data;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		irc_err("Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st)) {
+		irc_err("fstat failed: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if (!st.st_size) {
+		close(fd);
+		return 0;
+	}
+	data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		irc_err("Failed to map %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	madvise(data, (size_t) st.st_size, MADV_SEQUENTIAL); /* Each thread reads its chunk front to back */
+
+	memset(&f, 0, sizeof(f));
+	f.replay = replay;
+	f.data = data;
+	f.len = (size_t) st.st_size;
+	f.chunks = (f.len + replay->chunk_size - 1) / replay->chunk_size;
+
+	workers = calloc(replay->threads, sizeof(*workers));
+	if (!workers) {
+		irc_err("calloc failed\n");
+		munmap(data, f.len);
+		return -1;
+	}
+	for (i = 0; i < replay->threads && i < f.chunks; i++) {
+		/* Separately allocated, so threads don't share cache lines */
+		workers[i] = calloc(1, sizeof(*workers[i]));
+		if (!workers[i] || table_init(&workers[i]->channels) || table_init(&workers[i]->nicks)) {
+			irc_err("calloc failed\n");
+			res = -1;
+			break;
+		}
+		workers[i]->file = &f;
+		if (pthread_create(&workers[i]->thread, NULL, replay_thread, workers[i])) {
+			irc_err("Failed to create replay thread\n");
+			res = -1;
+			break;
+		}
+		started++;
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i]->thread, NULL);
+	}
+
+	/* In thread order, though the results would be the same in any order */
+	for (i = 0; i < replay->threads; i++) {
+		struct replay_worker *w = workers[i];
+		unsigned int j;
+		if (!w) {
+			continue;
+		}
+		if (!res && i < started) {
+			if (w->failed || table_merge(&replay->channels, &w->channels, replay->casemapping) || table_merge(&replay->nicks, &w->nicks, replay->casemapping)) {
+				res = -1;
+			}
+			replay->totals.lines += w->totals.lines;
+			replay->totals.invalid += w->totals.invalid;
+			for (j = 0; j < sizeof(w->totals.types) / sizeof(w->totals.types[0]); j++) {
+				replay->totals.types[j] += w->totals.types[j];
+			}
+		}
+		table_free(&w->channels);
+		table_free(&w->nicks);
+		free(w);
+	}
+	free(workers);
+	munmap(data, f.len);
+	replay->replayed += f.len;
+	return res;
+}
+
+void irc_replay_totals(struct irc_replay *replay, struct irc_replay_totals *totals)
+{
+	*totals = replay->totals;
+}
+
+static int entry_cmp(const void *a, const void *b, void *varg)
+{
+	const struct replay_entry *x = *(struct replay_entry * const *) a, *y = *(struct replay_entry * const *) b;
+	const enum irc_casemapping *casemapping = varg;
+	return irc_casemap_cmp(*casemapping, x->name, y->name);
+}
+
+/*! \brief Pass on the entries of a table, in order of name */
+static ssize_t table_list(struct replay_table *t, enum irc_casemapping casemapping,
+	void (*cb)(void *data, const char *name, const struct irc_replay_counts *counts), void *data)
+{
+	struct replay_entry **sorted = malloc((t->count + 1) * sizeof(*sorted));
+	size_t i, n = 0;
+
+	if (!sorted) {
+		irc_err("malloc failed\n");
+		return -1;
+	}
+	for (i = 0; i < t->nbuckets; i++) {
+		struct replay_entry *e;
+		for (e = t->buckets[i]; e; e = e->next) {
+			sorted[n++] = e;
+		}
+	}
+	qsort_r(sorted, n, sizeof(*sorted), entry_cmp, &casemapping);
+	for (i = 0; i < n; i++) {
+		cb(data, sorted[i]->name, &sorted[i]->counts);
+	}
+	free(sorted);
+	return (ssize_t) n;
+}
+
+ssize_t irc_replay_channels(struct irc_replay *replay, void (*cb)(void *data, const char *channel, const struct irc_replay_counts *counts), void *data)
+{
+	return table_list(&replay->channels, replay->casemapping, cb, data);
+}
+
+ssize_t irc_replay_nicks(struct irc_replay *replay, void (*cb)(void *data, const char *nick, const struct irc_replay_counts *counts), void *data)
+{
+	return table_list(&replay->nicks, replay->casemapping, cb, data);
+}
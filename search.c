@@ -0,0 +1,1164 @@
+/*
+ * LIRC - IRC Client Library for C
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This library is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Full-text index of message archives
+ *
+ * \note Each archived message is split into terms: the words in its text (lowercased), any URLs in it (url:...),
+ *       the nick it's from (nick:...) and the channel it's for (chan:...), both casemapped.
+ *       Messages are numbered within their segment, and each term has the numbers of the messages
+ *       it's in (its postings), in increasing order, stored as varint deltas, so most take a byte.
+ * \note As blocks are written to the archive, their messages are indexed in memory, which is written out
+ *       now and then as a run: a file (NNNNNNNN-DDDDDDDDDD.fts, for the segment and its first message)
+ *       of its terms in order, each with its postings. A thread merges a segment's runs in the background,
+ *       so searches don't have to look at many. Runs are written to a temporary file and renamed into place,
+ *       so they're never seen partly written.
+ * \note Searching looks up each term in each run with a binary search, intersects their postings,
+ *       and then decompresses only the blocks with the messages that matched.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+
+#include "irc_internal.h"
+
+#define RUN_MAGIC "LIRCFTS1"
+
+/*! \brief Write out the index in memory once it's using this much, even if not asked to */
+#define COMMIT_MEMORY (16 * 1024 * 1024)
+
+/*! \brief Merge a segment's runs once it has this many. Once a segment is finished, they're always merged. */
+#define MERGE_RUNS 8
+
+/*! \brief Shortest word that's indexed */
+#define MIN_WORD 2
+
+/*! \brief Longest word that's indexed. Longer ones are mostly noise, and nobody searches for them. */
+#define MAX_WORD 32
+
+/*! \brief Longest term, e.g. a URL */
+#define MAX_TERM 256
+
+/*! \brief Number of times to retry searching a segment whose runs were merged while it was being searched */
+#define SEARCH_RETRIES 5
+
+struct run_header {
+	char magic[8];
+	uint32_t terms;					/*!< Number of terms */
+	uint32_t firstdoc;				/*!< First message indexed */
+	uint32_t lastdoc;				/*!< Last message indexed */
+	uint32_t unused;
+};
+
+/*! \brief Terms follow the header, in order, then the text of the terms, then their postings */
+struct run_term {
+	uint64_t postings;				/*!< Offset of the postings */
+	uint32_t postingslen;			/*!< Size of the postings */
+	uint32_t count;					/*!< Number of postings */
+	uint32_t text;					/*!< Offset of the term */
+	uint32_t textlen;
+};
+
+struct term {
+	struct term *next;				/*!< Next in the same hash bucket */
+	uint32_t lastdoc;				/*!< Last message in postings */
+	uint32_t count;					/*!< Number of postings */
+	unsigned char *postings;		/*!< Varint deltas, the first from 0 */
+	size_t len;
+	size_t alloc;
+	size_t textlen;
+	char text[];
+};
+
+/*! \brief Index of some of a segment's messages, in memory */
+struct postings {
+	struct term **buckets;
+	size_t nbuckets;				/*!< Power of 2 */
+	size_t terms;
+	size_t memory;					/*!< About how many bytes are used */
+	unsigned int segno;
+	uint32_t firstdoc;
+	uint32_t lastdoc;
+	uint32_t docs;					/*!< Messages indexed, 0 if empty */
+};
+
+struct search_index {
+	struct postings live;			/*!< Messages being archived. Only used with the archive locked. */
+	unsigned int segno;				/*!< Segment being written */
+	unsigned int catchup;			/*!< Segments before this one are checked in the background for messages that aren't indexed */
+	pthread_t thread;				/*!< Merges runs, and catches up earlier segments */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int pending;					/*!< A run was written since the merging thread last looked */
+	int stopping;
+	char dir[];
+};
+
+/*! \brief A run on disk */
+struct run_file {
+	unsigned int segno;
+	uint32_t firstdoc;
+};
+
+struct run {
+	struct archive_map map;
+	struct run_header h;
+};
+
+/*! \brief Message numbers */
+struct docs {
+	uint32_t *docs;
+	size_t count;
+	size_t alloc;
+};
+
+/* === Terms === */
+
+typedef void (*term_cb)(void *data, const char *term, size_t len);
+
+static int word_char(unsigned char c)
+{
+	/* Bytes of multibyte UTF-8 characters are part of words too, so words in other languages are still words */
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c >= 0x80;
+}
+
+/*! \brief Pass on a term with a prefix, folded using a casemapping */
+static void add_term(const char *prefix, enum irc_casemapping casemapping, const char *s, size_t len, term_cb add, void *data)
+{
+	char term[MAX_TERM];
+	size_t plen = strlen(prefix);
+
+	if (!len || plen + len > sizeof(term)) {
+		return;
+	}
+	memcpy(term, prefix, plen);
+	irc_casemap_fold(casemapping, term + plen, s, len);
+	add(data, term, plen + len);
+}
+
+static int starts_with_ci(const char *s, const char *end, const char *prefix)
+{
+	size_t len = strlen(prefix);
+	return (size_t) (end - s) > len && !strncasecmp(s, prefix, len);
+}
+
+/*! \brief Split text into words and URLs */
+static void tokenize_text(const char *s, size_t len, term_cb add, void *data)
+{
+	const char *end = s + len;
+
+	while (s < end) {
+		const char *word;
+		if (*s == 3) {
+			/* mIRC color code: ^C, then up to 2 digits, optionally followed by a comma and up to 2 more */
+			int i;
+			for (s++, i = 0; i < 2 && s < end && *s >= '0' && *s <= '9'; i++, s++);
+			if (i && s + 1 < end && *s == ',' && s[1] >= '0' && s[1] <= '9') {
+				for (s++, i = 0; i < 2 && s < end && *s >= '0' && *s <= '9'; i++, s++);
+			}
+			continue;
+		} else if (!word_char((unsigned char) *s)) {
+			s++;
+			continue;
+		}
+		if ((*s == 'h' || *s == 'H') && (starts_with_ci(s, end, "http://") || starts_with_ci(s, end, "https://"))) {
+			const char *url = s;
+			while (url < end && (unsigned char) *url > ' ') {
+				url++;
+			}
+			while (url > s && strchr(".,;:!?'\")]>", url[-1])) {
+				url--; /* Punctuation after it, most likely */
+			}
+			add_term("url:", IRC_CASEMAPPING_ASCII, s, (size_t) (url - s), add, data);
+			/* And its words too, so e.g. the site's name finds it */
+		}
+		for (word = s; s < end && word_char((unsigned char) *s); s++);
+		if (s - word >= MIN_WORD && s - word <= MAX_WORD) {
+			add_term("", IRC_CASEMAPPING_ASCII, word, (size_t) (s - word), add, data);
+		}
+	}
+}
+
+/*! \brief Split a raw message into terms */
+static void tokenize_message(const char *line, size_t len, term_cb add, void *data)
+{
+	const char *s = line, *end = line + len, *channel, *p;
+	size_t chanlen;
+
+	if (s < end && *s == '@') {
+		s = memchr(s, ' ', (size_t) (end - s));
+		if (!s) {
+			return;
+		}
+		while (s < end && *s == ' ') {
+			s++;
+		}
+	}
+	if (s < end && *s == ':') {
+		const char *prefix = s + 1, *bang;
+		s = memchr(s, ' ', (size_t) (end - s));
+		if (!s) {
+			return;
+		}
+		bang = memchr(prefix, '!', (size_t) (s - prefix));
+		if (bang) {
+			add_term("nick:", IRC_CASEMAPPING_RFC1459, prefix, (size_t) (bang - prefix), add, data); /* Not servers */
+		}
+	}
+	channel = archive_line_channel(line, len, &chanlen);
+	if (channel) {
+		add_term("chan:", IRC_CASEMAPPING_RFC1459, channel, chanlen, add, data);
+	}
+	for (p = s; p + 1 < end; p++) {
+		if (p[0] == ' ' && p[1] == ':') {
+			tokenize_text(p + 2, (size_t) (end - p - 2), add, data);
+			break;
+		}
+	}
+}
+
+/*! \brief Split a search into terms: words, URLs, nick:NICK, and chan:CHANNEL (or just #channel) */
+static void tokenize_query(const char *query, term_cb add, void *data)
+{
+	const char *s = query;
+
+	while (*s) {
+		const char *word = s;
+		size_t len = strcspn(s, " ");
+		s += len;
+		while (*s == ' ') {
+			s++;
+		}
+		if (!len) {
+			continue;
+		} else if (len > 5 && !strncasecmp(word, "nick:", 5)) {
+			add_term("nick:", IRC_CASEMAPPING_RFC1459, word + 5, len - 5, add, data);
+		} else if (len > 5 && !strncasecmp(word, "chan:", 5)) {
+			add_term("chan:", IRC_CASEMAPPING_RFC1459, word + 5, len - 5, add, data);
+		} else if (*word == '#' || *word == '&') {
+			add_term("chan:", IRC_CASEMAPPING_RFC1459, word, len, add, data);
+		} else {
+			tokenize_text(word, len, add, data);
+		}
+	}
+}
+
+/* === Indexing in memory === */
+
+static uint64_t term_hash(const char *s, size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char) s[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static int postings_init(struct postings *p)
+{
+	memset(p, 0, sizeof(*p));
+	p->nbuckets = 1024;
+	p->buckets = calloc(p->nbuckets, sizeof(*p->buckets));
+	if (!p->buckets) {
+		irc_err("calloc failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void postings_clear(struct postings *p)
+{
+	size_t i;
+
+	for (i = 0; i < p->nbuckets; i++) {
+		while (p->buckets[i]) {
+			struct term *t = p->buckets[i];
+			p->buckets[i] = t->next;
+			free(t->postings);
+			free(t);
+		}
+	}
+	p->terms = p->memory = 0;
+	p->docs = 0;
+}
+
+static void postings_free(struct postings *p)
+{
+	if (p->buckets) {
+		postings_clear(p);
+		free(p->buckets);
+		p->buckets = NULL;
+	}
+}
+
+static int postings_grow(struct postings *p)
+{
+	size_t nbuckets = p->nbuckets * 2, i;
+	struct term **buckets = calloc(nbuckets, sizeof(*buckets));
+
+	if (!buckets) {
+		irc_err("calloc failed\n");
+		return -1;
+	}
+	for (i = 0; i < p->nbuckets; i++) {
+		while (p->buckets[i]) {
+			struct term *t = p->buckets[i];
+			size_t b = term_hash(t->text, t->textlen) & (nbuckets - 1);
+			p->buckets[i] = t->next;
+			t->next = buckets[b];
+			buckets[b] = t;
+		}
+	}
+	free(p->buckets);
+	p->buckets = buckets;
+	p->memory += (nbuckets - p->nbuckets) * sizeof(*buckets);
+	p->nbuckets = nbuckets;
+	return 0;
+}
+
+/*! \brief Add a message to a term's postings. Messages must be added in increasing order. */
+static int postings_add(struct postings *p, const char *text, size_t len, uint32_t doc)
+{
+	struct term *t;
+	unsigned char *end;
+
+	if (p->terms >= p->nbuckets && postings_grow(p)) {
+		return -1;
+	}
+	for (t = p->buckets[term_hash(text, len) & (p->nbuckets - 1)]; t; t = t->next) {
+		if (t->textlen == len && !memcmp(t->text, text, len)) {
+			break;
+		}
+	}
+	if (!t) {
+		size_t b = term_hash(text, len) & (p->nbuckets - 1);
+		t = malloc(sizeof(*t) + len);
+		if (!t) {
+			irc_err("malloc failed\n");
+			return -1;
+		}
+		t->alloc = 8;
+		t->postings = malloc(t->alloc);
+		if (!t->postings) {
+			irc_err("malloc failed\n");
+			free(t);
+			return -1;
+		}
+		t->len = 0;
+		t->count = 0;
+		t->lastdoc = 0;
+		t->textlen = len;
+		memcpy(t->text, text, len);
+		t->next = p->buckets[b];
+		p->buckets[b] = t;
+		p->terms++;
+		p->memory += sizeof(*t) + len + t->alloc;
+	} else if (doc <= t->lastdoc) {
+		return 0; /* Already there, e.g. a word that's in a message twice */
+	}
+	if (t->len + 5 > t->alloc) {
+		unsigned char *postings = realloc(t->postings, t->alloc * 2);
+		if (!postings) {
+			irc_err("realloc failed\n");
+			return -1;
+		}
+		t->postings = postings;
+		p->memory += t->alloc;
+		t->alloc *= 2;
+	}
+	end = archive_put_varint(t->postings + t->len, t->count ? doc - t->lastdoc : doc);
+	t->len = (size_t) (end - t->postings);
+	t->lastdoc = doc;
+	t->count++;
+	return 0;
+}
+
+struct index_msg {
+	struct postings *p;
+	uint32_t doc;
+};
+
+static void index_term(void *data, const char *term, size_t len)
+{
+	struct index_msg *m = data;
+	postings_add(m->p, term, len, m->doc);
+}
+
+static void index_message(struct postings *p, uint32_t doc, const char *line, size_t len)
+{
+	struct index_msg m;
+
+	if (!p->docs) {
+		p->firstdoc = doc;
+	}
+	m.p = p;
+	m.doc = doc;
+	tokenize_message(line, len, index_term, &m);
+	p->lastdoc = doc;
+	p->docs++;
+}
+
+/*! \brief Terms are in the order of their bytes, then shortest first */
+static int term_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+	int res = memcmp(a, b, alen < blen ? alen : blen);
+	return res ? res : (alen > blen) - (alen < blen);
+}
+
+static int term_sort(const void *a, const void *b)
+{
+	const struct term *x = *(struct term * const *) a, *y = *(struct term * const *) b;
+	return term_cmp(x->text, x->textlen, y->text, y->textlen);
+}
+
+static void run_path(const char *dir, unsigned int segno, uint32_t firstdoc, char *buf, size_t len)
+{
+	snprintf(buf, len, "%s/%08u-%010u.fts", dir, segno, firstdoc);
+}
+
+/*! \brief Write out an index in memory as a run, and empty it */
+static int postings_write(struct postings *p, const char *dir)
+{
+	char path[4096], tmp[4200];
+	struct run_header h;
+	struct term **sorted;
+	uint64_t postings;
+	uint32_t text;
+	size_t i, n = 0;
+	FILE *f;
+	int res = 0;
+
+	if (!p->docs) {
+		return 0;
+	}
+	sorted = malloc((p->terms + 1) * sizeof(*sorted));
+	if (!sorted) {
+		irc_err("malloc failed\n");
+		return -1;
+	}
+	for (i = 0; i < p->nbuckets; i++) {
+		struct term *t;
+		for (t = p->buckets[i]; t; t = t->next) {
+			sorted[n++] = t;
+		}
+	}
+	qsort(sorted, n, sizeof(*sorted), term_sort);
+
+	run_path(dir, p->segno, p->firstdoc, path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "wb");
+	if (!f) {
+		irc_err("Failed to open %s: %s\n", tmp, strerror(errno));
+		free(sorted);
+		return -1;
+	}
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, RUN_MAGIC, sizeof(h.magic));
+	h.terms = (uint32_t) n;
+	h.firstdoc = p->firstdoc;
+	h.lastdoc = p->lastdoc;
+	fwrite(&h, sizeof(h), 1, f);
+	text = (uint32_t) (sizeof(h) + n * sizeof(struct run_term));
+	postings = text;
+	for (i = 0; i < n; i++) {
+		postings += sorted[i]->textlen;
+	}
+	for (i = 0; i < n; i++) {
+		struct run_term rt;
+		memset(&rt, 0, sizeof(rt));
+		rt.postings = postings;
+		rt.postingslen = (uint32_t) sorted[i]->len;
+		rt.count = sorted[i]->count;
+		rt.text = text;
+		rt.textlen = (uint32_t) sorted[i]->textlen;
+		fwrite(&rt, sizeof(rt), 1, f);
+		text += rt.textlen;
+		postings += rt.postingslen;
+	}
+	for (i = 0; i < n; i++) {
+		fwrite(sorted[i]->text, 1, sorted[i]->textlen, f);
+	}
+	for (i = 0; i < n; i++) {
+		fwrite(sorted[i]->postings, 1, sorted[i]->len, f);
+	}
+	free(sorted);
+	if (ferror(f) | fclose(f)) {
+		irc_err("Failed to write %s: %s\n", tmp, strerror(errno));
+		res = -1;
+	} else if (rename(tmp, path)) {
+		irc_err("Failed to rename %s to %s: %s\n", tmp, path, strerror(errno));
+		res = -1;
+	}
+	if (res) {
+		unlink(tmp);
+	}
+	/* Either way, start over, rather than letting it grow without limit */
+	postings_clear(p);
+	return res;
+}
+
+/* === Runs === */
+
+static int run_file_cmp(const void *a, const void *b)
+{
+	const struct run_file *x = a, *y = b;
+
+	if (x->segno != y->segno) {
+		return x->segno < y->segno ? -1 : 1;
+	}
+	return (x->firstdoc > y->firstdoc) - (x->firstdoc < y->firstdoc);
+}
+
+/*!
+ * \brief List the runs in an archive
+ * \param dir
+ * \param segno Only list runs for this segment, or -1 for all of them
+ * \param[out] runs In order of segment, then first message. Must be freed.
+ * \return Number of runs, -1 on failure
+ */
+static int runs_list(const char *dir, int segno, struct run_file **runs)
+{
+	DIR *d = opendir(dir);
+	struct dirent *de;
+	struct run_file *list = NULL;
+	int count = 0, alloc = 0;
+
+	if (!d) {
+		return -1;
+	}
+	while ((de = readdir(d))) {
+		char *end, *end2;
+		unsigned long seg = strtoul(de->d_name, &end, 10), first;
+		if (end != de->d_name + 8 || *end != '-' || (segno >= 0 && seg != (unsigned long) segno)) {
+			continue;
+		}
+		first = strtoul(end + 1, &end2, 10);
+		if (end2 != end + 11 || strcmp(end2, ".fts")) {
+			continue; /* Including temporary files */
+		}
+		if (count == alloc) {
+			struct run_file *newlist = realloc(list, (size_t) (alloc = alloc ? alloc * 2 : 16) * sizeof(*list));
+			if (!newlist) {
+				irc_err("realloc failed\n");
+				free(list);
+				closedir(d);
+				return -1;
+			}
+			list = newlist;
+		}
+		list[count].segno = (unsigned int) seg;
+		list[count].firstdoc = (uint32_t) first;
+		count++;
+	}
+	closedir(d);
+	if (count) {
+		qsort(list, (size_t) count, sizeof(*list), run_file_cmp);
+	}
+	*runs = list;
+	return count;
+}
+
+/*! \brief Open a run. On failure, errno is ENOENT if it's gone (e.g. merged). */
+static int run_open(const char *dir, const struct run_file *rf, struct run *r)
+{
+	char path[4096];
+
+	run_path(dir, rf->segno, rf->firstdoc, path, sizeof(path));
+	if (archive_map(path, &r->map)) {
+		return -1;
+	}
+	if (r->map.len < sizeof(r->h) || memcmp(r->map.data, RUN_MAGIC, sizeof(r->h.magic))) {
+		irc_warn("%s is not a valid index\n", path);
+		archive_unmap(&r->map);
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(&r->h, r->map.data, sizeof(r->h));
+	if (sizeof(r->h) + (uint64_t) r->h.terms * sizeof(struct run_term) > r->map.len) {
+		irc_warn("%s is truncated\n", path);
+		archive_unmap(&r->map);
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/*! \brief Get a term of a run, checking that it's all inside the file */
+static int run_term(const struct run *r, uint32_t i, struct run_term *rt)
+{
+	memcpy(rt, r->map.data + sizeof(r->h) + (size_t) i * sizeof(*rt), sizeof(*rt));
+	if ((uint64_t) rt->text + rt->textlen > r->map.len || rt->postings + rt->postingslen > r->map.len) {
+		return -1;
+	}
+	return 0;
+}
+
+/*! \brief Find a term in a run */
+static int run_find(const struct run *r, const char *text, size_t len, struct run_term *rt)
+{
+	uint32_t lo = 0, hi = r->h.terms;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int cmp;
+		if (run_term(r, mid, rt)) {
+			return -1;
+		}
+		cmp = term_cmp((const char *) r->map.data + rt->text, rt->textlen, text, len);
+		if (!cmp) {
+			return 0;
+		} else if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return -1;
+}
+
+static int docs_push(struct docs *d, uint32_t doc)
+{
+	if (d->count == d->alloc) {
+		uint32_t *docs = realloc(d->docs, (d->alloc = d->alloc ? d->alloc * 2 : 64) * sizeof(*docs));
+		if (!docs) {
+			irc_err("realloc failed\n");
+			return -1;
+		}
+		d->docs = docs;
+	}
+	d->docs[d->count++] = doc;
+	return 0;
+}
+
+/*! \brief Decode the postings of a term, calling cb for each message */
+static int run_postings(const struct run *r, const struct run_term *rt, int (*cb)(void *data, uint32_t doc), void *data)
+{
+	const unsigned char *p = r->map.data + rt->postings, *end = p + rt->postingslen;
+	uint32_t i, doc = 0;
+
+	for (i = 0; i < rt->count; i++) {
+		uint64_t delta;
+		p = archive_get_varint(p, end, &delta);
+		if (!p) {
+			return -1;
+		}
+		doc += (uint32_t) delta;
+		if (cb(data, doc)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*! \brief Highest message indexed in a segment, plus 1 (0 if none are) */
+static uint32_t runs_covered(const char *dir, unsigned int segno)
+{
+	struct run_file *runs;
+	uint32_t covered = 0;
+	int count, i;
+
+	count = runs_list(dir, (int) segno, &runs);
+	for (i = 0; i < count; i++) {
+		struct run r;
+		if (!run_open(dir, &runs[i], &r)) {
+			if (r.h.lastdoc + 1 > covered) {
+				covered = r.h.lastdoc + 1;
+			}
+			archive_unmap(&r.map);
+		}
+	}
+	if (count >= 0) {
+		free(runs);
+	}
+	return covered;
+}
+
+/* === Background merging === */
+
+static int search_stopping(struct search_index *s)
+{
+	return __atomic_load_n(&s->stopping, __ATOMIC_RELAXED);
+}
+
+struct merge_term {
+	struct postings *p;
+	const char *text;
+	size_t len;
+};
+
+static int merge_doc(void *data, uint32_t doc)
+{
+	struct merge_term *m = data;
+	return postings_add(m->p, m->text, m->len, doc);
+}
+
+/*! \brief Merge some runs of a segment into one, replacing the first */
+static void merge_segment(struct search_index *s, const struct run_file *runs, int count)
+{
+	struct postings p;
+	int i, failed = 0;
+
+	if (postings_init(&p)) {
+		return;
+	}
+	p.segno = runs[0].segno;
+	p.firstdoc = runs[0].firstdoc;
+	for (i = 0; i < count && !failed && !search_stopping(s); i++) {
+		struct run r;
+		uint32_t j;
+		if (run_open(s->dir, &runs[i], &r)) {
+			continue;
+		}
+		/* In order of first message, so postings are added in order. Anything already added (from a run that overlaps) is skipped. */
+		for (j = 0; j < r.h.terms; j++) {
+			struct run_term rt;
+			struct merge_term m;
+			m.p = &p;
+			if (run_term(&r, j, &rt) || (m.text = (const char *) r.map.data + rt.text, m.len = rt.textlen, run_postings(&r, &rt, merge_doc, &m))) {
+				irc_warn("Failed to merge index of archive segment %u\n", runs[i].segno);
+				failed = 1; /* Don't replace what's there with less */
+				break;
+			}
+		}
+		if (!p.docs || r.h.lastdoc > p.lastdoc) {
+			p.lastdoc = r.h.lastdoc;
+		}
+		p.docs = p.lastdoc - p.firstdoc + 1;
+		archive_unmap(&r.map);
+	}
+	if (i == count && !postings_write(&p, s->dir)) {
+		/* The first one was replaced, and the rest are in it */
+		for (i = 1; i < count; i++) {
+			char path[4096];
+			run_path(s->dir, runs[i].segno, runs[i].firstdoc, path, sizeof(path));
+			unlink(path);
+		}
+		irc_debug(5, "Merged %d runs of archive segment %u\n", count, runs[0].segno);
+	}
+	postings_free(&p);
+}
+
+static void merge_runs(struct search_index *s)
+{
+	struct run_file *runs;
+	unsigned int current = __atomic_load_n(&s->segno, __ATOMIC_RELAXED);
+	int count, i, j;
+
+	count = runs_list(s->dir, -1, &runs);
+	if (count < 0) {
+		return;
+	}
+	for (i = 0; i < count && !search_stopping(s); i = j) {
+		for (j = i; j < count && runs[j].segno == runs[i].segno; j++);
+		if (j - i >= MERGE_RUNS || (runs[i].segno < current && j - i > 1)) {
+			merge_segment(s, runs + i, j - i);
+		}
+	}
+	free(runs);
+}
+
+struct catchup {
+	struct search_index *s;
+	struct postings *p;
+};
+
+static int catchup_msg(void *data, uint32_t doc, long long time, const char *line, size_t len)
+{
+	struct catchup *c = data;
+
+	(void) time;
+	index_message(c->p, doc, line, len);
+	if (c->p->memory >= COMMIT_MEMORY) {
+		postings_write(c->p, c->s->dir);
+	}
+	return search_stopping(c->s);
+}
+
+/*! \brief Index any messages in a segment that aren't yet */
+static void catch_up(struct search_index *s, unsigned int segno, struct postings *p)
+{
+	struct catchup c;
+	uint32_t from = runs_covered(s->dir, segno);
+
+	c.s = s;
+	c.p = p;
+	p->segno = segno;
+	archive_segment_read(s->dir, segno, from, NULL, 0, catchup_msg, &c);
+	if (p->docs) {
+		irc_debug(3, "Indexed %u messages in archive segment %u\n", p->lastdoc - from + 1, segno);
+	}
+	postings_write(p, s->dir);
+}
+
+static void *search_thread(void *varg)
+{
+	struct search_index *s = varg;
+	unsigned int *segnos;
+	int count, i;
+
+	/* Segments from before indexing was turned on, or whose last messages weren't indexed when it was last closed */
+	count = archive_segments(s->dir, &segnos);
+	if (count > 0) {
+		struct postings p;
+		if (!postings_init(&p)) {
+			for (i = 0; i < count && segnos[i] < s->catchup && !search_stopping(s); i++) {
+				catch_up(s, segnos[i], &p);
+			}
+			postings_free(&p);
+		}
+	}
+	if (count >= 0) {
+		free(segnos);
+	}
+
+	for (;;) {
+		int stopping;
+		merge_runs(s);
+		pthread_mutex_lock(&s->lock);
+		while (!s->pending && !s->stopping) {
+			pthread_cond_wait(&s->cond, &s->lock);
+		}
+		s->pending = 0;
+		stopping = s->stopping;
+		pthread_mutex_unlock(&s->lock);
+		if (stopping) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* === Writer === */
+
+struct search_index *search_open(const char *dir, unsigned int segno)
+{
+	struct search_index *s = calloc(1, sizeof(*s) + strlen(dir) + 1);
+
+	if (!s) {
+		irc_err("calloc failed\n");
+		return NULL;
+	}
+	strcpy(s->dir, dir); /* Safe */
+	if (postings_init(&s->live)) {
+		free(s);
+		return NULL;
+	}
+	s->segno = s->catchup = segno;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	catch_up(s, segno, &s->live); /* So new messages can be added after it */
+	if (pthread_create(&s->thread, NULL, search_thread, s)) {
+		irc_err("Failed to create index merging thread\n");
+		pthread_cond_destroy(&s->cond);
+		pthread_mutex_destroy(&s->lock);
+		postings_free(&s->live);
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+void search_add(struct search_index *s, unsigned int segno, uint32_t doc, const char *line, size_t len)
+{
+	if (segno != s->live.segno) {
+		search_commit(s, 1);
+		s->live.segno = segno;
+		__atomic_store_n(&s->segno, segno, __ATOMIC_RELAXED);
+	}
+	index_message(&s->live, doc, line, len);
+}
+
+void search_commit(struct search_index *s, int force)
+{
+	if (!s->live.docs || (!force && s->live.memory < COMMIT_MEMORY)) {
+		return;
+	}
+	postings_write(&s->live, s->dir);
+	pthread_mutex_lock(&s->lock);
+	s->pending = 1;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+void search_close(struct search_index *s)
+{
+	search_commit(s, 1);
+	pthread_mutex_lock(&s->lock);
+	__atomic_store_n(&s->stopping, 1, __ATOMIC_RELAXED); /* Also checked without the lock, to stop in the middle of something */
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	pthread_join(s->thread, NULL);
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+	postings_free(&s->live);
+	free(s);
+}
+
+/* === Searching === */
+
+struct query {
+	char terms[16][MAX_TERM];		/*!< Terms, all of which must match */
+	size_t lens[16];
+	size_t count;
+};
+
+static void query_term(void *data, const char *term, size_t len)
+{
+	struct query *q = data;
+	size_t i;
+
+	for (i = 0; i < q->count; i++) {
+		if (q->lens[i] == len && !memcmp(q->terms[i], term, len)) {
+			return; /* Already have it */
+		}
+	}
+	if (q->count < sizeof(q->terms) / sizeof(q->terms[0])) {
+		memcpy(q->terms[q->count], term, len);
+		q->lens[q->count++] = len;
+	}
+}
+
+static int docs_add(void *data, uint32_t doc)
+{
+	return docs_push(data, doc);
+}
+
+static int uint32_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+}
+
+/*! \brief Get every message in any of the runs with a term */
+static int term_docs(const struct run *runs, int nruns, const char *text, size_t len, struct docs *d)
+{
+	int i, found = 0;
+	size_t j;
+
+	d->count = 0;
+	for (i = 0; i < nruns; i++) {
+		struct run_term rt;
+		if (run_find(&runs[i], text, len, &rt)) {
+			continue;
+		}
+		if (run_postings(&runs[i], &rt, docs_add, d)) {
+			return -1;
+		}
+		found++;
+	}
+	if (found > 1) {
+		/* Runs being merged can overlap, so there can be duplicates, out of order */
+		for (j = 1; j < d->count && d->docs[j - 1] < d->docs[j]; j++);
+		if (j < d->count) {
+			size_t k = 0;
+			qsort(d->docs, d->count, sizeof(*d->docs), uint32_cmp);
+			for (j = 0; j < d->count; j++) {
+				if (!k || d->docs[k - 1] != d->docs[j]) {
+					d->docs[k++] = d->docs[j];
+				}
+			}
+			d->count = k;
+		}
+	}
+	return 0;
+}
+
+/*! \brief Keep only the messages in both */
+static void docs_intersect(struct docs *a, const struct docs *b)
+{
+	size_t i = 0, j = 0, k = 0;
+
+	while (i < a->count && j < b->count) {
+		if (a->docs[i] < b->docs[j]) {
+			i++;
+		} else if (a->docs[i] > b->docs[j]) {
+			j++;
+		} else {
+			a->docs[k++] = a->docs[i];
+			i++;
+			j++;
+		}
+	}
+	a->count = k;
+}
+
+/*!
+ * \brief Find the messages in a segment that have all the terms
+ * \retval 0 on success, -1 on failure, -2 if a run went away (was merged) while searching
+ */
+static int runs_search(const char *dir, const struct run_file *files, int nfiles, const struct query *q, struct docs *out)
+{
+	struct run *runs;
+	struct docs d;
+	size_t order[16], i, j;
+	uint32_t counts[16];
+	int nruns = 0, res = 0, k;
+
+	out->count = 0;
+	if (!nfiles) {
+		return 0;
+	}
+	runs = malloc((size_t) nfiles * sizeof(*runs));
+	if (!runs) {
+		irc_err("malloc failed\n");
+		return -1;
+	}
+	for (k = 0; k < nfiles; k++) {
+		if (!run_open(dir, &files[k], &runs[nruns])) {
+			nruns++;
+		} else if (errno == ENOENT) {
+			res = -2;
+			goto cleanup;
+		} /* else, skip it */
+	}
+
+	/* Rarest terms first, so there are as few messages as possible to intersect with the rest */
+	for (i = 0; i < q->count; i++) {
+		counts[i] = 0;
+		for (k = 0; k < nruns; k++) {
+			struct run_term rt;
+			if (!run_find(&runs[k], q->terms[i], q->lens[i], &rt)) {
+				counts[i] += rt.count;
+			}
+		}
+		for (j = i; j > 0 && counts[order[j - 1]] > counts[i]; j--) {
+			order[j] = order[j - 1];
+		}
+		order[j] = i;
+	}
+	if (!counts[order[0]]) {
+		goto cleanup; /* Something isn't there at all */
+	}
+
+	memset(&d, 0, sizeof(d));
+	for (i = 0; i < q->count && (!i || out->count); i++) {
+		struct docs *target = i ? &d : out;
+		if (term_docs(runs, nruns, q->terms[order[i]], q->lens[order[i]], target)) {
+			irc_warn("Index of archive segment %u is corrupt\n", files[0].segno);
+			res = -1;
+			break;
+		}
+		if (i) {
+			docs_intersect(out, &d);
+		}
+	}
+	free(d.docs);
+
+cleanup:
+	while (nruns-- > 0) {
+		archive_unmap(&runs[nruns].map);
+	}
+	free(runs);
+	return res;
+}
+
+static int segment_search(const char *dir, unsigned int segno, const struct query *q, struct docs *out)
+{
+	int attempt, res = -1;
+
+	for (attempt = 0; attempt < SEARCH_RETRIES; attempt++) {
+		struct run_file *runs;
+		int count = runs_list(dir, (int) segno, &runs);
+		if (count < 0) {
+			return -1;
+		}
+		res = runs_search(dir, runs, count, q, out);
+		free(runs);
+		if (res != -2) {
+			break;
+		}
+	}
+	return res;
+}
+
+struct search_results {
+	int (*cb)(void *data, long long time, const char *line, size_t len);
+	void *data;
+	int found;
+};
+
+static int search_result(void *data, uint32_t doc, long long time, const char *line, size_t len)
+{
+	struct search_results *r = data;
+
+	(void) doc;
+	r->found++;
+	return r->cb(r->data, time, line, len);
+}
+
+int irc_archive_search(const char *dir, const char *query, size_t max,
+	int (*cb)(void *data, long long time, const char *line, size_t len), void *data)
+{
+	struct query q;
+	struct search_results r;
+	struct docs *results;
+	unsigned int *segnos;
+	size_t total = 0;
+	int count, i, first;
+
+	q.count = 0;
+	tokenize_query(query, query_term, &q);
+	if (!q.count) {
+		irc_err("Nothing to search for in '%s'\n", query);
+		return -1;
+	}
+	count = archive_segments(dir, &segnos);
+	if (count < 0) {
+		irc_err("Failed to read archive %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+	results = calloc((size_t) count + 1, sizeof(*results));
+	if (!results) {
+		irc_err("calloc failed\n");
+		free(segnos);
+		return -1;
+	}
+
+	/* Newest first, so only as many segments as needed for the latest max are searched */
+	for (i = count - 1; i >= 0 && (!max || total < max); i--) {
+		if (segment_search(dir, segnos[i], &q, &results[i])) {
+			results[i].count = 0;
+		}
+		total += results[i].count;
+	}
+	first = i + 1;
+	if (max && total > max) {
+		size_t skip = total - max;
+		memmove(results[first].docs, results[first].docs + skip, (results[first].count - skip) * sizeof(uint32_t));
+		results[first].count -= skip;
+	}
+
+	r.cb = cb;
+	r.data = data;
+	r.found = 0;
+	for (i = first; i < count; i++) {
+		if (results[i].count && archive_segment_read(dir, segnos[i], 0, results[i].docs, results[i].count, search_result, &r) == 1) {
+			break;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		free(results[i].docs);
+	}
+	free(results);
+	free(segnos);
+	return r.found;
+}
@@ -0,0 +1,1064 @@
+/*
+ * LIRC - IRC Client Library for C
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This library is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Channel and membership state tracking
+ *
+ * \note Users and channels are kept in hash tables keyed by their casemapped names.
+ *       Each user is stored exactly once, no matter how many channels it is in,
+ *       and each membership is linked into both its channel's member table
+ *       (keyed by user pointer) and its user's list of channels.
+ *       This way, nick changes only need to rehash one entry, and quits only
+ *       need to visit the channels the user was actually in.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "irc_internal.h"
+#include "numerics.h"
+
+struct state_member;
+
+struct state_user {
+	struct state_user *next;		/*!< Next user in hash chain */
+	uint64_t hash;					/*!< Casemapped hash of nick */
+	const char *nick;				/*!< Nickname (interned) */
+	const char *userhost;			/*!< user@host (interned), NULL if not known */
+	struct state_member *channels;	/*!< Memberships of this user */
+	size_t nchannels;				/*!< Number of memberships */
+};
+
+struct state_member {
+	struct state_user *user;
+	struct state_channel *channel;
+	struct state_member *chan_next;	/*!< Next member in channel's hash chain */
+	struct state_member *user_prev;	/*!< Previous membership of the same user */
+	struct state_member *user_next;	/*!< Next membership of the same user */
+	unsigned int modes;				/*!< Membership modes, one bit per prefix rank */
+	unsigned int generation;		/*!< NAMES generation in which this member was last seen */
+};
+
+struct state_mode {
+	char mode;						/*!< Channel mode */
+	char *param;					/*!< Mode parameter, if any */
+};
+
+struct state_channel {
+	struct state_channel *next;		/*!< Next channel in hash chain */
+	uint64_t hash;					/*!< Casemapped hash of name */
+	const char *name;				/*!< Channel name (interned) */
+	char *topic;					/*!< Channel topic */
+	const char *topic_setter;		/*!< Who set the topic (interned) */
+	time_t topic_time;				/*!< When the topic was set */
+	struct state_mode *modes;		/*!< Channel modes (excluding list and membership modes) */
+	size_t nmodes;					/*!< Number of modes */
+	struct state_member **members;	/*!< Member hash table, keyed by user pointer */
+	size_t nmembers;				/*!< Number of members */
+	size_t members_size;			/*!< Number of buckets in members (power of 2) */
+	unsigned int generation;		/*!< Current NAMES generation */
+	unsigned int names_syncing:1;	/*!< Whether a NAMES reply is in progress */
+};
+
+struct irc_state {
+	pthread_rwlock_t lock;
+	struct irc_intern_pool *pool;	/*!< Pool for nicks, hosts, and channel names */
+	enum irc_casemapping casemapping;	/*!< Casemapping used for the hash tables */
+	struct state_user **users;		/*!< User hash table */
+	size_t nusers;
+	size_t users_size;				/*!< Number of buckets in users (power of 2) */
+	struct state_channel **channels;	/*!< Channel hash table */
+	size_t nchannels;
+	size_t channels_size;			/*!< Number of buckets in channels (power of 2) */
+};
+
+#define INITIAL_BUCKETS 16
+
+/*! \brief Hash a user pointer, for channel member tables */
+static inline size_t member_bucket(const struct state_channel *c, const struct state_user *u)
+{
+	uint64_t h = (uint64_t) (uintptr_t) u * UINT64_C(0x9E3779B97F4A7C15);
+	return (size_t) (h >> 32) & (c->members_size - 1);
+}
+
+/*! \brief Resize a hash table of entries whose first two members are the chain pointer and the hash */
+#define REHASH(type, table, size, newsize) { \
+	type **newtable = calloc(newsize, sizeof(*newtable)); \
+	size_t bucket; \
+	if (newtable) { \
+		for (bucket = 0; bucket < size; bucket++) { \
+			type *e, *next; \
+			for (e = table[bucket]; e; e = next) { \
+				next = e->next; \
+				e->next = newtable[e->hash & (newsize - 1)]; \
+				newtable[e->hash & (newsize - 1)] = e; \
+			} \
+		} \
+		free(table); \
+		table = newtable; \
+		size = newsize; \
+	} \
+}
+
+static struct state_user *user_find(struct irc_state *st, const char *nick, size_t len, uint64_t hash)
+{
+	struct state_user *u;
+
+	for (u = st->users[hash & (st->users_size - 1)]; u; u = u->next) {
+		if (u->hash == hash && irc_intern_len(u->nick) == len && irc_casemap_memeq(st->casemapping, u->nick, nick, len)) {
+			return u;
+		}
+	}
+	return NULL;
+}
+
+static struct state_channel *channel_find(struct irc_state *st, const char *name, size_t len)
+{
+	struct state_channel *c;
+	uint64_t hash = irc_casemap_hash(st->casemapping, name, len);
+
+	for (c = st->channels[hash & (st->channels_size - 1)]; c; c = c->next) {
+		if (c->hash == hash && irc_intern_len(c->name) == len && irc_casemap_memeq(st->casemapping, c->name, name, len)) {
+			return c;
+		}
+	}
+	return NULL;
+}
+
+static void user_link(struct irc_state *st, struct state_user *u)
+{
+	size_t b = u->hash & (st->users_size - 1);
+	u->next = st->users[b];
+	st->users[b] = u;
+	if (++st->nusers > st->users_size) {
+		REHASH(struct state_user, st->users, st->users_size, st->users_size * 2);
+	}
+}
+
+static void user_unlink(struct irc_state *st, struct state_user *u)
+{
+	struct state_user **prev;
+
+	for (prev = &st->users[u->hash & (st->users_size - 1)]; *prev; prev = &(*prev)->next) {
+		if (*prev == u) {
+			*prev = u->next;
+			st->nusers--;
+			return;
+		}
+	}
+}
+
+/*! \brief Get a user, creating it if it doesn't exist yet */
+static struct state_user *user_get(struct irc_state *st, const char *nick, size_t len)
+{
+	uint64_t hash = irc_casemap_hash(st->casemapping, nick, len);
+	struct state_user *u = user_find(st, nick, len, hash);
+
+	if (u) {
+		return u;
+	}
+	u = calloc(1, sizeof(*u));
+	if (!u) {
+		return NULL;
+	}
+	u->nick = irc_intern(st->pool, nick, len);
+	if (!u->nick) {
+		free(u);
+		return NULL;
+	}
+	u->hash = hash;
+	user_link(st, u);
+	return u;
+}
+
+static void user_free(struct irc_state *st, struct state_user *u)
+{
+	irc_intern_release(st->pool, u->nick);
+	irc_intern_release(st->pool, u->userhost);
+	free(u);
+}
+
+static struct state_member *member_find(struct state_channel *c, struct state_user *u)
+{
+	struct state_member *m;
+
+	for (m = c->members[member_bucket(c, u)]; m; m = m->chan_next) {
+		if (m->user == u) {
+			return m;
+		}
+	}
+	return NULL;
+}
+
+static void member_resize(struct state_channel *c, size_t newsize)
+{
+	struct state_member **newtable = calloc(newsize, sizeof(*newtable));
+	size_t i, oldsize = c->members_size;
+	struct state_member **old = c->members;
+
+	if (!newtable) {
+		return;
+	}
+	c->members = newtable;
+	c->members_size = newsize;
+	for (i = 0; i < oldsize; i++) {
+		struct state_member *m, *next;
+		for (m = old[i]; m; m = next) {
+			size_t b = member_bucket(c, m->user);
+			next = m->chan_next;
+			m->chan_next = newtable[b];
+			newtable[b] = m;
+		}
+	}
+	free(old);
+}
+
+static struct state_member *member_add(struct state_channel *c, struct state_user *u)
+{
+	struct state_member *m = member_find(c, u);
+	size_t b;
+
+	if (m) {
+		return m;
+	}
+	m = calloc(1, sizeof(*m));
+	if (!m) {
+		return NULL;
+	}
+	m->user = u;
+	m->channel = c;
+	m->generation = c->generation;
+	b = member_bucket(c, u);
+	m->chan_next = c->members[b];
+	c->members[b] = m;
+	m->user_next = u->channels;
+	if (u->channels) {
+		u->channels->user_prev = m;
+	}
+	u->channels = m;
+	u->nchannels++;
+	if (++c->nmembers > c->members_size) {
+		member_resize(c, c->members_size * 2);
+	}
+	return m;
+}
+
+/*! \brief Remove a membership, and the user too if it no longer shares any channels with us */
+static void member_remove(struct irc_state *st, struct state_member *m)
+{
+	struct state_channel *c = m->channel;
+	struct state_user *u = m->user;
+	struct state_member **prev;
+
+	for (prev = &c->members[member_bucket(c, u)]; *prev; prev = &(*prev)->chan_next) {
+		if (*prev == m) {
+			*prev = m->chan_next;
+			break;
+		}
+	}
+	c->nmembers--;
+
+	if (m->user_prev) {
+		m->user_prev->user_next = m->user_next;
+	} else {
+		u->channels = m->user_next;
+	}
+	if (m->user_next) {
+		m->user_next->user_prev = m->user_prev;
+	}
+	free(m);
+	if (!--u->nchannels) {
+		user_unlink(st, u);
+		user_free(st, u);
+	}
+}
+
+static struct state_channel *channel_add(struct irc_state *st, const char *name, size_t len)
+{
+	struct state_channel *c = channel_find(st, name, len);
+	size_t b;
+
+	if (c) {
+		return c;
+	}
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		return NULL;
+	}
+	c->name = irc_intern(st->pool, name, len);
+	c->members = calloc(INITIAL_BUCKETS, sizeof(*c->members));
+	if (!c->name || !c->members) {
+		irc_intern_release(st->pool, c->name);
+		free(c->members);
+		free(c);
+		return NULL;
+	}
+	c->members_size = INITIAL_BUCKETS;
+	c->hash = irc_casemap_hash(st->casemapping, name, len);
+	b = c->hash & (st->channels_size - 1);
+	c->next = st->channels[b];
+	st->channels[b] = c;
+	if (++st->nchannels > st->channels_size) {
+		REHASH(struct state_channel, st->channels, st->channels_size, st->channels_size * 2);
+	}
+	return c;
+}
+
+static void channel_modes_clear(struct state_channel *c)
+{
+	size_t i;
+
+	for (i = 0; i < c->nmodes; i++) {
+		free(c->modes[i].param);
+	}
+	free(c->modes);
+	c->modes = NULL;
+	c->nmodes = 0;
+}
+
+static void channel_remove(struct irc_state *st, struct state_channel *c)
+{
+	struct state_channel **prev;
+	size_t i;
+
+	for (i = 0; i < c->members_size; i++) {
+		while (c->members[i]) {
+			member_remove(st, c->members[i]);
+		}
+	}
+	for (prev = &st->channels[c->hash & (st->channels_size - 1)]; *prev; prev = &(*prev)->next) {
+		if (*prev == c) {
+			*prev = c->next;
+			st->nchannels--;
+			break;
+		}
+	}
+	channel_modes_clear(c);
+	free(c->members);
+	free(c->topic);
+	irc_intern_release(st->pool, c->topic_setter);
+	irc_intern_release(st->pool, c->name);
+	free(c);
+}
+
+static void state_clear(struct irc_state *st)
+{
+	size_t i;
+
+	for (i = 0; i < st->channels_size; i++) {
+		while (st->channels[i]) {
+			channel_remove(st, st->channels[i]);
+		}
+	}
+}
+
+/*! \brief Rebuild the hash tables, after the server's casemapping changed */
+static void state_rehash(struct irc_state *st, enum irc_casemapping casemapping)
+{
+	size_t i;
+
+	st->casemapping = casemapping;
+	for (i = 0; i < st->users_size; i++) {
+		struct state_user *u;
+		for (u = st->users[i]; u; u = u->next) {
+			u->hash = irc_casemap_strhash(casemapping, u->nick);
+		}
+	}
+	for (i = 0; i < st->channels_size; i++) {
+		struct state_channel *c;
+		for (c = st->channels[i]; c; c = c->next) {
+			c->hash = irc_casemap_strhash(casemapping, c->name);
+		}
+	}
+	REHASH(struct state_user, st->users, st->users_size, st->users_size);
+	REHASH(struct state_channel, st->channels, st->channels_size, st->channels_size);
+}
+
+void state_destroy(struct irc_state *st)
+{
+	state_clear(st);
+	free(st->users);
+	free(st->channels);
+	irc_intern_pool_unref(st->pool);
+	pthread_rwlock_destroy(&st->lock);
+	free(st);
+}
+
+int irc_client_track_state(struct irc_client *client, int enable)
+{
+	struct irc_state *st;
+
+	if (!enable) {
+		if (irc_loop_running(client)) {
+			irc_err("State tracking can't be disabled while irc_loop is running\n");
+			return -1;
+		}
+		pthread_mutex_lock(&client->lock);
+		st = client->state;
+		client->state = NULL;
+		pthread_mutex_unlock(&client->lock);
+		if (st) {
+			state_destroy(st);
+		}
+		return 0;
+	} else if (client->state) {
+		return 0;
+	}
+
+	st = calloc(1, sizeof(*st));
+	if (!st) {
+		irc_err("calloc failed\n");
+		return -1;
+	}
+	st->users = calloc(INITIAL_BUCKETS, sizeof(*st->users));
+	st->channels = calloc(INITIAL_BUCKETS, sizeof(*st->channels));
+	if (!st->users || !st->channels) {
+		free(st->users);
+		free(st->channels);
+		free(st);
+		irc_err("calloc failed\n");
+		return -1;
+	}
+	st->users_size = st->channels_size = INITIAL_BUCKETS;
+	st->casemapping = irc_client_casemapping(client);
+	st->pool = client->pool;
+	irc_intern_pool_ref(st->pool);
+	pthread_rwlock_init(&st->lock, NULL);
+	client->state = st;
+	return 0;
+}
+
+/*! \brief Length of the nick portion of a prefix (nick!user@host) */
+static size_t prefix_nicklen(const char *prefix)
+{
+	return strcspn(prefix, "!@");
+}
+
+/*! \brief Whether a nick is our own */
+static int is_self(struct irc_client *client, const char *nick, size_t len)
+{
+	const char *me = irc_client_nickname(client);
+	return me && strlen(me) == len && irc_casemap_memeq(client->state->casemapping, me, nick, len);
+}
+
+/*! \brief Channel name from a parsed message (some servers send JOIN :#channel) */
+static const char *msg_channel(struct irc_msg *msg)
+{
+	const char *channel = msg->channel;
+	if (channel && *channel == ':') {
+		channel++;
+	}
+	return channel;
+}
+
+static void user_set_userhost(struct irc_state *st, struct state_user *u, const char *userhost, size_t len)
+{
+	const char *old = u->userhost;
+
+	u->userhost = irc_intern(st->pool, userhost, len);
+	irc_intern_release(st->pool, old);
+}
+
+static void handle_join(struct irc_client *client, struct irc_state *st, const char *prefix, const char *channel)
+{
+	size_t nicklen = prefix_nicklen(prefix);
+	struct state_channel *c;
+	struct state_user *u;
+
+	if (is_self(client, prefix, nicklen)) {
+		c = channel_find(st, channel, strlen(channel));
+		if (c) {
+			channel_remove(st, c); /* Stale state */
+		}
+		c = channel_add(st, channel, strlen(channel));
+	} else {
+		c = channel_find(st, channel, strlen(channel));
+	}
+	if (!c) {
+		return;
+	}
+	u = user_get(st, prefix, nicklen);
+	if (!u) {
+		return;
+	}
+	if (strchr(prefix, '!')) {
+		const char *userhost = strchr(prefix, '!') + 1;
+		user_set_userhost(st, u, userhost, strlen(userhost));
+	}
+	member_add(c, u);
+}
+
+/*! \brief Remove a user from a channel, or the entire channel if it's us */
+static void handle_leave(struct irc_client *client, struct irc_state *st, const char *nick, size_t nicklen, const char *channel)
+{
+	struct state_channel *c = channel_find(st, channel, strlen(channel));
+	struct state_user *u;
+
+	if (!c) {
+		return;
+	}
+	if (is_self(client, nick, nicklen)) {
+		channel_remove(st, c);
+		return;
+	}
+	u = user_find(st, nick, nicklen, irc_casemap_hash(st->casemapping, nick, nicklen));
+	if (u) {
+		struct state_member *m = member_find(c, u);
+		if (m) {
+			member_remove(st, m);
+		}
+	}
+}
+
+static void handle_quit(struct irc_state *st, const char *nick, size_t nicklen)
+{
+	struct state_user *u = user_find(st, nick, nicklen, irc_casemap_hash(st->casemapping, nick, nicklen));
+
+	/* Only visit the channels this user was in. The user is freed along with its last membership. */
+	while (u && u->channels) {
+		struct state_member *m = u->channels;
+		int last = u->nchannels == 1;
+		member_remove(st, m);
+		if (last) {
+			break;
+		}
+	}
+}
+
+void state_quit_bulk(struct irc_client *client, const char *const *nicks, size_t count)
+{
+	struct irc_state *st = client->state;
+	size_t i;
+
+	if (!st) {
+		return;
+	}
+	pthread_rwlock_wrlock(&st->lock);
+	for (i = 0; i < count; i++) {
+		handle_quit(st, nicks[i], strlen(nicks[i]));
+	}
+	pthread_rwlock_unlock(&st->lock);
+}
+
+static void handle_nick(struct irc_state *st, const char *prefix, const char *newnick, size_t len)
+{
+	size_t nicklen = prefix_nicklen(prefix);
+	struct state_user *u = user_find(st, prefix, nicklen, irc_casemap_hash(st->casemapping, prefix, nicklen));
+	const char *nick;
+
+	if (!u || !len) {
+		return;
+	}
+	nick = irc_intern(st->pool, newnick, len);
+	if (!nick) {
+		return;
+	}
+	/* Memberships reference the user, not the nick, so only the user table needs updating */
+	user_unlink(st, u);
+	irc_intern_release(st->pool, u->nick);
+	u->nick = nick;
+	u->hash = st->casemapping == irc_intern_pool_casemapping(st->pool) ? irc_intern_hash(nick) : irc_casemap_hash(st->casemapping, nick, len);
+	user_link(st, u);
+}
+
+/*! \brief Set or unset a (non-membership, non-list) channel mode */
+static void channel_mode_set(struct state_channel *c, char mode, int add, const char *param, size_t paramlen)
+{
+	size_t i;
+	struct state_mode *modes;
+
+	for (i = 0; i < c->nmodes; i++) {
+		if (c->modes[i].mode == mode) {
+			free(c->modes[i].param);
+			if (!add) {
+				c->modes[i] = c->modes[--c->nmodes];
+				return;
+			}
+			c->modes[i].param = param ? strndup(param, paramlen) : NULL;
+			return;
+		}
+	}
+	if (!add) {
+		return;
+	}
+	modes = realloc(c->modes, (c->nmodes + 1) * sizeof(*modes));
+	if (!modes) {
+		return;
+	}
+	c->modes = modes;
+	c->modes[c->nmodes].mode = mode;
+	c->modes[c->nmodes].param = param ? strndup(param, paramlen) : NULL;
+	c->nmodes++;
+}
+
+/*! \brief Apply a mode string and its parameters to a channel */
+static void channel_apply_modes(struct irc_client *client, struct irc_state *st, struct state_channel *c, const char *s)
+{
+	const char *modes, *m;
+	size_t modeslen;
+	int add = 1;
+
+	modes = next_param(&s, &modeslen);
+	if (!modes) {
+		return;
+	}
+	for (m = modes; m < modes + modeslen; m++) {
+		const char *param = NULL;
+		size_t paramlen = 0;
+		if (*m == '+' || *m == '-') {
+			add = *m == '+';
+			continue;
+		}
+		if (irc_client_chanmode_has_param(client, *m, add)) {
+			param = next_param(&s, &paramlen);
+			if (!param) {
+				break;
+			}
+		}
+		switch (irc_client_chanmode_type(client, *m)) {
+		case IRC_CHANMODE_PREFIX:
+			{
+				struct state_user *u = user_find(st, param, paramlen, irc_casemap_hash(st->casemapping, param, paramlen));
+				struct state_member *mem = u ? member_find(c, u) : NULL;
+				if (mem) {
+					unsigned int bit = 1U << irc_client_prefix_rank(client, *m);
+					mem->modes = add ? mem->modes | bit : mem->modes & ~bit;
+				}
+			}
+			break;
+		case IRC_CHANMODE_LIST:
+			break; /* Lists (e.g. bans) are not tracked */
+		default:
+			channel_mode_set(c, *m, add, param, paramlen);
+			break;
+		}
+	}
+}
+
+static void handle_namreply(struct irc_client *client, struct irc_state *st, const char *s)
+{
+	const char *channel, *names, *name;
+	size_t len;
+	struct state_channel *c;
+
+	/* <client> <symbol> <channel> :[prefix]<nick>{ [prefix]<nick>} */
+	next_param(&s, &len);
+	next_param(&s, &len);
+	channel = next_param(&s, &len);
+	if (!channel) {
+		return;
+	}
+	c = channel_find(st, channel, len);
+	names = next_param(&s, &len);
+	if (!c || !names) {
+		return;
+	}
+	if (!c->names_syncing) {
+		/* Start of a new NAMES reply, which replaces the existing member list */
+		c->names_syncing = 1;
+		c->generation++;
+	}
+	while ((name = next_param(&names, &len))) {
+		unsigned int modes = 0;
+		size_t nicklen;
+		struct state_user *u;
+		struct state_member *m;
+		int rank;
+		/* With multi-prefix, there may be several prefixes */
+		while (len && (rank = irc_client_prefix_rank(client, *name)) >= 0 && irc_client_prefix_mode(client, *name)) {
+			modes |= 1U << rank;
+			name++;
+			len--;
+		}
+		nicklen = strcspn(name, "! ");
+		if (nicklen > len) {
+			nicklen = len;
+		}
+		if (!nicklen) {
+			continue;
+		}
+		u = user_get(st, name, nicklen);
+		if (!u) {
+			continue;
+		}
+		if (nicklen < len && name[nicklen] == '!') { /* userhost-in-names */
+			user_set_userhost(st, u, name + nicklen + 1, len - nicklen - 1);
+		}
+		m = member_add(c, u);
+		if (m) {
+			m->modes = modes;
+			m->generation = c->generation;
+		} else if (!u->nchannels) {
+			user_unlink(st, u);
+			user_free(st, u);
+		}
+	}
+}
+
+static void handle_endofnames(struct irc_state *st, const char *s)
+{
+	const char *channel;
+	size_t len, i;
+	struct state_channel *c;
+
+	next_param(&s, &len);
+	channel = next_param(&s, &len);
+	c = channel ? channel_find(st, channel, len) : NULL;
+	if (!c || !c->names_syncing) {
+		return;
+	}
+	c->names_syncing = 0;
+	/* Anyone not in the NAMES reply is no longer in the channel */
+	for (i = 0; i < c->members_size; i++) {
+		struct state_member *m, *next;
+		for (m = c->members[i]; m; m = next) {
+			next = m->chan_next;
+			if (m->generation != c->generation) {
+				member_remove(st, m);
+			}
+		}
+	}
+}
+
+/*! \brief Find the channel named by the second parameter of a numeric (<client> <channel> ...) */
+static struct state_channel *numeric_channel(struct irc_state *st, const char **s)
+{
+	const char *channel;
+	size_t len;
+
+	next_param(s, &len);
+	channel = next_param(s, &len);
+	return channel ? channel_find(st, channel, len) : NULL;
+}
+
+static void set_topic_setter(struct irc_state *st, struct state_channel *c, const char *setter, size_t setterlen)
+{
+	const char *old = c->topic_setter;
+
+	c->topic_setter = setter ? irc_intern(st->pool, setter, setterlen) : NULL;
+	irc_intern_release(st->pool, old);
+}
+
+static void set_topic(struct irc_state *st, struct state_channel *c, const char *topic, const char *setter, size_t setterlen, time_t when)
+{
+	free(c->topic);
+	c->topic = topic && *topic ? strdup(topic) : NULL;
+	set_topic_setter(st, c, setter, setterlen);
+	c->topic_time = when;
+}
+
+void state_process(struct irc_client *client, struct irc_msg *msg)
+{
+	struct irc_state *st = client->state;
+	struct state_channel *c;
+	const char *s = msg->body, *channel, *param;
+	size_t len;
+
+	if (!st) {
+		return;
+	}
+
+	pthread_rwlock_wrlock(&st->lock);
+	if (st->casemapping != irc_client_casemapping(client)) {
+		state_rehash(st, irc_client_casemapping(client));
+	}
+
+	switch (msg->type) {
+	case IRC_NUMERIC:
+		switch (msg->numeric) {
+		case RPL_WELCOME:
+			state_clear(st); /* New session */
+			break;
+		case RPL_NAMREPLY:
+			handle_namreply(client, st, s);
+			break;
+		case RPL_ENDOFNAMES:
+			handle_endofnames(st, s);
+			break;
+		case RPL_TOPIC:
+			c = numeric_channel(st, &s);
+			param = next_param(&s, &len);
+			if (c && param) {
+				free(c->topic);
+				c->topic = *param ? strdup(param) : NULL;
+			}
+			break;
+		case RPL_NOTOPIC:
+			c = numeric_channel(st, &s);
+			if (c) {
+				set_topic(st, c, NULL, NULL, 0, 0);
+			}
+			break;
+		case RPL_TOPICWHOTIME:
+			c = numeric_channel(st, &s);
+			param = next_param(&s, &len);
+			if (c && param) {
+				set_topic_setter(st, c, param, prefix_nicklen(param) < len ? prefix_nicklen(param) : len);
+				param = next_param(&s, &len);
+				c->topic_time = param ? (time_t) atol(param) : 0;
+			}
+			break;
+		case RPL_CHANNELMODEIS:
+			c = numeric_channel(st, &s);
+			if (c) {
+				channel_modes_clear(c);
+				channel_apply_modes(client, st, c, s);
+			}
+			break;
+		default:
+			break;
+		}
+		break;
+	case IRC_CMD_JOIN:
+		channel = msg_channel(msg);
+		if (msg->prefix && channel) {
+			handle_join(client, st, msg->prefix, channel);
+		}
+		break;
+	case IRC_CMD_PART:
+		channel = msg_channel(msg);
+		if (msg->prefix && channel) {
+			handle_leave(client, st, msg->prefix, prefix_nicklen(msg->prefix), channel);
+		}
+		break;
+	case IRC_CMD_KICK:
+		channel = msg_channel(msg);
+		param = next_param(&s, &len);
+		if (channel && param) {
+			handle_leave(client, st, param, len, channel);
+		}
+		break;
+	case IRC_CMD_QUIT:
+		if (msg->prefix) {
+			handle_quit(st, msg->prefix, prefix_nicklen(msg->prefix));
+		}
+		break;
+	case IRC_CMD_NICK:
+		param = next_param(&s, &len);
+		if (msg->prefix && param) {
+			handle_nick(st, msg->prefix, param, len);
+		}
+		break;
+	case IRC_CMD_MODE:
+		channel = msg_channel(msg);
+		c = channel ? channel_find(st, channel, strlen(channel)) : NULL;
+		if (c) {
+			channel_apply_modes(client, st, c, s);
+		}
+		break;
+	case IRC_CMD_TOPIC:
+		channel = msg_channel(msg);
+		c = channel ? channel_find(st, channel, strlen(channel)) : NULL;
+		if (c && msg->prefix) {
+			set_topic(st, c, msg->body, msg->prefix, prefix_nicklen(msg->prefix), time(NULL));
+		}
+		break;
+	case IRC_CMD_OTHER:
+		if (msg->prefix && msg->command && !strcmp(msg->command, "CHGHOST")) {
+			/* CHGHOST <new_user> <new_host> */
+			size_t nicklen = prefix_nicklen(msg->prefix), hostlen;
+			struct state_user *u = user_find(st, msg->prefix, nicklen, irc_casemap_hash(st->casemapping, msg->prefix, nicklen));
+			const char *host;
+			param = next_param(&s, &len);
+			host = next_param(&s, &hostlen);
+			if (u && param && host) {
+				char userhost[512];
+				int uhlen = snprintf(userhost, sizeof(userhost), "%.*s@%.*s", (int) len, param, (int) hostlen, host);
+				if (uhlen > 0 && (size_t) uhlen < sizeof(userhost)) {
+					user_set_userhost(st, u, userhost, (size_t) uhlen);
+				}
+			}
+		}
+		break;
+	default:
+		break;
+	}
+	pthread_rwlock_unlock(&st->lock);
+}
+
+/* Queries */
+
+/*! \brief Format membership modes as prefixes, e.g. @+ */
+static void member_prefixes(struct irc_client *client, const struct state_member *m, char *buf, size_t len)
+{
+	const char *symbols = client->isupport.prefix_symbols;
+	size_t i, o = 0;
+
+	for (i = 0; symbols[i] && o + 1 < len; i++) {
+		if (m->modes & (1U << i)) {
+			buf[o++] = symbols[i];
+		}
+	}
+	if (len) {
+		buf[o] = '\0';
+	}
+}
+
+#define STATE_READ_BEGIN(client, st) \
+	struct irc_state *st = client->state; \
+	if (!st) { \
+		irc_err("State tracking is not enabled\n"); \
+		return -1; \
+	} \
+	pthread_rwlock_rdlock(&st->lock);
+
+#define STATE_READ_END(st) pthread_rwlock_unlock(&st->lock);
+
+static struct state_member *find_membership(struct irc_state *st, const char *channel, const char *nick)
+{
+	struct state_channel *c = channel_find(st, channel, strlen(channel));
+	struct state_user *u;
+
+	if (!c) {
+		return NULL;
+	}
+	u = user_find(st, nick, strlen(nick), irc_casemap_strhash(st->casemapping, nick));
+	return u ? member_find(c, u) : NULL;
+}
+
+int irc_state_channel_has(struct irc_client *client, const char *channel, const char *nick)
+{
+	int res;
+	STATE_READ_BEGIN(client, st);
+	res = find_membership(st, channel, nick) ? 1 : 0;
+	STATE_READ_END(st);
+	return res;
+}
+
+int irc_state_member_prefixes(struct irc_client *client, const char *channel, const char *nick, char *buf, size_t len)
+{
+	struct state_member *m;
+	STATE_READ_BEGIN(client, st);
+	m = find_membership(st, channel, nick);
+	if (m) {
+		member_prefixes(client, m, buf, len);
+	}
+	STATE_READ_END(st);
+	return m ? 0 : -1;
+}
+
+int irc_state_channels(struct irc_client *client, void (*cb)(void *data, const char *channel), void *data)
+{
+	size_t i;
+	int count;
+	STATE_READ_BEGIN(client, st);
+	count = (int) st->nchannels;
+	for (i = 0; cb && i < st->channels_size; i++) {
+		struct state_channel *c;
+		for (c = st->channels[i]; c; c = c->next) {
+			cb(data, c->name);
+		}
+	}
+	STATE_READ_END(st);
+	return count;
+}
+
+int irc_state_channel_members(struct irc_client *client, const char *channel, void (*cb)(void *data, const char *nick, const char *prefixes), void *data)
+{
+	struct state_channel *c;
+	char prefixes[16];
+	size_t i;
+	int count = -1;
+	STATE_READ_BEGIN(client, st);
+	c = channel_find(st, channel, strlen(channel));
+	if (c) {
+		count = (int) c->nmembers;
+		for (i = 0; cb && i < c->members_size; i++) {
+			struct state_member *m;
+			for (m = c->members[i]; m; m = m->chan_next) {
+				member_prefixes(client, m, prefixes, sizeof(prefixes));
+				cb(data, m->user->nick, prefixes);
+			}
+		}
+	}
+	STATE_READ_END(st);
+	return count;
+}
+
+int irc_state_user_channels(struct irc_client *client, const char *nick, void (*cb)(void *data, const char *channel, const char *prefixes), void *data)
+{
+	struct state_user *u;
+	char prefixes[16];
+	int count = -1;
+	STATE_READ_BEGIN(client, st);
+	u = user_find(st, nick, strlen(nick), irc_casemap_strhash(st->casemapping, nick));
+	if (u) {
+		struct state_member *m;
+		count = (int) u->nchannels;
+		for (m = u->channels; cb && m; m = m->user_next) {
+			member_prefixes(client, m, prefixes, sizeof(prefixes));
+			cb(data, m->channel->name, prefixes);
+		}
+	}
+	STATE_READ_END(st);
+	return count;
+}
+
+int irc_state_user_host(struct irc_client *client, const char *nick, char *buf, size_t len)
+{
+	struct state_user *u;
+	int res = -1;
+	STATE_READ_BEGIN(client, st);
+	u = user_find(st, nick, strlen(nick), irc_casemap_strhash(st->casemapping, nick));
+	if (u && u->userhost) {
+		snprintf(buf, len, "%s", u->userhost);
+		res = 0;
+	}
+	STATE_READ_END(st);
+	return res;
+}
+
+int irc_state_channel_topic(struct irc_client *client, const char *channel, char *buf, size_t len)
+{
+	struct state_channel *c;
+	int res = -1;
+	STATE_READ_BEGIN(client, st);
+	c = channel_find(st, channel, strlen(channel));
+	if (c) {
+		snprintf(buf, len, "%s", c->topic ? c->topic : "");
+		res = 0;
+	}
+	STATE_READ_END(st);
+	return res;
+}
+
+int irc_state_channel_modes(struct irc_client *client, const char *channel, char *buf, size_t len)
+{
+	struct state_channel *c;
+	int res = -1;
+	STATE_READ_BEGIN(client, st);
+	c = channel_find(st, channel, strlen(channel));
+	if (c && len) {
+		size_t i, o = 0;
+		buf[o++] = '+';
+		for (i = 0; i < c->nmodes && o + 1 < len; i++) {
+			buf[o++] = c->modes[i].mode;
+		}
+		buf[o] = '\0';
+		for (i = 0; i < c->nmodes && o + 1 < len; i++) {
+			if (c->modes[i].param) {
+				int r = snprintf(buf + o, len - o, " %s", c->modes[i].param);
+				if (r < 0 || (size_t) r >= len - o) {
+					break;
+				}
+				o += (size_t) r;
+			}
+		}
+		res = 0;
+	}
+	STATE_READ_END(st);
+	return res;
+}
@@ -0,0 +1,696 @@
+/*
+ * LIRC - IRC Client Library for C
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This library is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief User information cache, populated from WHO, WHOX, and WHOIS replies
+ *
+ * \note Lookups for a nick or channel that is already being looked up
+ *       do not send another request, they just wait for the same reply.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "irc_internal.h"
+#include "numerics.h"
+
+/*! \brief Token for our WHOX requests, so we can recognize the replies */
+#define WHOX_TOKEN "745"
+
+/*! \brief WHOX fields: token, channel, user, host, nick, flags, account, realname (escaped for use as a format string) */
+#define WHOX_FIELDS "%%tcuhnfar," WHOX_TOKEN
+
+#define WHO_TTL_DEFAULT 300
+#define INITIAL_BUCKETS 64
+
+struct who_entry {
+	struct who_entry *next;			/*!< Next entry in hash chain */
+	uint64_t hash;					/*!< Casemapped hash of nick */
+	const char *nick;				/*!< Interned */
+	const char *user;				/*!< Interned */
+	const char *host;				/*!< Interned */
+	const char *account;			/*!< Interned, NULL if not logged in */
+	char *realname;
+	time_t fetched;					/*!< When the information was last refreshed */
+	unsigned int away:1;
+	unsigned int oper:1;
+	unsigned int whois:1;			/*!< WHOIS reply in progress */
+};
+
+/*! \brief A caller waiting for a lookup */
+struct who_waiter {
+	void (*user_cb)(void *data, const char *nick, const struct irc_user_info *info);
+	void (*channel_cb)(void *data, const char *channel, int count);
+	void *data;
+	struct who_waiter *next;
+};
+
+/*! \brief A WHO request that has been sent, but not yet completed */
+struct who_pending {
+	char *mask;						/*!< Nick or channel */
+	int count;						/*!< Number of replies so far */
+	struct who_waiter *waiters;
+	struct who_pending *next;
+};
+
+struct who_cache {
+	pthread_mutex_t lock;
+	struct irc_intern_pool *pool;
+	enum irc_casemapping casemapping;
+	int ttl;						/*!< Seconds entries are valid */
+	struct who_entry **buckets;
+	size_t size;					/*!< Number of buckets (power of 2) */
+	size_t count;					/*!< Number of entries */
+	size_t sweep_at;				/*!< Entry count at which to next sweep expired entries */
+	struct who_pending *pending;	/*!< Requests in progress, oldest first */
+};
+
+static void entry_free(struct who_cache *wc, struct who_entry *e)
+{
+	irc_intern_release(wc->pool, e->nick);
+	irc_intern_release(wc->pool, e->user);
+	irc_intern_release(wc->pool, e->host);
+	irc_intern_release(wc->pool, e->account);
+	free(e->realname);
+	free(e);
+}
+
+static struct who_entry **entry_findp(struct who_cache *wc, const char *nick, size_t len)
+{
+	uint64_t hash = irc_casemap_hash(wc->casemapping, nick, len);
+	struct who_entry **e;
+
+	for (e = &wc->buckets[hash & (wc->size - 1)]; *e; e = &(*e)->next) {
+		if ((*e)->hash == hash && irc_intern_len((*e)->nick) == len && irc_casemap_memeq(wc->casemapping, (*e)->nick, nick, len)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static struct who_entry *entry_find(struct who_cache *wc, const char *nick, size_t len)
+{
+	struct who_entry **e = entry_findp(wc, nick, len);
+	return e ? *e : NULL;
+}
+
+static void entry_remove(struct who_cache *wc, struct who_entry **e)
+{
+	struct who_entry *old = *e;
+
+	*e = old->next;
+	wc->count--;
+	entry_free(wc, old);
+}
+
+static void entry_link(struct who_cache *wc, struct who_entry *e)
+{
+	size_t b = e->hash & (wc->size - 1);
+	e->next = wc->buckets[b];
+	wc->buckets[b] = e;
+	wc->count++;
+}
+
+/*! \brief Remove expired entries, and grow the table if it's still full */
+static void sweep(struct who_cache *wc)
+{
+	time_t now = time(NULL);
+	size_t i;
+
+	for (i = 0; i < wc->size; i++) {
+		struct who_entry **e = &wc->buckets[i];
+		while (*e) {
+			if ((*e)->fetched + wc->ttl <= now && !(*e)->whois) {
+				entry_remove(wc, e);
+			} else {
+				e = &(*e)->next;
+			}
+		}
+	}
+	if (wc->count >= wc->size) {
+		struct who_entry **buckets = calloc(wc->size * 2, sizeof(*buckets));
+		if (buckets) {
+			size_t oldsize = wc->size;
+			struct who_entry **old = wc->buckets;
+			wc->buckets = buckets;
+			wc->size *= 2;
+			wc->count = 0;
+			for (i = 0; i < oldsize; i++) {
+				struct who_entry *e, *next;
+				for (e = old[i]; e; e = next) {
+					next = e->next;
+					entry_link(wc, e);
+				}
+			}
+			free(old);
+		}
+	}
+	wc->sweep_at = wc->count * 2 > wc->size ? wc->count * 2 : wc->size;
+}
+
+/*! \brief Get the entry for a nick, creating it if needed */
+static struct who_entry *entry_get(struct who_cache *wc, const char *nick, size_t len)
+{
+	struct who_entry *e = entry_find(wc, nick, len);
+
+	if (e) {
+		return e;
+	}
+	if (wc->count >= wc->sweep_at) {
+		sweep(wc);
+	}
+	e = calloc(1, sizeof(*e));
+	if (!e) {
+		return NULL;
+	}
+	e->nick = irc_intern(wc->pool, nick, len);
+	if (!e->nick) {
+		free(e);
+		return NULL;
+	}
+	e->hash = irc_casemap_hash(wc->casemapping, nick, len);
+	entry_link(wc, e);
+	return e;
+}
+
+/*! \brief Replace an interned field */
+static void set_field(struct who_cache *wc, const char **field, const char *s, size_t len)
+{
+	const char *old = *field;
+
+	*field = s ? irc_intern(wc->pool, s, len) : NULL;
+	irc_intern_release(wc->pool, old);
+}
+
+static void set_realname(struct who_entry *e, const char *s, size_t len)
+{
+	free(e->realname);
+	e->realname = s ? strndup(s, len) : NULL;
+}
+
+/*! \brief Fill in user info from flags (H/G, *) */
+static void set_flags(struct who_entry *e, const char *flags, size_t len)
+{
+	e->away = len && *flags == 'G';
+	e->oper = memchr(flags, '*', len) ? 1 : 0;
+}
+
+/*! \brief Copy an entry, for use outside the lock */
+static void info_copy(const struct who_entry *e, struct irc_user_info *info, char *buf, size_t len)
+{
+	const char *fields[5] = { e->nick, e->user, e->host, e->account, e->realname };
+	const char **out[5] = { &info->nick, &info->user, &info->host, &info->account, &info->realname };
+	size_t i, o = 0;
+
+	for (i = 0; i < ARRAY_LEN(fields); i++) {
+		size_t flen;
+		if (!fields[i]) {
+			*out[i] = NULL;
+			continue;
+		}
+		flen = strlen(fields[i]);
+		if (o + flen + 1 > len) {
+			flen = o < len ? len - o - 1 : 0;
+		}
+		memcpy(buf + o, fields[i], flen);
+		buf[o + flen] = '\0';
+		*out[i] = buf + o;
+		o += flen + 1;
+		if (o >= len) {
+			o = len - 1; /* Remaining fields will be empty */
+		}
+	}
+	info->away = e->away;
+	info->oper = e->oper;
+	info->fetched = e->fetched;
+}
+
+static int fresh(struct who_cache *wc, const struct who_entry *e)
+{
+	return e->user && !e->whois && e->fetched + wc->ttl > time(NULL);
+}
+
+int irc_client_who_cache(struct irc_client *client, int ttl)
+{
+	struct who_cache *wc;
+
+	pthread_mutex_lock(&client->lock);
+	wc = client->who;
+	if (wc) {
+		pthread_mutex_unlock(&client->lock);
+		pthread_mutex_lock(&wc->lock);
+		wc->ttl = ttl > 0 ? ttl : WHO_TTL_DEFAULT;
+		pthread_mutex_unlock(&wc->lock);
+		return 0;
+	}
+	wc = calloc(1, sizeof(*wc));
+	if (wc) {
+		wc->buckets = calloc(INITIAL_BUCKETS, sizeof(*wc->buckets));
+	}
+	if (!wc || !wc->buckets) {
+		pthread_mutex_unlock(&client->lock);
+		free(wc);
+		irc_err("calloc failed\n");
+		return -1;
+	}
+	wc->size = wc->sweep_at = INITIAL_BUCKETS;
+	wc->ttl = ttl > 0 ? ttl : WHO_TTL_DEFAULT;
+	wc->casemapping = irc_client_casemapping(client);
+	wc->pool = client->pool;
+	irc_intern_pool_ref(wc->pool);
+	pthread_mutex_init(&wc->lock, NULL);
+	client->who = wc;
+	pthread_mutex_unlock(&client->lock);
+	return 0;
+}
+
+void who_destroy(struct irc_client *client)
+{
+	struct who_cache *wc = client->who;
+	size_t i;
+
+	if (!wc) {
+		return;
+	}
+	for (i = 0; i < wc->size; i++) {
+		while (wc->buckets[i]) {
+			entry_remove(wc, &wc->buckets[i]);
+		}
+	}
+	while (wc->pending) {
+		struct who_pending *p = wc->pending;
+		wc->pending = p->next;
+		while (p->waiters) {
+			struct who_waiter *w = p->waiters;
+			p->waiters = w->next;
+			free(w);
+		}
+		free(p->mask);
+		free(p);
+	}
+	free(wc->buckets);
+	irc_intern_pool_unref(wc->pool);
+	pthread_mutex_destroy(&wc->lock);
+	free(wc);
+	client->who = NULL;
+}
+
+int irc_client_user_cached(struct irc_client *client, const char *nick, struct irc_user_info *info, char *buf, size_t len)
+{
+	struct who_cache *wc = client->who;
+	struct who_entry *e;
+	int res = -1;
+
+	if (!wc) {
+		return -1;
+	}
+	pthread_mutex_lock(&wc->lock);
+	e = entry_find(wc, nick, strlen(nick));
+	if (e && fresh(wc, e)) {
+		info_copy(e, info, buf, len);
+		res = 0;
+	}
+	pthread_mutex_unlock(&wc->lock);
+	return res;
+}
+
+/*! \brief Start a lookup, or join one in progress */
+static int who_lookup(struct irc_client *client, const char *mask, struct who_waiter *w)
+{
+	struct who_cache *wc = client->who;
+	struct who_pending *p, **tail;
+	int res;
+
+	pthread_mutex_lock(&wc->lock);
+	for (tail = &wc->pending; (p = *tail); tail = &p->next) {
+		if (irc_casemap_eq(wc->casemapping, p->mask, mask)) {
+			/* Already asked, just wait for the same answer */
+			w->next = p->waiters;
+			p->waiters = w;
+			pthread_mutex_unlock(&wc->lock);
+			return 0;
+		}
+	}
+	p = calloc(1, sizeof(*p));
+	if (p) {
+		p->mask = strdup(mask);
+	}
+	if (!p || !p->mask) {
+		pthread_mutex_unlock(&wc->lock);
+		free(p);
+		free(w);
+		irc_err("Failed to allocate memory\n");
+		return -1;
+	}
+	p->waiters = w;
+	*tail = p; /* Replies come in the order requests were sent */
+	pthread_mutex_unlock(&wc->lock);
+
+	if (irc_client_isupport(client, IRC_ISUPPORT_WHOX)) {
+		res = irc_send(client, "WHO %s " WHOX_FIELDS, mask);
+	} else {
+		res = irc_send(client, "WHO %s", mask);
+	}
+	if (res) {
+		pthread_mutex_lock(&wc->lock);
+		for (tail = &wc->pending; *tail; tail = &(*tail)->next) {
+			if (*tail == p) {
+				*tail = p->next;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&wc->lock);
+		while (p->waiters) {
+			w = p->waiters;
+			p->waiters = w->next;
+			free(w);
+		}
+		free(p->mask);
+		free(p);
+	}
+	return res;
+}
+
+int irc_client_user_lookup(struct irc_client *client, const char *nick, void (*cb)(void *data, const char *nick, const struct irc_user_info *info), void *data)
+{
+	struct irc_user_info info;
+	struct who_waiter *w;
+	char buf[1024];
+
+	if (!client->who && irc_client_who_cache(client, 0)) {
+		return -1;
+	}
+	if (!irc_client_user_cached(client, nick, &info, buf, sizeof(buf))) {
+		cb(data, nick, &info);
+		return 0;
+	}
+	w = calloc(1, sizeof(*w));
+	if (!w) {
+		irc_err("calloc failed\n");
+		return -1;
+	}
+	w->user_cb = cb;
+	w->data = data;
+	return who_lookup(client, nick, w);
+}
+
+int irc_client_channel_lookup(struct irc_client *client, const char *channel, void (*cb)(void *data, const char *channel, int count), void *data)
+{
+	struct who_waiter *w;
+
+	if (!client->who && irc_client_who_cache(client, 0)) {
+		return -1;
+	}
+	w = calloc(1, sizeof(*w));
+	if (!w) {
+		irc_err("calloc failed\n");
+		return -1;
+	}
+	w->channel_cb = cb;
+	w->data = data;
+	return who_lookup(client, channel, w);
+}
+
+/*! \brief Find a pending request. Must be called with the cache locked. */
+static struct who_pending *pending_find(struct who_cache *wc, const char *mask, size_t len)
+{
+	struct who_pending *p;
+
+	for (p = wc->pending; p; p = p->next) {
+		if (strlen(p->mask) == len && irc_casemap_memeq(wc->casemapping, p->mask, mask, len)) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/*! \brief Complete a pending request: remove it and notify everyone waiting for it */
+static void pending_complete(struct who_cache *wc, struct who_pending *p)
+{
+	struct who_pending **pp;
+	struct who_waiter *w;
+	struct irc_user_info info;
+	struct who_entry *e;
+	char buf[1024];
+	int found;
+
+	for (pp = &wc->pending; *pp; pp = &(*pp)->next) {
+		if (*pp == p) {
+			*pp = p->next;
+			break;
+		}
+	}
+	e = entry_find(wc, p->mask, strlen(p->mask));
+	found = e && e->user;
+	if (found) {
+		info_copy(e, &info, buf, sizeof(buf));
+	}
+	pthread_mutex_unlock(&wc->lock);
+
+	while ((w = p->waiters)) {
+		p->waiters = w->next;
+		if (w->user_cb) {
+			w->user_cb(w->data, p->mask, found ? &info : NULL);
+		} else if (w->channel_cb) {
+			w->channel_cb(w->data, p->mask, p->count);
+		}
+		free(w);
+	}
+	free(p->mask);
+	free(p);
+	pthread_mutex_lock(&wc->lock);
+}
+
+/*! \brief Count a WHO reply for a channel or nick, returning whether we asked for it */
+static int pending_count(struct who_cache *wc, const char *channel, size_t chanlen, const char *nick, size_t nicklen)
+{
+	struct who_pending *p = pending_find(wc, channel, chanlen);
+
+	if (!p) {
+		p = pending_find(wc, nick, nicklen);
+	}
+	if (p) {
+		p->count++;
+	}
+	return p ? 1 : 0;
+}
+
+/*! \brief Get the next n parameters of a message */
+static int get_params(const char **s, const char **params, size_t *lens, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		params[i] = next_param(s, &lens[i]);
+		if (!params[i]) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int who_numeric(struct who_cache *wc, struct irc_msg *msg)
+{
+	const char *s = msg->body, *p[8], *realname;
+	size_t l[8], len;
+	struct who_entry *e;
+	struct who_pending *pending;
+
+	switch (msg->numeric) {
+	case RPL_WHOSPCRPL:
+		/* <client> <token> <channel> <user> <host> <nick> <flags> <account> :<realname> */
+		if (get_params(&s, p, l, 8) || l[1] != strlen(WHOX_TOKEN) || strncmp(p[1], WHOX_TOKEN, l[1])) {
+			return 0; /* Not ours */
+		}
+		e = entry_get(wc, p[5], l[5]);
+		if (e) {
+			set_field(wc, &e->user, p[3], l[3]);
+			set_field(wc, &e->host, p[4], l[4]);
+			set_flags(e, p[6], l[6]);
+			set_field(wc, &e->account, l[7] == 1 && *p[7] == '0' ? NULL : p[7], l[7]);
+			realname = next_param(&s, &len);
+			set_realname(e, realname, realname ? len : 0);
+			e->fetched = time(NULL);
+		}
+		pending_count(wc, p[2], l[2], p[5], l[5]);
+		return 1;
+	case RPL_WHOREPLY:
+		/* <client> <channel> <user> <host> <server> <nick> <flags> :<hopcount> <realname> */
+		if (get_params(&s, p, l, 7)) {
+			return 0;
+		}
+		e = entry_get(wc, p[5], l[5]);
+		if (e) {
+			set_field(wc, &e->user, p[2], l[2]);
+			set_field(wc, &e->host, p[3], l[3]);
+			set_flags(e, p[6], l[6]);
+			realname = next_param(&s, &len);
+			if (realname && (realname = memchr(realname, ' ', len))) {
+				set_realname(e, realname + 1, strlen(realname + 1));
+			}
+			e->fetched = time(NULL);
+		}
+		return pending_count(wc, p[1], l[1], p[5], l[5]);
+	case RPL_ENDOFWHO:
+		/* <client> <mask> :End of WHO list */
+		if (get_params(&s, p, l, 2)) {
+			return 0;
+		}
+		pending = pending_find(wc, p[1], l[1]);
+		if (pending) {
+			pending_complete(wc, pending);
+			return 1;
+		}
+		return 0;
+	case RPL_WHOISUSER:
+		/* <client> <nick> <user> <host> * :<realname> (not consumed, since the application asked for it) */
+		if (!get_params(&s, p, l, 5) && (e = entry_get(wc, p[1], l[1]))) {
+			set_field(wc, &e->user, p[2], l[2]);
+			set_field(wc, &e->host, p[3], l[3]);
+			set_field(wc, &e->account, NULL, 0); /* Until we see RPL_WHOISACCOUNT */
+			realname = next_param(&s, &len);
+			set_realname(e, realname, realname ? len : 0);
+			e->away = e->oper = 0;
+			e->whois = 1;
+		}
+		return 0;
+	case RPL_WHOISACCOUNT:
+	case RPL_WHOISOPERATOR:
+	case RPL_AWAY:
+	case RPL_ENDOFWHOIS:
+		if (get_params(&s, p, l, 2) || !(e = entry_find(wc, p[1], l[1])) || !e->whois) {
+			return 0;
+		}
+		if (msg->numeric == RPL_WHOISACCOUNT && !get_params(&s, &p[2], &l[2], 1)) {
+			set_field(wc, &e->account, p[2], l[2]);
+		} else if (msg->numeric == RPL_WHOISOPERATOR) {
+			e->oper = 1;
+		} else if (msg->numeric == RPL_AWAY) {
+			e->away = 1;
+		} else if (msg->numeric == RPL_ENDOFWHOIS) {
+			e->whois = 0;
+			e->fetched = time(NULL);
+		}
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+void who_quit_bulk(struct irc_client *client, const char *const *nicks, size_t count)
+{
+	struct who_cache *wc = client->who;
+	size_t i;
+
+	if (!wc) {
+		return;
+	}
+	pthread_mutex_lock(&wc->lock);
+	for (i = 0; i < count; i++) {
+		struct who_entry **e = entry_findp(wc, nicks[i], strlen(nicks[i]));
+		if (e) {
+			entry_remove(wc, e);
+		}
+	}
+	pthread_mutex_unlock(&wc->lock);
+}
+
+int who_process(struct irc_client *client, struct irc_msg *msg)
+{
+	struct who_cache *wc = client->who;
+	const char *s = msg->body, *param, *host;
+	size_t nicklen, len, hostlen;
+	struct who_entry **e;
+	int res = 0;
+
+	if (msg->type != IRC_NUMERIC && !msg->prefix) {
+		return 0;
+	}
+	pthread_mutex_lock(&wc->lock);
+	if (wc->casemapping != irc_client_casemapping(client)) {
+		/* Entries were hashed with the wrong casemapping. Just start over. */
+		size_t i;
+		for (i = 0; i < wc->size; i++) {
+			while (wc->buckets[i]) {
+				entry_remove(wc, &wc->buckets[i]);
+			}
+		}
+		wc->casemapping = irc_client_casemapping(client);
+	}
+
+	if (msg->type == IRC_NUMERIC) {
+		res = who_numeric(wc, msg);
+		pthread_mutex_unlock(&wc->lock);
+		return res;
+	}
+
+	nicklen = strcspn(msg->prefix, "!@");
+	e = entry_findp(wc, msg->prefix, nicklen);
+	if (!e) {
+		pthread_mutex_unlock(&wc->lock);
+		return 0;
+	}
+	switch (msg->type) {
+	case IRC_CMD_QUIT:
+		entry_remove(wc, e);
+		break;
+	case IRC_CMD_NICK:
+		param = next_param(&s, &len);
+		if (param && len) {
+			/* Same user, so the information is still valid under the new nick */
+			struct who_entry *entry = *e, **existing;
+			*e = entry->next;
+			wc->count--;
+			existing = entry_findp(wc, param, len);
+			if (existing) {
+				entry_remove(wc, existing);
+			}
+			set_field(wc, &entry->nick, param, len);
+			if (entry->nick) {
+				entry->hash = irc_casemap_hash(wc->casemapping, param, len);
+				entry_link(wc, entry);
+			} else {
+				entry_free(wc, entry);
+			}
+		}
+		break;
+	case IRC_CMD_OTHER:
+		if (!msg->command) {
+			break;
+		} else if (!strcmp(msg->command, "CHGHOST")) {
+			param = next_param(&s, &len);
+			host = next_param(&s, &hostlen);
+			if (param && host) {
+				set_field(wc, &(*e)->user, param, len);
+				set_field(wc, &(*e)->host, host, hostlen);
+			}
+		} else if (!strcmp(msg->command, "ACCOUNT")) {
+			/* account-notify: ACCOUNT <account>, or * if logged out */
+			param = next_param(&s, &len);
+			if (param) {
+				set_field(wc, &(*e)->account, len == 1 && *param == '*' ? NULL : param, len);
+			}
+		} else if (!strcmp(msg->command, "AWAY")) {
+			/* away-notify: AWAY [:message] */
+			(*e)->away = s && *s ? 1 : 0;
+		}
+		break;
+	default:
+		break;
+	}
+	pthread_mutex_unlock(&wc->lock);
+	return 0;
+}